@@ -0,0 +1,766 @@
+#include "net/socket.h"
+#include "protocol/framer.h"
+#include "protocol/protocol.h"
+#include "protocol/protocol_v2.h"
+#include "server/metrics.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifndef _WIN32
+#include <signal.h>
+#include <sys/resource.h>
+#endif
+
+/// The first ident of the simulated clients.
+#define BENCH_FIRST_IDENT 100000
+/// The first ident of the rooms, far from the clients.
+#define BENCH_FIRST_ROOM 1000000
+/// How long the workers keep reading for the replies in flight at the end.
+#define BENCH_DRAIN_MS 1000
+/// Clients per loopback source address, below the range of the ephemeral
+/// ports of an address.
+#define BENCH_CLIENTS_PER_ADDRESS 16384
+
+/// What the clients do.
+enum Workload {
+  /// Clients in pairs, sending to each other
+  WORKLOAD_DIRECT,
+  /// Clients in rooms, sending to their room
+  WORKLOAD_ROOM,
+  /// Clients joining and leaving rooms, one operation at a time
+  WORKLOAD_CHURN,
+  /// Clients connected and silent, measuring the memory of the server
+  WORKLOAD_IDLE,
+};
+
+/// The parameters of a run.
+struct BenchConfig {
+  Workload workload = WORKLOAD_DIRECT;
+  const char* workload_name = "direct";
+  size_t port = 8888;
+  size_t clients = 1000;
+  size_t room_size = 10;
+  int seconds = 10;
+  /// Bytes of data of every message, the send time first
+  size_t payload = 64;
+  /// Messages in flight per client, waiting for their reply
+  uint32_t window = 4;
+  size_t threads = 4;
+  /// The version of the wire format spoken
+  uint32_t version = 1;
+  /// Clients which stop reading once set up, the first ones
+  size_t stalled = 0;
+};
+
+/// A simulated client.
+struct BenchClient {
+  SOCKET socket = INVALID_SOCKET;
+  ident_t ident = 0;
+  /// The partner or the room the client sends to
+  ident_t dst = 0;
+  framer_t framer = {};
+  /// Messages or operations waiting for their reply
+  uint32_t in_flight = 0;
+  /// When the operation in flight was sent, for the churn
+  uint64_t op_start = 0;
+  /// Whether the client is in its room, for the churn
+  bool joined = false;
+  /// Whether the client stopped reading once set up
+  bool stalled = false;
+};
+
+/// The counts of a worker, summed at the end.
+struct BenchResult {
+  /// Messages or operations sent
+  uint64_t sent = 0;
+  /// Bytes written to the server
+  uint64_t bytes_sent = 0;
+  /// Messages delivered to the clients, or operations replied to
+  uint64_t delivered = 0;
+  /// Bytes of the messages delivered
+  uint64_t bytes_delivered = 0;
+  /// Replies with a code other than `RPL_OK`, and connections lost
+  uint64_t errors = 0;
+  /// Nanoseconds from sending to delivery, or to the reply for the churn
+  Histogram latency;
+};
+
+/// Write the whole message in the version of the client.
+///
+/// Returns the bytes written, or -1 on failure.
+static int bench_send(BenchClient* client, uint8_t* message) {
+  uint8_t encoded[PROTOCOL_BUFFER_SIZE];
+  length_t len = ((message_header_t*)message)->length;
+
+  if (client->framer.version == 2) {
+    len = protocol_v2_encode(message, PROTOCOL_TO_SERVER, encoded);
+    message = encoded;
+  }
+
+  if (len < 0) {
+    return -1;
+  }
+
+  int sent = 0;
+  while (sent < len) {
+    int res = send(client->socket, (char*)message + sent, len - sent, 0);
+    if (res <= 0) {
+      return -1;
+    }
+    sent += res;
+  }
+
+  return sent;
+}
+
+/// Read from the client until a complete message and decode it into
+/// `message`, blocking. For the setup only.
+///
+/// Returns 1 if the connection failed.
+static int bench_read_message(
+  BenchClient* client,
+  uint8_t* buffer,
+  std::vector<uint8_t>* message
+) {
+  while (true) {
+    uint8_t* frame;
+    uint32_t len;
+    int res = framer_next(&client->framer, &frame, &len);
+
+    if (res < 0) {
+      return 1;
+    }
+
+    if (res > 0) {
+      message->resize(PROTOCOL_V2_DECODED_MAX(len));
+
+      if (client->framer.version == 2) {
+        length_t decoded_len = protocol_v2_decode(
+          frame, len, PROTOCOL_TO_CLIENT, 0, message->data(),
+          (uint32_t)message->size()
+        );
+        if (decoded_len < 0) {
+          return 1;
+        }
+      } else {
+        memcpy(message->data(), frame, len);
+      }
+
+      return 0;
+    }
+
+    int recv_size =
+      recv(client->socket, (char*)buffer, PROTOCOL_BUFFER_SIZE, 0);
+    if (recv_size <= 0) {
+      return 1;
+    }
+
+    framer_feed(&client->framer, buffer, recv_size);
+  }
+}
+
+/// Send the message and wait for its reply, skipping the version message.
+///
+/// Returns the reply code, or `RPL_NONE` if the connection failed.
+static reply_code_t bench_request(BenchClient* client, uint8_t* message) {
+  uint8_t buffer[PROTOCOL_BUFFER_SIZE];
+  std::vector<uint8_t> reply;
+
+  if (bench_send(client, message) < 0) {
+    return RPL_NONE;
+  }
+
+  while (bench_read_message(client, buffer, &reply) == 0) {
+    message_header_t* header = (message_header_t*)reply.data();
+
+    if (header->type == MSG_VERSION) {
+      // the reply that follows is in the new format
+      client->framer.version = ((msg_version_t*)reply.data())->version;
+    } else if (header->type == MSG_REPLY) {
+      return ((msg_reply_t*)reply.data())->code;
+    }
+  }
+
+  return RPL_NONE;
+}
+
+/// Connect the client, register it and put it in its room.
+///
+/// Returns 1 on failure.
+static int bench_setup(const BenchConfig* config, BenchClient* client) {
+  uint8_t message[sizeof(msg_conn_version_t)];
+
+  client->socket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+  if (client->socket == INVALID_SOCKET) {
+    return 1;
+  }
+
+  struct sockaddr_in server = {};
+  server.sin_family = AF_INET;
+  server.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  server.sin_port = htons((u_short)config->port);
+
+  // the clients beyond the ephemeral ports of 127.0.0.1 come from the next
+  // loopback addresses
+  size_t index = client->ident > BENCH_FIRST_IDENT
+                   ? (size_t)(client->ident - BENCH_FIRST_IDENT)
+                   : 0;
+  if (index >= BENCH_CLIENTS_PER_ADDRESS) {
+    struct sockaddr_in local = {};
+    local.sin_family = AF_INET;
+    local.sin_addr.s_addr =
+      htonl(INADDR_LOOPBACK + (uint32_t)(index / BENCH_CLIENTS_PER_ADDRESS));
+
+    if (bind(client->socket, (struct sockaddr*)&local, sizeof(local)) < 0) {
+      return 1;
+    }
+  }
+
+  if (connect(client->socket, (struct sockaddr*)&server, sizeof(server)) < 0) {
+    return 1;
+  }
+
+  // the messages are small, they must not wait for each other
+  int nodelay = 1;
+  setsockopt(
+    client->socket, IPPROTO_TCP, TCP_NODELAY, (char*)&nodelay, sizeof(nodelay)
+  );
+
+  framer_init(&client->framer);
+
+  if (config->version > 1) {
+    protocol_wrap_msg_connect_version(
+      client->ident, config->version, 0, message
+    );
+  } else {
+    protocol_wrap_msg_connect(client->ident, message);
+  }
+
+  if (bench_request(client, message) != RPL_OK) {
+    return 1;
+  }
+
+  if (config->workload == WORKLOAD_ROOM) {
+    protocol_wrap_msg_join(client->ident, client->dst, message);
+
+    if (bench_request(client, message) != RPL_OK) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+/// Ask the server for its metrics and read the memory resident.
+///
+/// Returns the bytes resident, 0 if unknown or the connection failed.
+static uint64_t bench_resident(BenchClient* client) {
+  uint8_t buffer[PROTOCOL_BUFFER_SIZE];
+  uint8_t message[sizeof(message_header_t)];
+  std::vector<uint8_t> reply;
+
+  protocol_wrap_msg_stats(0, nullptr, message);
+
+  if (bench_send(client, message) < 0) {
+    return 0;
+  }
+
+  while (bench_read_message(client, buffer, &reply) == 0) {
+    message_header_t* header = (message_header_t*)reply.data();
+
+    if (header->type != MSG_STATS) {
+      continue;
+    }
+
+    std::string text(
+      (char*)reply.data() + sizeof(message_header_t),
+      header->length - sizeof(message_header_t)
+    );
+
+    const char* name = "\nchat_resident_bytes ";
+    size_t at = text.find(name);
+    if (at == std::string::npos) {
+      return 0;
+    }
+
+    return strtoull(text.c_str() + at + strlen(name), nullptr, 10);
+  }
+
+  return 0;
+}
+
+/// Handle a message received by the client during the run.
+static void bench_handle(
+  const BenchConfig* config,
+  BenchClient* client,
+  message_header_t* header,
+  BenchResult* result
+) {
+  uint64_t now = metrics_now();
+
+  switch (header->type) {
+    case MSG_SEND: {
+      msg_send_t* msg = (msg_send_t*)header;
+      uint8_t* data = (uint8_t*)msg + sizeof(msg_send_t);
+      uint32_t data_len = msg->header.length - sizeof(msg_send_t);
+
+      if (data_len < sizeof(uint64_t)) {
+        break;
+      }
+
+      // the send time is carried by the message itself
+      uint64_t sent_at;
+      memcpy(&sent_at, data, sizeof(sent_at));
+
+      result->delivered++;
+      result->bytes_delivered += data_len;
+      result->latency.record(now - sent_at);
+      break;
+    }
+    case MSG_REPLY: {
+      msg_reply_t* reply = (msg_reply_t*)header;
+
+      // told about the messages dropped, not a reply to a request
+      if (reply->code == RPL_DROPPED) {
+        break;
+      }
+
+      if (client->in_flight > 0) {
+        client->in_flight--;
+      }
+
+      if (reply->code != RPL_OK) {
+        result->errors++;
+      }
+
+      if (config->workload == WORKLOAD_CHURN) {
+        result->delivered++;
+        result->latency.record(now - client->op_start);
+
+        if (reply->code == RPL_OK) {
+          client->joined = !client->joined;
+        }
+      }
+      break;
+    }
+    default: {
+      break;
+    }
+  }
+}
+
+/// Read what is ready on the client and handle the messages.
+///
+/// Returns 1 if the connection failed.
+static int bench_receive(
+  const BenchConfig* config,
+  BenchClient* client,
+  uint8_t* buffer,
+  std::vector<uint8_t>* decoded,
+  BenchResult* result
+) {
+  int recv_size = recv(client->socket, (char*)buffer, PROTOCOL_BUFFER_SIZE, 0);
+  if (recv_size <= 0) {
+    return 1;
+  }
+
+  framer_feed(&client->framer, buffer, recv_size);
+
+  uint8_t* frame;
+  uint32_t len;
+  int res;
+
+  while ((res = framer_next(&client->framer, &frame, &len)) > 0) {
+    message_header_t* header = (message_header_t*)frame;
+
+    if (client->framer.version == 2) {
+      decoded->resize(PROTOCOL_V2_DECODED_MAX(len));
+
+      length_t decoded_len = protocol_v2_decode(
+        frame, len, PROTOCOL_TO_CLIENT, 0, decoded->data(),
+        (uint32_t)decoded->size()
+      );
+      if (decoded_len < 0) {
+        return 1;
+      }
+
+      header = (message_header_t*)decoded->data();
+    }
+
+    bench_handle(config, client, header, result);
+  }
+
+  return res < 0 ? 1 : 0;
+}
+
+/// Send from the client until its window is full.
+///
+/// Returns 1 if the connection failed.
+static int bench_fill(
+  const BenchConfig* config,
+  BenchClient* client,
+  uint8_t* data,
+  uint8_t* message,
+  BenchResult* result
+) {
+  if (config->workload == WORKLOAD_CHURN) {
+    if (client->in_flight > 0) {
+      return 0;
+    }
+
+    if (client->joined) {
+      protocol_wrap_msg_leave(client->ident, client->dst, message);
+    } else {
+      protocol_wrap_msg_join(client->ident, client->dst, message);
+    }
+
+    client->op_start = metrics_now();
+
+    int res = bench_send(client, message);
+    if (res < 0) {
+      return 1;
+    }
+
+    client->in_flight++;
+    result->sent++;
+    result->bytes_sent += res;
+    return 0;
+  }
+
+  while (client->in_flight < config->window) {
+    uint64_t now = metrics_now();
+    memcpy(data, &now, sizeof(now));
+
+    protocol_wrap_msg_send(
+      client->ident, client->dst, FMT_BINARY, (length_t)config->payload, data,
+      message
+    );
+
+    int res = bench_send(client, message);
+    if (res < 0) {
+      return 1;
+    }
+
+    client->in_flight++;
+    result->sent++;
+    result->bytes_sent += res;
+  }
+
+  return 0;
+}
+
+/// Drive the clients until the deadline, then wait for the replies.
+static void bench_worker(
+  const BenchConfig* config,
+  BenchClient* clients,
+  size_t count,
+  std::chrono::steady_clock::time_point deadline,
+  BenchResult* result
+) {
+  std::vector<uint8_t> buffer(PROTOCOL_BUFFER_SIZE);
+  std::vector<uint8_t> message(PROTOCOL_BUFFER_SIZE);
+  std::vector<uint8_t> decoded;
+  std::vector<uint8_t> data(config->payload, 'x');
+
+  std::vector<struct pollfd> fds(count);
+  for (size_t i = 0; i < count; i++) {
+    // a stalled client neither sends nor reads
+    fds[i].fd = clients[i].stalled ? INVALID_SOCKET : clients[i].socket;
+    fds[i].events = POLLIN;
+  }
+
+  auto drain_deadline = deadline + std::chrono::milliseconds(BENCH_DRAIN_MS);
+
+  while (true) {
+    auto now = std::chrono::steady_clock::now();
+    bool sending = now < deadline;
+
+    if (!sending) {
+      // stop once every reply is in, or the server is too slow
+      bool idle = true;
+      for (size_t i = 0; i < count; i++) {
+        if (fds[i].fd != INVALID_SOCKET && clients[i].in_flight > 0) {
+          idle = false;
+          break;
+        }
+      }
+
+      if (idle || now >= drain_deadline) {
+        break;
+      }
+    }
+
+    for (size_t i = 0; i < count && sending; i++) {
+      if (fds[i].fd == INVALID_SOCKET) {
+        continue;
+      }
+
+      if (bench_fill(
+            config, &clients[i], data.data(), message.data(), result
+          ) != 0) {
+        result->errors++;
+        fds[i].fd = INVALID_SOCKET;
+      }
+    }
+
+    if (net_poll(fds.data(), count, 1) <= 0) {
+      continue;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+      if (fds[i].fd == INVALID_SOCKET || fds[i].revents == 0) {
+        continue;
+      }
+
+      if (bench_receive(
+            config, &clients[i], buffer.data(), &decoded, result
+          ) != 0) {
+        result->errors++;
+        fds[i].fd = INVALID_SOCKET;
+      }
+    }
+  }
+}
+
+/// Parse the workload name, returns 1 if unknown.
+static int bench_parse_workload(const char* name, BenchConfig* config) {
+  if (strcmp(name, "direct") == 0) {
+    config->workload = WORKLOAD_DIRECT;
+  } else if (strcmp(name, "room") == 0) {
+    config->workload = WORKLOAD_ROOM;
+  } else if (strcmp(name, "churn") == 0) {
+    config->workload = WORKLOAD_CHURN;
+  } else if (strcmp(name, "idle") == 0) {
+    config->workload = WORKLOAD_IDLE;
+  } else {
+    return 1;
+  }
+
+  config->workload_name = name;
+  return 0;
+}
+
+/// End-to-end benchmark of a server on the loopback, printing JSON.
+///
+/// Usage: chat-bench <port> [direct|room|churn|idle] [clients] [room size]
+///                   [seconds] [payload] [window] [threads] [version]
+///                   [stalled]
+///
+/// The server must accept the clients, e.g. `server 100000 <port>`. The
+/// idle workload only connects the clients, and reports the memory the
+/// server holds for each from its metrics. The first `stalled` clients stop
+/// reading once set up, the messages to them piling up on the server, to
+/// see how the others fare.
+int main(int argc, char* argv[]) {
+  BenchConfig config;
+
+  if (argc < 2) {
+    printf(
+      "Usage: %s <port> [direct|room|churn|idle] [clients] [room size] "
+      "[seconds] [payload] [window] [threads] [version] [stalled]\n",
+      argv[0]
+    );
+    return 1;
+  }
+
+  config.port = atoi(argv[1]);
+
+  if (argc > 2 && bench_parse_workload(argv[2], &config) != 0) {
+    printf("unknown workload: %s\n", argv[2]);
+    return 1;
+  }
+
+  if (argc > 3) {
+    config.clients = atoi(argv[3]);
+  }
+  if (argc > 4) {
+    config.room_size = atoi(argv[4]);
+  }
+  if (argc > 5) {
+    config.seconds = atoi(argv[5]);
+  }
+  if (argc > 6) {
+    config.payload = atoi(argv[6]);
+  }
+  if (argc > 7) {
+    config.window = atoi(argv[7]);
+  }
+  if (argc > 8) {
+    config.threads = atoi(argv[8]);
+  }
+  if (argc > 9) {
+    config.version = atoi(argv[9]);
+  }
+  if (argc > 10) {
+    config.stalled = atoi(argv[10]);
+  }
+
+  // the send time takes the first bytes of the data
+  size_t max_payload =
+    PROTOCOL_BUFFER_SIZE - sizeof(msg_send_t) - sizeof(message_header_t);
+  config.payload = std::clamp(config.payload, sizeof(uint64_t), max_payload);
+  config.clients = std::max(config.clients, (size_t)2);
+  config.room_size = std::max(config.room_size, (size_t)1);
+  config.seconds = std::max(config.seconds, 1);
+  config.window = std::max(config.window, (uint32_t)1);
+  config.threads = std::clamp(config.threads, (size_t)1, config.clients);
+  config.version = std::clamp(config.version, (uint32_t)1, (uint32_t)2);
+  config.stalled = std::min(config.stalled, config.clients - 1);
+
+  WSADATA wsa;
+  if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0) {
+    printf("WSAStartup failed: %d\n", WSAGetLastError());
+    return 1;
+  }
+
+#ifndef _WIN32
+  signal(SIGPIPE, SIG_IGN);
+
+  // every client holds a descriptor
+  struct rlimit limit;
+  if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+  }
+#endif
+
+  // connected first, to see the memory of the server before the others
+  BenchClient probe;
+  probe.ident = BENCH_FIRST_IDENT - 1;
+  uint64_t resident_before = 0;
+
+  if (config.workload == WORKLOAD_IDLE) {
+    if (bench_setup(&config, &probe) != 0) {
+      fprintf(stderr, "probe failed to connect: %d\n", WSAGetLastError());
+      return 1;
+    }
+    resident_before = bench_resident(&probe);
+  }
+
+  std::vector<BenchClient> clients(config.clients);
+
+  for (size_t i = 0; i < config.clients; i++) {
+    BenchClient& client = clients[i];
+    client.ident = BENCH_FIRST_IDENT + (ident_t)i;
+
+    if (config.workload == WORKLOAD_DIRECT) {
+      // the last client of an odd count sends to itself
+      size_t partner = (i ^ 1) < config.clients ? (i ^ 1) : i;
+      client.dst = BENCH_FIRST_IDENT + (ident_t)partner;
+    } else {
+      client.dst = BENCH_FIRST_ROOM + (ident_t)(i / config.room_size);
+    }
+
+    if (bench_setup(&config, &client) != 0) {
+      fprintf(
+        stderr, "client %zu failed to connect: %d\n", i, WSAGetLastError()
+      );
+      return 1;
+    }
+
+    client.stalled = i < config.stalled;
+  }
+
+  if (config.workload == WORKLOAD_IDLE) {
+    // let the server handle the last connections before measuring
+    std::this_thread::sleep_for(std::chrono::seconds(config.seconds));
+
+    uint64_t resident_after = bench_resident(&probe);
+    double per_connection =
+      ((double)resident_after - (double)resident_before) / config.clients;
+
+    printf(
+      "{\"workload\": \"idle\", \"clients\": %zu, \"version\": %u, "
+      "\"resident_bytes_before\": %llu, \"resident_bytes_after\": %llu, "
+      "\"resident_bytes_per_connection\": %.1f}\n",
+      config.clients, config.version, (unsigned long long)resident_before,
+      (unsigned long long)resident_after, per_connection
+    );
+
+    for (auto& client : clients) {
+      framer_free(&client.framer);
+      closesocket(client.socket);
+    }
+    framer_free(&probe.framer);
+    closesocket(probe.socket);
+
+    WSACleanup();
+
+    return 0;
+  }
+
+  fprintf(
+    stderr, "%zu clients connected, running %s for %d s\n", config.clients,
+    config.workload_name, config.seconds
+  );
+
+  std::vector<BenchResult> results(config.threads);
+  std::vector<std::thread> workers;
+
+  auto start = std::chrono::steady_clock::now();
+  auto deadline = start + std::chrono::seconds(config.seconds);
+
+  // the clients are split evenly between the workers
+  for (size_t t = 0; t < config.threads; t++) {
+    size_t first = config.clients * t / config.threads;
+    size_t last = config.clients * (t + 1) / config.threads;
+
+    workers.emplace_back(
+      bench_worker, &config, clients.data() + first, last - first, deadline,
+      &results[t]
+    );
+  }
+
+  for (auto& worker : workers) {
+    worker.join();
+  }
+
+  BenchResult total;
+  for (auto& result : results) {
+    total.sent += result.sent;
+    total.bytes_sent += result.bytes_sent;
+    total.delivered += result.delivered;
+    total.bytes_delivered += result.bytes_delivered;
+    total.errors += result.errors;
+    total.latency.merge(result.latency);
+  }
+
+  // the messages delivered while draining count too
+  std::chrono::duration<double> elapsed =
+    std::chrono::steady_clock::now() - start;
+
+  printf(
+    "{\"workload\": \"%s\", \"clients\": %zu, \"room_size\": %zu, "
+    "\"seconds\": %d, \"payload\": %zu, \"window\": %u, \"threads\": %zu, "
+    "\"version\": %u, \"stalled\": %zu, \"sent\": %llu, \"delivered\": %llu, "
+    "\"errors\": %llu, "
+    "\"messages_per_second\": %.1f, \"bytes_per_second\": %.1f, "
+    "\"latency_us\": {\"p50\": %.1f, \"p99\": %.1f, \"p999\": %.1f, "
+    "\"max\": %.1f}}\n",
+    config.workload_name, config.clients,
+    config.workload == WORKLOAD_DIRECT ? (size_t)2 : config.room_size,
+    config.seconds, config.payload, config.window, config.threads,
+    config.version, config.stalled, (unsigned long long)total.sent,
+    (unsigned long long)total.delivered, (unsigned long long)total.errors,
+    total.delivered / elapsed.count(),
+    total.bytes_delivered / elapsed.count(),
+    total.latency.quantile(0.5) / 1e3, total.latency.quantile(0.99) / 1e3,
+    total.latency.quantile(0.999) / 1e3, total.latency.quantile(1.0) / 1e3
+  );
+
+  for (auto& client : clients) {
+    framer_free(&client.framer);
+    closesocket(client.socket);
+  }
+
+  WSACleanup();
+
+  return 0;
+}
@@ -0,0 +1,210 @@
+#include "protocol/compress.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+/// Number of the members of the room the messages are sent to.
+#define BENCH_MEMBERS 50
+
+/// Words of the chat messages.
+static const char* words[] = {
+  "the",  "a",     "to",     "and",    "you",   "it",    "is",     "that",
+  "of",   "in",    "we",     "for",    "this",  "on",    "have",   "be",
+  "can",  "just",  "think",  "server", "build", "merge", "review", "today",
+  "fix",  "test",  "branch", "deploy", "later", "lunch", "yes",    "no",
+  "what", "about", "meeting", "bug",   "works", "now",   "again",  "thanks",
+};
+
+/// Levels and sources of the log lines.
+static const char* levels[] = {"INFO", "WARN", "DEBUG", "ERROR"};
+static const char* sources[] = {
+  "net/reactor.cpp", "server/server.cpp", "server/registry.cpp",
+  "client/client.cpp"
+};
+
+/// Sink of the results, keeping them from being optimized out.
+static std::atomic<uint64_t> sink = 0;
+
+static uint32_t next_random(uint32_t* seed) {
+  *seed ^= *seed << 13;
+  *seed ^= *seed >> 17;
+  *seed ^= *seed << 5;
+  return *seed;
+}
+
+/// Sentences of random words, like a long chat message.
+static std::string make_chat(size_t len, uint32_t seed) {
+  std::string text;
+  size_t count = sizeof(words) / sizeof(words[0]);
+
+  while (text.size() < len) {
+    text += words[next_random(&seed) % count];
+    text += next_random(&seed) % 8 == 0 ? ". " : " ";
+  }
+
+  text.resize(len);
+  return text;
+}
+
+/// Log lines, like the ones pasted into a chat.
+static std::string make_log(size_t len, uint32_t seed) {
+  std::string text;
+  char line[256];
+  uint32_t millis = 0;
+
+  while (text.size() < len) {
+    millis += next_random(&seed) % 500;
+    snprintf(
+      line, sizeof(line), "2024-03-01 12:%02u:%02u.%03u [%s] %s:%u %s %u\n",
+      millis / 60000 % 60, millis / 1000 % 60, millis % 1000,
+      levels[next_random(&seed) % 4], sources[next_random(&seed) % 4],
+      next_random(&seed) % 900 + 10,
+      words[next_random(&seed) % (sizeof(words) / sizeof(words[0]))],
+      next_random(&seed) % 100000
+    );
+    text += line;
+  }
+
+  text.resize(len);
+  return text;
+}
+
+/// Random bytes, which do not compress.
+static std::string make_random(size_t len, uint32_t seed) {
+  std::string text(len, '\0');
+  for (auto& c : text) {
+    c = (char)next_random(&seed);
+  }
+  return text;
+}
+
+/// Run `work` repeatedly for `millis`, returns the seconds per run.
+template <typename Work>
+static double time_per_run(int millis, Work work) {
+  auto start = std::chrono::steady_clock::now();
+  auto deadline = start + std::chrono::milliseconds(millis);
+  uint64_t runs = 0;
+
+  do {
+    for (int i = 0; i < 16; i++) {
+      work();
+    }
+    runs += 16;
+  } while (std::chrono::steady_clock::now() < deadline);
+
+  std::chrono::duration<double> elapsed =
+    std::chrono::steady_clock::now() - start;
+
+  return elapsed.count() / runs;
+}
+
+/// Compression ratio, speed and bytes on the wire for a room fan-out.
+///
+/// Usage: compress-bench [millis per run]
+int main(int argc, char* argv[]) {
+  int millis = 200;
+
+  if (argc > 1) {
+    millis = atoi(argv[1]);
+  }
+
+  if (millis < 1) {
+    millis = 1;
+  }
+
+  struct Corpus {
+    const char* name;
+    std::string (*make)(size_t, uint32_t);
+  };
+  Corpus corpora[] = {
+    {"chat", make_chat}, {"log", make_log}, {"random", make_random}
+  };
+  size_t sizes[] = {64, 256, 1024, 4096, 16384, 60000};
+
+  std::vector<uint8_t> compressed(PROTOCOL_BUFFER_SIZE);
+  std::vector<uint8_t> plain(PROTOCOL_BUFFER_SIZE);
+
+  printf(
+    "room of %d members, threshold %d bytes, %d ms per run\n", BENCH_MEMBERS,
+    COMPRESS_THRESHOLD, millis
+  );
+  printf(
+    "%-7s %6s %6s %6s %9s %9s %10s %10s %9s\n", "data", "bytes", "sent",
+    "ratio", "comp MB/s", "dec MB/s", "room raw", "room sent", "cpu us"
+  );
+
+  for (auto& corpus : corpora) {
+    for (size_t size : sizes) {
+      std::string text = corpus.make(size, 0x9E3779B9u + (uint32_t)size);
+      const uint8_t* data = (const uint8_t*)text.data();
+      uint32_t len = (uint32_t)text.size();
+
+      // what the client would send, the data as is below the threshold or
+      // when it does not shrink
+      length_t compressed_len = -1;
+      if (len >= COMPRESS_THRESHOLD) {
+        compressed_len = compress_data(
+          FMT_UTF8, data, len, compressed.data(), (uint32_t)compressed.size()
+        );
+      }
+
+      double compress_time = time_per_run(millis, [&]() {
+        sink += compress_data(
+          FMT_UTF8, data, len, compressed.data(), (uint32_t)compressed.size()
+        );
+      });
+
+      // incompressible data is never decompressed, measure the round trip
+      // of what compressed.
+      double decompress_time = 0;
+      if (compressed_len > 0) {
+        format_t format;
+        length_t check = decompress_data(
+          compressed.data(), compressed_len, &format, plain.data(),
+          (uint32_t)plain.size()
+        );
+
+        if (check != (length_t)len || memcmp(plain.data(), data, len) != 0) {
+          printf("round trip failed for %s of %zu bytes\n", corpus.name, size);
+          return 1;
+        }
+
+        decompress_time = time_per_run(millis, [&]() {
+          format_t format;
+          sink += decompress_data(
+            compressed.data(), compressed_len, &format, plain.data(),
+            (uint32_t)plain.size()
+          );
+        });
+      }
+
+      uint32_t sent = compressed_len > 0 ? (uint32_t)compressed_len : len;
+
+      // the header of every copy of the message, then the data
+      uint64_t room_raw = (uint64_t)BENCH_MEMBERS * (20 + len);
+      uint64_t room_sent = (uint64_t)BENCH_MEMBERS * (20 + sent);
+
+      // compressed once by the sender, decompressed by every member
+      double cpu = 0;
+      if (compressed_len > 0) {
+        cpu = compress_time + BENCH_MEMBERS * decompress_time;
+      } else if (len >= COMPRESS_THRESHOLD) {
+        cpu = compress_time;
+      }
+
+      printf(
+        "%-7s %6u %6u %5.2fx %9.0f %9.0f %10llu %10llu %9.1f\n", corpus.name,
+        len, sent, (double)len / sent, len / compress_time / 1e6,
+        decompress_time > 0 ? len / decompress_time / 1e6 : 0.0,
+        (unsigned long long)room_raw, (unsigned long long)room_sent, cpu * 1e6
+      );
+    }
+  }
+
+  return 0;
+}
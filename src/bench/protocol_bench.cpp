@@ -0,0 +1,449 @@
+#include "net/io.h"
+#include "protocol/framer.h"
+#include "protocol/protocol.h"
+#include "protocol/protocol_v2.h"
+#include "server/server.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+/// Messages fed to the framer and the dispatch at once, like a busy read.
+#define BENCH_BATCH 64
+/// Members of the room the dispatch fans out to.
+#define BENCH_ROOM_MEMBERS 10
+/// The ident of the room, after the clients.
+#define BENCH_ROOM 1000
+/// Bytes of data of the messages in the history of the room.
+#define BENCH_HISTORY_SIZE 64
+
+/// Sink of the results, keeping them from being optimized out.
+static std::atomic<uint64_t> sink = 0;
+
+/// A backend without sockets, dropping the frames queued.
+struct NullBackend : IoBackend {
+  const char* name() override { return "null"; }
+  int init(SOCKET, IoHandler*) override { return 0; }
+  int poll(int) override { return 0; }
+  int send_frame(SOCKET, FrameRef frame) override {
+    sink += frame->size();
+    return 0;
+  }
+  size_t queued(SOCKET) override { return 0; }
+  size_t drop(SOCKET, size_t) override { return 0; }
+  void watch(SOCKET, size_t) override {}
+  void pause(SOCKET, bool) override {}
+  void close(SOCKET) override {}
+  void wake() override {}
+  void cleanup() override {}
+};
+
+/// Run `work` repeatedly for `millis`, returns the seconds per run.
+template <typename Work>
+static double time_per_run(int millis, Work work) {
+  auto start = std::chrono::steady_clock::now();
+  auto deadline = start + std::chrono::milliseconds(millis);
+  uint64_t runs = 0;
+
+  do {
+    for (int i = 0; i < 16; i++) {
+      work();
+    }
+    runs += 16;
+  } while (std::chrono::steady_clock::now() < deadline);
+
+  std::chrono::duration<double> elapsed =
+    std::chrono::steady_clock::now() - start;
+
+  return elapsed.count() / runs;
+}
+
+/// Print a result, `ops` operations of `bytes` in total per run.
+static void report(
+  const char* name,
+  size_t size,
+  double seconds,
+  size_t ops,
+  size_t bytes
+) {
+  printf(
+    "%-22s %7zu %10.1f %10.1f\n", name, size, seconds / ops * 1e9,
+    bytes / seconds / 1e6
+  );
+}
+
+/// The wrapping of the messages without data.
+static void bench_wrap_fixed(int millis) {
+  uint8_t buffer[PROTOCOL_BUFFER_SIZE];
+  uint8_t codes[1] = {RPL_OK};
+
+  struct Case {
+    const char* name;
+    length_t (*wrap)(uint8_t*, const uint8_t*);
+  };
+
+  // plain functions, so every call goes through the same indirection
+  Case cases[] = {
+    {"wrap_connect",
+     [](uint8_t* b, const uint8_t*) {
+       return protocol_wrap_msg_connect(7, b);
+     }},
+    {"wrap_connect_version",
+     [](uint8_t* b, const uint8_t*) {
+       return protocol_wrap_msg_connect_version(7, 2, FEATURE_LZ, b);
+     }},
+    {"wrap_disconnect",
+     [](uint8_t* b, const uint8_t*) {
+       return protocol_wrap_msg_disconnect(7, b);
+     }},
+    {"wrap_join",
+     [](uint8_t* b, const uint8_t*) {
+       return protocol_wrap_msg_join(7, 9, b);
+     }},
+    {"wrap_leave",
+     [](uint8_t* b, const uint8_t*) {
+       return protocol_wrap_msg_leave(7, 9, b);
+     }},
+    {"wrap_reply",
+     [](uint8_t* b, const uint8_t*) {
+       return protocol_wrap_msg_reply(RPL_OK, b);
+     }},
+    {"wrap_reply_id",
+     [](uint8_t* b, const uint8_t*) {
+       return protocol_wrap_msg_reply_id(42, RPL_OK, b);
+     }},
+    {"wrap_version",
+     [](uint8_t* b, const uint8_t*) {
+       return protocol_wrap_msg_version(2, FEATURE_LZ, b);
+     }},
+    {"wrap_reply_bundle",
+     [](uint8_t* b, const uint8_t* c) {
+       return protocol_wrap_msg_reply_bundle(42, 1, c, b);
+     }},
+  };
+
+  for (auto& c : cases) {
+    length_t len = c.wrap(buffer, codes);
+    double seconds = time_per_run(millis, [&]() {
+      sink += c.wrap(buffer, codes);
+    });
+    report(c.name, 0, seconds, 1, len);
+  }
+}
+
+/// The wrapping of the messages carrying `size` bytes.
+static void bench_wrap_sized(int millis, size_t size) {
+  std::vector<uint8_t> data(size, 'x');
+  std::vector<uint8_t> buffer(PROTOCOL_BUFFER_SIZE);
+  length_t len;
+  double seconds;
+
+  len = protocol_wrap_msg_send(
+    7, 9, FMT_UTF8, (length_t)size, data.data(), buffer.data()
+  );
+  seconds = time_per_run(millis, [&]() {
+    sink += protocol_wrap_msg_send(
+      7, 9, FMT_UTF8, (length_t)size, data.data(), buffer.data()
+    );
+  });
+  report("wrap_send", size, seconds, 1, len);
+
+  len = protocol_wrap_msg_stats((length_t)size, data.data(), buffer.data());
+  seconds = time_per_run(millis, [&]() {
+    sink += protocol_wrap_msg_stats((length_t)size, data.data(), buffer.data());
+  });
+  report("wrap_stats", size, seconds, 1, len);
+
+  // a send wrapped by a request, as the client does
+  uint8_t* inner = buffer.data() + sizeof(msg_request_t);
+  len = protocol_wrap_msg_request(
+    42,
+    protocol_wrap_msg_send(7, 9, FMT_UTF8, (length_t)size, data.data(), inner),
+    buffer.data()
+  );
+  seconds = time_per_run(millis, [&]() {
+    length_t inner_len = protocol_wrap_msg_send(
+      7, 9, FMT_UTF8, (length_t)size, data.data(), inner
+    );
+    sink += protocol_wrap_msg_request(42, inner_len, buffer.data());
+  });
+  report("wrap_request", size, seconds, 1, len);
+
+  // as many sends as fit, up to a batch, wrapped by a bundle
+  size_t count = (PROTOCOL_BUFFER_SIZE - sizeof(msg_bundle_t)) /
+                 (sizeof(msg_send_t) + size);
+  count = std::min(count, (size_t)BENCH_BATCH);
+
+  auto wrap_bundle = [&]() {
+    uint8_t* iter = buffer.data() + sizeof(msg_bundle_t);
+    for (size_t i = 0; i < count; i++) {
+      iter += protocol_wrap_msg_send(
+        7, 9 + (ident_t)i, FMT_UTF8, (length_t)size, data.data(), iter
+      );
+    }
+
+    length_t messages_len =
+      (length_t)(iter - buffer.data() - sizeof(msg_bundle_t));
+    return protocol_wrap_msg_bundle(
+      42, (uint32_t)count, messages_len, buffer.data()
+    );
+  };
+
+  len = wrap_bundle();
+  seconds = time_per_run(millis, [&]() { sink += wrap_bundle(); });
+  report("wrap_bundle", size, seconds, count, len);
+}
+
+/// The framing of a batch of sends, and the version 2 codec.
+static void bench_parse(int millis, size_t size) {
+  std::vector<uint8_t> data(size, 'x');
+  std::vector<uint8_t> message(PROTOCOL_BUFFER_SIZE);
+  std::vector<uint8_t> encoded(PROTOCOL_BUFFER_SIZE);
+  std::vector<uint8_t> decoded(PROTOCOL_V2_DECODED_MAX(PROTOCOL_BUFFER_SIZE));
+
+  length_t len = protocol_wrap_msg_send(
+    7, 9, FMT_UTF8, (length_t)size, data.data(), message.data()
+  );
+  length_t encoded_len =
+    protocol_v2_encode(message.data(), PROTOCOL_TO_CLIENT, encoded.data());
+
+  // a batch of at most a megabyte
+  size_t count =
+    std::clamp((size_t)(1 << 20) / len, (size_t)1, (size_t)BENCH_BATCH);
+
+  // the stream of a busy read, back to back
+  for (uint32_t version = 1; version <= 2; version++) {
+    const uint8_t* frame = version == 1 ? message.data() : encoded.data();
+    length_t frame_len = version == 1 ? len : encoded_len;
+
+    std::vector<uint8_t> stream;
+    for (size_t i = 0; i < count; i++) {
+      stream.insert(stream.end(), frame, frame + frame_len);
+    }
+
+    framer_t framer;
+    framer_init(&framer);
+    framer.version = version;
+
+    double seconds = time_per_run(millis, [&]() {
+      framer_feed(&framer, stream.data(), (uint32_t)stream.size());
+
+      uint8_t* next;
+      uint32_t next_len;
+      while (framer_next(&framer, &next, &next_len) > 0) {
+        // the header, as the handlers read it
+        sink += ((message_header_t*)next)->type;
+      }
+    });
+
+    framer_free(&framer);
+    report(
+      version == 1 ? "framer_v1" : "framer_v2", size, seconds, count,
+      stream.size()
+    );
+  }
+
+  double seconds = time_per_run(millis, [&]() {
+    sink +=
+      protocol_v2_encode(message.data(), PROTOCOL_TO_CLIENT, encoded.data());
+  });
+  report("v2_encode_send", size, seconds, 1, len);
+
+  seconds = time_per_run(millis, [&]() {
+    sink += protocol_v2_decode(
+      encoded.data(), encoded_len, PROTOCOL_TO_CLIENT, 0, decoded.data(),
+      (uint32_t)decoded.size()
+    );
+  });
+  report("v2_decode_send", size, seconds, 1, encoded_len);
+}
+
+/// A server without sockets, with a client on each fake socket and a room
+/// of the first ones, served by a single reactor.
+struct BenchServer {
+  ServerState state;
+  ServerReactor* reactor;
+
+  BenchServer() {
+    this->state.max_clients = BENCH_ROOM_MEMBERS + 1;
+    this->state.logger.level = LOG_OFF;
+    this->state.reactors.push_back(
+      std::make_unique<ServerReactor>(&this->state, 0)
+    );
+
+    this->reactor = this->state.reactors[0].get();
+    this->reactor->io = std::make_unique<NullBackend>();
+    this->reactor->stats = this->state.metrics.local();
+
+    uint8_t message[sizeof(msg_room_t)];
+
+    for (SOCKET s = 1; s <= BENCH_ROOM_MEMBERS; s++) {
+      this->reactor->on_accept(s);
+
+      length_t len = protocol_wrap_msg_connect((ident_t)s, message);
+      server_recv_handler(this->reactor, s, message, len);
+
+      len = protocol_wrap_msg_join((ident_t)s, BENCH_ROOM, message);
+      server_recv_handler(this->reactor, s, message, len);
+    }
+
+    // the joins are posted to the reactor owning the room
+    server_drain_mailbox(this->reactor);
+  }
+};
+
+/// The dispatch of a batch of messages by `server_recv_handler`, from the
+/// framing to the frames queued, the messages to the room by way of the
+/// mailbox of the reactor.
+static void bench_dispatch(int millis, size_t size, BenchServer* server) {
+  std::vector<uint8_t> data(size, 'x');
+  std::vector<uint8_t> message(PROTOCOL_BUFFER_SIZE);
+
+  struct Case {
+    const char* name;
+    message_type_t type;
+    ident_t dst;
+  };
+
+  Case cases[] = {
+    {"dispatch_none", MSG_NONE, 0},
+    {"dispatch_send", MSG_SEND, 2},
+    {"dispatch_send_room", MSG_SEND, BENCH_ROOM},
+  };
+
+  for (auto& c : cases) {
+    length_t len;
+
+    if (c.type == MSG_NONE) {
+      message_header_t header = {MSG_NONE, sizeof(message_header_t)};
+      memcpy(message.data(), &header, sizeof(header));
+      len = sizeof(header);
+    } else {
+      len = protocol_wrap_msg_send(
+        1, c.dst, FMT_UTF8, (length_t)size, data.data(), message.data()
+      );
+    }
+
+    // a batch of at most a megabyte
+    size_t count =
+      std::clamp((size_t)(1 << 20) / len, (size_t)1, (size_t)BENCH_BATCH);
+
+    std::vector<uint8_t> stream;
+    for (size_t i = 0; i < count; i++) {
+      stream.insert(stream.end(), message.data(), message.data() + len);
+    }
+
+    double seconds = time_per_run(millis, [&]() {
+      server_recv_handler(
+        server->reactor, 1, stream.data(), (int)stream.size()
+      );
+      server_drain_mailbox(server->reactor);
+    });
+
+    report(
+      c.name, c.type == MSG_NONE ? 0 : size, seconds, count, stream.size()
+    );
+  }
+}
+
+/// The appending of `HISTORY_REPLAY_MAX` messages to the history of the
+/// room, and their replay to a client by `server_recv_handler`, from the
+/// mapped segments to the frames queued.
+static void bench_history(int millis) {
+  std::filesystem::path dir =
+    std::filesystem::temp_directory_path() / "protocol-bench-history";
+  std::filesystem::remove_all(dir);
+
+  BenchServer server;
+  History& history = server.state.history;
+
+  if (history.open(dir.string()) != 0) {
+    printf("cannot open the history in %s\n", dir.string().c_str());
+    return;
+  }
+
+  std::vector<uint8_t> data(BENCH_HISTORY_SIZE, 'x');
+  size_t count = HISTORY_REPLAY_MAX;
+
+  // a single pass, every run would grow the log
+  auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < count; i++) {
+    sink += history.append(
+      BENCH_ROOM, 1, FMT_UTF8, data.data(), (uint32_t)data.size()
+    );
+  }
+  std::chrono::duration<double> elapsed =
+    std::chrono::steady_clock::now() - start;
+
+  size_t bytes = count * (sizeof(msg_send_t) + data.size());
+  report("history_append", data.size(), elapsed.count(), count, bytes);
+
+  uint8_t message[sizeof(msg_history_t)];
+  length_t len =
+    protocol_wrap_msg_history(BENCH_ROOM, 0, (uint32_t)count, message);
+
+  double seconds = time_per_run(millis, [&]() {
+    server_recv_handler(server.reactor, 1, message, len);
+  });
+  report("history_replay", data.size(), seconds, count, bytes);
+
+  history.rooms.clear();
+  std::filesystem::remove_all(dir);
+}
+
+/// Cost per message of wrapping, framing, the version 2 codec and the
+/// dispatch of the server.
+///
+/// Usage: protocol-bench [millis per run] [payload sizes...]
+int main(int argc, char* argv[]) {
+  int millis = 200;
+  std::vector<size_t> sizes = {16, 256, 4096, 60000};
+
+  if (argc > 1) {
+    millis = atoi(argv[1]);
+  }
+
+  if (millis < 1) {
+    millis = 1;
+  }
+
+  if (argc > 2) {
+    sizes.clear();
+    for (int i = 2; i < argc; i++) {
+      size_t size = strtoul(argv[i], NULL, 10);
+      sizes.push_back(
+        std::min(size, PROTOCOL_BUFFER_SIZE - sizeof(msg_request_t) -
+                         sizeof(msg_send_t))
+      );
+    }
+  }
+
+  printf("%d ms per run, ns per message\n", millis);
+  printf("%-22s %7s %10s %10s\n", "bench", "bytes", "ns/op", "MB/s");
+
+  bench_wrap_fixed(millis);
+
+  for (size_t size : sizes) {
+    bench_wrap_sized(millis, size);
+  }
+
+  for (size_t size : sizes) {
+    bench_parse(millis, size);
+  }
+
+  BenchServer server;
+
+  for (size_t size : sizes) {
+    bench_dispatch(millis, size, &server);
+  }
+
+  bench_history(millis);
+
+  return 0;
+}
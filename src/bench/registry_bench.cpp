@@ -0,0 +1,180 @@
+#include "server/registry.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+/// Number of the registered clients.
+#define BENCH_CLIENTS 10000
+
+/// Sink of the lookup results, keeping them from being optimized out.
+static std::atomic<uint64_t> sink = 0;
+
+/// The registry before sharding, one mutex around a map, for comparison.
+struct LockedRegistry {
+  std::mutex mutex;
+  std::unordered_map<ident_t, SOCKET> clients;
+
+  SOCKET find_client(ident_t ident) {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    auto it = this->clients.find(ident);
+    return it != this->clients.end() ? it->second : INVALID_SOCKET;
+  }
+
+  void add_client(ident_t ident, SOCKET socket) {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    this->clients.emplace(ident, socket);
+  }
+
+  void remove_client(ident_t ident) {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    this->clients.erase(ident);
+  }
+};
+
+/// Look up random clients from `threads` threads for `millis`, with another
+/// thread connecting and disconnecting clients if `churn`.
+///
+/// Returns the lookups per second.
+template <typename Lookup, typename Write>
+static double run(
+  int threads,
+  int millis,
+  bool churn,
+  Lookup lookup,
+  Write write
+) {
+  std::atomic<bool> stop = false;
+  std::atomic<uint64_t> total = 0;
+  std::vector<std::thread> workers;
+
+  for (int t = 0; t < threads; t++) {
+    workers.emplace_back([&, t]() {
+      uint32_t seed = 0x12345678u + t * 7919u;
+      uint64_t count = 0;
+      uint64_t found = 0;
+
+      while (!stop.load(std::memory_order_relaxed)) {
+        for (int i = 0; i < 1024; i++) {
+          // xorshift, the idents are 1 to BENCH_CLIENTS
+          seed ^= seed << 13;
+          seed ^= seed >> 17;
+          seed ^= seed << 5;
+          found += lookup(seed % BENCH_CLIENTS + 1) != INVALID_SOCKET;
+        }
+        count += 1024;
+      }
+
+      total += count;
+      sink += found;
+    });
+  }
+
+  std::thread writer;
+  if (churn) {
+    writer = std::thread([&]() {
+      ident_t ident = BENCH_CLIENTS + 1;
+      while (!stop.load(std::memory_order_relaxed)) {
+        write(ident);
+        ident = ident == BENCH_CLIENTS + 64 ? BENCH_CLIENTS + 1 : ident + 1;
+        std::this_thread::sleep_for(std::chrono::microseconds(50));
+      }
+    });
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  std::this_thread::sleep_for(std::chrono::milliseconds(millis));
+  stop = true;
+
+  for (auto& worker : workers) {
+    worker.join();
+  }
+  if (writer.joinable()) {
+    writer.join();
+  }
+
+  std::chrono::duration<double> elapsed =
+    std::chrono::steady_clock::now() - start;
+
+  return total / elapsed.count();
+}
+
+/// Lookup throughput of the registry against a single mutex.
+///
+/// Usage: registry-bench [max threads] [millis per run]
+int main(int argc, char* argv[]) {
+  int max_threads = std::thread::hardware_concurrency();
+  int millis = 500;
+
+  if (argc > 1) {
+    max_threads = atoi(argv[1]);
+  }
+
+  if (argc > 2) {
+    millis = atoi(argv[2]);
+  }
+
+  if (max_threads < 1) {
+    max_threads = 1;
+  }
+
+  Registry registry;
+  LockedRegistry locked;
+
+  for (ident_t ident = 1; ident <= BENCH_CLIENTS; ident++) {
+    registry.add_client(ident, (SOCKET)ident, SIZE_MAX);
+    locked.add_client(ident, (SOCKET)ident);
+  }
+
+  auto registry_lookup = [&](ident_t ident) {
+    return registry.find_client(ident);
+  };
+  auto registry_write = [&](ident_t ident) {
+    if (registry.find_client(ident) == INVALID_SOCKET) {
+      registry.add_client(ident, (SOCKET)ident, SIZE_MAX);
+    } else {
+      registry.remove_client(ident, (SOCKET)ident);
+    }
+  };
+  auto locked_lookup = [&](ident_t ident) { return locked.find_client(ident); };
+  auto locked_write = [&](ident_t ident) {
+    if (locked.find_client(ident) == INVALID_SOCKET) {
+      locked.add_client(ident, (SOCKET)ident);
+    } else {
+      locked.remove_client(ident);
+    }
+  };
+
+  printf(
+    "lookups per second, %d clients, %d ms per run\n", BENCH_CLIENTS, millis
+  );
+  printf(
+    "%8s %8s %14s %14s %8s\n", "threads", "churn", "registry", "mutex", "ratio"
+  );
+
+  for (int churn = 0; churn < 2; churn++) {
+    for (int threads = 1; threads <= max_threads;) {
+      double sharded =
+        run(threads, millis, churn, registry_lookup, registry_write);
+      double single = run(threads, millis, churn, locked_lookup, locked_write);
+
+      printf(
+        "%8d %8s %14.0f %14.0f %7.2fx\n", threads, churn ? "yes" : "no",
+        sharded, single, sharded / single
+      );
+
+      // always measure the maximum, even if it is not a power of two
+      if (threads < max_threads && threads * 2 > max_threads) {
+        threads = max_threads;
+      } else {
+        threads *= 2;
+      }
+    }
+  }
+
+  return 0;
+}
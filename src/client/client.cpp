@@ -1,33 +1,23 @@
-#include "WS2tcpip.h"
-#include "WinSock2.h"
 #include "stdio.h"
 #include "time.h"
 
 #include "client/client.h"
+#include "net/socket.h"
+#include "protocol/compress.h"
+#include "protocol/framer.h"
 #include "protocol/protocol.h"
+#include "protocol/protocol_v2.h"
 
+#include <algorithm>
 #include <chrono>
+#include <format>
 #include <iostream>
 
-#pragma comment(lib, "ws2_32.lib")
-
-void ClientState::log(const std::wstring& msg) {
-  if (!this->log_enabled) {
-    return;
-  }
-
-  auto const time =
-    std::chrono::current_zone()->to_local(std::chrono::system_clock::now());
-
-  std::wcout << std::format(L"\033[90m[ {} CLIENT ]\033[0m {}", time, msg)
-             << std::endl;
-}
-
 int ClientState::init(char* ip, size_t port) {
   // create the socket
   this->s = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
   if (this->s == INVALID_SOCKET) {
-    this->log(std::format(L"could not create socket: {}", WSAGetLastError()));
+    this->log<LOG_WARN>(L"could not create socket: {}", WSAGetLastError());
     return 1;
   }
 
@@ -44,14 +34,24 @@ int ClientState::init(char* ip, size_t port) {
 
   // connect to server
   if (connect(this->s, (struct sockaddr*)&this->server, sizeof(this->server)) < 0) {
-    this->log(
-      std::format(L"connect failed with error code: {}", WSAGetLastError())
+    this->log<LOG_WARN>(
+      L"connect failed with error code: {}", WSAGetLastError()
     );
     return 1;
   }
 
   this->log(L"connected.");
 
+  // the recv thread waits on the reactor, woken up to stop
+  if (this->reactor.init() != 0) {
+    this->log<LOG_WARN>(
+      L"reactor init failed with error code: {}", WSAGetLastError()
+    );
+    return 1;
+  }
+
+  this->timers.init(client_now(), (uint64_t)TIMER_TICK_MS * 1000000);
+
   return 0;
 }
 
@@ -67,9 +67,9 @@ void ClientState::show_info() {
   }
 
   // print info
-  this->log(std::format(
+  this->log(
     L"connected to server at {}:{}", ip_wstr, ntohs(this->server.sin_port)
-  ));
+  );
 }
 
 void ClientState::loop() {
@@ -78,8 +78,10 @@ void ClientState::loop() {
   // start recv thread
   std::thread recv_handler_thread(client_recv_handler, this);
 
-  // the buffer for sending messages
-  uint8_t message[PROTOCOL_BUFFER_SIZE] = {0};
+  // the buffer for sending requests, the message is wrapped behind the
+  // request header
+  uint8_t buffer[PROTOCOL_BUFFER_SIZE] = {0};
+  uint8_t* message = buffer + sizeof(msg_request_t);
 
   while (true) {
     // print prefix, ident green
@@ -122,31 +124,131 @@ void ClientState::loop() {
       continue;
     }
 
-    bool set_reply_flag = true;
-
     if (tokens[0] == L"send") {
       if (tokens.size() < 3) {
         this->log(L"usage: send <dst> <message>");
         continue;
       }
 
+      // the text goes on the wire in UTF-8, whatever the size of `wchar_t`
+      std::string content = client_utf8_encode(tokens[2]);
+      length_t content_len = (length_t)content.size();
+
+      uint8_t* data = (uint8_t*)content.data();
+      format_t format = FMT_UTF8;
+
+      uint32_t features;
+      {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        features = this->features;
+      }
+
+      // long text is compressed once here, the server forwards it as is and
+      // every receiver decompresses it.
+      std::vector<uint8_t> compressed(content.size());
+      if (content.size() >= COMPRESS_THRESHOLD && (features & FEATURE_LZ)) {
+        length_t compressed_len = compress_data(
+          FMT_UTF8, data, content_len, compressed.data(),
+          (uint32_t)compressed.size()
+        );
+
+        if (compressed_len > 0) {
+          this->log<LOG_DEBUG>(
+            L"compressed {} bytes to {}.", content_len, compressed_len
+          );
+          data = compressed.data();
+          content_len = compressed_len;
+          format = FMT_LZ;
+        }
+      }
+
+      // a list of destinations, `send 2,3,9 <message>`, is sent as a bundle
+      if (tokens[1].find(L',') != std::wstring::npos) {
+        std::vector<ident_t> dsts;
+        size_t start = 0;
+        while (start <= tokens[1].size()) {
+          size_t end = tokens[1].find(L',', start);
+          if (end == std::wstring::npos) {
+            end = tokens[1].size();
+          }
+          if (end > start) {
+            dsts.push_back(std::stoi(tokens[1].substr(start, end - start)));
+          }
+          start = end + 1;
+        }
+
+        size_t total = dsts.size() * (sizeof(msg_send_t) + content_len);
+        if (total > PROTOCOL_BUFFER_SIZE - sizeof(msg_bundle_t)) {
+          this->log(L"message is too long.");
+          continue;
+        }
+
+        // wrap the messages back to back behind the bundle header
+        uint8_t* iter = buffer + sizeof(msg_bundle_t);
+        for (auto dst : dsts) {
+          iter += protocol_wrap_msg_send(
+            this->ident, dst, format, content_len, data, iter
+          );
+        }
+
+        length_t len = (length_t)(iter - buffer - sizeof(msg_bundle_t));
+
+        int res =
+          this->request_bundle(prompt, (uint32_t)dsts.size(), len, buffer);
+
+        if (res != 0) {
+          this->log<LOG_WARN>(L"send to server failed.");
+          break;
+        }
+
+        this->log<LOG_DEBUG>(L"sent bundle to server.");
+        continue;
+      }
+
       ident_t dst = std::stoi(tokens[1]);
 
-      // get length of bytes of the content
-      length_t content_len = (int)(tokens[2].length() * sizeof(wchar_t));
+      if ((size_t)content_len >
+          PROTOCOL_BUFFER_SIZE - sizeof(msg_request_t) - sizeof(msg_send_t)) {
+        this->log(L"message is too long.");
+        continue;
+      }
 
-      uint8_t* data = (uint8_t*)(tokens[2].c_str());
+      // the data is written from where it is, behind the headers
+      if (this->request_send(prompt, dst, format, content_len, data) != 0) {
+        this->log<LOG_WARN>(L"send to server failed.");
+        break;
+      }
 
-      // get length of bytes of the message
-      length_t len =
-        protocol_wrap_msg_send(this->ident, dst, 0, content_len, data, message);
+      this->log<LOG_DEBUG>(L"sent message to server.");
+    } else if (tokens[0] == L"sendfile") {
+      if (tokens.size() < 3) {
+        this->log(L"usage: sendfile <dst> <path>");
+        continue;
+      }
 
-      if (send(this->s, (char*)message, (int)len, 0) < 0) {
-        this->log(L"send to server failed.");
-        return;
+      ident_t dst = std::stoi(tokens[1]);
+      std::string path = client_utf8_encode(tokens[2]);
+
+      FILE* file = fopen(path.c_str(), "rb");
+      if (file == NULL) {
+        this->log(L"cannot open {}.", tokens[2]);
+        continue;
+      }
+
+      // the receiver only learns the name of the file, not where it is
+      size_t slash = path.find_last_of("/\\");
+      std::string name =
+        slash == std::string::npos ? path : path.substr(slash + 1);
+
+      int res = this->send_file(prompt, dst, name, file);
+      fclose(file);
+
+      if (res != 0) {
+        this->log<LOG_WARN>(L"send to server failed.");
+        break;
       }
 
-      this->log(L"sent message to server.");
+      this->log<LOG_DEBUG>(L"sent file to server.");
     } else if (tokens[0] == L"join") {
       if (tokens.size() < 2) {
         this->log(L"usage: join <room>");
@@ -157,13 +259,12 @@ void ClientState::loop() {
 
       length_t len = protocol_wrap_msg_join(this->ident, room, message);
 
-      if (send(this->s, (char*)message, (int)len, 0) < 0) {
-        this->log(L"send to server failed.");
-
-        return;
+      if (this->request(prompt, len, buffer) != 0) {
+        this->log<LOG_WARN>(L"send to server failed.");
+        break;
       }
 
-      this->log(L"sent join message to server.");
+      this->log<LOG_DEBUG>(L"sent join message to server.");
     } else if (tokens[0] == L"leave") {
       if (tokens.size() < 2) {
         this->log(L"usage: leave <room>");
@@ -174,94 +275,792 @@ void ClientState::loop() {
 
       length_t len = protocol_wrap_msg_leave(this->ident, room, message);
 
-      if (send(this->s, (char*)message, (int)len, 0) < 0) {
-        this->log(L"send to server failed.");
+      if (this->request(prompt, len, buffer) != 0) {
+        this->log<LOG_WARN>(L"send to server failed.");
+        break;
+      }
 
-        return;
+      this->log<LOG_DEBUG>(L"sent leave message to server.");
+    } else if (tokens[0] == L"history") {
+      if (tokens.size() < 2) {
+        this->log(L"usage: history <room> [count] [from]");
+        continue;
       }
 
-      this->log(L"sent leave message to server.");
-    } else if (tokens[0] == L"connect") {
-      length_t len = protocol_wrap_msg_connect(this->ident, message);
+      ident_t room = std::stoi(tokens[1]);
+      uint32_t count = tokens.size() > 2 ? std::stoul(tokens[2]) : 20;
+      uint32_t from = tokens.size() > 3 ? std::stoul(tokens[3]) : 0;
 
-      if (send(this->s, (char*)message, (int)len, 0) < 0) {
-        this->log(L"send to server failed.");
+      length_t len = protocol_wrap_msg_history(room, from, count, message);
 
-        return;
+      if (this->request(prompt, len, buffer) != 0) {
+        this->log<LOG_WARN>(L"send to server failed.");
+        break;
+      }
+
+      this->log<LOG_DEBUG>(L"sent history message to server.");
+    } else if (tokens[0] == L"stats") {
+      length_t len = protocol_wrap_msg_stats(0, nullptr, message);
+
+      if (this->request(prompt, len, buffer) != 0) {
+        this->log<LOG_WARN>(L"send to server failed.");
+        break;
+      }
+
+      this->log<LOG_DEBUG>(L"sent stats message to server.");
+    } else if (tokens[0] == L"connect") {
+      uint32_t version;
+      {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        version = this->version;
+      }
+
+      // offer the latest version and the features, once agreed they stay
+      // for the connection
+      length_t len =
+        version < PROTOCOL_VERSION
+          ? protocol_wrap_msg_connect_version(
+              this->ident, PROTOCOL_VERSION, PROTOCOL_FEATURES, message
+            )
+          : protocol_wrap_msg_connect(this->ident, message);
+
+      if (this->request(prompt, len, buffer) != 0) {
+        this->log<LOG_WARN>(L"send to server failed.");
+        break;
       }
 
       this->log(L"sent connect message to server.");
+
+      // the version may change before the reply, nothing can be sent until
+      // it is known.
+      std::unique_lock<std::mutex> lock(this->mutex);
+      this->replied_cv.wait(lock, [this] {
+        return this->in_flight.empty() || !this->receiving;
+      });
     } else if (tokens[0] == L"disconnect") {
       length_t len = protocol_wrap_msg_disconnect(this->ident, message);
 
-      if (send(this->s, (char*)message, (int)len, 0) < 0) {
-        this->log(L"send to server failed.");
-        return;
+      if (this->request(prompt, len, buffer) != 0) {
+        this->log<LOG_WARN>(L"send to server failed.");
+        break;
       }
 
       this->log(L"sent disconnect message to server.");
     } else {
-      this->log(std::format(L"unknown command: {}", tokens[0]));
+      this->log(L"unknown command: {}", tokens[0]);
       std::wcout << std::format(
                       L"\033[90m{:^17}\033[0m> \033[31munknown command: {}",
                       L"client", tokens[0]
                     )
                  << std::endl;
+    }
+  }
+
+  {
+    // wait for the replies still in flight before leaving
+    std::unique_lock<std::mutex> lock(this->mutex);
+    this->replied_cv.wait(lock, [this] {
+      return this->in_flight.empty() || !this->receiving;
+    });
+    this->running = false;
+    this->reactor.wake();
+  }
+
+  // wait for thread to join, it takes the mutex to retire the replies
+  recv_handler_thread.join();
+  this->cleanup();
+}
+
+request_id_t ClientState::begin_request(const std::wstring& command) {
+  // wait for room in the window
+  std::unique_lock<std::mutex> lock(this->mutex);
+  this->replied_cv.wait(lock, [this] {
+    return this->in_flight.size() < this->window || !this->receiving;
+  });
+
+  if (!this->receiving) {
+    return 0;
+  }
+
+  // 0 is never used as an id
+  if (this->next_request == 0) {
+    this->next_request++;
+  }
+
+  // registered before sending, the reply may come back at once
+  request_id_t id = this->next_request++;
+  PendingRequest& request = this->in_flight[id];
+  request.command = command;
+
+  if (this->request_timeout_ms > 0) {
+    uint64_t now = client_now();
+    uint64_t delay = this->request_timeout_ms * 1000000;
+    request.timer = this->timers.schedule(now, delay, id);
+
+    // the recv thread only waits for the timers it knew of
+    if (now + delay < this->wake_at) {
+      this->reactor.wake();
+    }
+  }
+
+  return id;
+}
+
+int ClientState::request(
+  const std::wstring& command,
+  length_t len,
+  uint8_t buffer[]
+) {
+  request_id_t id = this->begin_request(command);
+  if (id == 0) {
+    return 1;
+  }
+
+  len = protocol_wrap_msg_request(id, len, buffer);
+
+  return this->send_message(buffer, len);
+}
+
+int ClientState::request_bundle(
+  const std::wstring& command,
+  uint32_t count,
+  length_t len,
+  uint8_t buffer[]
+) {
+  request_id_t id = this->begin_request(command);
+  if (id == 0) {
+    return 1;
+  }
+
+  len = protocol_wrap_msg_bundle(id, count, len, buffer);
+
+  return this->send_message(buffer, len);
+}
+
+int ClientState::request_send(
+  const std::wstring& command,
+  ident_t dst,
+  format_t format,
+  length_t data_len,
+  const uint8_t data[]
+) {
+  request_id_t id = this->begin_request(command);
+  if (id == 0) {
+    return 1;
+  }
+
+  bool v2;
+  {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    v2 = this->version == 2;
+  }
+
+  // the request and send headers, the data follows them on the wire
+  uint8_t prefix[PROTOCOL_V2_HEADER_MAX * 2];
+  length_t len;
+
+  if (v2) {
+    uint8_t send_header[PROTOCOL_V2_HEADER_MAX];
+    length_t send_len = protocol_v2_encode_send_header(
+      this->ident, dst, format, data_len, PROTOCOL_TO_SERVER, send_header
+    );
+    if (send_len < 0) {
+      return 1;
+    }
 
-      set_reply_flag = false;
+    len = protocol_v2_encode_request_header(id, send_len + data_len, prefix);
+    if (len < 0) {
+      return 1;
     }
 
-    if (set_reply_flag) {
-      // use condition variable to wait for reply
+    memcpy(prefix + len, send_header, send_len);
+    len += send_len;
+  } else {
+    protocol_wrap_msg_request(id, sizeof(msg_send_t) + data_len, prefix);
+    len = sizeof(msg_request_t) + protocol_wrap_msg_send_header(
+      this->ident, dst, format, data_len, prefix + sizeof(msg_request_t)
+    );
+  }
+
+  net_iovec_t iov[2];
+  net_iovec_set(&iov[0], prefix, len);
+  net_iovec_set(&iov[1], data, data_len);
+
+  std::lock_guard<std::mutex> lock(this->send_mutex);
+  if (net_sendv(this->s, iov, 2) != len + data_len) {
+    return 1;
+  }
+
+  return 0;
+}
+
+int ClientState::send_file(
+  const std::wstring& command,
+  ident_t dst,
+  const std::string& name,
+  FILE* file
+) {
+  if (fseek(file, 0, SEEK_END) != 0) {
+    this->log(L"cannot read the file.");
+    return 0;
+  }
+
+  long size = ftell(file);
+  if (size < 0 || (unsigned long)size > UINT32_MAX) {
+    this->log(L"file is too large to send.");
+    return 0;
+  }
+
+  uint8_t buffer[sizeof(msg_request_t) + sizeof(msg_stream_start_t) +
+                 STREAM_NAME_MAX];
+  length_t name_len =
+    (length_t)std::min(name.size(), (size_t)STREAM_NAME_MAX);
+
+  request_id_t id = this->begin_request(command);
+  if (id == 0) {
+    return 1;
+  }
+
+  uint32_t stream;
+  bool v2;
+  {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    stream = this->next_stream++;
+    v2 = this->version == 2;
+
+    this->stream_id = stream;
+    this->stream_request = id;
+    this->stream_reply = RPL_NONE;
+    this->stream_acked = 0;
+    this->stream_ended = false;
+  }
+
+  length_t len = protocol_wrap_msg_stream_start(
+    this->ident, dst, FMT_BINARY, stream, (uint32_t)size, name_len,
+    (const uint8_t*)name.data(), buffer + sizeof(msg_request_t)
+  );
+  len = protocol_wrap_msg_request(id, len, buffer);
+
+  int res = this->send_message(buffer, len);
+
+  // the chunks only go out once the server has opened the stream
+  reply_code_t reply = RPL_NONE;
+  if (res == 0) {
+    std::unique_lock<std::mutex> lock(this->mutex);
+    this->replied_cv.wait(lock, [this] {
+      return this->stream_reply != RPL_NONE || !this->receiving;
+    });
+    reply = this->stream_reply;
+  }
+
+  int fd = fileno(file);
+  uint64_t offset = 0;
+  bool ended = reply != RPL_OK;
+
+  while (res == 0 && !ended && offset < (uint64_t)size) {
+    uint32_t chunk =
+      (uint32_t)std::min((uint64_t)STREAM_CHUNK_SIZE, size - offset);
+
+    {
       std::unique_lock<std::mutex> lock(this->mutex);
-      this->replied = false;
-      this->replied_cv.wait(lock, [this] { return this->replied; });
+      this->replied_cv.wait(lock, [&] {
+        return offset + chunk - this->stream_acked <= STREAM_WINDOW ||
+               this->stream_ended || !this->receiving;
+      });
+      ended = this->stream_ended || !this->receiving;
+    }
+
+    if (ended) {
+      break;
+    }
+
+    // only the headers are built here, the data goes from the file to the
+    // socket
+    uint8_t prefix[PROTOCOL_V2_HEADER_MAX + sizeof(msg_stream_chunk_t)];
+    length_t prefix_len;
+
+    if (v2) {
+      prefix_len = protocol_v2_encode_header(
+        MSG_STREAM_CHUNK, 2 * sizeof(uint32_t) + chunk, prefix
+      );
+      memcpy(prefix + prefix_len, &this->ident, sizeof(ident_t));
+      memcpy(prefix + prefix_len + sizeof(ident_t), &stream, sizeof(stream));
+      prefix_len += 2 * sizeof(uint32_t);
+    } else {
+      prefix_len = protocol_wrap_msg_stream_chunk_header(
+        this->ident, stream, chunk, prefix
+      );
     }
+
+    std::lock_guard<std::mutex> lock(this->send_mutex);
+    if (send(this->s, (char*)prefix, prefix_len, 0) != prefix_len ||
+        net_sendfile(this->s, fd, offset, chunk) != 0) {
+      res = 1;
+      break;
+    }
+
+    offset += chunk;
   }
 
-  this->mutex.lock();
-  this->running = false;
-  // wait for thread to join
-  recv_handler_thread.join();
-  this->cleanup();
-  this->mutex.unlock();
+  // a stream the server has ended is not ended again
+  if (res == 0 && reply == RPL_OK && !ended) {
+    res = this->request(
+      command, protocol_wrap_msg_stream_end(
+                 this->ident, stream, RPL_OK, buffer + sizeof(msg_request_t)
+               ),
+      buffer
+    );
+  }
+
+  if (res == 0 && reply == RPL_OK) {
+    this->log(L"sent {} of {} bytes.", offset, size);
+  }
+
+  std::lock_guard<std::mutex> lock(this->mutex);
+  this->stream_id = 0;
+  this->stream_request = 0;
+
+  return res;
+}
+
+int ClientState::send_message(uint8_t buffer[], length_t len) {
+  uint8_t encoded[PROTOCOL_BUFFER_SIZE];
+
+  bool v2;
+  {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    v2 = this->version == 2;
+  }
+
+  // never longer than the message
+  if (v2) {
+    len = protocol_v2_encode(buffer, PROTOCOL_TO_SERVER, encoded);
+    buffer = encoded;
+  }
+
+  std::lock_guard<std::mutex> lock(this->send_mutex);
+  if (len < 0 || send(this->s, (char*)buffer, (int)len, 0) < 0) {
+    return 1;
+  }
+
+  return 0;
 }
 
 void ClientState::cleanup() {
   this->log(L"cleaning up...");
+  this->reactor.cleanup();
   closesocket(this->s);
   WSACleanup();
   this->log(L"cleaned up.");
 }
 
-void client_recv_handler(ClientState* state) {
-  uint8_t buffer[PROTOCOL_BUFFER_SIZE] = {0};
+void client_reply_handler(ClientState* state, reply_code_t code) {
+  switch (code) {
+    case RPL_NONE: {
+      break;
+    }
+    case RPL_OK: {
+      state->log(L"server accomplished the request successfully.");
+      break;
+    }
+    case RPL_SEND_FAILED: {
+      state->log(L"server failed to send the message.");
+      std::wcout
+        << std::format(
+             L"\033[90m{:^17}\033[0m> \033[31mfailed to send the "
+             L"message.\033[0m",
+             L"server"
+           )
+        << std::endl;
+      break;
+    }
+    case RPL_DUPLICATED_ID: {
+      state->log(L"cannot connect to server with duplicated id.");
+      std::wcout
+        << std::format(
+             L"\033[90m{:^17}\033[0m> \033[31mplease choose another "
+             L"id.\033[0m",
+             L"server"
+           )
+        << std::endl;
+      break;
+    }
+    case RPL_DST_NOT_FOUND: {
+      state->log(L"the destination of the message is not found.");
+
+      std::wcout << std::format(
+                      L"\033[90m{:^17}\033[0m> \033[31mdestination "
+                      L"of the message is "
+                      L"not found.\033[0m",
+                      L"server"
+                    )
+                 << std::endl;
+      break;
+    }
+    case RPL_ROOM_NOT_FOUND: {
+      state->log(L"the room to join or leave is not found.");
+      std::wcout << std::format(
+                      L"\033[90m{:^17}\033[0m> \033[31mroom is not "
+                      L"found.\033[0m",
+                      L"server"
+                    )
+                 << std::endl;
+      break;
+    }
+    case RPL_NOT_IN_ROOM: {
+      state->log(L"the client is not in the room.");
+      std::wcout << std::format(
+                      L"\033[90m{:^17}\033[0m> \033[31mhave not "
+                      L"joined the room "
+                      L"yet.\033[0m",
+                      L"server"
+                    )
+                 << std::endl;
+      break;
+    }
+    case RPL_ROOM_CONFLICT: {
+      state->log(L"the room id for join has conflict with an existing client.");
+      std::wcout << std::format(
+                      L"\033[90m{:^17}\033[0m> \033[31mroom id "
+                      L"conflict with client.\033[0m",
+                      L"server"
+                    )
+                 << std::endl;
+      break;
+    }
+    case RPL_REJECTED: {
+      state->log(L"the server rejected the client.");
+      std::wcout << std::format(
+                      L"\033[90m{:^17}\033[0m> \033[31mserver "
+                      L"rejected the client.\033[0m",
+                      L"server"
+                    )
+                 << std::endl;
+      break;
+    }
+    case RPL_BAD_REQUEST: {
+      state->log(L"the server could not understand the request.");
+      std::wcout << std::format(
+                      L"\033[90m{:^17}\033[0m> \033[31mbad "
+                      L"request.\033[0m",
+                      L"server"
+                    )
+                 << std::endl;
+      break;
+    }
+    case RPL_QUEUED: {
+      state->log(L"the destination is offline, the message is queued.");
+      std::wcout << std::format(
+                      L"\033[90m{:^17}\033[0m> destination is offline, "
+                      L"the message is delivered once it connects.",
+                      L"server"
+                    )
+                 << std::endl;
+      break;
+    }
+    case RPL_QUEUE_FULL: {
+      state->log(L"the queue of the offline destination is full.");
+      std::wcout << std::format(
+                      L"\033[90m{:^17}\033[0m> \033[31mdestination "
+                      L"is offline and its queue is full.\033[0m",
+                      L"server"
+                    )
+                 << std::endl;
+      break;
+    }
+    case RPL_DROPPED: {
+      state->log(L"messages to the client have been dropped.");
+      std::wcout << std::format(
+                      L"\033[90m{:^17}\033[0m> \033[31mmessages were "
+                      L"dropped, not read fast enough.\033[0m",
+                      L"server"
+                    )
+                 << std::endl;
+      break;
+    }
+  }
+}
+
+std::string client_utf8_encode(const std::wstring& text) {
+  std::string out;
+  out.reserve(text.size());
+
+  for (size_t i = 0; i < text.size(); i++) {
+    uint32_t cp = (uint32_t)text[i];
+
+    // a surrogate pair where `wchar_t` is UTF-16
+    if (cp >= 0xD800 && cp <= 0xDBFF && i + 1 < text.size() &&
+        (uint32_t)text[i + 1] >= 0xDC00 && (uint32_t)text[i + 1] <= 0xDFFF) {
+      cp = 0x10000 + ((cp - 0xD800) << 10) + ((uint32_t)text[i + 1] - 0xDC00);
+      i++;
+    } else if ((cp >= 0xD800 && cp <= 0xDFFF) || cp > 0x10FFFF) {
+      cp = 0xFFFD;
+    }
+
+    if (cp < 0x80) {
+      out.push_back((char)cp);
+    } else if (cp < 0x800) {
+      out.push_back((char)(0xC0 | (cp >> 6)));
+      out.push_back((char)(0x80 | (cp & 0x3F)));
+    } else if (cp < 0x10000) {
+      out.push_back((char)(0xE0 | (cp >> 12)));
+      out.push_back((char)(0x80 | ((cp >> 6) & 0x3F)));
+      out.push_back((char)(0x80 | (cp & 0x3F)));
+    } else {
+      out.push_back((char)(0xF0 | (cp >> 18)));
+      out.push_back((char)(0x80 | ((cp >> 12) & 0x3F)));
+      out.push_back((char)(0x80 | ((cp >> 6) & 0x3F)));
+      out.push_back((char)(0x80 | (cp & 0x3F)));
+    }
+  }
+
+  return out;
+}
+
+std::wstring client_utf8_decode(const uint8_t* data, size_t len) {
+  // the smallest code point of each sequence length, shorter are overlong
+  static const uint32_t min_cp[] = {0, 0, 0x80, 0x800, 0x10000};
+
+  std::wstring out;
+  out.reserve(len);
+
+  size_t i = 0;
+  while (i < len) {
+    uint8_t c = data[i];
+    uint32_t cp;
+    size_t n;
+
+    if (c < 0x80) {
+      cp = c;
+      n = 1;
+    } else if ((c & 0xE0) == 0xC0) {
+      cp = c & 0x1F;
+      n = 2;
+    } else if ((c & 0xF0) == 0xE0) {
+      cp = c & 0x0F;
+      n = 3;
+    } else if ((c & 0xF8) == 0xF0) {
+      cp = c & 0x07;
+      n = 4;
+    } else {
+      out.push_back((wchar_t)0xFFFD);
+      i++;
+      continue;
+    }
+
+    bool valid = true;
+    for (size_t k = 1; k < n; k++) {
+      if (i + k >= len || (data[i + k] & 0xC0) != 0x80) {
+        valid = false;
+        break;
+      }
+      cp = (cp << 6) | (data[i + k] & 0x3F);
+    }
+
+    if (!valid || cp < min_cp[n] || cp > 0x10FFFF ||
+        (cp >= 0xD800 && cp <= 0xDFFF)) {
+      out.push_back((wchar_t)0xFFFD);
+      i++;
+      continue;
+    }
+
+    if (sizeof(wchar_t) == 2 && cp >= 0x10000) {
+      out.push_back((wchar_t)(0xD800 + ((cp - 0x10000) >> 10)));
+      out.push_back((wchar_t)(0xDC00 + ((cp - 0x10000) & 0x3FF)));
+    } else {
+      out.push_back((wchar_t)cp);
+    }
 
-  // set timeout, so that the thread can exit normally
-  struct timeval timeout;
-  timeout.tv_sec = 1;
-  timeout.tv_usec = 0;
+    i += n;
+  }
+
+  return out;
+}
 
-  if (setsockopt(state->s, SOL_SOCKET, SO_RCVTIMEO, (char*)&timeout, sizeof(timeout)) < 0) {
-    state->log(
-      std::format(L"setsockopt failed with error code: {}", WSAGetLastError())
+uint64_t client_now() {
+  return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+           std::chrono::steady_clock::now().time_since_epoch()
+  )
+    .count();
+}
+
+/// Schedule the next heartbeat, after `heartbeat_ms` or `idle_timeout_ms`
+/// of silence of the server since `active`, with the mutex held.
+static void client_schedule_heartbeat(
+  ClientState* state,
+  uint64_t active,
+  uint64_t now
+) {
+  uint64_t heartbeat = state->heartbeat_ms * 1000000;
+  uint64_t timeout = state->idle_timeout_ms * 1000000;
+  uint64_t idle = now > active ? now - active : 0;
+  uint64_t delay = UINT64_MAX;
+
+  // pinged again every heartbeat while silent
+  if (heartbeat > 0) {
+    delay = idle < heartbeat ? heartbeat - idle : heartbeat;
+  }
+  if (timeout > 0) {
+    delay = std::min(delay, idle < timeout ? timeout - idle : 0);
+  }
+
+  if (delay != UINT64_MAX) {
+    state->timers.schedule(now, delay, 0);
+  }
+}
+
+/// Run the timers due: give the requests up, and ping the server or take it
+/// for gone once silent since `active` for long enough.
+///
+/// Returns 1 if the server is gone.
+static int client_run_timers(ClientState* state, uint64_t active) {
+  std::vector<std::wstring> given_up;
+  bool ping = false;
+  bool gone = false;
+  uint64_t idle = 0;
+
+  {
+    std::lock_guard<std::mutex> lock(state->mutex);
+    uint64_t now = client_now();
+    idle = now - active;
+
+    state->timers.advance(now, [&](uint64_t data) {
+      if (data == 0) {
+        uint64_t timeout = state->idle_timeout_ms * 1000000;
+        uint64_t heartbeat = state->heartbeat_ms * 1000000;
+
+        gone = timeout > 0 && idle >= timeout;
+        ping = !gone && heartbeat > 0 && idle >= heartbeat;
+
+        if (!gone) {
+          client_schedule_heartbeat(state, active, now);
+        }
+        return;
+      }
+
+      auto it = state->in_flight.find((request_id_t)data);
+      if (it == state->in_flight.end()) {
+        return;
+      }
+
+      // the stream waiting for its start goes no further
+      if (it->first == state->stream_request) {
+        state->stream_reply = RPL_SEND_FAILED;
+      }
+
+      given_up.push_back(it->second.command);
+      state->in_flight.erase(it);
+      state->replied_cv.notify_all();
+    });
+  }
+
+  for (const std::wstring& command : given_up) {
+    state->log<LOG_WARN>(L"request `{}` timed out.", command);
+    std::wcout << std::endl
+               << std::format(
+                    L"\033[90m{:^17}\033[0m> \033[31mno reply to `{}` in "
+                    L"time.\033[0m",
+                    L"client", command
+                  );
+  }
+
+  if (gone) {
+    state->log<LOG_WARN>(L"server silent for {} ms.", idle / 1000000);
+    std::wcout << std::endl
+               << std::format(
+                    L"\033[90m{:^17}\033[0m> \033[31mserver is not "
+                    L"responding.\033[0m",
+                    L"client"
+                  );
+    return 1;
+  }
+
+  if (ping) {
+    uint8_t message[sizeof(message_header_t)];
+    length_t len = protocol_wrap_msg_ping(0, message);
+
+    if (state->send_message(message, len) != 0) {
+      state->log<LOG_WARN>(L"send to server failed.");
+    }
+  }
+
+  return 0;
+}
+
+void client_recv_handler(ClientState* state) {
+  // messages split across reads are reassembled by the framer, so the reads
+  // do not need to hold a whole message.
+  uint8_t buffer[16384];
+
+  framer_t framer;
+  framer_init(&framer);
+
+  // the messages decoded from version 2 frames
+  std::vector<uint8_t> decoded;
+  // the data of the compressed messages
+  std::vector<uint8_t> plain(PROTOCOL_BUFFER_SIZE);
+  // the messages replayed from the history of a room still to come
+  uint32_t replaying = 0;
+  // the streams being received, by sender and id
+  std::unordered_map<uint64_t, IncomingStream> incoming;
+
+  // when the last bytes were read from the server
+  uint64_t active = client_now();
+  // whether the socket has bytes to read, set by the reactor
+  bool readable = false;
+
+  // the socket is blocking, it is read a call at a time while ready
+  bool added = state->reactor.add(
+                 state->s, EV_READ | EV_LEVEL,
+                 [&readable](SOCKET, uint32_t) { readable = true; }
+               ) == 0;
+
+  if (!added) {
+    state->log<LOG_WARN>(
+      L"reactor add failed with error code: {}", WSAGetLastError()
     );
-    return;
   }
 
-  while (true) {
-    if (!state->running) {
+  {
+    std::lock_guard<std::mutex> lock(state->mutex);
+    client_schedule_heartbeat(state, active, active);
+  }
+
+  while (added) {
+    int wait_ms;
+    {
+      // the loop wakes up to stop, for a tick of the timers or for bytes
+      std::lock_guard<std::mutex> lock(state->mutex);
+      if (!state->running) {
+        break;
+      }
+
+      uint64_t now = client_now();
+      wait_ms = state->timers.timeout_ms(now);
+      state->wake_at =
+        wait_ms < 0 ? UINT64_MAX : now + (uint64_t)wait_ms * 1000000;
+    }
+
+    if (state->reactor.poll(wait_ms) < 0) {
+      state->log<LOG_WARN>(
+        L"reactor poll failed with error code: {}", WSAGetLastError()
+      );
       break;
     }
 
-    int recv_size = recv(state->s, (char*)buffer, PROTOCOL_BUFFER_SIZE, 0);
-    if (recv_size == SOCKET_ERROR) {
-      if (WSAGetLastError() == WSAETIMEDOUT) {
-        continue;
-      }
+    if (client_run_timers(state, active) != 0) {
+      break;
+    }
 
-      state->log(
-        std::format(L"recv failed with error code: {}", WSAGetLastError())
+    if (!readable) {
+      continue;
+    }
+    readable = false;
+
+    int recv_size = recv(state->s, (char*)buffer, sizeof(buffer), 0);
+    if (recv_size == SOCKET_ERROR) {
+      state->log<LOG_WARN>(
+        L"recv failed with error code: {}", WSAGetLastError()
       );
       break;
     }
@@ -271,37 +1070,86 @@ void client_recv_handler(ClientState* state) {
       break;
     }
 
-    state->log(std::format(L"received {} bytes from server.", recv_size));
+    active = client_now();
+
+    state->log<LOG_DEBUG>(L"received {} bytes from server.", recv_size);
+
+    framer_feed(&framer, buffer, recv_size);
 
     // parse the message
-    uint8_t* iter = buffer;
-    while (iter < buffer + recv_size) {
-      message_header_t* header = (message_header_t*)iter;
+    uint8_t* frame;
+    uint32_t len;
+    int res;
+
+    while ((res = framer_next(&framer, &frame, &len)) > 0) {
+      message_header_t* header = (message_header_t*)frame;
+
+      if (framer.version == 2) {
+        decoded.resize(PROTOCOL_V2_DECODED_MAX(len));
+
+        length_t decoded_len = protocol_v2_decode(
+          frame, len, PROTOCOL_TO_CLIENT, 0, decoded.data(),
+          (uint32_t)decoded.size()
+        );
+
+        if (decoded_len < 0) {
+          res = -1;
+          break;
+        }
+
+        header = (message_header_t*)decoded.data();
+      }
+
+      uint8_t* iter = (uint8_t*)header;
       switch (header->type) {
         case MSG_NONE: {
-          state->log(L"received MSG_NONE.");
+          state->log<LOG_DEBUG>(L"received MSG_NONE.");
           break;
         }
         case MSG_SEND: {
           msg_send_t* send = (msg_send_t*)iter;
 
-          int content_len = send->header.length - sizeof(msg_send_t);
-          std::wstring wstr;
+          size_t content_len = send->header.length - sizeof(msg_send_t);
+          uint8_t* content = iter + sizeof(msg_send_t);
+          format_t format = send->format;
+
+          if (format == FMT_LZ) {
+            length_t len = decompress_data(
+              content, (uint32_t)content_len, &format, plain.data(),
+              (uint32_t)plain.size()
+            );
+
+            if (len < 0) {
+              state->log<LOG_WARN>(L"invalid compressed data.");
+              break;
+            }
+
+            content = plain.data();
+            content_len = len;
+          }
 
-          wchar_t* content = (wchar_t*)(iter + sizeof(msg_send_t));
-          for (int i = 0; i < content_len / sizeof(wchar_t); i++) {
-            wstr.push_back(content[i]);
+          // the data is only converted here, at the terminal
+          std::wstring wstr;
+          if (format == FMT_UTF8) {
+            wstr = client_utf8_decode(content, content_len);
+          } else {
+            wstr =
+              std::format(L"<{} bytes of format {}>", content_len, format);
           }
 
-          state->log(std::format(
+          state->log<LOG_DEBUG>(
             L"received MSG_SEND from {} to {} with `{}`", send->src, send->dst,
             wstr
-          ));
+          );
 
           // center, 15 alinged
           std::wstring detail = L"";
 
-          if (send->dst != state->ident) {
+          // the own messages are only shown replayed
+          if (replaying > 0) {
+            replaying--;
+            detail = std::format(L"# room {}", send->dst);
+          } else if (send->dst != state->ident) {
             if (send->src == state->ident) {
               break;
             }
@@ -317,112 +1165,290 @@ void client_recv_handler(ClientState* state) {
         }
         case MSG_REPLY: {
           msg_reply_t* reply = (msg_reply_t*)iter;
+          state->log<LOG_DEBUG>(
+            L"received MSG_REPLY with code: {}", (int)reply->code
+          );
+
+          client_reply_handler(state, reply->code);
+          break;
+        }
+        case MSG_REPLY_ID: {
+          msg_reply_id_t* reply = (msg_reply_id_t*)iter;
+
+          std::unique_lock<std::mutex> lock(state->mutex);
+
+          auto it = state->in_flight.find(reply->id);
+          if (it == state->in_flight.end()) {
+            state->log(L"reply to unknown request {}", reply->id);
+            break;
+          }
+
+          state->log<LOG_DEBUG>(
+            L"received MSG_REPLY_ID to `{}` with code: {}",
+            it->second.command, (int)reply->code
+          );
+
+          // retire the request and let the next one in the window
+          state->timers.cancel(it->second.timer);
+          state->in_flight.erase(it);
+          if (reply->id == state->stream_request) {
+            state->stream_reply = reply->code;
+          }
+          state->replied_cv.notify_all();
+          lock.unlock();
+
+          client_reply_handler(state, reply->code);
+          break;
+        }
+        case MSG_REPLY_BUNDLE: {
+          msg_reply_bundle_t* reply = (msg_reply_bundle_t*)iter;
+          uint8_t* codes = iter + sizeof(msg_reply_bundle_t);
+
+          std::unique_lock<std::mutex> lock(state->mutex);
+
+          auto it = state->in_flight.find(reply->id);
+          if (it == state->in_flight.end()) {
+            state->log(L"reply to unknown request {}", reply->id);
+            break;
+          }
+
+          state->log<LOG_DEBUG>(
+            L"received MSG_REPLY_BUNDLE to `{}` with {} codes",
+            it->second.command, reply->count
+          );
+
+          state->timers.cancel(it->second.timer);
+          state->in_flight.erase(it);
+          state->replied_cv.notify_all();
+          lock.unlock();
+
+          // the codes are bounded by the length, whatever the count says
+          uint32_t count = std::min(
+            reply->count,
+            (uint32_t)(reply->header.length - sizeof(msg_reply_bundle_t))
+          );
+          for (uint32_t i = 0; i < count; i++) {
+            client_reply_handler(state, (reply_code_t)codes[i]);
+          }
+          break;
+        }
+        case MSG_VERSION: {
+          msg_version_t* version = (msg_version_t*)iter;
+
+          if (version->version < 1 || version->version > PROTOCOL_VERSION) {
+            state->log<LOG_WARN>(
+              L"received unknown version: {}", version->version
+            );
+            break;
+          }
+
           state->log(
-            std::format(L"received MSG_REPLY with code: {}", (int)reply->code)
+            L"speaking version {} with features {}.", version->version,
+            version->features
           );
 
-          switch (reply->code) {
-            case RPL_NONE: {
-              break;
-            }
-            case RPL_OK: {
-              state->log(L"server accomplished the request successfully.");
-              break;
-            }
-            case RPL_SEND_FAILED: {
-              state->log(L"server failed to send the message.");
-              std::wcout
-                << std::format(
-                     L"\033[90m{:^17}\033[0m> \033[31mfailed to send the "
-                     L"message.\033[0m",
-                     L"server"
-                   )
-                << std::endl;
-              break;
-            }
-            case RPL_DUPLICATED_ID: {
-              state->log(L"cannot connect to server with duplicated id.");
-              std::wcout
-                << std::format(
-                     L"\033[90m{:^17}\033[0m> \033[31mplease choose another "
-                     L"id.\033[0m",
-                     L"server"
-                   )
-                << std::endl;
-              break;
-            }
-            case RPL_DST_NOT_FOUND: {
-              state->log(L"the destination of the message is not found.");
-
-              std::wcout << std::format(
-                              L"\033[90m{:^17}\033[0m> \033[31mdestination "
-                              L"of the message is "
-                              L"not found.\033[0m",
-                              L"server"
-                            )
-                         << std::endl;
-              break;
-            }
-            case RPL_ROOM_NOT_FOUND: {
-              state->log(L"the room to join or leave is not found.");
-              std::wcout << std::format(
-                              L"\033[90m{:^17}\033[0m> \033[31mroom is not "
-                              L"found.\033[0m",
-                              L"server"
-                            )
-                         << std::endl;
-              break;
-            }
-            case RPL_NOT_IN_ROOM: {
-              state->log(L"the client is not in the room.");
-              std::wcout << std::format(
-                              L"\033[90m{:^17}\033[0m> \033[31mhave not "
-                              L"joined the room "
-                              L"yet.\033[0m",
-                              L"server"
-                            )
-                         << std::endl;
-              break;
-            }
-            case RPL_ROOM_CONFLICT: {
-              state->log(
-                L"the room id for join has conflict with an existing client."
-              );
-              std::wcout << std::format(
-                              L"\033[90m{:^17}\033[0m> \033[31mroom id "
-                              L"conflict with client.\033[0m",
-                              L"server"
-                            )
-                         << std::endl;
-              break;
-            }
-            case RPL_REJECTED: {
-              state->log(L"the server rejected the client.");
-              std::wcout << std::format(
-                              L"\033[90m{:^17}\033[0m> \033[31mserver "
-                              L"rejected the client.\033[0m",
-                              L"server"
-                            )
-                         << std::endl;
-              break;
+          // the following messages are in the new format, both ways
+          framer.version = version->version;
+
+          std::lock_guard<std::mutex> lock(state->mutex);
+          state->version = version->version;
+          state->features = version->features;
+          break;
+        }
+        case MSG_HISTORY: {
+          msg_history_t* history = (msg_history_t*)iter;
+
+          state->log<LOG_DEBUG>(
+            L"received MSG_HISTORY of room {} with {} messages from {}",
+            history->room, history->count, history->from
+          );
+
+          replaying = history->count;
+
+          std::wcout << std::endl
+                     << std::format(
+                          L"\033[90m{:^17}\033[0m> {} messages of room {} "
+                          L"from {}",
+                          L"history", history->count, history->room,
+                          history->from
+                        );
+          break;
+        }
+        case MSG_STREAM_START: {
+          msg_stream_start_t* start = (msg_stream_start_t*)iter;
+          uint64_t key = ((uint64_t)start->src << 32) | start->id;
+
+          // only the name is taken, never a path
+          std::string name(
+            (char*)iter + sizeof(msg_stream_start_t),
+            start->header.length - sizeof(msg_stream_start_t)
+          );
+          if (name.empty() || name == "." || name == ".." ||
+              name.find_first_of("/\\") != std::string::npos ||
+              name.find('\0') != std::string::npos) {
+            name = std::format("stream-{}", start->id);
+          }
+          name = std::format("from-{}-{}", start->src, name);
+
+          if (incoming.contains(key)) {
+            state->log<LOG_WARN>(L"stream {} started twice.", start->id);
+            break;
+          }
+
+          FILE* file = fopen(name.c_str(), "wb");
+          if (file == NULL) {
+            state->log<LOG_WARN>(L"cannot write the stream to a file.");
+            break;
+          }
+
+          IncomingStream& stream = incoming[key];
+          stream.file = file;
+          stream.name = name;
+          stream.size = start->size;
+
+          std::wstring wname =
+            client_utf8_decode((uint8_t*)name.data(), name.size());
+          std::wcout << std::endl
+                     << std::format(
+                          L"\033[90m{:^17}\033[0m> receiving {} bytes from "
+                          L"{} into {}",
+                          L"stream", start->size, start->src, wname
+                        );
+          break;
+        }
+        case MSG_STREAM_CHUNK: {
+          msg_stream_chunk_t* chunk = (msg_stream_chunk_t*)iter;
+          uint32_t data_len = chunk->header.length - sizeof(msg_stream_chunk_t);
+
+          auto it = incoming.find(((uint64_t)chunk->src << 32) | chunk->id);
+          if (it == incoming.end()) {
+            break;
+          }
+
+          IncomingStream& stream = it->second;
+          if (fwrite(iter + sizeof(msg_stream_chunk_t), 1, data_len,
+                     stream.file) != data_len) {
+            state->log<LOG_WARN>(L"cannot write the stream to a file.");
+          }
+          stream.received += data_len;
+          stream.unacked += data_len;
+
+          // the data written opens the window of the sender, half of it at
+          // once
+          if (stream.unacked >= STREAM_WINDOW / 2) {
+            uint8_t ack[sizeof(msg_stream_ack_t)];
+            length_t ack_len = protocol_wrap_msg_stream_ack(
+              chunk->src, chunk->id, stream.unacked, ack
+            );
+            stream.unacked = 0;
+
+            if (state->send_message(ack, ack_len) != 0) {
+              state->log<LOG_WARN>(L"send to server failed.");
             }
           }
+          break;
+        }
+        case MSG_STREAM_END: {
+          msg_stream_end_t* end = (msg_stream_end_t*)iter;
 
-          // set replied flag and notify
+          state->log<LOG_DEBUG>(
+            L"received MSG_STREAM_END {} from {} with code {}", end->id,
+            end->src, (int)end->code
+          );
+
+          auto it = incoming.find(((uint64_t)end->src << 32) | end->id);
+          if (it != incoming.end()) {
+            IncomingStream& stream = it->second;
+            fclose(stream.file);
+
+            bool complete =
+              end->code == RPL_OK &&
+              (stream.size == 0 || stream.received == stream.size);
+            std::wstring wname = client_utf8_decode(
+              (uint8_t*)stream.name.data(), stream.name.size()
+            );
+            std::wcout << std::endl
+                       << std::format(
+                            L"\033[90m{:^17}\033[0m> {}{} of {} bytes "
+                            L"{}\033[0m",
+                            L"stream", complete ? L"" : L"\033[31m",
+                            wname, stream.received,
+                            complete ? L"received" : L"incomplete"
+                          );
+            incoming.erase(it);
+          }
+
+          // the stream sent is ended by the server, the receiver gone
           std::unique_lock<std::mutex> lock(state->mutex);
-          state->replied = true;
-          state->replied_cv.notify_all();
+          if (end->src == state->ident && end->id == state->stream_id &&
+              end->code != RPL_OK) {
+            state->stream_ended = true;
+            state->replied_cv.notify_all();
+            lock.unlock();
+
+            client_reply_handler(state, end->code);
+          }
+          break;
+        }
+        case MSG_STREAM_ACK: {
+          msg_stream_ack_t* ack = (msg_stream_ack_t*)iter;
+
+          std::lock_guard<std::mutex> lock(state->mutex);
+          if (ack->src == state->ident && ack->id == state->stream_id) {
+            state->stream_acked += ack->bytes;
+            state->replied_cv.notify_all();
+          }
+          break;
+        }
+        case MSG_PING: {
+          state->log<LOG_DEBUG>(L"received MSG_PING.");
+
+          uint8_t pong[sizeof(message_header_t)];
+          length_t pong_len = protocol_wrap_msg_ping(1, pong);
+
+          if (state->send_message(pong, pong_len) != 0) {
+            state->log<LOG_WARN>(L"send to server failed.");
+          }
+          break;
+        }
+        case MSG_PONG: {
+          // the server is alive, as told by any bytes read from it
+          state->log<LOG_DEBUG>(L"received MSG_PONG.");
+          break;
+        }
+        case MSG_STATS: {
+          uint8_t* text = iter + sizeof(message_header_t);
+          size_t text_len = header->length - sizeof(message_header_t);
 
+          state->log<LOG_DEBUG>(L"received MSG_STATS with {} bytes", text_len);
+
+          std::wcout << std::endl << client_utf8_decode(text, text_len);
           break;
         }
         default: {
-          state->log(std::format(
+          state->log<LOG_WARN>(
             L"received unknown message type: {}", (uint32_t)header->type
-          ));
+          );
           break;
         }
       }
-      iter += header->length;
     }
+
+    if (res < 0) {
+      state->log<LOG_WARN>(L"invalid message.");
+      break;
+    }
+  }
+
+  state->reactor.remove(state->s);
+  framer_free(&framer);
+
+  for (auto& [key, stream] : incoming) {
+    fclose(stream.file);
   }
+
+  // nothing will be replied anymore, release the waiting requests
+  std::unique_lock<std::mutex> lock(state->mutex);
+  state->receiving = false;
+  state->replied_cv.notify_all();
 }
\ No newline at end of file
@@ -1,13 +1,52 @@
 #ifndef CLIENT_CLIENT_H_
 #define CLIENT_CLIENT_H_
 
-#include "WinSock2.h"
+#include <stdio.h>
 
-#include <string>
+#include <condition_variable>
 #include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 
+#include "log/logger.h"
+#include "net/reactor.h"
+#include "net/socket.h"
+#include "net/timer_wheel.h"
 #include "protocol/protocol.h"
 
+/// Milliseconds the server may stay silent before it is pinged, by default.
+#define CLIENT_HEARTBEAT_MS 30000
+/// Milliseconds the server may stay silent before it is taken for gone, by
+/// default.
+#define CLIENT_IDLE_TIMEOUT_MS 90000
+/// Milliseconds a request waits for its reply before it is given up, by
+/// default.
+#define CLIENT_REQUEST_TIMEOUT_MS 10000
+
+/// A request sent and not replied by the server yet.
+struct PendingRequest {
+  /// The command the request was sent for
+  std::wstring command;
+  /// The timer giving the request up, 0 if none
+  timer_id_t timer = 0;
+};
+
+/// A stream received from another client, written to a file.
+struct IncomingStream {
+  /// The file the data is written to
+  FILE* file = nullptr;
+  /// The name of the file
+  std::string name;
+  /// Number of bytes of the data announced, 0 if not known
+  uint32_t size = 0;
+  /// Bytes of the data written
+  uint64_t received = 0;
+  /// Bytes written and not acknowledged yet
+  uint32_t unacked = 0;
+};
+
 /// The state of the client
 struct ClientState {
   /// The socket to the server
@@ -20,16 +59,64 @@ struct ClientState {
   std::mutex mutex;
   /// Whether the client is running
   bool running = true;
-  /// Whether the client log function is enabled
-  bool log_enabled = true;
+  /// The logger, off the thread reading commands
+  Logger logger{L"CLIENT"};
+
+  /// Whether the recv thread is still receiving from the server
+  bool receiving = true;
+  /// The version of the wire format, raised by the server at `connect`
+  uint32_t version = 1;
+  /// The features agreed on with the server at `connect`
+  uint32_t features = 0;
 
-  /// Mark the message is sent but not replied by the server
-  bool replied = false;
-  /// The condition variable for replied to synchronize the client threads
+  /// Maximum number of requests in flight, 1 waits for every reply
+  size_t window = 1;
+  /// The id of the next request
+  request_id_t next_request = 1;
+  /// The requests sent but not replied by the server, with their command
+  std::unordered_map<request_id_t, PendingRequest> in_flight;
+  /// Notified when a request is replied to or given up, the stream sent is
+  /// acknowledged or ended, or the recv thread stops
   std::condition_variable replied_cv;
-  
-  /// Print a message to stdout with a prefix
-  void log(const std::wstring& msg);
+
+  /// Milliseconds the server may stay silent before it is pinged, 0 for
+  /// never
+  uint64_t heartbeat_ms = CLIENT_HEARTBEAT_MS;
+  /// Milliseconds the server may stay silent before it is taken for gone,
+  /// 0 for never
+  uint64_t idle_timeout_ms = CLIENT_IDLE_TIMEOUT_MS;
+  /// Milliseconds a request waits for its reply, 0 for ever
+  uint64_t request_timeout_ms = CLIENT_REQUEST_TIMEOUT_MS;
+  /// The timers of the requests in flight, by id, and of the heartbeat, as
+  /// 0, run by the recv thread
+  TimerWheel timers;
+  /// When the recv thread wakes up next at the latest, see `client_now`
+  uint64_t wake_at = UINT64_MAX;
+  /// Waits for the socket and the timers on the recv thread, woken up to
+  /// stop or for an earlier timer
+  Reactor reactor;
+
+  /// Taken around every write to the socket, the recv thread acknowledges
+  /// the streams received while a message is sent
+  std::mutex send_mutex;
+  /// The id of the next stream sent
+  uint32_t next_stream = 1;
+  /// The id of the stream being sent, 0 if none
+  uint32_t stream_id = 0;
+  /// The request starting the stream being sent
+  request_id_t stream_request = 0;
+  /// The reply to the request starting the stream, `RPL_NONE` until then
+  reply_code_t stream_reply = RPL_NONE;
+  /// Bytes of the stream being sent acknowledged by the receiver
+  uint64_t stream_acked = 0;
+  /// Whether the server has ended the stream being sent
+  bool stream_ended = false;
+
+  /// Log a message of the level, formatted only if the level is enabled
+  template <LogLevel Level = LOG_INFO, typename... Args>
+  void log(std::wformat_string<Args...> fmt, Args&&... args) {
+    this->logger.log<Level>(fmt, std::forward<Args>(args)...);
+  }
   /// Initialize the client
   int init(char* ip, size_t port);
   /// Main loop of the client
@@ -38,11 +125,65 @@ struct ClientState {
   void show_info();
   /// Cleanup the client
   void cleanup();
+  /// Wait for room in the window and register a request for the command.
+  ///
+  /// Returns the id of the request, 0 if the server is gone.
+  request_id_t begin_request(const std::wstring& command);
+  /// Send the message in the version of the wire format spoken.
+  int send_message(uint8_t buffer[], length_t len);
+  /// Send the message wrapped at `buffer + sizeof(msg_request_t)` as a
+  /// request, waiting for room in the window first.
+  int request(const std::wstring& command, length_t len, uint8_t buffer[]);
+  /// Send a message of the data to `dst` as a request, waiting for room in
+  /// the window first.
+  ///
+  /// Only the headers are wrapped, the data is written from where it is.
+  int request_send(
+    const std::wstring& command,
+    ident_t dst,
+    format_t format,
+    length_t data_len,
+    const uint8_t data[]
+  );
+  /// Stream the file to `dst` under the name, in chunks read by the system
+  /// straight into the socket, waiting for the receiver to acknowledge them
+  /// once `STREAM_WINDOW` bytes are in flight.
+  ///
+  /// Returns 1 if the server is gone.
+  int send_file(
+    const std::wstring& command,
+    ident_t dst,
+    const std::string& name,
+    FILE* file
+  );
+  /// Send the `count` messages wrapped at `buffer + sizeof(msg_bundle_t)` as
+  /// a bundle, waiting for room in the window first.
+  int request_bundle(
+    const std::wstring& command,
+    uint32_t count,
+    length_t len,
+    uint8_t buffer[]
+  );
 };
 
 /// The handler for receiving messages from the server.
 void client_recv_handler(ClientState* state);
 
+/// Nanoseconds of a steady clock, the time of the timers.
+uint64_t client_now();
+
+/// Show the reply of the server to the user.
+void client_reply_handler(ClientState* state, reply_code_t code);
+
+/// Encode the text typed by the user into UTF-8, for `FMT_UTF8` data.
+///
+/// The text is UTF-16 where `wchar_t` is 2 bytes and UTF-32 elsewhere.
+std::string client_utf8_encode(const std::wstring& text);
+
+/// Decode `FMT_UTF8` data for the terminal, invalid bytes are replaced by
+/// U+FFFD.
+std::wstring client_utf8_decode(const uint8_t* data, size_t len);
+
 
 
 #endif // CLIENT_CLIENT_H_
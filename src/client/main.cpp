@@ -1,19 +1,22 @@
-#include "WS2tcpip.h"
-#include "WinSock2.h"
 #include "stdio.h"
+#include "string.h"
 #include "time.h"
 
 #include "client/client.h"
+#include "net/socket.h"
 #include "protocol/protocol.h"
 
 #include <format>
 #include <iostream>
-
-#pragma comment(lib, "ws2_32.lib")
+#include <string>
 
 int main(int argc, char* argv[]) {
   if (argc < 4) {
-    printf("Usage: %s <ip> <server port> <ident> <logging>\n", argv[0]);
+    printf(
+      "Usage: %s <ip> <server port> <ident> <log level> <window> "
+      "<request timeout> <heartbeat> <idle timeout>\n",
+      argv[0]
+    );
     return 1;
   }
   size_t port = atoi(argv[2]);
@@ -22,8 +25,39 @@ int main(int argc, char* argv[]) {
 
   ClientState state;
 
+  // the log level, `0` and `1` still turn the log off and on
   if (argc >= 5) {
-    state.log_enabled = atoi(argv[4]);
+    std::string level = argv[4];
+    if (level == "0") {
+      state.logger.level = LOG_OFF;
+    } else if (level == "1") {
+      state.logger.level = LOG_INFO;
+    } else {
+      state.logger.level = log_level_parse(level);
+    }
+  }
+
+  // the number of requests in flight, 1 waits for every reply
+  if (argc >= 6 && atoi(argv[5]) > 0) {
+    state.window = atoi(argv[5]);
+  }
+
+  // the milliseconds a request waits for its reply, 10 s by default or with
+  // `-`, 0 for ever
+  if (argc >= 7 && strcmp(argv[6], "-") != 0) {
+    state.request_timeout_ms = strtoull(argv[6], NULL, 10);
+  }
+
+  // the milliseconds the server may stay silent before it is pinged, 30 s
+  // by default or with `-`, 0 for never
+  if (argc >= 8 && strcmp(argv[7], "-") != 0) {
+    state.heartbeat_ms = strtoull(argv[7], NULL, 10);
+  }
+
+  // the milliseconds the server may stay silent before it is taken for
+  // gone, 90 s by default or with `-`, 0 for never
+  if (argc >= 9 && strcmp(argv[8], "-") != 0) {
+    state.idle_timeout_ms = strtoull(argv[8], NULL, 10);
   }
 
   // set locale chinese
@@ -35,7 +69,7 @@ int main(int argc, char* argv[]) {
 
   state.log(L"initializing winsock...");
   if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0) {
-    state.log(std::format(L"failed. error code: {}", WSAGetLastError()));
+    state.log(L"failed. error code: {}", WSAGetLastError());
     return 1;
   }
 
@@ -0,0 +1,207 @@
+#include "log/logger.h"
+
+#include <chrono>
+#include <iostream>
+
+Logger::Logger(std::wstring name)
+  : name(std::move(name)), ring(LOGGER_RING_SIZE) {
+  for (uint64_t i = 0; i < LOGGER_RING_SIZE; i++) {
+    this->ring[i].sequence.store(i, std::memory_order_relaxed);
+  }
+
+  this->thread = std::thread(&Logger::drain, this);
+}
+
+Logger::~Logger() {
+  // the records pushed so far are still written
+  this->running = false;
+  this->notify();
+  this->thread.join();
+
+  uint64_t dropped = this->dropped.load();
+  if (dropped > 0) {
+    fprintf(stderr, "%llu log records dropped\n", (unsigned long long)dropped);
+  }
+
+  if (this->binary != nullptr) {
+    fclose(this->binary);
+  }
+}
+
+int Logger::open_binary(const char* path) {
+  FILE* file = fopen(path, "wb");
+  if (file == nullptr) {
+    return 1;
+  }
+
+  uint8_t wchar_size = sizeof(wchar_t);
+  fwrite("WCLOG1", 1, 6, file);
+  fwrite(&wchar_size, 1, 1, file);
+
+  this->binary = file;
+
+  return 0;
+}
+
+void Logger::push(LogLevel level, std::wstring&& text) {
+  uint64_t pos = this->head.load(std::memory_order_relaxed);
+  Slot* slot;
+
+  // claim the slot at the head, it is ready when its sequence is the
+  // position. a lower sequence is a slot not popped yet, the ring is full.
+  while (true) {
+    slot = &this->ring[pos & (LOGGER_RING_SIZE - 1)];
+    uint64_t sequence = slot->sequence.load(std::memory_order_acquire);
+    int64_t diff = (int64_t)(sequence - pos);
+
+    if (diff == 0) {
+      if (this->head.compare_exchange_weak(
+            pos, pos + 1, std::memory_order_relaxed
+          )) {
+        break;
+      }
+    } else if (diff < 0) {
+      this->dropped.fetch_add(1, std::memory_order_relaxed);
+      return;
+    } else {
+      pos = this->head.load(std::memory_order_relaxed);
+    }
+  }
+
+  slot->record.level = level;
+  slot->record.time =
+    std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::system_clock::now().time_since_epoch()
+    )
+      .count();
+  slot->record.text = std::move(text);
+
+  // publish the record to the background thread
+  slot->sequence.store(pos + 1, std::memory_order_release);
+
+  // either the background thread sees the record before it sleeps, or the
+  // record sees it sleeping
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (this->sleeping.load(std::memory_order_relaxed)) {
+    this->notify();
+  }
+}
+
+void Logger::notify() {
+  std::lock_guard<std::mutex> lock(this->mutex);
+  this->sleeping.store(false, std::memory_order_relaxed);
+  this->wake.notify_one();
+}
+
+bool Logger::ready() {
+  Slot& slot = this->ring[this->tail & (LOGGER_RING_SIZE - 1)];
+  return slot.sequence.load(std::memory_order_acquire) == this->tail + 1;
+}
+
+bool Logger::pop(Record* record) {
+  Slot& slot = this->ring[this->tail & (LOGGER_RING_SIZE - 1)];
+
+  if (slot.sequence.load(std::memory_order_acquire) != this->tail + 1) {
+    return false;
+  }
+
+  *record = std::move(slot.record);
+
+  // hand the slot back to the pushers, for the next lap of the ring
+  slot.sequence.store(
+    this->tail + LOGGER_RING_SIZE, std::memory_order_release
+  );
+  this->tail++;
+
+  return true;
+}
+
+void Logger::drain() {
+  std::vector<Record> batch(LOGGER_RING_SIZE);
+
+  while (true) {
+    // read before popping, so nothing pushed before the stop is missed
+    bool running = this->running.load();
+
+    size_t count = 0;
+    while (count < batch.size() && this->pop(&batch[count])) {
+      count++;
+    }
+
+    if (count > 0) {
+      this->write(batch, count);
+      continue;
+    }
+
+    if (!running) {
+      break;
+    }
+
+    // the flag is raised before the ring is looked at again, see `push`
+    std::unique_lock<std::mutex> lock(this->mutex);
+    this->sleeping.store(true, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+
+    if (this->ready() || !this->running.load()) {
+      this->sleeping.store(false, std::memory_order_relaxed);
+      continue;
+    }
+
+    this->wake.wait(lock, [this]() {
+      return !this->sleeping.load(std::memory_order_relaxed);
+    });
+  }
+}
+
+void Logger::write(std::vector<Record>& batch, size_t count) {
+  if (this->binary != nullptr) {
+    for (size_t i = 0; i < count; i++) {
+      Record& record = batch[i];
+      uint8_t level = (uint8_t)record.level;
+      uint32_t len = (uint32_t)record.text.size();
+
+      fwrite(&record.time, sizeof(record.time), 1, this->binary);
+      fwrite(&level, 1, 1, this->binary);
+      fwrite(&len, sizeof(len), 1, this->binary);
+      fwrite(record.text.data(), sizeof(wchar_t), len, this->binary);
+    }
+
+    fflush(this->binary);
+    return;
+  }
+
+  static const wchar_t* names[] = {L"", L"", L" WARN", L" ERROR"};
+
+  for (size_t i = 0; i < count; i++) {
+    Record& record = batch[i];
+
+    std::chrono::system_clock::time_point time{
+      std::chrono::duration_cast<std::chrono::system_clock::duration>(
+        std::chrono::nanoseconds(record.time)
+      )
+    };
+    auto const local = std::chrono::current_zone()->to_local(time);
+
+    // grey for time and default for msg
+    std::wcout << std::format(
+                    L"\033[90m[ {} {}{} ]\033[0m {}\n", local, this->name,
+                    names[record.level], record.text
+                  );
+  }
+
+  std::wcout.flush();
+}
+
+LogLevel log_level_parse(const std::string& name) {
+  if (name == "debug") {
+    return LOG_DEBUG;
+  } else if (name == "warn") {
+    return LOG_WARN;
+  } else if (name == "error") {
+    return LOG_ERROR;
+  } else if (name == "off") {
+    return LOG_OFF;
+  }
+
+  return LOG_INFO;
+}
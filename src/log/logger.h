@@ -0,0 +1,142 @@
+#ifndef LOG_LOGGER_H_
+#define LOG_LOGGER_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <format>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/// Number of the records the ring holds, a power of two.
+#define LOGGER_RING_SIZE 4096
+
+/// Level of a log record, the records below the level of the logger are
+/// dropped without being formatted.
+enum LogLevel {
+  LOG_DEBUG = 0,
+  LOG_INFO,
+  LOG_WARN,
+  LOG_ERROR,
+  /// Not a level of a record, turns the logger off
+  LOG_OFF,
+};
+
+/// The lowest level compiled in, the calls below it compile to nothing.
+#ifndef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL LOG_DEBUG
+#endif
+
+/// Asynchronous logger.
+///
+/// A record is formatted by the thread logging it, only if its level is
+/// enabled, and pushed into a bounded ring without any lock. A background
+/// thread drains the ring in batches, converts the time and writes the
+/// records out, flushing once per batch. It sleeps while the ring is empty,
+/// woken by the record pushed into it. When the ring is full the record is
+/// dropped and counted, logging never blocks.
+///
+/// Records are written as text to stdout, or in the binary format to a file
+/// when one is opened. A binary file starts with the magic `WCLOG1` and the
+/// size of `wchar_t` in a byte, followed by the records:
+///
+/// +------+-------+-----+------------+
+/// | TIME | LEVEL | LEN | TEXT ...   |
+/// +------+-------+-----+------------+
+///
+/// The time is 8 bytes of nanoseconds since the epoch of the system clock,
+/// the level 1 byte, and the length 4 bytes, the number of `wchar_t` of the
+/// text.
+struct Logger {
+  /// A formatted record.
+  struct Record {
+    LogLevel level;
+    /// Nanoseconds since the epoch of the system clock
+    int64_t time;
+    std::wstring text;
+  };
+
+  /// A slot of the ring.
+  struct Slot {
+    /// The position the slot is ready for, see `push` and `pop`
+    std::atomic<uint64_t> sequence;
+    Record record;
+  };
+
+  /// The name in the prefix of the records, like `SERVER`
+  std::wstring name;
+  /// The lowest level logged
+  std::atomic<int> level = LOG_INFO;
+
+  /// The records waiting for the background thread
+  std::vector<Slot> ring;
+  /// The position of the next record pushed
+  std::atomic<uint64_t> head = 0;
+  /// The position of the next record popped, only used by the background
+  /// thread
+  uint64_t tail = 0;
+  /// Number of the records dropped because the ring was full
+  std::atomic<uint64_t> dropped = 0;
+
+  /// The binary file the records go to, null for text to stdout
+  std::atomic<FILE*> binary = nullptr;
+
+  std::atomic<bool> running = true;
+  /// Whether the background thread sleeps on the empty ring, to be woken
+  std::atomic<bool> sleeping = false;
+  /// Mutex of the sleep of the background thread
+  std::mutex mutex;
+  /// Wakes the background thread
+  std::condition_variable wake;
+  /// Drains the ring
+  std::thread thread;
+
+  explicit Logger(std::wstring name);
+  ~Logger();
+
+  Logger(const Logger&) = delete;
+  Logger& operator=(const Logger&) = delete;
+
+  /// Whether the records of the level are logged.
+  bool enabled(LogLevel level) const {
+    return level >= this->level.load(std::memory_order_relaxed);
+  }
+
+  /// Format and log a record, if its level is enabled.
+  template <LogLevel Level, typename... Args>
+  void log(std::wformat_string<Args...> fmt, Args&&... args) {
+    if constexpr (Level >= LOG_COMPILE_LEVEL) {
+      if (this->enabled(Level)) {
+        this->push(Level, std::format(fmt, std::forward<Args>(args)...));
+      }
+    }
+  }
+
+  /// Write the records to a file in the binary format instead of stdout.
+  ///
+  /// Must be called before logging. Returns 1 if the file cannot be opened.
+  int open_binary(const char* path);
+
+  /// Push a formatted record into the ring, or drop it if full.
+  void push(LogLevel level, std::wstring&& text);
+  /// Pop the oldest record, returns false if the ring is empty.
+  bool pop(Record* record);
+  /// Whether a record is ready to be popped.
+  bool ready();
+  /// Wake the background thread if it sleeps.
+  void notify();
+  /// Body of the background thread, drains the ring until stopped.
+  void drain();
+  /// Write the first `count` records of the batch and flush them.
+  void write(std::vector<Record>& batch, size_t count);
+};
+
+/// Parse a level name, `debug`, `info`, `warn`, `error` or `off`.
+///
+/// Returns `LOG_INFO` for anything else.
+LogLevel log_level_parse(const std::string& name);
+
+#endif  // LOG_LOGGER_H_
@@ -0,0 +1,89 @@
+#include "net/buffer_pool.h"
+
+#include <stdlib.h>
+
+#include <bit>
+
+/// Hand out a buffer of the pool in `ctx` to a framer.
+static uint8_t* pool_acquire(void* ctx, uint32_t size, uint32_t* capacity) {
+  size_t pooled;
+  uint8_t* buffer = ((BufferPool*)ctx)->acquire(size, &pooled);
+  *capacity = (uint32_t)pooled;
+  return buffer;
+}
+
+/// Give back a buffer of a framer to the pool in `ctx`.
+static void pool_release(void* ctx, uint8_t* buffer, uint32_t capacity) {
+  ((BufferPool*)ctx)->release(buffer, capacity);
+}
+
+BufferPool::BufferPool() {
+  this->allocator.acquire = pool_acquire;
+  this->allocator.release = pool_release;
+  this->allocator.ctx = this;
+}
+
+BufferPool::~BufferPool() {
+  this->trim();
+}
+
+uint8_t* BufferPool::acquire(size_t size, size_t* capacity) {
+  int shift = size <= ((size_t)1 << BUFFER_POOL_MIN_SHIFT)
+                ? BUFFER_POOL_MIN_SHIFT
+                : std::bit_width(size - 1);
+  *capacity = (size_t)1 << shift;
+
+  uint8_t* buffer = nullptr;
+
+  if (shift <= BUFFER_POOL_MAX_SHIFT) {
+    auto& list = this->free_lists[shift - BUFFER_POOL_MIN_SHIFT];
+
+    if (!list.empty()) {
+      buffer = list.back();
+      list.pop_back();
+      this->idle -= *capacity;
+    }
+  }
+
+  if (buffer == nullptr) {
+    buffer = (uint8_t*)malloc(*capacity);
+    if (buffer == nullptr) {
+      return nullptr;
+    }
+  }
+
+  this->in_use += *capacity;
+
+  return buffer;
+}
+
+void BufferPool::release(uint8_t* buffer, size_t capacity) {
+  if (buffer == nullptr) {
+    return;
+  }
+
+  this->in_use -= capacity;
+
+  int shift = std::bit_width(capacity) - 1;
+
+  if (shift > BUFFER_POOL_MAX_SHIFT ||
+      this->idle + capacity > this->idle_budget) {
+    free(buffer);
+    return;
+  }
+
+  this->free_lists[shift - BUFFER_POOL_MIN_SHIFT].push_back(buffer);
+  this->idle += capacity;
+}
+
+void BufferPool::trim() {
+  for (auto& list : this->free_lists) {
+    for (auto buffer : list) {
+      free(buffer);
+    }
+    list.clear();
+    list.shrink_to_fit();
+  }
+
+  this->idle = 0;
+}
@@ -0,0 +1,58 @@
+#ifndef NET_BUFFER_POOL_H_
+#define NET_BUFFER_POOL_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <vector>
+
+#include "protocol/framer.h"
+
+/// Exponent of the smallest buffer handed out.
+#define BUFFER_POOL_MIN_SHIFT 6
+/// Exponent of the largest buffer kept by the pool, enough for a version 2
+/// frame of `PROTOCOL_BUFFER_SIZE` bytes. Larger buffers are not pooled.
+#define BUFFER_POOL_MAX_SHIFT 17
+/// Number of the size classes.
+#define BUFFER_POOL_CLASSES (BUFFER_POOL_MAX_SHIFT - BUFFER_POOL_MIN_SHIFT + 1)
+/// Bytes of the free buffers kept for reuse, beyond which the buffers given
+/// back are freed.
+#define BUFFER_POOL_IDLE_BYTES (1 << 20)
+
+/// The I/O buffers of the connections of a thread, in power of two sizes.
+///
+/// A connection only holds a buffer while a message is split across its
+/// reads, and gives it back once the message is handled. The free buffers
+/// are kept for the next connection needing one, up to the idle budget, so
+/// the memory follows the connections with data in flight rather than the
+/// connections open.
+///
+/// Not thread safe, every thread handling sockets has its own.
+struct BufferPool {
+  /// The free buffers of every size class
+  std::vector<uint8_t*> free_lists[BUFFER_POOL_CLASSES];
+  /// Bytes of the buffers handed out
+  size_t in_use = 0;
+  /// Bytes of the free buffers kept
+  size_t idle = 0;
+  /// The most bytes of free buffers kept
+  size_t idle_budget = BUFFER_POOL_IDLE_BYTES;
+  /// The allocator handing out the buffers of the pool to the framers
+  framer_allocator_t allocator;
+
+  BufferPool();
+  ~BufferPool();
+  BufferPool(const BufferPool&) = delete;
+  BufferPool& operator=(const BufferPool&) = delete;
+
+  /// Get a buffer of at least `size` bytes, setting its capacity.
+  ///
+  /// Returns null if the memory is exhausted.
+  uint8_t* acquire(size_t size, size_t* capacity);
+  /// Give back a buffer of the capacity set by `acquire`.
+  void release(uint8_t* buffer, size_t capacity);
+  /// Free the buffers kept.
+  void trim();
+};
+
+#endif  // NET_BUFFER_POOL_H_
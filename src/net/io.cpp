@@ -0,0 +1,188 @@
+#include "net/io.h"
+
+#include <string.h>
+
+#include <algorithm>
+
+#include "net/reactor_backend.h"
+#include "net/uring_backend.h"
+
+FrameRef frame_create(const uint8_t* data, size_t len) {
+  auto frame = std::make_shared<Frame>();
+  frame->bytes.assign(data, data + len);
+  return frame;
+}
+
+FrameRef frame_create(
+  const uint8_t* header,
+  size_t len,
+  Payload payload,
+  bool droppable
+) {
+  auto frame = std::make_shared<Frame>();
+  frame->bytes.assign(header, header + len);
+  frame->payload = std::move(payload);
+  frame->droppable = droppable;
+  return frame;
+}
+
+Payload payload_create(const uint8_t* data, size_t len) {
+  return std::make_shared<const std::vector<uint8_t>>(data, data + len);
+}
+
+size_t Frame::size() const {
+  return this->bytes.size() + (this->payload ? this->payload->size() : 0);
+}
+
+int Frame::gather(size_t offset, net_iovec_t* iov, int capacity) const {
+  int count = 0;
+  size_t head = this->bytes.size();
+
+  if (offset < head && count < capacity) {
+    net_iovec_set(&iov[count++], this->bytes.data() + offset, head - offset);
+  }
+
+  size_t skip = offset > head ? offset - head : 0;
+  if (this->payload && skip < this->payload->size() && count < capacity) {
+    net_iovec_set(
+      &iov[count++], this->payload->data() + skip, this->payload->size() - skip
+    );
+  }
+
+  return count;
+}
+
+size_t Frame::copy(size_t offset, uint8_t* out, size_t len) const {
+  size_t copied = 0;
+  size_t head = this->bytes.size();
+
+  if (offset < head) {
+    copied = std::min(head - offset, len);
+    memcpy(out, this->bytes.data() + offset, copied);
+  }
+
+  size_t skip = offset > head ? offset - head : 0;
+  if (this->payload && skip < this->payload->size() && copied < len) {
+    size_t n = std::min(this->payload->size() - skip, len - copied);
+    memcpy(out + copied, this->payload->data() + skip, n);
+    copied += n;
+  }
+
+  return copied;
+}
+
+void OutboundQueue::push(FrameRef frame) {
+  if (frame->size() == 0) {
+    return;
+  }
+
+  if (this->bytes == 0) {
+    this->since = std::chrono::steady_clock::now();
+  }
+
+  this->bytes += frame->size();
+  this->frames.push_back(std::move(frame));
+}
+
+void OutboundQueue::consume(size_t len) {
+  this->bytes -= len;
+
+  while (len > 0) {
+    size_t left = this->frames[this->head]->size() - this->offset;
+
+    if (len < left) {
+      this->offset += len;
+      return;
+    }
+
+    len -= left;
+    this->offset = 0;
+    this->frames[this->head++] = nullptr;
+  }
+
+  if (this->head == this->frames.size()) {
+    // drained, the room of a burst is not kept
+    this->frames.clear();
+    this->head = 0;
+
+    if (this->frames.capacity() > IO_IDLE_FRAMES) {
+      this->frames.shrink_to_fit();
+    }
+  } else if (this->head * 2 >= this->frames.size() &&
+             this->head >= IO_IDLE_FRAMES) {
+    // never drained, drop the written frames once they are half of them
+    this->frames.erase(this->frames.begin(), this->frames.begin() + this->head);
+    this->head = 0;
+  }
+}
+
+size_t OutboundQueue::drop(size_t len) {
+  // the first frame may be partly written, it goes out whole
+  size_t first = this->offset > 0 ? this->head + 1 : this->head;
+  size_t kept = first;
+  size_t freed = 0;
+  size_t dropped = 0;
+
+  for (size_t i = first; i < this->frames.size(); i++) {
+    if (freed < len && this->frames[i]->droppable) {
+      freed += this->frames[i]->size();
+      dropped++;
+      continue;
+    }
+    this->frames[kept++] = std::move(this->frames[i]);
+  }
+
+  this->frames.resize(kept);
+  this->bytes -= freed;
+
+  return dropped;
+}
+
+bool OutboundQueue::empty() const {
+  return this->bytes == 0;
+}
+
+const FrameRef& OutboundQueue::front() const {
+  return this->frames[this->head];
+}
+
+int IoBackend::send(SOCKET socket, const uint8_t* data, size_t len) {
+  return this->send_frame(socket, frame_create(data, len));
+}
+
+bool IoBackend::hold(
+  const OutboundQueue& queue,
+  std::chrono::steady_clock::time_point now,
+  int* wait_ms
+) {
+  if (this->flush_delay_us <= 0 || queue.bytes >= IO_FLUSH_BYTES) {
+    return false;
+  }
+
+  auto due = queue.since + std::chrono::microseconds(this->flush_delay_us);
+  if (due <= now) {
+    return false;
+  }
+
+  // round up, waking up early would only find it still held
+  auto left = std::chrono::ceil<std::chrono::milliseconds>(due - now);
+  if (*wait_ms < 0 || left.count() < *wait_ms) {
+    *wait_ms = (int)left.count();
+  }
+
+  return true;
+}
+
+std::unique_ptr<IoBackend> io_backend_create(const std::string& name) {
+  if (name == "epoll") {
+    return std::make_unique<ReactorBackend>();
+  }
+
+#ifdef __linux__
+  if (name == "uring") {
+    return std::make_unique<UringBackend>();
+  }
+#endif
+
+  return nullptr;
+}
@@ -0,0 +1,201 @@
+#ifndef NET_IO_H_
+#define NET_IO_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "net/socket.h"
+
+/// Queued bytes from which a socket is flushed without waiting for the
+/// latency budget, enough to fill a few segments.
+#define IO_FLUSH_BYTES 16384
+/// Maximum number of frames gathered by a single write.
+#define IO_FLUSH_FRAMES 64
+
+/// Bytes shared by several frames, like the data of a message forwarded in
+/// both versions of the protocol.
+using Payload = std::shared_ptr<const std::vector<uint8_t>>;
+
+/// An immutable frame, serialized once and shared by every outbound queue it
+/// is pushed to.
+///
+/// The frame is its own bytes followed by the payload, if any. Frames
+/// differing only by their header keep a single copy of the payload.
+struct Frame {
+  std::vector<uint8_t> bytes;
+  Payload payload;
+  /// Whether the frame may be dropped from a queue over its limit, see
+  /// `OutboundQueue::drop`
+  bool droppable = false;
+
+  /// Length of the frame, payload included.
+  size_t size() const;
+  /// Point up to 2 buffers at the bytes of the frame from `offset`.
+  ///
+  /// Returns the number of buffers set, 0 if `capacity` is.
+  int gather(size_t offset, net_iovec_t* iov, int capacity) const;
+  /// Copy up to `len` bytes of the frame from `offset` into `out`.
+  ///
+  /// Returns the number of bytes copied.
+  size_t copy(size_t offset, uint8_t* out, size_t len) const;
+};
+
+/// A reference to a frame, which is freed with the last queue holding it.
+using FrameRef = std::shared_ptr<const Frame>;
+
+/// Copy the bytes into a new frame.
+FrameRef frame_create(const uint8_t* data, size_t len);
+/// Copy the header into a new frame followed by the shared payload.
+FrameRef frame_create(
+  const uint8_t* header,
+  size_t len,
+  Payload payload,
+  bool droppable = false
+);
+/// Copy the bytes into a payload to be shared by several frames.
+Payload payload_create(const uint8_t* data, size_t len);
+
+/// Frames an idle queue keeps room for, more are freed once written.
+#define IO_IDLE_FRAMES 4
+
+/// The frames queued to a socket, written in order.
+///
+/// An idle queue holds room for a few frames at most, so an idle connection
+/// costs a few bytes beside its record.
+struct OutboundQueue {
+  /// The frames, the ones before `head` already written
+  std::vector<FrameRef> frames;
+  /// Index of the first frame not completely written
+  size_t head = 0;
+  /// Bytes of the first frame already written
+  size_t offset = 0;
+  /// Bytes queued and not written yet
+  size_t bytes = 0;
+  /// Whether the socket is waiting to become writable
+  bool waiting = false;
+  /// When the first frame has been queued to the empty queue
+  std::chrono::steady_clock::time_point since;
+  /// Whether the handler is told once the queue is down to `drain_bytes`
+  bool watched = false;
+  /// Bytes queued at most once drained, see `IoBackend::watch`
+  size_t drain_bytes = 0;
+
+  /// Queue the frame behind the others.
+  void push(FrameRef frame);
+  /// Drop `len` written bytes from the front.
+  void consume(size_t len);
+  /// Drop the oldest droppable frames not started yet until `len` bytes are
+  /// freed or none is left.
+  ///
+  /// Returns the number of frames dropped.
+  size_t drop(size_t len);
+  /// Whether all the bytes have been written.
+  bool empty() const;
+  /// The first frame not completely written.
+  const FrameRef& front() const;
+};
+
+/// Receiver of the events produced by an I/O backend.
+///
+/// All the methods are invoked on the thread running `IoBackend::poll`.
+struct IoHandler {
+  virtual ~IoHandler() = default;
+
+  /// A connection has been accepted on the listening socket.
+  virtual void on_accept(SOCKET socket) = 0;
+  /// Accepting connections failed with the error code, other than on a
+  /// connection aborted while pending. The backend accepts again on the
+  /// next connection.
+  virtual void on_accept_failed(int error) = 0;
+  /// Bytes have been received on the socket.
+  ///
+  /// The data is only valid during the call, the backend reuses the buffer
+  /// afterwards.
+  virtual void on_recv(SOCKET socket, uint8_t* data, size_t len) = 0;
+  /// The peer closed the connection or the socket failed.
+  ///
+  /// The backend does not close the socket by itself, the handler is
+  /// expected to call `IoBackend::close`.
+  virtual void on_closed(SOCKET socket) = 0;
+  /// The bytes queued to the watched socket are down to the mark, see
+  /// `IoBackend::watch`.
+  virtual void on_drained(SOCKET socket) = 0;
+};
+
+/// The socket I/O of the server.
+///
+/// A backend owns the listening socket once initialized, accepts connections,
+/// receives bytes and writes the frames queued to every socket in order.
+/// Queueing never performs I/O, the backend drains the queues on its own
+/// schedule, so a slow socket never holds up the others.
+struct IoBackend {
+  /// Number of system calls issued by the backend for socket I/O.
+  uint64_t syscalls = 0;
+  /// Number of writes flushing queued frames.
+  uint64_t flushes = 0;
+  /// Bytes written by the flushes.
+  uint64_t flushed_bytes = 0;
+  /// How long, in microseconds, the frames queued to a socket may be held to
+  /// gather more into a single write. 0 flushes at the end of every
+  /// iteration of `poll`.
+  int flush_delay_us = 0;
+
+  virtual ~IoBackend() = default;
+
+  /// Name of the backend.
+  virtual const char* name() = 0;
+  /// Start listening on the bound `master` socket.
+  virtual int init(SOCKET master, IoHandler* handler) = 0;
+  /// Wait up to `timeout_ms` milliseconds (-1 for infinity) for I/O and
+  /// dispatch the events to the handler.
+  ///
+  /// Returns -1 on error.
+  virtual int poll(int timeout_ms) = 0;
+  /// Queue the frame to the socket. Returns -1 if the socket has failed, in
+  /// which case the caller should close it.
+  virtual int send_frame(SOCKET socket, FrameRef frame) = 0;
+  /// Queue a copy of the bytes to the socket, see `send_frame`.
+  int send(SOCKET socket, const uint8_t* data, size_t len);
+  /// Bytes queued to the socket and not written yet.
+  virtual size_t queued(SOCKET socket) = 0;
+  /// Drop the oldest droppable frames queued to the socket until `len`
+  /// bytes are freed, see `OutboundQueue::drop`.
+  ///
+  /// Returns the number of frames dropped.
+  virtual size_t drop(SOCKET socket, size_t len) = 0;
+  /// Call `IoHandler::on_drained` once, when the bytes queued to the socket,
+  /// now over `bytes`, are down to `bytes` at most.
+  virtual void watch(SOCKET socket, size_t bytes) = 0;
+  /// Stop reading from the socket, or read from it again.
+  ///
+  /// The bytes already received may still be handed to the handler after
+  /// the socket is paused, nothing more is read until it is resumed.
+  virtual void pause(SOCKET socket, bool paused) = 0;
+  /// Close the socket and drop the bytes still queued to it.
+  virtual void close(SOCKET socket) = 0;
+  /// Interrupt a blocking `poll`. Can be called from any thread.
+  virtual void wake() = 0;
+  /// Release the resources of the backend.
+  virtual void cleanup() = 0;
+
+  /// Whether the queue is small and young enough to be held back at `now`.
+  ///
+  /// Lowers `*wait_ms`, -1 for infinity, to the time left until it is due.
+  bool hold(
+    const OutboundQueue& queue,
+    std::chrono::steady_clock::time_point now,
+    int* wait_ms
+  );
+};
+
+/// Create the backend with the given name, `epoll` or `uring`.
+///
+/// Returns null if the backend is unknown or not supported on this platform.
+std::unique_ptr<IoBackend> io_backend_create(const std::string& name);
+
+#endif  // NET_IO_H_
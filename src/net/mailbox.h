@@ -0,0 +1,92 @@
+#ifndef NET_MAILBOX_H_
+#define NET_MAILBOX_H_
+
+#include <atomic>
+#include <utility>
+
+/// Unbounded lock-free queue of many producers and a single consumer, after
+/// Dmitry Vyukov's intrusive MPSC queue.
+///
+/// Pushing is an exchange and a store, it never waits on the other
+/// producers nor on the consumer. Only the consumer thread pops. A push
+/// halfway done hides the values pushed after it until it completes, so the
+/// producer is expected to signal the consumer once its push returns.
+template <typename T>
+struct Mailbox {
+  struct Node {
+    std::atomic<Node*> next = nullptr;
+    T value;
+  };
+
+  /// The last node pushed, written by the producers
+  alignas(64) std::atomic<Node*> head;
+  /// The node before the next value popped, owned by the consumer
+  alignas(64) Node* tail;
+  /// Placeholder keeping the queue non-empty without allocating
+  Node stub;
+
+  Mailbox() : head(&this->stub), tail(&this->stub) {}
+
+  ~Mailbox() {
+    T value;
+    while (this->pop(&value)) {
+      continue;
+    }
+  }
+
+  Mailbox(const Mailbox&) = delete;
+  Mailbox& operator=(const Mailbox&) = delete;
+
+  /// Queue the value, from any thread.
+  void push(T value) {
+    Node* node = new Node();
+    node->value = std::move(value);
+    this->link(node);
+  }
+
+  /// Take the oldest value, from the consumer thread.
+  ///
+  /// Returns false if there is none, or none visible yet.
+  bool pop(T* value) {
+    Node* tail = this->tail;
+    Node* next = tail->next.load(std::memory_order_acquire);
+
+    if (tail == &this->stub) {
+      if (next == nullptr) {
+        return false;
+      }
+      this->tail = next;
+      tail = next;
+      next = next->next.load(std::memory_order_acquire);
+    }
+
+    if (next == nullptr) {
+      // the last node is only taken with the stub queued behind it
+      if (tail != this->head.load(std::memory_order_acquire)) {
+        return false;
+      }
+
+      this->stub.next.store(nullptr, std::memory_order_relaxed);
+      this->link(&this->stub);
+
+      next = tail->next.load(std::memory_order_acquire);
+      if (next == nullptr) {
+        return false;
+      }
+    }
+
+    *value = std::move(tail->value);
+    this->tail = next;
+    delete tail;
+
+    return true;
+  }
+
+  /// Append the node behind the last one.
+  void link(Node* node) {
+    Node* prev = this->head.exchange(node, std::memory_order_acq_rel);
+    prev->next.store(node, std::memory_order_release);
+  }
+};
+
+#endif  // NET_MAILBOX_H_
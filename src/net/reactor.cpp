@@ -0,0 +1,265 @@
+#include "net/reactor.h"
+
+#ifndef _WIN32
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+/// Translate reactor events into epoll events.
+static uint32_t to_epoll_events(uint32_t events) {
+  uint32_t result = (events & EV_LEVEL) ? EPOLLRDHUP : EPOLLET | EPOLLRDHUP;
+  if (events & EV_READ) {
+    result |= EPOLLIN;
+  }
+  if (events & EV_WRITE) {
+    result |= EPOLLOUT;
+  }
+  return result;
+}
+
+int Reactor::init() {
+  this->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (this->epoll_fd < 0) {
+    return 1;
+  }
+
+  this->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (this->wake_fd < 0) {
+    return 1;
+  }
+
+  struct epoll_event ev = {};
+  ev.events = EPOLLIN;
+  ev.data.fd = this->wake_fd;
+
+  if (epoll_ctl(this->epoll_fd, EPOLL_CTL_ADD, this->wake_fd, &ev) < 0) {
+    return 1;
+  }
+
+  return 0;
+}
+
+int Reactor::add(SOCKET socket, uint32_t events, ReactorCallback callback) {
+  struct epoll_event ev = {};
+  ev.events = to_epoll_events(events);
+  ev.data.fd = socket;
+
+  if (epoll_ctl(this->epoll_fd, EPOLL_CTL_ADD, socket, &ev) < 0) {
+    return 1;
+  }
+
+  this->entries[socket] = Entry{events, std::move(callback)};
+
+  return 0;
+}
+
+int Reactor::modify(SOCKET socket, uint32_t events) {
+  auto it = this->entries.find(socket);
+  if (it == this->entries.end()) {
+    return 1;
+  }
+
+  if (it->second.events == events) {
+    return 0;
+  }
+
+  struct epoll_event ev = {};
+  ev.events = to_epoll_events(events);
+  ev.data.fd = socket;
+
+  if (epoll_ctl(this->epoll_fd, EPOLL_CTL_MOD, socket, &ev) < 0) {
+    return 1;
+  }
+
+  it->second.events = events;
+
+  return 0;
+}
+
+void Reactor::remove(SOCKET socket) {
+  if (this->entries.erase(socket) == 0) {
+    return;
+  }
+  epoll_ctl(this->epoll_fd, EPOLL_CTL_DEL, socket, NULL);
+}
+
+int Reactor::poll(int timeout_ms) {
+  struct epoll_event events[256];
+
+  int n = epoll_wait(this->epoll_fd, events, 256, timeout_ms);
+  if (n < 0) {
+    return errno == EINTR ? 0 : -1;
+  }
+
+  for (int i = 0; i < n; i++) {
+    int fd = events[i].data.fd;
+
+    if (fd == this->wake_fd) {
+      uint64_t value;
+      while (read(this->wake_fd, &value, sizeof(value)) > 0) {
+        continue;
+      }
+      continue;
+    }
+
+    // the socket may have been removed by an earlier callback in this batch,
+    // so look it up again instead of caching a pointer in the epoll data.
+    auto it = this->entries.find(fd);
+    if (it == this->entries.end()) {
+      continue;
+    }
+
+    uint32_t ready = 0;
+    if (events[i].events & EPOLLIN) {
+      ready |= EV_READ;
+    }
+    if (events[i].events & EPOLLOUT) {
+      ready |= EV_WRITE;
+    }
+    if (events[i].events & (EPOLLHUP | EPOLLRDHUP | EPOLLERR)) {
+      ready |= EV_CLOSED;
+    }
+
+    // copy the callback, it may unregister itself while running.
+    ReactorCallback callback = it->second.callback;
+    callback(fd, ready);
+  }
+
+  return n;
+}
+
+void Reactor::wake() {
+  uint64_t value = 1;
+  (void)!write(this->wake_fd, &value, sizeof(value));
+}
+
+void Reactor::cleanup() {
+  this->entries.clear();
+  if (this->wake_fd >= 0) {
+    close(this->wake_fd);
+    this->wake_fd = -1;
+  }
+  if (this->epoll_fd >= 0) {
+    close(this->epoll_fd);
+    this->epoll_fd = -1;
+  }
+}
+
+#else
+
+int Reactor::init() {
+  this->wake_socket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+  if (this->wake_socket == INVALID_SOCKET) {
+    return 1;
+  }
+
+  this->wake_addr = {};
+  this->wake_addr.sin_family = AF_INET;
+  this->wake_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  this->wake_addr.sin_port = 0;
+
+  int addrlen = sizeof(this->wake_addr);
+
+  if (bind(this->wake_socket, (struct sockaddr*)&this->wake_addr, addrlen) == SOCKET_ERROR) {
+    return 1;
+  }
+
+  // fetch the port assigned by the system
+  if (getsockname(this->wake_socket, (struct sockaddr*)&this->wake_addr, &addrlen) == SOCKET_ERROR) {
+    return 1;
+  }
+
+  return net_set_nonblocking(this->wake_socket);
+}
+
+int Reactor::add(SOCKET socket, uint32_t events, ReactorCallback callback) {
+  this->entries[socket] = Entry{events, std::move(callback)};
+  return 0;
+}
+
+int Reactor::modify(SOCKET socket, uint32_t events) {
+  auto it = this->entries.find(socket);
+  if (it == this->entries.end()) {
+    return 1;
+  }
+  it->second.events = events;
+  return 0;
+}
+
+void Reactor::remove(SOCKET socket) {
+  this->entries.erase(socket);
+}
+
+int Reactor::poll(int timeout_ms) {
+  std::vector<WSAPOLLFD> fds;
+  fds.reserve(this->entries.size() + 1);
+
+  fds.push_back({this->wake_socket, POLLRDNORM, 0});
+
+  for (auto& [socket, entry] : this->entries) {
+    SHORT events = 0;
+    if (entry.events & EV_READ) {
+      events |= POLLRDNORM;
+    }
+    if (entry.events & EV_WRITE) {
+      events |= POLLWRNORM;
+    }
+    fds.push_back({socket, events, 0});
+  }
+
+  int n = WSAPoll(fds.data(), (ULONG)fds.size(), timeout_ms);
+  if (n == SOCKET_ERROR) {
+    return -1;
+  }
+
+  if (fds[0].revents & POLLRDNORM) {
+    char drain[64];
+    while (recv(this->wake_socket, drain, sizeof(drain), 0) > 0) {
+      continue;
+    }
+  }
+
+  for (size_t i = 1; i < fds.size(); i++) {
+    if (fds[i].revents == 0) {
+      continue;
+    }
+
+    auto it = this->entries.find(fds[i].fd);
+    if (it == this->entries.end()) {
+      continue;
+    }
+
+    uint32_t ready = 0;
+    if (fds[i].revents & POLLRDNORM) {
+      ready |= EV_READ;
+    }
+    if (fds[i].revents & POLLWRNORM) {
+      ready |= EV_WRITE;
+    }
+    if (fds[i].revents & (POLLHUP | POLLERR | POLLNVAL)) {
+      ready |= EV_CLOSED;
+    }
+
+    ReactorCallback callback = it->second.callback;
+    callback(fds[i].fd, ready);
+  }
+
+  return n;
+}
+
+void Reactor::wake() {
+  char byte = 0;
+  sendto(
+    this->wake_socket, &byte, 1, 0, (struct sockaddr*)&this->wake_addr,
+    sizeof(this->wake_addr)
+  );
+}
+
+void Reactor::cleanup() {
+  this->entries.clear();
+  if (this->wake_socket != INVALID_SOCKET) {
+    closesocket(this->wake_socket);
+    this->wake_socket = INVALID_SOCKET;
+  }
+}
+
+#endif
@@ -0,0 +1,84 @@
+#ifndef NET_REACTOR_H_
+#define NET_REACTOR_H_
+
+#include <stdint.h>
+
+#include <functional>
+#include <unordered_map>
+#include <vector>
+
+#include "net/socket.h"
+
+/// Readiness events reported by the reactor.
+enum ReactorEvent : uint32_t {
+  /// The socket has data to read, or a pending connection to accept.
+  EV_READ = 1 << 0,
+  /// The socket can be written without blocking.
+  EV_WRITE = 1 << 1,
+  /// The peer hung up or the socket is in an error state.
+  EV_CLOSED = 1 << 2,
+  /// Report the readiness for as long as it lasts, not once per change, so
+  /// a blocking socket can be read a call at a time. Always the case on
+  /// Windows.
+  EV_LEVEL = 1 << 3,
+};
+
+/// Callback invoked on the reactor thread when a socket is ready.
+///
+/// The events are a combination of `ReactorEvent`.
+using ReactorCallback = std::function<void(SOCKET, uint32_t)>;
+
+/// A readiness based event loop.
+///
+/// On Linux this is an edge-triggered epoll instance: a callback is invoked
+/// once per readiness change, so handlers must read or write until the
+/// operation would block. On Windows it falls back to `WSAPoll`, which is
+/// level-triggered; handlers written for the edge-triggered contract work
+/// unchanged there.
+///
+/// All the methods except `wake` must be called from the reactor thread.
+struct Reactor {
+#ifdef _WIN32
+  /// Loopback datagram socket used to interrupt `WSAPoll`.
+  SOCKET wake_socket = INVALID_SOCKET;
+  /// The address of the wake socket.
+  struct sockaddr_in wake_addr;
+#else
+  /// The epoll instance.
+  int epoll_fd = -1;
+  /// Eventfd used to interrupt `epoll_wait`.
+  int wake_fd = -1;
+#endif
+
+  /// A registered socket.
+  struct Entry {
+    /// Events the socket is interested in.
+    uint32_t events;
+    /// The callback to invoke.
+    ReactorCallback callback;
+  };
+
+  /// Registered sockets and their callbacks.
+  std::unordered_map<SOCKET, Entry> entries;
+
+  /// Create the underlying poller.
+  int init();
+  /// Register a socket with the given interest.
+  int add(SOCKET socket, uint32_t events, ReactorCallback callback);
+  /// Change the interest of a registered socket.
+  int modify(SOCKET socket, uint32_t events);
+  /// Unregister a socket. It is safe to call this from a callback, also for
+  /// sockets other than the one being dispatched.
+  void remove(SOCKET socket);
+  /// Wait up to `timeout_ms` milliseconds (-1 for infinity) for readiness and
+  /// invoke the callbacks of the ready sockets.
+  ///
+  /// Returns the number of dispatched events, or -1 on error.
+  int poll(int timeout_ms);
+  /// Interrupt a blocking `poll`. Can be called from any thread.
+  void wake();
+  /// Close the underlying poller.
+  void cleanup();
+};
+
+#endif  // NET_REACTOR_H_
@@ -0,0 +1,268 @@
+#include "net/reactor_backend.h"
+
+const char* ReactorBackend::name() {
+  return "epoll";
+}
+
+int ReactorBackend::init(SOCKET master, IoHandler* handler) {
+  this->master = master;
+  this->handler = handler;
+
+  if (net_set_nonblocking(master) != 0) {
+    return 1;
+  }
+
+  if (this->reactor.init() != 0) {
+    return 1;
+  }
+
+  return this->reactor.add(master, EV_READ, [this](SOCKET, uint32_t) {
+    this->accept_ready();
+  });
+}
+
+int ReactorBackend::poll(int timeout_ms) {
+  int wait_ms = this->flush_dirty();
+  if (wait_ms >= 0 && (timeout_ms < 0 || wait_ms < timeout_ms)) {
+    timeout_ms = wait_ms;
+  }
+
+  this->syscalls++;
+  if (this->reactor.poll(timeout_ms) < 0) {
+    return -1;
+  }
+
+  this->flush_dirty();
+
+  return 0;
+}
+
+int ReactorBackend::send_frame(SOCKET socket, FrameRef frame) {
+  if (!this->reactor.entries.contains(socket)) {
+    return -1;
+  }
+
+  OutboundQueue& queue = this->outbound[socket];
+
+  // an empty queue is neither dirty nor waiting for the socket yet
+  if (queue.empty()) {
+    this->dirty.push_back(socket);
+  }
+
+  queue.push(std::move(frame));
+
+  return 0;
+}
+
+size_t ReactorBackend::queued(SOCKET socket) {
+  auto it = this->outbound.find(socket);
+  return it == this->outbound.end() ? 0 : it->second.bytes;
+}
+
+size_t ReactorBackend::drop(SOCKET socket, size_t len) {
+  auto it = this->outbound.find(socket);
+  return it == this->outbound.end() ? 0 : it->second.drop(len);
+}
+
+void ReactorBackend::watch(SOCKET socket, size_t bytes) {
+  auto it = this->outbound.find(socket);
+  if (it == this->outbound.end()) {
+    return;
+  }
+
+  it->second.watched = true;
+  it->second.drain_bytes = bytes;
+}
+
+void ReactorBackend::pause(SOCKET socket, bool paused) {
+  if (!this->reactor.entries.contains(socket)) {
+    return;
+  }
+
+  if (paused) {
+    this->paused.insert(socket);
+  } else {
+    this->paused.erase(socket);
+  }
+
+  auto it = this->outbound.find(socket);
+  this->update(socket, it != this->outbound.end() && it->second.waiting);
+}
+
+void ReactorBackend::update(SOCKET socket, bool waiting) {
+  // the bytes which came while paused are reported again once resumed
+  uint32_t events = this->paused.contains(socket) ? 0 : (uint32_t)EV_READ;
+  if (waiting) {
+    events |= EV_WRITE;
+  }
+
+  this->reactor.modify(socket, events);
+}
+
+void ReactorBackend::close(SOCKET socket) {
+  this->outbound.erase(socket);
+  this->paused.erase(socket);
+  this->reactor.remove(socket);
+  closesocket(socket);
+}
+
+void ReactorBackend::wake() {
+  this->reactor.wake();
+}
+
+void ReactorBackend::cleanup() {
+  this->outbound.clear();
+  this->paused.clear();
+  this->reactor.cleanup();
+}
+
+void ReactorBackend::accept_ready() {
+  struct sockaddr_in client_addr;
+  socklen_t addrlen = sizeof(struct sockaddr_in);
+
+  while (true) {
+    this->syscalls++;
+    SOCKET socket =
+      accept(this->master, (struct sockaddr*)&client_addr, &addrlen);
+
+    if (socket == INVALID_SOCKET) {
+      // edge-triggered, the connections behind an aborted one would wait
+      // for the next to arrive
+      if (net_interrupted() || net_accept_aborted()) {
+        continue;
+      }
+      if (!net_would_block()) {
+        this->handler->on_accept_failed(WSAGetLastError());
+      }
+      break;
+    }
+
+    if (net_set_nonblocking(socket) != 0) {
+      closesocket(socket);
+      continue;
+    }
+
+    int res = this->reactor.add(socket, EV_READ, [this](SOCKET s, uint32_t ev) {
+      if (ev & EV_WRITE) {
+        this->send_ready(s);
+      }
+      if (ev & (EV_READ | EV_CLOSED)) {
+        this->recv_ready(s);
+      }
+    });
+
+    if (res != 0) {
+      closesocket(socket);
+      continue;
+    }
+
+    this->handler->on_accept(socket);
+  }
+}
+
+void ReactorBackend::recv_ready(SOCKET socket) {
+  // the handler may close or pause the socket while handling the bytes
+  while (this->reactor.entries.contains(socket) &&
+         !this->paused.contains(socket)) {
+    this->syscalls++;
+    int recv_size = recv(socket, (char*)this->buffer, sizeof(this->buffer), 0);
+
+    if (recv_size < 0 && net_interrupted()) {
+      continue;
+    }
+
+    if (recv_size < 0 && net_would_block()) {
+      return;
+    }
+
+    if (recv_size <= 0) {
+      this->handler->on_closed(socket);
+      return;
+    }
+
+    this->handler->on_recv(socket, this->buffer, recv_size);
+  }
+}
+
+void ReactorBackend::send_ready(SOCKET socket) {
+  auto it = this->outbound.find(socket);
+  if (it == this->outbound.end()) {
+    return;
+  }
+
+  OutboundQueue& queue = it->second;
+
+  while (!queue.empty()) {
+    // gather the queued frames into a single write, a frame with a payload
+    // takes 2 buffers
+    net_iovec_t iov[IO_FLUSH_FRAMES * 2];
+    int count = 0;
+    size_t offset = queue.offset;
+
+    for (size_t i = queue.head; i < queue.frames.size(); i++) {
+      if (count >= IO_FLUSH_FRAMES * 2 - 1) {
+        break;
+      }
+      count += queue.frames[i]->gather(
+        offset, &iov[count], IO_FLUSH_FRAMES * 2 - count
+      );
+      offset = 0;
+    }
+
+    this->syscalls++;
+    int res = net_sendv(socket, iov, count);
+
+    if (res < 0) {
+      if (net_interrupted()) {
+        continue;
+      }
+      if (net_would_block()) {
+        break;
+      }
+      this->handler->on_closed(socket);
+      return;
+    }
+
+    this->flushes++;
+    this->flushed_bytes += res;
+
+    queue.consume(res);
+  }
+
+  if (queue.waiting != !queue.empty()) {
+    queue.waiting = !queue.empty();
+    this->update(socket, queue.waiting);
+  }
+
+  // last, the handler may queue more to the socket
+  if (queue.watched && queue.bytes <= queue.drain_bytes) {
+    queue.watched = false;
+    this->handler->on_drained(socket);
+  }
+}
+
+int ReactorBackend::flush_dirty() {
+  std::vector<SOCKET> dirty;
+  dirty.swap(this->dirty);
+
+  auto now = std::chrono::steady_clock::now();
+  int wait_ms = -1;
+
+  for (SOCKET socket : dirty) {
+    auto it = this->outbound.find(socket);
+
+    // a socket waiting for writability is written when it becomes writable
+    if (it == this->outbound.end() || it->second.waiting) {
+      continue;
+    }
+
+    if (this->hold(it->second, now, &wait_ms)) {
+      this->dirty.push_back(socket);
+      continue;
+    }
+
+    this->send_ready(socket);
+  }
+
+  return wait_ms;
+}
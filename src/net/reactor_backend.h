@@ -0,0 +1,62 @@
+#ifndef NET_REACTOR_BACKEND_H_
+#define NET_REACTOR_BACKEND_H_
+
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "net/io.h"
+#include "net/reactor.h"
+
+/// Readiness based backend, one `recv` per read and one gathered write per
+/// flush.
+///
+/// This is the default backend, backed by epoll on Linux and `WSAPoll` on
+/// Windows through `Reactor`. The frames queued while dispatching the events
+/// of an iteration are written together after the dispatch, or once the
+/// latency budget runs out, and the rest once the socket becomes writable
+/// again.
+struct ReactorBackend : IoBackend {
+  /// The event loop
+  Reactor reactor;
+  /// The listening socket
+  SOCKET master = INVALID_SOCKET;
+  /// The handler of the events
+  IoHandler* handler = nullptr;
+  /// The frames queued to every socket
+  std::unordered_map<SOCKET, OutboundQueue> outbound;
+  /// Sockets with frames queued and not tried yet
+  std::vector<SOCKET> dirty;
+  /// Sockets not read from until resumed
+  std::unordered_set<SOCKET> paused;
+  /// The buffer for receiving bytes
+  uint8_t buffer[65536];
+
+  const char* name() override;
+  int init(SOCKET master, IoHandler* handler) override;
+  int poll(int timeout_ms) override;
+  int send_frame(SOCKET socket, FrameRef frame) override;
+  size_t queued(SOCKET socket) override;
+  size_t drop(SOCKET socket, size_t len) override;
+  void watch(SOCKET socket, size_t bytes) override;
+  void pause(SOCKET socket, bool paused) override;
+  void close(SOCKET socket) override;
+  void wake() override;
+  void cleanup() override;
+
+  /// Accept until there is no pending connection left.
+  void accept_ready();
+  /// Read until the socket would block.
+  void recv_ready(SOCKET socket);
+  /// Write the queued frames of the socket until it would block.
+  void send_ready(SOCKET socket);
+  /// Wait for the events the socket is interested in, as whether it is
+  /// paused and waiting to write its queue tell.
+  void update(SOCKET socket, bool waiting);
+  /// Write the queues of the dirty sockets not held back.
+  ///
+  /// Returns the milliseconds until the next held one is due, -1 if none.
+  int flush_dirty();
+};
+
+#endif  // NET_REACTOR_BACKEND_H_
@@ -0,0 +1,216 @@
+#ifndef NET_SOCKET_H_
+#define NET_SOCKET_H_
+
+// Portability layer over winsock and BSD sockets.
+//
+// The code base is written against the winsock API. On other platforms the
+// handful of winsock names it uses are mapped to their POSIX counterparts so
+// the same sources build on both.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef _WIN32
+
+#include <io.h>
+
+#include "WS2tcpip.h"
+#include "WinSock2.h"
+#include "afunix.h"
+
+#pragma comment(lib, "ws2_32.lib")
+
+#else
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/select.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+typedef int SOCKET;
+typedef struct {
+  int unused;
+} WSADATA;
+
+#define INVALID_SOCKET (-1)
+#define SOCKET_ERROR (-1)
+#define WSAETIMEDOUT EAGAIN
+#define WSAEWOULDBLOCK EWOULDBLOCK
+#define MAKEWORD(a, b) ((unsigned short)(((a)&0xff) | (((b)&0xff) << 8)))
+
+inline int closesocket(SOCKET s) {
+  return close(s);
+}
+
+inline int WSAGetLastError() {
+  return errno;
+}
+
+inline int WSAStartup(unsigned short, WSADATA*) {
+  return 0;
+}
+
+inline int WSACleanup() {
+  return 0;
+}
+
+#endif
+
+/// Put the socket into non-blocking mode.
+inline int net_set_nonblocking(SOCKET s) {
+#ifdef _WIN32
+  u_long mode = 1;
+  return ioctlsocket(s, FIONBIO, &mode) == 0 ? 0 : 1;
+#else
+  int flags = fcntl(s, F_GETFL, 0);
+  if (flags < 0) {
+    return 1;
+  }
+  return fcntl(s, F_SETFL, flags | O_NONBLOCK) == 0 ? 0 : 1;
+#endif
+}
+
+/// A buffer of a gathered write.
+#ifdef _WIN32
+typedef WSABUF net_iovec_t;
+#else
+typedef struct iovec net_iovec_t;
+#endif
+
+/// Point the buffer to `len` bytes at `data`.
+inline void net_iovec_set(net_iovec_t* iov, const void* data, size_t len) {
+#ifdef _WIN32
+  iov->buf = (CHAR*)data;
+  iov->len = (ULONG)len;
+#else
+  iov->iov_base = (void*)data;
+  iov->iov_len = len;
+#endif
+}
+
+/// Write the buffers in order with a single call.
+///
+/// Returns the number of bytes written, or -1 on error.
+inline int net_sendv(SOCKET s, net_iovec_t* iov, int count) {
+#ifdef _WIN32
+  DWORD sent = 0;
+  if (WSASend(s, iov, (DWORD)count, &sent, 0, NULL, NULL) != 0) {
+    return -1;
+  }
+  return (int)sent;
+#else
+  struct msghdr msg = {};
+  msg.msg_iov = iov;
+  msg.msg_iovlen = count;
+  return (int)sendmsg(s, &msg, MSG_NOSIGNAL);
+#endif
+}
+
+/// Wait for the sockets to be ready, like `poll`.
+///
+/// Returns the number of the sockets ready, 0 on timeout or -1 on error.
+inline int net_poll(struct pollfd* fds, size_t count, int timeout_ms) {
+#ifdef _WIN32
+  return WSAPoll(fds, (ULONG)count, timeout_ms);
+#else
+  return poll(fds, (nfds_t)count, timeout_ms);
+#endif
+}
+
+/// Whether the last socket error means the operation would block.
+inline bool net_would_block() {
+#ifdef _WIN32
+  return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+  return errno == EAGAIN || errno == EWOULDBLOCK;
+#endif
+}
+
+/// Whether the last socket error was caused by an interrupted call.
+inline bool net_interrupted() {
+#ifdef _WIN32
+  return WSAGetLastError() == WSAEINTR;
+#else
+  return errno == EINTR;
+#endif
+}
+
+/// Whether the last accept failed on a connection reset while pending, the
+/// other pending connections can still be accepted.
+inline bool net_accept_aborted() {
+#ifdef _WIN32
+  return WSAGetLastError() == WSAECONNRESET;
+#else
+  return errno == ECONNABORTED || errno == EPROTO;
+#endif
+}
+
+/// Write `len` bytes of the file at `offset` to the blocking socket, without
+/// going through user space where the system allows it.
+///
+/// Returns 0 once every byte is written, or -1 on error.
+inline int net_sendfile(SOCKET s, int fd, uint64_t offset, size_t len) {
+#ifdef __linux__
+  off_t at = (off_t)offset;
+  while (len > 0) {
+    ssize_t sent = sendfile(s, fd, &at, len);
+    if (sent < 0 && errno == EINTR) {
+      continue;
+    }
+    if (sent <= 0) {
+      return -1;
+    }
+    len -= (size_t)sent;
+  }
+  return 0;
+#else
+  char buffer[16 << 10];
+  while (len > 0) {
+    size_t chunk = len < sizeof(buffer) ? len : sizeof(buffer);
+#ifdef _WIN32
+    if (_lseeki64(fd, (__int64)offset, SEEK_SET) < 0) {
+      return -1;
+    }
+    int read = _read(fd, buffer, (unsigned int)chunk);
+#else
+    ssize_t read = pread(fd, buffer, chunk, (off_t)offset);
+#endif
+    if (read <= 0) {
+      return -1;
+    }
+
+    for (size_t done = 0; done < (size_t)read;) {
+#ifdef _WIN32
+      int sent = send(s, buffer + done, (int)(read - done), 0);
+#else
+      ssize_t sent = send(s, buffer + done, read - done, MSG_NOSIGNAL);
+#endif
+      if (sent < 0 && net_interrupted()) {
+        continue;
+      }
+      if (sent <= 0) {
+        return -1;
+      }
+      done += (size_t)sent;
+    }
+
+    offset += (uint64_t)read;
+    len -= (size_t)read;
+  }
+  return 0;
+#endif
+}
+
+#endif  // NET_SOCKET_H_
@@ -0,0 +1,160 @@
+#include "net/timer_wheel.h"
+
+#include <limits.h>
+
+#include <algorithm>
+
+/// The ticks a timer may be scheduled ahead at most, the span of the wheel.
+#define TIMER_SPAN (((uint64_t)1 << (TIMER_LEVELS * TIMER_SLOT_BITS)) - 1)
+
+void TimerWheel::init(uint64_t now, uint64_t tick_ns) {
+  this->tick_ns = tick_ns;
+  this->start = now;
+  this->tick = 0;
+  this->free_list = 0;
+  this->count = 0;
+
+  // every slot starts as an empty ring of its own node
+  this->nodes.assign(TIMER_LEVELS * TIMER_SLOTS, Node{});
+  for (uint32_t i = 0; i < TIMER_LEVELS * TIMER_SLOTS; i++) {
+    this->nodes[i].prev = i;
+    this->nodes[i].next = i;
+  }
+}
+
+timer_id_t TimerWheel::schedule(uint64_t now, uint64_t delay, uint64_t data) {
+  uint64_t elapsed = now > this->start ? now - this->start : 0;
+
+  // nothing runs in between, the ticks missed while idle are skipped
+  if (this->count == 0) {
+    this->tick = std::max(this->tick, elapsed / this->tick_ns);
+  }
+
+  // the tick after the one the delay ends in, never the one being run
+  uint64_t expiry = (elapsed + delay) / this->tick_ns + 1;
+  expiry = std::clamp(expiry, this->tick + 1, this->tick + TIMER_SPAN);
+
+  uint32_t node = this->free_list;
+  if (node != 0) {
+    this->free_list = this->nodes[node].next;
+  } else {
+    node = (uint32_t)this->nodes.size();
+    this->nodes.emplace_back();
+  }
+
+  this->nodes[node].expiry = expiry;
+  this->nodes[node].data = data;
+  this->place(node);
+  this->count++;
+
+  return node;
+}
+
+void TimerWheel::cancel(timer_id_t timer) {
+  if (timer == 0) {
+    return;
+  }
+
+  this->unlink(timer);
+  this->nodes[timer].next = this->free_list;
+  this->free_list = timer;
+  this->count--;
+}
+
+int TimerWheel::timeout_ms(uint64_t now) {
+  if (this->count == 0) {
+    return -1;
+  }
+
+  // the first level wrapping moves the timers of the next one down
+  uint64_t next = ((this->tick >> TIMER_SLOT_BITS) + 1) << TIMER_SLOT_BITS;
+
+  for (uint64_t t = this->tick + 1; t < next; t++) {
+    uint32_t slot = (uint32_t)(t & (TIMER_SLOTS - 1));
+    if (this->nodes[slot].next != slot) {
+      next = t;
+      break;
+    }
+  }
+
+  uint64_t at = this->start + next * this->tick_ns;
+  if (at <= now) {
+    return 0;
+  }
+
+  uint64_t ms = (at - now + 999999) / 1000000;
+  return (int)std::min(ms, (uint64_t)INT_MAX);
+}
+
+void TimerWheel::advance(
+  uint64_t now,
+  const std::function<void(uint64_t)>& run
+) {
+  uint64_t current = now > this->start ? (now - this->start) / this->tick_ns
+                                       : 0;
+
+  while (this->tick < current) {
+    if (this->count == 0) {
+      this->tick = current;
+      break;
+    }
+
+    this->tick++;
+
+    // the slots of the upper levels whose turn came move down
+    for (int level = 1; level < TIMER_LEVELS; level++) {
+      int shift = level * TIMER_SLOT_BITS;
+      if ((this->tick & (((uint64_t)1 << shift) - 1)) != 0) {
+        break;
+      }
+
+      uint32_t head =
+        level * TIMER_SLOTS + ((this->tick >> shift) & (TIMER_SLOTS - 1));
+
+      while (this->nodes[head].next != head) {
+        uint32_t node = this->nodes[head].next;
+        this->unlink(node);
+        this->place(node);
+      }
+    }
+
+    uint32_t head = (uint32_t)(this->tick & (TIMER_SLOTS - 1));
+
+    while (this->nodes[head].next != head) {
+      uint32_t node = this->nodes[head].next;
+      uint64_t data = this->nodes[node].data;
+
+      this->cancel(node);
+      run(data);
+    }
+  }
+}
+
+void TimerWheel::place(uint32_t node) {
+  uint64_t expiry = this->nodes[node].expiry;
+  uint64_t delta = expiry - this->tick;
+
+  int level = 0;
+  while (level < TIMER_LEVELS - 1 &&
+         delta >= (uint64_t)1 << ((level + 1) * TIMER_SLOT_BITS)) {
+    level++;
+  }
+
+  uint32_t head =
+    level * TIMER_SLOTS +
+    (uint32_t)((expiry >> (level * TIMER_SLOT_BITS)) & (TIMER_SLOTS - 1));
+
+  // last in the ring of the slot
+  uint32_t last = this->nodes[head].prev;
+  this->nodes[node].prev = last;
+  this->nodes[node].next = head;
+  this->nodes[last].next = node;
+  this->nodes[head].prev = node;
+}
+
+void TimerWheel::unlink(uint32_t node) {
+  uint32_t prev = this->nodes[node].prev;
+  uint32_t next = this->nodes[node].next;
+  this->nodes[prev].next = next;
+  this->nodes[next].prev = prev;
+}
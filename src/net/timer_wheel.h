@@ -0,0 +1,84 @@
+#ifndef NET_TIMER_WHEEL_H_
+#define NET_TIMER_WHEEL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <functional>
+#include <vector>
+
+/// Exponent of the number of the slots of a level of the wheel.
+#define TIMER_SLOT_BITS 6
+/// Number of the slots of a level.
+#define TIMER_SLOTS (1 << TIMER_SLOT_BITS)
+/// Number of the levels, each spanning `TIMER_SLOTS` times the one below.
+#define TIMER_LEVELS 4
+/// Milliseconds of a tick of the wheel, by default.
+#define TIMER_TICK_MS 100
+
+/// A timer of a wheel, 0 for none.
+typedef uint32_t timer_id_t;
+
+/// The timers of a thread, in a hierarchical timing wheel.
+///
+/// The time is cut into ticks. The first level has a slot for every tick of
+/// the next `TIMER_SLOTS`, the second a slot for every `TIMER_SLOTS` ticks
+/// after that, and so on. A timer is linked into the slot of its expiry,
+/// and moved down a level each time the level below wraps around, until the
+/// slot of its tick is run. Scheduling and cancelling a timer are a few
+/// links whatever the number of timers, and the timers of a tick all run
+/// at the same wakeup. A timer runs at most a tick late, delays past the
+/// last level are cut to it.
+///
+/// The timers are kept in a vector and linked by index, with the slots as
+/// the first nodes, so none is allocated past the most ever scheduled at
+/// once.
+///
+/// Not thread safe, every thread has its own.
+struct TimerWheel {
+  /// A timer, or the head of the ring of the timers of a slot.
+  struct Node {
+    uint32_t prev = 0;
+    uint32_t next = 0;
+    /// The tick the timer expires at
+    uint64_t expiry = 0;
+    /// Given back when the timer runs
+    uint64_t data = 0;
+  };
+
+  /// Nanoseconds of a tick
+  uint64_t tick_ns = (uint64_t)TIMER_TICK_MS * 1000000;
+  /// When the first tick started, in nanoseconds
+  uint64_t start = 0;
+  /// The last tick run
+  uint64_t tick = 0;
+  /// The slots of the levels, then the timers
+  std::vector<Node> nodes;
+  /// The timers not in use, linked by `next`
+  uint32_t free_list = 0;
+  /// Number of the timers scheduled
+  size_t count = 0;
+
+  /// Start the wheel at `now`, in nanoseconds of a steady clock.
+  void init(uint64_t now, uint64_t tick_ns);
+  /// Run the `data` of a timer once `delay` nanoseconds have passed from
+  /// `now`.
+  ///
+  /// Returns the timer, to cancel it.
+  timer_id_t schedule(uint64_t now, uint64_t delay, uint64_t data);
+  /// Cancel the timer scheduled and not run yet.
+  void cancel(timer_id_t timer);
+  /// Milliseconds from `now` to the next tick which may run a timer, -1 if
+  /// there is none, to wait for at most.
+  int timeout_ms(uint64_t now);
+  /// Run the ticks up to `now`, calling `run` with the data of every timer
+  /// expired. The timer is gone before it runs, `run` may schedule others.
+  void advance(uint64_t now, const std::function<void(uint64_t)>& run);
+
+  /// Link the timer into the slot of its expiry.
+  void place(uint32_t node);
+  /// Unlink the node from its ring.
+  void unlink(uint32_t node);
+};
+
+#endif  // NET_TIMER_WHEEL_H_
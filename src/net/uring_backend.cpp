@@ -0,0 +1,727 @@
+#include "net/uring_backend.h"
+
+#ifdef __linux__
+
+#include <poll.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <time.h>
+
+#include <algorithm>
+
+/// Kind of operation encoded in the user data of a submission.
+enum UringOp : uint64_t {
+  URING_OP_ACCEPT = 1,
+  URING_OP_RECV = 2,
+  URING_OP_WRITE = 3,
+  URING_OP_WAKE = 4,
+  URING_OP_CANCEL = 5,
+};
+
+/// The user data is laid out as | op:4 | slot:16 | gen:12 | fd:32 |.
+static uint64_t pack(UringOp op, uint32_t slot, uint32_t gen, SOCKET fd) {
+  return ((uint64_t)op << 60) | ((uint64_t)(slot & 0xffff) << 44) |
+         ((uint64_t)(gen & 0xfff) << 32) | (uint32_t)fd;
+}
+
+static UringOp unpack_op(uint64_t data) {
+  return (UringOp)(data >> 60);
+}
+
+static uint32_t unpack_slot(uint64_t data) {
+  return (uint32_t)((data >> 44) & 0xffff);
+}
+
+static uint32_t unpack_gen(uint64_t data) {
+  return (uint32_t)((data >> 32) & 0xfff);
+}
+
+static SOCKET unpack_fd(uint64_t data) {
+  return (SOCKET)(uint32_t)data;
+}
+
+static int uring_setup(unsigned entries, struct io_uring_params* params) {
+  return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uring_register(int fd, unsigned op, void* arg, unsigned nr_args) {
+  return (int)syscall(__NR_io_uring_register, fd, op, arg, nr_args);
+}
+
+static void* map_anonymous(size_t size) {
+  void* ptr = mmap(
+    NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0
+  );
+  return ptr == MAP_FAILED ? nullptr : ptr;
+}
+
+const char* UringBackend::name() {
+  return "uring";
+}
+
+int UringBackend::init(SOCKET master, IoHandler* handler) {
+  this->master = master;
+  this->handler = handler;
+
+  // prefer the flags cutting the task work overhead, fall back on older
+  // kernels.
+  unsigned flag_sets[] = {
+    IORING_SETUP_SUBMIT_ALL | IORING_SETUP_SINGLE_ISSUER |
+      IORING_SETUP_DEFER_TASKRUN,
+    IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN,
+    0,
+  };
+
+  struct io_uring_params params;
+
+  for (unsigned flags : flag_sets) {
+    memset(&params, 0, sizeof(params));
+    params.flags = flags | IORING_SETUP_CQSIZE;
+    params.cq_entries = URING_ENTRIES * 4;
+
+    this->ring_fd = uring_setup(URING_ENTRIES, &params);
+    if (this->ring_fd >= 0) {
+      break;
+    }
+  }
+
+  if (this->ring_fd < 0) {
+    return 1;
+  }
+
+  if (!(params.features & IORING_FEAT_SINGLE_MMAP) ||
+      !(params.features & IORING_FEAT_EXT_ARG)) {
+    return 1;
+  }
+
+  // map the rings, both share one mapping
+  this->sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  this->cq_size =
+    params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  this->sq_size = std::max(this->sq_size, this->cq_size);
+  this->cq_size = this->sq_size;
+
+  this->sq_ptr = mmap(
+    NULL, this->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+    this->ring_fd, IORING_OFF_SQ_RING
+  );
+  if (this->sq_ptr == MAP_FAILED) {
+    this->sq_ptr = nullptr;
+    return 1;
+  }
+  this->cq_ptr = this->sq_ptr;
+
+  this->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  void* sqes = mmap(
+    NULL, this->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+    this->ring_fd, IORING_OFF_SQES
+  );
+  if (sqes == MAP_FAILED) {
+    return 1;
+  }
+  this->sqes = (struct io_uring_sqe*)sqes;
+
+  uint8_t* sq = (uint8_t*)this->sq_ptr;
+  this->sq_head = (unsigned*)(sq + params.sq_off.head);
+  this->sq_tail = (unsigned*)(sq + params.sq_off.tail);
+  this->sq_mask = *(unsigned*)(sq + params.sq_off.ring_mask);
+  this->sq_entries = *(unsigned*)(sq + params.sq_off.ring_entries);
+  this->sq_local_tail = *this->sq_tail;
+  this->sq_submitted = this->sq_local_tail;
+
+  // the entries are always submitted in order
+  unsigned* array = (unsigned*)(sq + params.sq_off.array);
+  for (unsigned i = 0; i < this->sq_entries; i++) {
+    array[i] = i;
+  }
+
+  uint8_t* cq = (uint8_t*)this->cq_ptr;
+  this->cq_head = (unsigned*)(cq + params.cq_off.head);
+  this->cq_tail = (unsigned*)(cq + params.cq_off.tail);
+  this->cq_mask = *(unsigned*)(cq + params.cq_off.ring_mask);
+  this->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+
+  // provided buffers for the multishot recv
+  this->buf_ring_size = URING_RECV_BUFFERS * sizeof(struct io_uring_buf);
+  this->buf_ring = (struct io_uring_buf_ring*)map_anonymous(this->buf_ring_size);
+  this->recv_buffers =
+    (uint8_t*)map_anonymous(URING_RECV_BUFFERS * URING_RECV_BUFFER_SIZE);
+  if (this->buf_ring == nullptr || this->recv_buffers == nullptr) {
+    return 1;
+  }
+
+  struct io_uring_buf_reg reg;
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (uint64_t)this->buf_ring;
+  reg.ring_entries = URING_RECV_BUFFERS;
+  reg.bgid = 0;
+
+  if (uring_register(this->ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+    return 1;
+  }
+
+  for (uint16_t bid = 0; bid < URING_RECV_BUFFERS; bid++) {
+    this->recycle(bid);
+  }
+
+  // registered buffers for the writes
+  this->send_buffers =
+    (uint8_t*)map_anonymous(URING_SEND_SLOTS * URING_SEND_SLOT_SIZE);
+  if (this->send_buffers == nullptr) {
+    return 1;
+  }
+
+  struct iovec iov;
+  iov.iov_base = this->send_buffers;
+  iov.iov_len = URING_SEND_SLOTS * URING_SEND_SLOT_SIZE;
+
+  if (uring_register(this->ring_fd, IORING_REGISTER_BUFFERS, &iov, 1) < 0) {
+    return 1;
+  }
+
+  for (int slot = URING_SEND_SLOTS - 1; slot >= 0; slot--) {
+    this->free_slots.push_back((uint16_t)slot);
+  }
+
+  this->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (this->wake_fd < 0) {
+    return 1;
+  }
+
+  this->arm_wake();
+  this->arm_accept();
+
+  return this->enter(0, 0) < 0 ? 1 : 0;
+}
+
+int UringBackend::poll(int timeout_ms) {
+  // queue the writes of this iteration, they are submitted with the wait
+  std::vector<SOCKET> ready;
+  ready.swap(this->ready);
+
+  auto now = std::chrono::steady_clock::now();
+  int wait_ms = -1;
+
+  for (SOCKET socket : ready) {
+    auto it = this->sockets.find(socket);
+    if (it != this->sockets.end() &&
+        this->hold(it->second.queue, now, &wait_ms)) {
+      this->ready.push_back(socket);
+      continue;
+    }
+    this->flush(socket);
+  }
+
+  if (wait_ms >= 0 && (timeout_ms < 0 || wait_ms < timeout_ms)) {
+    timeout_ms = wait_ms;
+  }
+
+  unsigned head = *this->cq_head;
+  unsigned tail = __atomic_load_n(this->cq_tail, __ATOMIC_ACQUIRE);
+
+  if (this->enter(head == tail ? 1 : 0, timeout_ms) < 0) {
+    return -1;
+  }
+
+  tail = __atomic_load_n(this->cq_tail, __ATOMIC_ACQUIRE);
+
+  while (head != tail) {
+    struct io_uring_cqe cqe = this->cqes[head & this->cq_mask];
+    head++;
+    // release the entry before handling, handling may submit and wait
+    __atomic_store_n(this->cq_head, head, __ATOMIC_RELEASE);
+
+    this->complete(&cqe);
+  }
+
+  return 0;
+}
+
+int UringBackend::send_frame(SOCKET socket, FrameRef frame) {
+  auto it = this->sockets.find(socket);
+  if (it == this->sockets.end() || it->second.failed) {
+    return -1;
+  }
+
+  Socket& s = it->second;
+
+  bool idle = s.queue.empty() && s.slot == -1;
+  s.queue.push(std::move(frame));
+
+  if (idle) {
+    this->ready.push_back(socket);
+  }
+
+  return 0;
+}
+
+size_t UringBackend::queued(SOCKET socket) {
+  auto it = this->sockets.find(socket);
+  if (it == this->sockets.end()) {
+    return 0;
+  }
+
+  // the bytes of the slot in flight are copied out of the queue already
+  const Socket& s = it->second;
+  size_t in_flight = s.slot != -1 ? s.slot_len - s.slot_off : 0;
+
+  return s.queue.bytes + in_flight;
+}
+
+size_t UringBackend::drop(SOCKET socket, size_t len) {
+  auto it = this->sockets.find(socket);
+  return it == this->sockets.end() ? 0 : it->second.queue.drop(len);
+}
+
+void UringBackend::watch(SOCKET socket, size_t bytes) {
+  auto it = this->sockets.find(socket);
+  if (it == this->sockets.end()) {
+    return;
+  }
+
+  it->second.queue.watched = true;
+  it->second.queue.drain_bytes = bytes;
+}
+
+void UringBackend::pause(SOCKET socket, bool paused) {
+  auto it = this->sockets.find(socket);
+  if (it == this->sockets.end() || it->second.failed ||
+      it->second.paused == paused) {
+    return;
+  }
+
+  Socket& s = it->second;
+  s.paused = paused;
+
+  // a recv being cancelled is armed again once its last completion is in
+  if (paused && s.receiving) {
+    this->cancel_recv(socket, s);
+  } else if (!paused && !s.receiving) {
+    this->arm_recv(socket, s);
+  }
+}
+
+void UringBackend::close(SOCKET socket) {
+  auto it = this->sockets.find(socket);
+  if (it == this->sockets.end() || it->second.closed) {
+    return;
+  }
+
+  // the submissions queued but not submitted yet resolve the descriptor when
+  // submitted, it stays open until their completions are in so that it is
+  // not reused by an accepted socket in between
+  Socket& s = it->second;
+  s.closed = true;
+  s.failed = true;
+  s.queue = OutboundQueue{};
+
+  // terminates the multishot recv and fails the write in flight
+  shutdown(socket, SHUT_RDWR);
+  this->settle(socket);
+}
+
+void UringBackend::wake() {
+  uint64_t value = 1;
+  (void)!write(this->wake_fd, &value, sizeof(value));
+}
+
+void UringBackend::cleanup() {
+  for (auto& [socket, s] : this->sockets) {
+    ::close(socket);
+  }
+  this->sockets.clear();
+
+  if (this->ring_fd >= 0) {
+    ::close(this->ring_fd);
+    this->ring_fd = -1;
+  }
+  if (this->wake_fd >= 0) {
+    ::close(this->wake_fd);
+    this->wake_fd = -1;
+  }
+  if (this->sq_ptr != nullptr) {
+    munmap(this->sq_ptr, this->sq_size);
+    this->sq_ptr = nullptr;
+  }
+  if (this->sqes != nullptr) {
+    munmap(this->sqes, this->sqes_size);
+    this->sqes = nullptr;
+  }
+  if (this->buf_ring != nullptr) {
+    munmap(this->buf_ring, this->buf_ring_size);
+    this->buf_ring = nullptr;
+  }
+  if (this->recv_buffers != nullptr) {
+    munmap(this->recv_buffers, URING_RECV_BUFFERS * URING_RECV_BUFFER_SIZE);
+    this->recv_buffers = nullptr;
+  }
+  if (this->send_buffers != nullptr) {
+    munmap(this->send_buffers, URING_SEND_SLOTS * URING_SEND_SLOT_SIZE);
+    this->send_buffers = nullptr;
+  }
+}
+
+struct io_uring_sqe* UringBackend::get_sqe() {
+  unsigned head = __atomic_load_n(this->sq_head, __ATOMIC_ACQUIRE);
+
+  if (this->sq_local_tail - head >= this->sq_entries) {
+    this->enter(0, 0);
+    head = __atomic_load_n(this->sq_head, __ATOMIC_ACQUIRE);
+    if (this->sq_local_tail - head >= this->sq_entries) {
+      return nullptr;
+    }
+  }
+
+  struct io_uring_sqe* sqe = &this->sqes[this->sq_local_tail & this->sq_mask];
+  memset(sqe, 0, sizeof(*sqe));
+  this->sq_local_tail++;
+
+  return sqe;
+}
+
+int UringBackend::enter(unsigned min_complete, int timeout_ms) {
+  __atomic_store_n(this->sq_tail, this->sq_local_tail, __ATOMIC_RELEASE);
+
+  unsigned to_submit = this->sq_local_tail - this->sq_submitted;
+  unsigned flags = IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+
+  struct __kernel_timespec ts;
+  struct io_uring_getevents_arg arg;
+  memset(&arg, 0, sizeof(arg));
+  arg.sigmask_sz = _NSIG / 8;
+
+  if (timeout_ms >= 0 && min_complete > 0) {
+    ts.tv_sec = timeout_ms / 1000;
+    ts.tv_nsec = (timeout_ms % 1000) * 1000000LL;
+    arg.ts = (uint64_t)&ts;
+  }
+
+  this->syscalls++;
+  int res = (int)syscall(
+    __NR_io_uring_enter, this->ring_fd, to_submit, min_complete, flags, &arg,
+    sizeof(arg)
+  );
+
+  if (res < 0) {
+    if (errno == EINTR || errno == ETIME || errno == EBUSY ||
+        errno == EAGAIN) {
+      return 0;
+    }
+    return -1;
+  }
+
+  this->sq_submitted += res;
+
+  return res;
+}
+
+void UringBackend::arm_accept() {
+  struct io_uring_sqe* sqe = this->get_sqe();
+  if (sqe == nullptr) {
+    return;
+  }
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = this->master;
+  sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+  sqe->accept_flags = SOCK_CLOEXEC;
+  sqe->user_data = pack(URING_OP_ACCEPT, 0, 0, this->master);
+}
+
+void UringBackend::arm_recv(SOCKET socket, Socket& s) {
+  struct io_uring_sqe* sqe = this->get_sqe();
+  if (sqe == nullptr) {
+    return;
+  }
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = socket;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = 0;
+  sqe->user_data = pack(URING_OP_RECV, 0, s.gen, socket);
+  s.receiving = true;
+  s.pending++;
+}
+
+void UringBackend::cancel_recv(SOCKET socket, Socket& s) {
+  struct io_uring_sqe* sqe = this->get_sqe();
+  if (sqe == nullptr) {
+    return;
+  }
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->fd = -1;
+  sqe->addr = pack(URING_OP_RECV, 0, s.gen, socket);
+  sqe->user_data = pack(URING_OP_CANCEL, 0, s.gen, socket);
+  s.pending++;
+}
+
+void UringBackend::arm_wake() {
+  struct io_uring_sqe* sqe = this->get_sqe();
+  if (sqe == nullptr) {
+    return;
+  }
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = this->wake_fd;
+  sqe->poll32_events = POLLIN;
+  sqe->len = IORING_POLL_ADD_MULTI;
+  sqe->user_data = pack(URING_OP_WAKE, 0, 0, this->wake_fd);
+}
+
+void UringBackend::recycle(uint16_t bid) {
+  uint8_t* addr = this->recv_buffers + (size_t)bid * URING_RECV_BUFFER_SIZE;
+
+  // the entries overlay the ring from its start. `bufs` is not used, the
+  // flexible array member of the kernel header is misplaced in C++.
+  struct io_uring_buf* bufs = (struct io_uring_buf*)this->buf_ring;
+  struct io_uring_buf* buf = &bufs[this->buf_tail & (URING_RECV_BUFFERS - 1)];
+  buf->addr = (uint64_t)addr;
+  buf->len = URING_RECV_BUFFER_SIZE;
+  buf->bid = bid;
+
+  this->buf_tail++;
+  __atomic_store_n(&this->buf_ring->tail, this->buf_tail, __ATOMIC_RELEASE);
+}
+
+void UringBackend::flush(SOCKET socket) {
+  auto it = this->sockets.find(socket);
+  if (it == this->sockets.end()) {
+    return;
+  }
+
+  Socket& s = it->second;
+  if (s.failed || s.slot != -1 || s.queue.empty()) {
+    return;
+  }
+
+  if (this->free_slots.empty()) {
+    // retried in the next iteration, when writes have completed
+    this->ready.push_back(socket);
+    return;
+  }
+
+  struct io_uring_sqe* sqe = this->get_sqe();
+  if (sqe == nullptr) {
+    this->ready.push_back(socket);
+    return;
+  }
+
+  uint16_t slot = this->free_slots.back();
+  this->free_slots.pop_back();
+
+  // coalesce the frames queued so far into the slot
+  uint8_t* buf = this->send_buffers + (size_t)slot * URING_SEND_SLOT_SIZE;
+  uint32_t len = 0;
+
+  while (!s.queue.empty() && len < URING_SEND_SLOT_SIZE) {
+    const Frame& frame = *s.queue.front();
+    size_t n = frame.copy(
+      s.queue.offset, buf + len, (size_t)URING_SEND_SLOT_SIZE - len
+    );
+    s.queue.consume(n);
+    len += (uint32_t)n;
+  }
+
+  s.slot = slot;
+  s.slot_off = 0;
+  s.slot_len = len;
+
+  sqe->opcode = IORING_OP_WRITE_FIXED;
+  sqe->fd = socket;
+  sqe->addr = (uint64_t)buf;
+  sqe->len = len;
+  sqe->buf_index = 0;
+  sqe->user_data = pack(URING_OP_WRITE, slot, s.gen, socket);
+  s.pending++;
+}
+
+void UringBackend::complete(struct io_uring_cqe* cqe) {
+  UringOp op = unpack_op(cqe->user_data);
+  SOCKET fd = unpack_fd(cqe->user_data);
+  uint32_t gen = unpack_gen(cqe->user_data);
+  bool more = cqe->flags & IORING_CQE_F_MORE;
+
+  // every submission on a socket ends with a completion without more to come
+  bool last = !more && op != URING_OP_ACCEPT && op != URING_OP_WAKE;
+  if (last) {
+    auto it = this->sockets.find(fd);
+    if (it != this->sockets.end() && (it->second.gen & 0xfff) == gen &&
+        it->second.pending > 0) {
+      it->second.pending--;
+    }
+  }
+
+  // look up the socket, completions of a closed socket are stale
+  auto lookup = [this, fd, gen]() -> Socket* {
+    auto it = this->sockets.find(fd);
+    if (it == this->sockets.end() || it->second.closed ||
+        (it->second.gen & 0xfff) != gen) {
+      return nullptr;
+    }
+    return &it->second;
+  };
+
+  switch (op) {
+    case URING_OP_ACCEPT: {
+      if (cqe->res >= 0) {
+        SOCKET socket = cqe->res;
+        Socket& s = this->sockets[socket];
+        s = Socket{};
+        s.gen = this->next_gen++;
+        this->arm_recv(socket, s);
+        this->accept_error = 0;
+        this->handler->on_accept(socket);
+      } else if (cqe->res != -ECONNABORTED && cqe->res != -EPROTO &&
+                 cqe->res != -this->accept_error) {
+        // the accept is armed again at once, it fails as long as the
+        // error lasts
+        this->accept_error = -cqe->res;
+        this->handler->on_accept_failed(this->accept_error);
+      }
+      if (!more) {
+        this->arm_accept();
+      }
+      break;
+    }
+    case URING_OP_RECV: {
+      bool has_buffer = cqe->flags & IORING_CQE_F_BUFFER;
+      uint16_t bid = (uint16_t)(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+
+      Socket* s = lookup();
+
+      // the last completion of the recv, armed again unless paused
+      if (s != nullptr && !more) {
+        s->receiving = false;
+      }
+
+      if (cqe->res > 0 && has_buffer) {
+        if (s != nullptr && !s->failed) {
+          this->handler->on_recv(
+            fd, this->recv_buffers + (size_t)bid * URING_RECV_BUFFER_SIZE,
+            cqe->res
+          );
+        }
+        this->recycle(bid);
+
+        // the handler may have closed, paused or resumed the socket
+        s = lookup();
+        if (s != nullptr && !s->receiving && !s->paused && !s->failed) {
+          this->arm_recv(fd, *s);
+        }
+      } else if (cqe->res == -ENOBUFS || cqe->res == -ECANCELED) {
+        // all the buffers were in use, they are back by now, or the socket
+        // has been paused
+        if (s != nullptr && !s->receiving && !s->paused && !s->failed) {
+          this->arm_recv(fd, *s);
+        }
+      } else if (s != nullptr) {
+        if (has_buffer) {
+          this->recycle(bid);
+        }
+        this->fail(fd);
+      } else if (has_buffer) {
+        this->recycle(bid);
+      }
+      break;
+    }
+    case URING_OP_WRITE: {
+      uint16_t slot = (uint16_t)unpack_slot(cqe->user_data);
+      Socket* s = lookup();
+
+      if (s == nullptr || s->slot != slot) {
+        this->free_slots.push_back(slot);
+        break;
+      }
+
+      if (cqe->res < 0) {
+        this->free_slots.push_back(slot);
+        s->slot = -1;
+        this->fail(fd);
+        break;
+      }
+
+      this->flushes++;
+      this->flushed_bytes += cqe->res;
+
+      s->slot_off += cqe->res;
+
+      if (s->slot_off < s->slot_len) {
+        // short write, write the rest of the slot
+        struct io_uring_sqe* sqe = this->get_sqe();
+        if (sqe != nullptr) {
+          uint8_t* buf = this->send_buffers + (size_t)slot * URING_SEND_SLOT_SIZE;
+          sqe->opcode = IORING_OP_WRITE_FIXED;
+          sqe->fd = fd;
+          sqe->addr = (uint64_t)(buf + s->slot_off);
+          sqe->len = s->slot_len - s->slot_off;
+          sqe->buf_index = 0;
+          sqe->user_data = pack(URING_OP_WRITE, slot, s->gen, fd);
+          s->pending++;
+          break;
+        }
+        this->free_slots.push_back(slot);
+        s->slot = -1;
+        this->fail(fd);
+        break;
+      }
+
+      this->free_slots.push_back(slot);
+      s->slot = -1;
+      this->flush(fd);
+      this->drained(fd);
+      break;
+    }
+    case URING_OP_CANCEL: {
+      // the recv cancelled completes on its own
+      break;
+    }
+    case URING_OP_WAKE: {
+      uint64_t value;
+      this->syscalls++;
+      (void)!read(this->wake_fd, &value, sizeof(value));
+      if (!more) {
+        this->arm_wake();
+      }
+      break;
+    }
+  }
+
+  if (last) {
+    this->settle(fd);
+  }
+}
+
+void UringBackend::drained(SOCKET socket) {
+  auto it = this->sockets.find(socket);
+  if (it == this->sockets.end() || !it->second.queue.watched ||
+      this->queued(socket) > it->second.queue.drain_bytes) {
+    return;
+  }
+
+  it->second.queue.watched = false;
+  this->handler->on_drained(socket);
+}
+
+void UringBackend::fail(SOCKET socket) {
+  auto it = this->sockets.find(socket);
+  if (it == this->sockets.end() || it->second.failed) {
+    return;
+  }
+  it->second.failed = true;
+  this->handler->on_closed(socket);
+}
+
+void UringBackend::settle(SOCKET socket) {
+  auto it = this->sockets.find(socket);
+  if (it == this->sockets.end() || !it->second.closed ||
+      it->second.pending > 0) {
+    return;
+  }
+
+  this->sockets.erase(it);
+  ::close(socket);
+}
+
+#endif  // __linux__
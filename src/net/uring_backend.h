@@ -0,0 +1,153 @@
+#ifndef NET_URING_BACKEND_H_
+#define NET_URING_BACKEND_H_
+
+#ifdef __linux__
+
+#include <linux/io_uring.h>
+
+#include <unordered_map>
+#include <vector>
+
+#include "net/io.h"
+
+/// Number of submission queue entries.
+#define URING_ENTRIES 4096
+/// Number of provided buffers for receiving, a power of two.
+#define URING_RECV_BUFFERS 512
+/// Size of a provided buffer for receiving.
+#define URING_RECV_BUFFER_SIZE 16384
+/// Number of registered buffers for sending.
+#define URING_SEND_SLOTS 1024
+/// Size of a registered buffer for sending.
+#define URING_SEND_SLOT_SIZE 16384
+
+/// Completion based backend on io_uring.
+///
+/// The listening socket is served by a multishot accept and every connection
+/// by a multishot recv picking buffers from a provided buffer ring, so a
+/// stream of incoming messages costs no submission at all. Queued frames are
+/// copied into registered fixed buffers and written with
+/// `IORING_OP_WRITE_FIXED`, one write in flight per socket to keep the order.
+///
+/// The submissions queued while handling an iteration are submitted together
+/// with the wait for the next completions, so one `io_uring_enter` covers the
+/// replies and the fan-out of all the messages handled in an iteration.
+struct UringBackend : IoBackend {
+  /// State of a connection.
+  struct Socket {
+    /// Generation of the socket, to recognize the completions of another
+    /// connection on the same descriptor.
+    uint32_t gen = 0;
+    /// Frames waiting for a free slot or for the write in flight.
+    OutboundQueue queue;
+    /// The slot of the write in flight, -1 if none.
+    int slot = -1;
+    /// Bytes of the slot already written.
+    uint32_t slot_off = 0;
+    /// Bytes held by the slot.
+    uint32_t slot_len = 0;
+    /// Whether the socket has failed and the handler has been notified.
+    bool failed = false;
+    /// Whether a multishot recv is armed on the socket.
+    bool receiving = false;
+    /// Whether the socket is not read from until resumed.
+    bool paused = false;
+    /// Whether the handler has closed the socket, the descriptor is closed
+    /// once the last completion of the socket is in.
+    bool closed = false;
+    /// Submissions on the socket whose last completion is not in yet.
+    unsigned pending = 0;
+  };
+
+  /// The ring
+  int ring_fd = -1;
+  /// The eventfd used to interrupt the wait
+  int wake_fd = -1;
+  /// The listening socket
+  SOCKET master = INVALID_SOCKET;
+  /// The handler of the events
+  IoHandler* handler = nullptr;
+  /// The error the accepts keep failing with, reported once, 0 if none
+  int accept_error = 0;
+
+  /// Mapped submission queue ring
+  void* sq_ptr = nullptr;
+  size_t sq_size = 0;
+  unsigned* sq_head = nullptr;
+  unsigned* sq_tail = nullptr;
+  unsigned sq_mask = 0;
+  unsigned sq_entries = 0;
+  /// Submission queue entries
+  struct io_uring_sqe* sqes = nullptr;
+  size_t sqes_size = 0;
+  /// Tail of the entries prepared but not yet published
+  unsigned sq_local_tail = 0;
+  /// Tail published to the kernel but not yet submitted
+  unsigned sq_submitted = 0;
+
+  /// Mapped completion queue ring
+  void* cq_ptr = nullptr;
+  size_t cq_size = 0;
+  unsigned* cq_head = nullptr;
+  unsigned* cq_tail = nullptr;
+  unsigned cq_mask = 0;
+  struct io_uring_cqe* cqes = nullptr;
+
+  /// The provided buffer ring for receiving
+  struct io_uring_buf_ring* buf_ring = nullptr;
+  size_t buf_ring_size = 0;
+  uint16_t buf_tail = 0;
+  uint8_t* recv_buffers = nullptr;
+
+  /// The registered buffers for sending
+  uint8_t* send_buffers = nullptr;
+  std::vector<uint16_t> free_slots;
+  /// Sockets with queued frames and no write in flight
+  std::vector<SOCKET> ready;
+
+  /// The connections
+  std::unordered_map<SOCKET, Socket> sockets;
+  /// Generation of the next accepted socket
+  uint32_t next_gen = 1;
+
+  const char* name() override;
+  int init(SOCKET master, IoHandler* handler) override;
+  int poll(int timeout_ms) override;
+  int send_frame(SOCKET socket, FrameRef frame) override;
+  size_t queued(SOCKET socket) override;
+  size_t drop(SOCKET socket, size_t len) override;
+  void watch(SOCKET socket, size_t bytes) override;
+  void pause(SOCKET socket, bool paused) override;
+  void close(SOCKET socket) override;
+  void wake() override;
+  void cleanup() override;
+
+  /// Get a free submission entry, submitting the queued ones if full.
+  struct io_uring_sqe* get_sqe();
+  /// Submit the queued entries and wait for `min_complete` completions.
+  int enter(unsigned min_complete, int timeout_ms);
+  /// Arm the multishot accept on the listening socket.
+  void arm_accept();
+  /// Arm the multishot recv on the socket.
+  void arm_recv(SOCKET socket, Socket& s);
+  /// Cancel the multishot recv armed on the socket.
+  void cancel_recv(SOCKET socket, Socket& s);
+  /// Arm the multishot poll on the wake eventfd.
+  void arm_wake();
+  /// Give a receive buffer back to the kernel.
+  void recycle(uint16_t bid);
+  /// Queue a write of the queued frames of the socket if possible.
+  void flush(SOCKET socket);
+  /// Handle a completion.
+  void complete(struct io_uring_cqe* cqe);
+  /// Mark the socket failed and notify the handler.
+  void fail(SOCKET socket);
+  /// Tell the handler if the watched socket has drained.
+  void drained(SOCKET socket);
+  /// Close the descriptor of a closed socket without pending submissions.
+  void settle(SOCKET socket);
+};
+
+#endif  // __linux__
+
+#endif  // NET_URING_BACKEND_H_
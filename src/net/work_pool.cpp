@@ -0,0 +1,136 @@
+#include "net/work_pool.h"
+
+/// Index of the current thread in its pool, `SIZE_MAX` outside of a pool.
+static thread_local size_t worker_index = SIZE_MAX;
+/// The pool of the current thread.
+static thread_local WorkPool* worker_pool = nullptr;
+
+WorkPool::~WorkPool() {
+  this->stop();
+}
+
+void WorkPool::start(size_t count) {
+  for (size_t i = 0; i < count; i++) {
+    this->queues.push_back(std::make_unique<Queue>());
+  }
+
+  for (size_t i = 0; i < count; i++) {
+    this->threads.emplace_back([this, i]() { this->work(i); });
+  }
+}
+
+void WorkPool::stop() {
+  {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    this->stopping = true;
+  }
+  this->wakeup.notify_all();
+
+  for (auto& thread : this->threads) {
+    thread.join();
+  }
+
+  this->threads.clear();
+}
+
+void WorkPool::submit(Task task) {
+  size_t index = worker_pool == this
+                   ? worker_index
+                   : this->next.fetch_add(1, std::memory_order_relaxed) %
+                       this->queues.size();
+
+  Queue& queue = *this->queues[index];
+  {
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    queue.tasks.push_back(std::move(task));
+  }
+
+  // a thread going to sleep counts itself before it checks the queues
+  // again, so either it sees the task or it is counted here.
+  this->queued.fetch_add(1, std::memory_order_seq_cst);
+
+  if (this->sleeping.load(std::memory_order_seq_cst) > 0) {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    this->wakeup.notify_one();
+  }
+}
+
+bool WorkPool::take(size_t index, Task* task) {
+  size_t count = this->queues.size();
+
+  // the own queue first, then the others from the next one on
+  for (size_t i = 0; i < count; i++) {
+    Queue& queue = *this->queues[(index + i) % count];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+
+    if (!queue.tasks.empty()) {
+      *task = std::move(queue.tasks.front());
+      queue.tasks.pop_front();
+      this->queued.fetch_sub(1, std::memory_order_relaxed);
+      return true;
+    }
+  }
+
+  return false;
+}
+
+void WorkPool::work(size_t index) {
+  worker_index = index;
+  worker_pool = this;
+
+  while (true) {
+    Task task;
+
+    if (this->take(index, &task)) {
+      task();
+      continue;
+    }
+
+    std::unique_lock<std::mutex> lock(this->mutex);
+
+    this->sleeping.fetch_add(1, std::memory_order_seq_cst);
+
+    if (this->queued.load(std::memory_order_seq_cst) == 0) {
+      if (this->stopping) {
+        this->sleeping.fetch_sub(1);
+        break;
+      }
+
+      this->wakeup.wait(lock);
+    }
+
+    this->sleeping.fetch_sub(1);
+  }
+
+  worker_pool = nullptr;
+}
+
+void Strand::post(Task task) {
+  this->tasks.push(std::move(task));
+
+  // the first task posted to an idle strand schedules it
+  if (this->pending.fetch_add(1, std::memory_order_acq_rel) == 0) {
+    this->pool->submit([this]() { this->run(); });
+  }
+}
+
+void Strand::run() {
+  for (size_t i = 0; i < STRAND_BATCH; i++) {
+    Task task;
+
+    // counted by a post not done linking it yet
+    while (!this->tasks.pop(&task)) {
+      std::this_thread::yield();
+    }
+
+    task();
+
+    // the strand may be freed with the last task, and another thread may
+    // run it as soon as it is idle.
+    if (this->pending.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+      return;
+    }
+  }
+
+  this->pool->submit([this]() { this->run(); });
+}
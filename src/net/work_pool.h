@@ -0,0 +1,101 @@
+#ifndef NET_WORK_POOL_H_
+#define NET_WORK_POOL_H_
+
+#include <stddef.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "net/mailbox.h"
+
+/// Number of the tasks a strand runs before letting the others have the
+/// thread.
+#define STRAND_BATCH 16
+
+/// A unit of work run by the pool.
+using Task = std::function<void()>;
+
+/// Threads running tasks, each thread taking from its own queue first and
+/// stealing from the others when it is empty.
+///
+/// A task submitted by a thread of the pool goes to the queue of that
+/// thread, the others are spread over the queues in turn. An idle thread
+/// takes the oldest tasks of the others, so a backlog is shared by every
+/// thread with nothing else to do. The threads sleep while there is no task.
+struct WorkPool {
+  /// The queue of a thread.
+  struct alignas(64) Queue {
+    std::mutex mutex;
+    std::deque<Task> tasks;
+  };
+
+  /// The queues, indexed by thread
+  std::vector<std::unique_ptr<Queue>> queues;
+  std::vector<std::thread> threads;
+  /// Number of the tasks in the queues
+  std::atomic<size_t> queued = 0;
+  /// Number of the threads sleeping, or about to
+  std::atomic<size_t> sleeping = 0;
+  /// The queue the next task submitted from outside the pool goes to
+  std::atomic<size_t> next = 0;
+  /// Guards the sleeping of the threads
+  std::mutex mutex;
+  std::condition_variable wakeup;
+  /// Whether the threads exit once the queues are empty
+  bool stopping = false;
+
+  WorkPool() = default;
+  ~WorkPool();
+  WorkPool(const WorkPool&) = delete;
+  WorkPool& operator=(const WorkPool&) = delete;
+
+  /// Start the threads.
+  void start(size_t count);
+  /// Run the tasks left, including those they submit, and join the threads.
+  void stop();
+  /// Queue the task, from any thread.
+  void submit(Task task);
+
+  /// Take a task of the queue of the thread, or steal one.
+  ///
+  /// Returns false if every queue is empty.
+  bool take(size_t index, Task* task);
+  /// Run the tasks on the thread of the index until stopped.
+  void work(size_t index);
+};
+
+/// Runs the tasks posted to it one at a time and in order, on the threads of
+/// a pool.
+///
+/// Posting never blocks. The tasks run on whichever thread is free, but
+/// never two at once, so the state only the tasks of a strand touch needs no
+/// lock. After `STRAND_BATCH` tasks the strand goes back to the end of the
+/// queue, a busy strand cannot keep a thread from the others.
+///
+/// The tasks posted must keep the strand alive until they have run.
+struct Strand {
+  /// The pool running the tasks
+  WorkPool* pool;
+  /// The tasks not run yet
+  Mailbox<Task> tasks;
+  /// Number of the tasks posted and not run yet
+  std::atomic<size_t> pending = 0;
+
+  explicit Strand(WorkPool* pool) : pool(pool) {}
+
+  Strand(const Strand&) = delete;
+  Strand& operator=(const Strand&) = delete;
+
+  /// Queue the task after the others, from any thread.
+  void post(Task task);
+  /// Run the tasks posted, on a thread of the pool.
+  void run();
+};
+
+#endif  // NET_WORK_POOL_H_
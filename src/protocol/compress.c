@@ -0,0 +1,275 @@
+#include "protocol/compress.h"
+#include "string.h"
+
+/// Bits of the hash of 4 bytes, indexing the positions seen last
+#define LZ_HASH_BITS 12
+/// Shortest match, also the bytes hashed
+#define LZ_MIN_MATCH 4
+/// Farthest match, the largest offset
+#define LZ_MAX_OFFSET 65535
+
+static uint32_t lz_read32(const uint8_t* p) {
+  uint32_t value;
+  memcpy(&value, p, sizeof(value));
+  return value;
+}
+
+static uint32_t lz_hash(uint32_t value) {
+  return (value * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+/// Write the remainder of a length whose nibble is 15.
+static uint8_t* lz_put_length(uint8_t* op, uint32_t len) {
+  for (len -= 15; len >= 255; len -= 255) {
+    *op++ = 255;
+  }
+  *op++ = (uint8_t)len;
+
+  return op;
+}
+
+/// Write a sequence, with a match unless `match_len` is 0.
+///
+/// Returns the end of the sequence, or NULL if it does not fit.
+static uint8_t* lz_put_sequence(
+  uint8_t* op,
+  const uint8_t* end,
+  const uint8_t* literals,
+  uint32_t literal_len,
+  uint32_t offset,
+  uint32_t match_len
+) {
+  // the worst case of the lengths, checked once
+  uint32_t worst = 1 + literal_len / 255 + 1 + literal_len + 2 +
+                   match_len / 255 + 1;
+  if ((uint32_t)(end - op) < worst) {
+    return NULL;
+  }
+
+  uint32_t match_code = match_len > 0 ? match_len - LZ_MIN_MATCH : 0;
+  uint8_t* token = op++;
+
+  *token = (uint8_t)((literal_len < 15 ? literal_len : 15) << 4);
+  if (literal_len >= 15) {
+    op = lz_put_length(op, literal_len);
+  }
+
+  memcpy(op, literals, literal_len);
+  op += literal_len;
+
+  if (match_len == 0) {
+    return op;
+  }
+
+  *op++ = (uint8_t)offset;
+  *op++ = (uint8_t)(offset >> 8);
+
+  *token |= (uint8_t)(match_code < 15 ? match_code : 15);
+  if (match_code >= 15) {
+    op = lz_put_length(op, match_code);
+  }
+
+  return op;
+}
+
+/// Compress into an LZ block, returns its length or -1 if it does not fit.
+static length_t lz_compress(
+  const uint8_t* src,
+  uint32_t len,
+  uint8_t* dst,
+  uint32_t capacity
+) {
+  // positions of the last bytes seen with each hash, a stale or colliding
+  // one is caught by comparing the bytes.
+  uint32_t table[1 << LZ_HASH_BITS];
+  memset(table, 0, sizeof(table));
+
+  uint8_t* op = dst;
+  const uint8_t* end = dst + capacity;
+  uint32_t anchor = 0;
+  uint32_t ip = 0;
+
+  while (ip + LZ_MIN_MATCH <= len) {
+    uint32_t sequence = lz_read32(src + ip);
+    uint32_t hash = lz_hash(sequence);
+    uint32_t candidate = table[hash];
+    table[hash] = ip;
+
+    if (candidate >= ip || ip - candidate > LZ_MAX_OFFSET ||
+        lz_read32(src + candidate) != sequence) {
+      ip++;
+      continue;
+    }
+
+    uint32_t match_len = LZ_MIN_MATCH;
+    while (ip + match_len < len &&
+           src[candidate + match_len] == src[ip + match_len]) {
+      match_len++;
+    }
+
+    op = lz_put_sequence(
+      op, end, src + anchor, ip - anchor, ip - candidate, match_len
+    );
+    if (op == NULL) {
+      return -1;
+    }
+
+    ip += match_len;
+    anchor = ip;
+  }
+
+  op = lz_put_sequence(op, end, src + anchor, len - anchor, 0, 0);
+  if (op == NULL) {
+    return -1;
+  }
+
+  return (length_t)(op - dst);
+}
+
+/// Read the remainder of a length whose nibble is 15.
+///
+/// Returns 0 on success, or -1 if the block ends first.
+static int lz_get_length(
+  const uint8_t** ip,
+  const uint8_t* end,
+  uint32_t* len
+) {
+  uint8_t byte;
+
+  do {
+    if (*ip >= end) {
+      return -1;
+    }
+    byte = *(*ip)++;
+    *len += byte;
+  } while (byte == 255);
+
+  return 0;
+}
+
+/// Decompress an LZ block, returns the length of the decoded bytes or -1.
+static length_t lz_decompress(
+  const uint8_t* src,
+  uint32_t len,
+  uint8_t* dst,
+  uint32_t capacity
+) {
+  const uint8_t* ip = src;
+  const uint8_t* end = src + len;
+  uint32_t op = 0;
+
+  while (ip < end) {
+    uint8_t token = *ip++;
+
+    uint32_t literal_len = token >> 4;
+    if (literal_len == 15 && lz_get_length(&ip, end, &literal_len) != 0) {
+      return -1;
+    }
+
+    if (literal_len > (uint32_t)(end - ip) || literal_len > capacity - op) {
+      return -1;
+    }
+
+    memcpy(dst + op, ip, literal_len);
+    ip += literal_len;
+    op += literal_len;
+
+    // the last sequence has no match
+    if (ip == end) {
+      break;
+    }
+
+    if (end - ip < 2) {
+      return -1;
+    }
+
+    uint32_t offset = ip[0] | ((uint32_t)ip[1] << 8);
+    ip += 2;
+
+    if (offset == 0 || offset > op) {
+      return -1;
+    }
+
+    uint32_t match_len = token & 15;
+    if (match_len == 15 && lz_get_length(&ip, end, &match_len) != 0) {
+      return -1;
+    }
+    match_len += LZ_MIN_MATCH;
+
+    if (match_len > capacity - op) {
+      return -1;
+    }
+
+    if (offset >= match_len) {
+      memcpy(dst + op, dst + op - offset, match_len);
+    } else {
+      // byte by byte, the match overlaps the bytes it produces
+      for (uint32_t i = 0; i < match_len; i++) {
+        dst[op + i] = dst[op - offset + i];
+      }
+    }
+    op += match_len;
+  }
+
+  return (length_t)op;
+}
+
+length_t compress_data(
+  format_t format,
+  const uint8_t data[],
+  uint32_t len,
+  uint8_t out[],
+  uint32_t capacity
+) {
+  // only worth it if shorter than the data
+  if (capacity > len) {
+    capacity = len;
+  }
+
+  if (capacity <= COMPRESS_HEADER_SIZE) {
+    return -1;
+  }
+
+  length_t block_len = lz_compress(
+    data, len, out + COMPRESS_HEADER_SIZE, capacity - COMPRESS_HEADER_SIZE
+  );
+  if (block_len < 0 || COMPRESS_HEADER_SIZE + (uint32_t)block_len >= len) {
+    return -1;
+  }
+
+  memcpy(out, &format, 4);
+  memcpy(out + 4, &len, 4);
+
+  return COMPRESS_HEADER_SIZE + block_len;
+}
+
+length_t decompress_data(
+  const uint8_t data[],
+  uint32_t len,
+  format_t* format,
+  uint8_t out[],
+  uint32_t capacity
+) {
+  uint32_t original_len;
+
+  if (len < COMPRESS_HEADER_SIZE) {
+    return -1;
+  }
+
+  memcpy(format, data, 4);
+  memcpy(&original_len, data + 4, 4);
+
+  // nested compression is not a thing
+  if (*format == FMT_LZ || original_len > capacity) {
+    return -1;
+  }
+
+  length_t decoded_len = lz_decompress(
+    data + COMPRESS_HEADER_SIZE, len - COMPRESS_HEADER_SIZE, out, original_len
+  );
+  if (decoded_len < 0 || (uint32_t)decoded_len != original_len) {
+    return -1;
+  }
+
+  return decoded_len;
+}
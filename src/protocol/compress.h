@@ -0,0 +1,65 @@
+#ifndef PROTOCOL_COMPRESS_H_
+#define PROTOCOL_COMPRESS_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+#include "protocol/protocol.h"
+
+/// Compression of the data of `SEND` messages, the `FMT_LZ` format.
+///
+/// The compressed data is the format and the length of the original data,
+/// 4 bytes each, followed by an LZ77 block. The block is a run of sequences,
+/// each a token byte, the literals and a match:
+///
+/// +-------+---------+----------+--------+---------+
+/// | TOKEN | LIT LEN | LITERALS | OFFSET | MAT LEN |
+/// +-------+---------+----------+--------+---------+
+///
+/// The high nibble of the token is the number of literals and the low nibble
+/// the length of the match minus 4. A nibble of 15 is continued by bytes
+/// added to it, up to the first byte below 255. The offset is 2 bytes,
+/// little-endian, counted back from the end of the decoded bytes. The last
+/// sequence has literals only and ends the block.
+///
+/// It trades ratio for speed, see `compress-bench`: text shrinks by a
+/// third to a half at hundreds of megabytes per second each way.
+
+/// Bytes before the block
+#define COMPRESS_HEADER_SIZE 8
+/// Data shorter than this is sent as is, the header and the CPU are not
+/// worth it.
+#define COMPRESS_THRESHOLD 256
+
+/// Compress the data of format `format` into `out`.
+///
+/// Returns the length of the compressed data, or -1 if it does not fit in
+/// `capacity` bytes or would not be shorter than the data.
+length_t compress_data(
+  format_t format,
+  const uint8_t data[],
+  uint32_t len,
+  uint8_t out[],
+  uint32_t capacity
+);
+
+/// Decompress the `FMT_LZ` data into `out`, setting the original format.
+///
+/// Returns the length of the original data, or -1 if the data is malformed
+/// or the original does not fit in `capacity` bytes.
+length_t decompress_data(
+  const uint8_t data[],
+  uint32_t len,
+  format_t* format,
+  uint8_t out[],
+  uint32_t capacity
+);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // PROTOCOL_COMPRESS_H_
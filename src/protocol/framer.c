@@ -0,0 +1,175 @@
+#include "protocol/framer.h"
+#include "protocol/protocol_v2.h"
+#include "stddef.h"
+#include "stdlib.h"
+#include "string.h"
+
+void framer_init(framer_t* framer) {
+  memset(framer, 0, sizeof(framer_t));
+  framer->version = 1;
+}
+
+/// Release the buffer, which holds no message any more.
+static void framer_release(framer_t* framer) {
+  if (framer->allocator != NULL) {
+    framer->allocator->release(
+      framer->allocator->ctx, framer->buffer, framer->capacity
+    );
+  } else {
+    free(framer->buffer);
+  }
+
+  framer->buffer = NULL;
+  framer->capacity = 0;
+  framer->len = 0;
+}
+
+void framer_free(framer_t* framer) {
+  framer_release(framer);
+  memset(framer, 0, sizeof(framer_t));
+}
+
+void framer_feed(framer_t* framer, const uint8_t* data, uint32_t len) {
+  framer->input = data;
+  framer->input_len = len;
+}
+
+/// Make room for `size` bytes in the buffer.
+static int framer_reserve(framer_t* framer, uint32_t size) {
+  if (size <= framer->capacity) {
+    return 0;
+  }
+
+  uint32_t capacity = framer->capacity > 0 ? framer->capacity : 64;
+  while (capacity < size) {
+    capacity *= 2;
+  }
+
+  uint8_t* buffer;
+
+  if (framer->allocator != NULL) {
+    const framer_allocator_t* allocator = framer->allocator;
+
+    buffer = allocator->acquire(allocator->ctx, capacity, &capacity);
+    if (buffer == NULL) {
+      return -1;
+    }
+
+    if (framer->len > 0) {
+      memcpy(buffer, framer->buffer, framer->len);
+    }
+    allocator->release(allocator->ctx, framer->buffer, framer->capacity);
+  } else {
+    buffer = (uint8_t*)realloc(framer->buffer, capacity);
+    if (buffer == NULL) {
+      return -1;
+    }
+  }
+
+  framer->buffer = buffer;
+  framer->capacity = capacity;
+
+  return 0;
+}
+
+/// Move up to `len` fed bytes into the buffer.
+static void framer_take(framer_t* framer, uint32_t len) {
+  if (len > framer->input_len) {
+    len = framer->input_len;
+  }
+
+  memcpy(framer->buffer + framer->len, framer->input, len);
+  framer->len += len;
+  framer->input += len;
+  framer->input_len -= len;
+}
+
+/// Get the length of the frame at the start of `avail` bytes.
+///
+/// Returns 1 with the length, 0 if more bytes are needed to tell, or -1 if
+/// the length is not acceptable.
+static int framer_length(
+  framer_t* framer,
+  const uint8_t* data,
+  uint32_t avail,
+  uint32_t* length
+) {
+  if (framer->version == 2) {
+    return protocol_v2_frame_length(data, avail, length);
+  }
+
+  if (avail < sizeof(message_header_t)) {
+    return 0;
+  }
+
+  memcpy(length, data + offsetof(message_header_t, length), sizeof(uint32_t));
+
+  if (*length < sizeof(message_header_t) || *length > PROTOCOL_BUFFER_SIZE) {
+    return -1;
+  }
+
+  return 1;
+}
+
+int framer_next(framer_t* framer, uint8_t** frame, uint32_t* len) {
+  // the split frame has been handled, drop it and its memory
+  if (framer->handed_out) {
+    framer_release(framer);
+    framer->handed_out = 0;
+  }
+
+  uint32_t length;
+  int known;
+
+  if (framer->len == 0) {
+    if (framer->input_len == 0) {
+      return 0;
+    }
+
+    // the frame is complete in the fed bytes, hand it out in place
+    known = framer_length(framer, framer->input, framer->input_len, &length);
+
+    if (known < 0) {
+      return -1;
+    }
+
+    if (known > 0 && length <= framer->input_len) {
+      *frame = (uint8_t*)framer->input;
+      *len = length;
+      framer->input += length;
+      framer->input_len -= length;
+      return 1;
+    }
+  }
+
+  // the frame is split, gather its header in the buffer byte by byte until
+  // the length is known.
+  while ((known = framer_length(framer, framer->buffer, framer->len, &length)
+         ) == 0) {
+    if (framer->input_len == 0) {
+      return 0;
+    }
+
+    if (framer_reserve(framer, framer->len + 1) != 0) {
+      return -1;
+    }
+
+    framer_take(framer, 1);
+  }
+
+  if (known < 0 || framer_reserve(framer, length) != 0) {
+    return -1;
+  }
+
+  framer_take(framer, length - framer->len);
+
+  if (framer->len < length) {
+    return 0;
+  }
+
+  *frame = framer->buffer;
+  *len = length;
+  framer->handed_out = 1;
+
+  return 1;
+}
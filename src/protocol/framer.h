@@ -0,0 +1,77 @@
+#ifndef PROTOCOL_FRAMER_H_
+#define PROTOCOL_FRAMER_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+#include "protocol/protocol.h"
+
+/// Where a framer takes the buffers of the split messages from.
+typedef struct {
+  /// Get a buffer of at least `size` bytes and set its capacity, or return
+  /// null if the memory is exhausted.
+  uint8_t* (*acquire)(void* ctx, uint32_t size, uint32_t* capacity);
+  /// Give back a buffer of the capacity set by `acquire`.
+  void (*release)(void* ctx, uint8_t* buffer, uint32_t capacity);
+  /// Passed to the functions
+  void* ctx;
+} framer_allocator_t;
+
+/// Reassembles the messages of a byte stream.
+///
+/// The bytes received from the stream are fed into the framer, which then
+/// hands out the complete messages one by one. A message entirely contained
+/// in the fed bytes is handed out in place, without copying. Only the bytes
+/// of a message split across reads are copied into the framer, which keeps
+/// them until the rest of the message arrives.
+///
+/// The framer holds no memory while no message is split. It reads the
+/// frames of the wire format of its version, which may change between two
+/// messages.
+typedef struct {
+  /// The version of the wire format, 1 or 2
+  uint32_t version;
+  /// The bytes of the split message
+  uint8_t* buffer;
+  /// The capacity of the buffer
+  uint32_t capacity;
+  /// Number of bytes held in the buffer
+  uint32_t len;
+  /// Whether the message in the buffer has been handed out
+  uint32_t handed_out;
+  /// The fed bytes not consumed yet
+  const uint8_t* input;
+  /// Number of the fed bytes not consumed yet
+  uint32_t input_len;
+  /// Where the buffer comes from, null for `malloc`. Set after
+  /// `framer_init`, while the framer holds no buffer.
+  const framer_allocator_t* allocator;
+} framer_t;
+
+/// Initialize the framer, reading version 1 frames.
+void framer_init(framer_t* framer);
+
+/// Release the memory held by the framer.
+void framer_free(framer_t* framer);
+
+/// Feed bytes received from the stream.
+///
+/// The bytes must stay valid until `framer_next` returns 0 or -1.
+void framer_feed(framer_t* framer, const uint8_t* data, uint32_t len);
+
+/// Get the next complete frame.
+///
+/// Returns 1 and points `frame` to the frame of `len` bytes, which stays
+/// valid until the next call. A version 1 frame is the message itself.
+/// Returns 0 when the fed bytes are used up, the bytes of an incomplete
+/// frame are kept. Returns -1 if the stream is corrupted.
+int framer_next(framer_t* framer, uint8_t** frame, uint32_t* len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // PROTOCOL_FRAMER_H_
@@ -10,6 +10,23 @@ length_t protocol_wrap_msg_connect(ident_t ident, uint8_t buffer[]) {
   return 12;
 }
 
+length_t protocol_wrap_msg_connect_version(
+  ident_t ident,
+  uint32_t version,
+  uint32_t features,
+  uint8_t buffer[]
+) {
+  msg_conn_version_t msg = {
+    .header = {.type = MSG_CONNECT, .length = 20},
+    .ident = ident,
+    .version = version,
+    .features = features};
+
+  memcpy(buffer, &msg, sizeof(msg_conn_version_t));
+
+  return 20;
+}
+
 length_t protocol_wrap_msg_disconnect(ident_t ident, uint8_t buffer[]) {
   msg_conn_t msg = {
     .header = {.type = MSG_DISCONNECT, .length = 12}, .ident = ident};
@@ -26,6 +43,20 @@ length_t protocol_wrap_msg_send(
   length_t data_len,
   uint8_t data[],
   uint8_t buffer[]
+) {
+  length_t header_len =
+    protocol_wrap_msg_send_header(src, dst, format, data_len, buffer);
+  memcpy(buffer + header_len, data, data_len);
+
+  return header_len + data_len;
+}
+
+length_t protocol_wrap_msg_send_header(
+  ident_t src,
+  ident_t dst,
+  format_t format,
+  length_t data_len,
+  uint8_t buffer[]
 ) {
   msg_send_t msg = {
     .header = {.type = MSG_SEND, .length = (size_t)(20 + data_len)},
@@ -34,9 +65,8 @@ length_t protocol_wrap_msg_send(
     .format = format};
 
   memcpy(buffer, &msg, sizeof(msg_send_t));
-  memcpy(buffer + sizeof(msg_send_t), data, data_len);
 
-  return 20 + data_len;
+  return sizeof(msg_send_t);
 }
 
 length_t protocol_wrap_msg_join(ident_t src, ident_t dst, uint8_t buffer[]) {
@@ -63,4 +93,200 @@ length_t protocol_wrap_msg_reply(reply_code_t code, uint8_t buffer[]) {
   memcpy(buffer, &msg, sizeof(msg_reply_t));
 
   return 12;
-}
\ No newline at end of file
+}
+
+length_t protocol_wrap_msg_request(
+  request_id_t id,
+  length_t message_len,
+  uint8_t buffer[]
+) {
+  msg_request_t msg = {
+    .header = {.type = MSG_REQUEST, .length = 12 + message_len}, .id = id};
+
+  memcpy(buffer, &msg, sizeof(msg_request_t));
+
+  return 12 + message_len;
+}
+
+length_t protocol_wrap_msg_reply_id(
+  request_id_t id,
+  reply_code_t code,
+  uint8_t buffer[]
+) {
+  msg_reply_id_t msg = {
+    .header = {.type = MSG_REPLY_ID, .length = 16}, .id = id, .code = code};
+
+  memcpy(buffer, &msg, sizeof(msg_reply_id_t));
+
+  return 16;
+}
+
+length_t protocol_wrap_msg_bundle(
+  request_id_t id,
+  uint32_t count,
+  length_t messages_len,
+  uint8_t buffer[]
+) {
+  msg_bundle_t msg = {
+    .header = {.type = MSG_BUNDLE, .length = 16 + messages_len},
+    .id = id,
+    .count = count};
+
+  memcpy(buffer, &msg, sizeof(msg_bundle_t));
+
+  return 16 + messages_len;
+}
+
+length_t protocol_wrap_msg_reply_bundle(
+  request_id_t id,
+  uint32_t count,
+  const uint8_t codes[],
+  uint8_t buffer[]
+) {
+  msg_reply_bundle_t msg = {
+    .header = {.type = MSG_REPLY_BUNDLE, .length = 16 + count},
+    .id = id,
+    .count = count};
+
+  memcpy(buffer, &msg, sizeof(msg_reply_bundle_t));
+  memcpy(buffer + sizeof(msg_reply_bundle_t), codes, count);
+
+  return 16 + count;
+}
+
+length_t protocol_wrap_msg_version(
+  uint32_t version,
+  uint32_t features,
+  uint8_t buffer[]
+) {
+  msg_version_t msg = {
+    .header = {.type = MSG_VERSION, .length = 16},
+    .version = version,
+    .features = features};
+
+  memcpy(buffer, &msg, sizeof(msg_version_t));
+
+  return 16;
+}
+
+length_t protocol_wrap_msg_stats(
+  length_t text_len,
+  const uint8_t text[],
+  uint8_t buffer[]
+) {
+  message_header_t header = {
+    .type = MSG_STATS, .length = (uint32_t)(8 + text_len)};
+
+  memcpy(buffer, &header, sizeof(message_header_t));
+  if (text_len > 0) {
+    memcpy(buffer + sizeof(message_header_t), text, text_len);
+  }
+
+  return 8 + text_len;
+}
+
+length_t protocol_wrap_msg_history(
+  ident_t room,
+  uint32_t from,
+  uint32_t count,
+  uint8_t buffer[]
+) {
+  msg_history_t msg = {
+    .header = {.type = MSG_HISTORY, .length = 20},
+    .room = room,
+    .from = from,
+    .count = count};
+
+  memcpy(buffer, &msg, sizeof(msg_history_t));
+
+  return 20;
+}
+
+length_t protocol_wrap_msg_stream_start(
+  ident_t src,
+  ident_t dst,
+  format_t format,
+  uint32_t id,
+  uint32_t size,
+  length_t name_len,
+  const uint8_t name[],
+  uint8_t buffer[]
+) {
+  msg_stream_start_t msg = {
+    .header =
+      {.type = MSG_STREAM_START,
+       .length = (uint32_t)(sizeof(msg_stream_start_t) + name_len)},
+    .src = src,
+    .dst = dst,
+    .format = format,
+    .id = id,
+    .size = size};
+
+  memcpy(buffer, &msg, sizeof(msg_stream_start_t));
+  if (name_len > 0) {
+    memcpy(buffer + sizeof(msg_stream_start_t), name, name_len);
+  }
+
+  return sizeof(msg_stream_start_t) + name_len;
+}
+
+length_t protocol_wrap_msg_stream_chunk_header(
+  ident_t src,
+  uint32_t id,
+  length_t data_len,
+  uint8_t buffer[]
+) {
+  msg_stream_chunk_t msg = {
+    .header =
+      {.type = MSG_STREAM_CHUNK,
+       .length = (uint32_t)(sizeof(msg_stream_chunk_t) + data_len)},
+    .src = src,
+    .id = id};
+
+  memcpy(buffer, &msg, sizeof(msg_stream_chunk_t));
+
+  return sizeof(msg_stream_chunk_t);
+}
+
+length_t protocol_wrap_msg_stream_end(
+  ident_t src,
+  uint32_t id,
+  reply_code_t code,
+  uint8_t buffer[]
+) {
+  msg_stream_end_t msg = {
+    .header = {.type = MSG_STREAM_END, .length = 20},
+    .src = src,
+    .id = id,
+    .code = code};
+
+  memcpy(buffer, &msg, sizeof(msg_stream_end_t));
+
+  return 20;
+}
+
+length_t protocol_wrap_msg_stream_ack(
+  ident_t src,
+  uint32_t id,
+  uint32_t bytes,
+  uint8_t buffer[]
+) {
+  msg_stream_ack_t msg = {
+    .header = {.type = MSG_STREAM_ACK, .length = 20},
+    .src = src,
+    .id = id,
+    .bytes = bytes};
+
+  memcpy(buffer, &msg, sizeof(msg_stream_ack_t));
+
+  return 20;
+}
+
+length_t protocol_wrap_msg_ping(int pong, uint8_t buffer[]) {
+  message_header_t header = {
+    .type = pong ? MSG_PONG : MSG_PING, .length = 8};
+
+  memcpy(buffer, &header, sizeof(message_header_t));
+
+  return 8;
+}
@@ -9,6 +9,18 @@ extern "C" {
 
 #define PROTOCOL_BUFFER_SIZE 65535
 
+/// Bytes of data a `MSG_STREAM_CHUNK` carries at most.
+#define STREAM_CHUNK_SIZE (60 << 10)
+/// Bytes of a stream the sender keeps sent and not acknowledged at most.
+#define STREAM_WINDOW (1 << 20)
+/// Bytes of the name of a stream at most.
+#define STREAM_NAME_MAX 255
+
+/// The highest version of the wire format, see `protocol/protocol_v2.h`.
+#define PROTOCOL_VERSION 2
+/// The features supported, a mask of `protocol_feature_t`.
+#define PROTOCOL_FEATURES FEATURE_LZ
+
 /// Message type, 4 bytes
 typedef enum {
   /// This message should be ignored.
@@ -26,6 +38,9 @@ typedef enum {
   /// +-+-+-+-+-+-+-+-+-+-+-+-+
   /// |  TYPE |  LEN  |  SRC  |
   /// +-+-+-+-+-+-+-+-+-+-+-+-+
+  /// Optionally followed by the highest version of the wire format and the
+  /// features the client speaks. The server answers a successful connect
+  /// offering them with a MSG_VERSION before the reply.
   MSG_CONNECT = 1,
   /// Disconnect from the server.
   ///
@@ -38,6 +53,8 @@ typedef enum {
   /// +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
   /// |  TYPE |  LEN  |  SRC  |  DST  | FORMAT| DATA ...  |
   /// +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+  /// Where format is a `data_format_t` telling how to read the data. The
+  /// server forwards the data as is, whatever the format.
   MSG_SEND = 3,
   /// Join a room.
   ///
@@ -55,6 +72,138 @@ typedef enum {
   MSG_LEAVE = 6,
   /// Server reply. length is 12 with a reply code.
   MSG_REPLY = 7,
+  /// A request tagged with an id chosen by the client.
+  ///
+  /// This message is sent by the client to the server, wrapping another
+  /// message. The server handles the inner message and answers it with a
+  /// single MSG_REPLY_ID carrying the same id instead of a MSG_REPLY, so the
+  /// client can keep many requests in flight and match the replies. An inner
+  /// message shorter than the fields of its type is answered
+  /// RPL_BAD_REQUEST.
+  /// The format is
+  /// +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+  /// |  TYPE |  LEN  |   ID  | MESSAGE ... |
+  /// +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+  MSG_REQUEST = 8,
+  /// Server reply to a MSG_REQUEST.
+  ///
+  /// The format is
+  /// +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+  /// |  TYPE |  LEN  |   ID  |  CODE |
+  /// +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+  MSG_REPLY_ID = 9,
+  /// Many messages submitted at once, a batch. The name `MSG_BATCH` is
+  /// taken by the socket flags of Linux.
+  ///
+  /// This message is sent by the client to the server, holding COUNT
+  /// messages back to back. The server handles them in order and answers
+  /// them all with a single MSG_REPLY_BUNDLE carrying the same id. Requests
+  /// and bundles cannot be nested in a bundle. A message shorter than the
+  /// fields of its type gets RPL_BAD_REQUEST and the ones after it are still
+  /// handled, a message overrunning the bundle fails it and the rest.
+  /// The format is
+  /// +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+  /// |  TYPE |  LEN  |   ID  | COUNT | MESSAGE ... |
+  /// +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+  MSG_BUNDLE = 10,
+  /// Server reply to a MSG_BUNDLE, one byte of reply code per message.
+  ///
+  /// The format is
+  /// +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+  /// |  TYPE |  LEN  |   ID  | COUNT | CODE ... |
+  /// +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+  MSG_REPLY_BUNDLE = 11,
+  /// The version of the wire format and the features agreed on at
+  /// MSG_CONNECT.
+  ///
+  /// This message is sent by the server to the client, still in the format
+  /// spoken before. Every later message is in the agreed format, both ways.
+  /// The format is
+  /// +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+  /// |  TYPE |  LEN  |VERSION|FEATURE|
+  /// +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+  MSG_VERSION = 12,
+  /// The metrics of the server.
+  ///
+  /// Sent empty by the client to the server, which answers with the same
+  /// type carrying the metrics in the text format of Prometheus. Wrapped in
+  /// a request, it is also answered with a MSG_REPLY_ID.
+  /// The format is
+  /// +-+-+-+-+-+-+-+-+-+-+-+-+-+
+  /// |  TYPE |  LEN  | TEXT ... |
+  /// +-+-+-+-+-+-+-+-+-+-+-+-+-+
+  MSG_STATS = 13,
+  /// The messages sent to a room, replayed from its history.
+  ///
+  /// Sent by the client to the server for COUNT messages of the room from
+  /// the sequence FROM on, or the last COUNT ones if FROM is 0. The messages
+  /// of a room are numbered from 1 in the order it forwarded them. The
+  /// server answers with the same type carrying the sequence of the first
+  /// message replayed and their number, followed by that many MSG_SEND
+  /// messages as they were forwarded, then a reply. The sequence is the one
+  /// of the next message when none is replayed. Only a connected member of
+  /// the room reads its history, the others are replied RPL_NOT_IN_ROOM
+  /// alone. A room without history is replied RPL_ROOM_NOT_FOUND alone.
+  /// The format is
+  /// +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+  /// |  TYPE |  LEN  |  ROOM |  FROM | COUNT |
+  /// +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+  MSG_HISTORY = 14,
+  /// The start of a stream to a client, for data larger than a message.
+  ///
+  /// Sent by the client to the server, which forwards it to DST as is and
+  /// replies. The data follows in MSG_STREAM_CHUNK messages of the same ID,
+  /// chosen by the client, and a MSG_STREAM_END closes the stream. SIZE is
+  /// the number of bytes of the data, 0 if not known in advance, and the
+  /// optional NAME tells the receiver what the data is, e.g. the name of a
+  /// file. SRC must be the client, and DST a client: a room is replied
+  /// RPL_DST_NOT_FOUND.
+  /// The format is
+  /// +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+  /// |  TYPE |  LEN  |  SRC  |  DST  | FORMAT|   ID  |  SIZE | NAME ... |
+  /// +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+  MSG_STREAM_START = 15,
+  /// A chunk of the data of a stream, of `STREAM_CHUNK_SIZE` bytes at most.
+  ///
+  /// Sent by the client to the server, which forwards it to the receiver of
+  /// the stream without a reply. The sender keeps at most `STREAM_WINDOW`
+  /// bytes sent and not acknowledged by a MSG_STREAM_ACK, the server ends a
+  /// stream going over it.
+  /// The format is
+  /// +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+  /// |  TYPE |  LEN  |  SRC  |   ID  | DATA ... |
+  /// +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+  MSG_STREAM_CHUNK = 16,
+  /// The end of a stream, RPL_OK once all the data has been sent.
+  ///
+  /// Sent by the client to the server, which forwards it to the receiver and
+  /// replies. Sent by the server to the sender with RPL_DST_NOT_FOUND when
+  /// the receiver has left, and to both with RPL_SEND_FAILED when the sender
+  /// has left or gone over the window or the size.
+  /// The format is
+  /// +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+  /// |  TYPE |  LEN  |  SRC  |   ID  |  CODE |
+  /// +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+  MSG_STREAM_END = 17,
+  /// The bytes of a stream consumed by the receiver, opening the window of
+  /// the sender by as many.
+  ///
+  /// Sent by the receiver of the stream from SRC to the server, which
+  /// forwards it to the sender without a reply.
+  /// The format is
+  /// +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+  /// |  TYPE |  LEN  |  SRC  |   ID  | BYTES |
+  /// +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+  MSG_STREAM_ACK = 18,
+  /// Whether the peer is still there.
+  ///
+  /// Sent by the server to a client silent for a while, and by a client to
+  /// a server silent for a while. The peer answers with a MSG_PONG, which
+  /// like any other message shows it is alive. The length of the message is
+  /// 8.
+  MSG_PING = 19,
+  /// The answer to a MSG_PING. The length of the message is 8.
+  MSG_PONG = 20,
 } message_type_t;
 
 /// Reply code from the server
@@ -65,7 +214,8 @@ typedef enum {
   RPL_OK,
   /// Error
   RPL_SEND_FAILED,
-  /// The ID of a `CONNECT` message has been used.
+  /// The ID of a `CONNECT` message has been used, or the connection is
+  /// connected already.
   RPL_DUPLICATED_ID,
   /// The `DST` of a `SEND` message is not found.
   RPL_DST_NOT_FOUND,
@@ -77,8 +227,35 @@ typedef enum {
   RPL_ROOM_CONFLICT,
   /// The server rejected the client.
   RPL_REJECTED,
+  /// The message wrapped by a `REQUEST` is malformed or unknown.
+  RPL_BAD_REQUEST,
+  /// The `DST` of a `SEND` message is not connected, the message is queued
+  /// until it connects.
+  RPL_QUEUED,
+  /// The `DST` of a `SEND` message is not connected and its queue is full.
+  RPL_QUEUE_FULL,
+  /// Messages to the client have been dropped, it did not read them fast
+  /// enough. Sent by the server once the client has caught up.
+  RPL_DROPPED,
 } reply_code_t;
 
+/// Format of the data of a `SEND` message
+typedef enum {
+  /// Text encoded in UTF-8, without a terminating null
+  FMT_UTF8 = 0,
+  /// Bytes to be handled by the application
+  FMT_BINARY = 1,
+  /// Data of another format compressed, see `protocol/compress.h`. Only
+  /// sent to the clients supporting `FEATURE_LZ`.
+  FMT_LZ = 2,
+} data_format_t;
+
+/// Optional features agreed on at `MSG_CONNECT`, a bit each
+typedef enum {
+  /// The client reads `FMT_LZ` data, the server forwards it as is
+  FEATURE_LZ = 1,
+} protocol_feature_t;
+
 /// Message header, 8 bytes
 typedef struct {
   /// Message type
@@ -97,6 +274,18 @@ typedef struct {
   ident_t ident;
 } msg_conn_t;
 
+/// Connect to the server, offering a version of the wire format.
+typedef struct {
+  /// Header
+  message_header_t header;
+  /// User id
+  ident_t ident;
+  /// The highest version spoken by the client
+  uint32_t version;
+  /// The features supported by the client
+  uint32_t features;
+} msg_conn_version_t;
+
 /// Send a message to the server.
 typedef struct {
   /// Header
@@ -127,11 +316,131 @@ typedef struct {
   reply_code_t code;
 } msg_reply_t;
 
+typedef uint32_t request_id_t;
+
+/// A request tagged with an id, followed by the wrapped message.
+typedef struct {
+  /// Header
+  message_header_t header;
+  /// Request id
+  request_id_t id;
+} msg_request_t;
+
+/// Server reply to a request.
+typedef struct {
+  /// Header
+  message_header_t header;
+  /// Id of the request replied to
+  request_id_t id;
+  /// Reply code
+  reply_code_t code;
+} msg_reply_id_t;
+
+/// Many messages submitted at once, followed by the messages.
+typedef struct {
+  /// Header
+  message_header_t header;
+  /// Request id
+  request_id_t id;
+  /// Number of messages
+  uint32_t count;
+} msg_bundle_t;
+
+/// Server reply to a bundle, followed by a byte of reply code per message.
+typedef struct {
+  /// Header
+  message_header_t header;
+  /// Id of the bundle replied to
+  request_id_t id;
+  /// Number of reply codes
+  uint32_t count;
+} msg_reply_bundle_t;
+
+/// The version of the wire format agreed on.
+typedef struct {
+  /// Header
+  message_header_t header;
+  /// The version
+  uint32_t version;
+  /// The features supported by both sides
+  uint32_t features;
+} msg_version_t;
+
+/// The messages of a room replayed from its history, asked by the client or
+/// followed by the messages from the server.
+typedef struct {
+  /// Header
+  message_header_t header;
+  /// Room id
+  ident_t room;
+  /// The sequence of the first message
+  uint32_t from;
+  /// Number of messages
+  uint32_t count;
+} msg_history_t;
+
+/// The start of a stream, followed by its name.
+typedef struct {
+  /// Header
+  message_header_t header;
+  /// Sender
+  ident_t src;
+  /// Receiver
+  ident_t dst;
+  /// Format of the data, a `data_format_t`
+  uint32_t format;
+  /// The id of the stream, chosen by the sender
+  uint32_t id;
+  /// Number of bytes of the data, 0 if not known
+  uint32_t size;
+} msg_stream_start_t;
+
+/// A chunk of the data of a stream, followed by the data.
+typedef struct {
+  /// Header
+  message_header_t header;
+  /// Sender of the stream
+  ident_t src;
+  /// The id of the stream
+  uint32_t id;
+} msg_stream_chunk_t;
+
+/// The end of a stream.
+typedef struct {
+  /// Header
+  message_header_t header;
+  /// Sender of the stream
+  ident_t src;
+  /// The id of the stream
+  uint32_t id;
+  /// `RPL_OK` if all the data has been sent
+  reply_code_t code;
+} msg_stream_end_t;
+
+/// The bytes of a stream consumed by the receiver.
+typedef struct {
+  /// Header
+  message_header_t header;
+  /// Sender of the stream
+  ident_t src;
+  /// The id of the stream
+  uint32_t id;
+  /// Number of bytes consumed since the last one
+  uint32_t bytes;
+} msg_stream_ack_t;
+
 typedef int length_t;
 typedef uint32_t format_t;
 
 /// Wrap a connect message into a buffer.
 length_t protocol_wrap_msg_connect(ident_t ident, uint8_t buffer[]);
+/// Wrap a connect message offering the version and features into a buffer.
+length_t protocol_wrap_msg_connect_version(
+  ident_t ident,
+  uint32_t version,
+  uint32_t features,
+  uint8_t buffer[]
+);
 /// Wrap a disconnect message into a buffer.
 length_t protocol_wrap_msg_disconnect(ident_t ident, uint8_t buffer[]);
 /// Wrap a send message into a buffer.
@@ -143,12 +452,109 @@ length_t protocol_wrap_msg_send(
   uint8_t data[],
   uint8_t buffer[]
 );
+/// Wrap the header of a send message of `data_len` bytes of data into a
+/// buffer, without the data.
+///
+/// The data goes on the wire right after the header, from where the caller
+/// keeps it, e.g. as the second buffer of a `writev`. Returns the length of
+/// the header, `sizeof(msg_send_t)`.
+length_t protocol_wrap_msg_send_header(
+  ident_t src,
+  ident_t dst,
+  format_t format,
+  length_t data_len,
+  uint8_t buffer[]
+);
 /// Wrap a join message into a buffer.
 length_t protocol_wrap_msg_join(ident_t src, ident_t dst, uint8_t buffer[]);
 /// Wrap a leave message into a buffer.
 length_t protocol_wrap_msg_leave(ident_t src, ident_t dst, uint8_t buffer[]);
 /// Wrap a reply message into a buffer.
 length_t protocol_wrap_msg_reply(reply_code_t code, uint8_t buffer[]);
+/// Wrap a request around the message of `message_len` bytes already wrapped
+/// at `buffer + sizeof(msg_request_t)`.
+length_t protocol_wrap_msg_request(
+  request_id_t id,
+  length_t message_len,
+  uint8_t buffer[]
+);
+/// Wrap a reply to a request into a buffer.
+length_t protocol_wrap_msg_reply_id(
+  request_id_t id,
+  reply_code_t code,
+  uint8_t buffer[]
+);
+/// Wrap a bundle around the `count` messages of `messages_len` bytes already
+/// wrapped back to back at `buffer + sizeof(msg_bundle_t)`.
+length_t protocol_wrap_msg_bundle(
+  request_id_t id,
+  uint32_t count,
+  length_t messages_len,
+  uint8_t buffer[]
+);
+/// Wrap a reply to a bundle with `count` reply codes into a buffer.
+length_t protocol_wrap_msg_reply_bundle(
+  request_id_t id,
+  uint32_t count,
+  const uint8_t codes[],
+  uint8_t buffer[]
+);
+/// Wrap a version message into a buffer.
+length_t protocol_wrap_msg_version(
+  uint32_t version,
+  uint32_t features,
+  uint8_t buffer[]
+);
+/// Wrap a stats message with `text_len` bytes of text into a buffer, the
+/// request of the client has none.
+length_t protocol_wrap_msg_stats(
+  length_t text_len,
+  const uint8_t text[],
+  uint8_t buffer[]
+);
+/// Wrap a history message into a buffer.
+length_t protocol_wrap_msg_history(
+  ident_t room,
+  uint32_t from,
+  uint32_t count,
+  uint8_t buffer[]
+);
+/// Wrap the start of a stream with a name of `name_len` bytes into a
+/// buffer.
+length_t protocol_wrap_msg_stream_start(
+  ident_t src,
+  ident_t dst,
+  format_t format,
+  uint32_t id,
+  uint32_t size,
+  length_t name_len,
+  const uint8_t name[],
+  uint8_t buffer[]
+);
+/// Wrap the header of a chunk of `data_len` bytes of data into a buffer,
+/// without the data, like `protocol_wrap_msg_send_header`.
+length_t protocol_wrap_msg_stream_chunk_header(
+  ident_t src,
+  uint32_t id,
+  length_t data_len,
+  uint8_t buffer[]
+);
+/// Wrap the end of a stream into a buffer.
+length_t protocol_wrap_msg_stream_end(
+  ident_t src,
+  uint32_t id,
+  reply_code_t code,
+  uint8_t buffer[]
+);
+/// Wrap the acknowledgement of `bytes` of a stream into a buffer.
+length_t protocol_wrap_msg_stream_ack(
+  ident_t src,
+  uint32_t id,
+  uint32_t bytes,
+  uint8_t buffer[]
+);
+/// Wrap a ping, or a pong if `pong`, into a buffer.
+length_t protocol_wrap_msg_ping(int pong, uint8_t buffer[]);
 
 #ifdef __cplusplus
 }
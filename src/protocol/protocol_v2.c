@@ -0,0 +1,529 @@
+#include "protocol/protocol_v2.h"
+#include "string.h"
+
+/// Maximum number of bytes of the varint length of a body, enough for
+/// `PROTOCOL_BUFFER_SIZE`.
+#define V2_LENGTH_BYTES 3
+
+/// Write the varint, returns the number of bytes written.
+static uint32_t put_varint(uint8_t* out, uint32_t value) {
+  uint32_t n = 0;
+
+  while (value >= 0x80) {
+    out[n++] = (uint8_t)(value | 0x80);
+    value >>= 7;
+  }
+  out[n++] = (uint8_t)value;
+
+  return n;
+}
+
+/// Read a varint from the bytes up to `end`.
+///
+/// Returns the number of bytes read, 0 if the bytes end in the middle of the
+/// varint, or -1 if it does not fit in 32 bits.
+static int get_varint(const uint8_t* p, const uint8_t* end, uint32_t* value) {
+  uint32_t result = 0;
+
+  for (int i = 0; i < 5; i++) {
+    if (p + i >= end) {
+      return 0;
+    }
+
+    uint8_t byte = p[i];
+    if (i == 4 && byte > 0x0f) {
+      return -1;
+    }
+
+    result |= (uint32_t)(byte & 0x7f) << (7 * i);
+
+    if (!(byte & 0x80)) {
+      *value = result;
+      return i + 1;
+    }
+  }
+
+  return -1;
+}
+
+/// Read a little-endian 32 bits field of a version 1 message.
+static uint32_t get_u32(const uint8_t* p) {
+  uint32_t value;
+  memcpy(&value, p, sizeof(value));
+  return value;
+}
+
+int protocol_v2_frame_length(
+  const uint8_t* data,
+  uint32_t avail,
+  uint32_t* length
+) {
+  if (avail < 1) {
+    return 0;
+  }
+
+  uint32_t header = avail < 1 + V2_LENGTH_BYTES ? avail : 1 + V2_LENGTH_BYTES;
+  uint32_t body;
+
+  int n = get_varint(data + 1, data + header, &body);
+
+  if (n == 0) {
+    // the length is incomplete, unless it already takes too many bytes
+    return avail >= 1 + V2_LENGTH_BYTES ? -1 : 0;
+  }
+
+  if (n < 0 || body > PROTOCOL_BUFFER_SIZE) {
+    return -1;
+  }
+
+  *length = 1 + n + body;
+
+  return 1;
+}
+
+/// Encode the message of at most `avail` bytes, see `protocol_v2_encode`.
+static length_t encode_frame(
+  const uint8_t* message,
+  uint32_t avail,
+  protocol_direction_t direction,
+  uint8_t* out
+) {
+  message_header_t header;
+
+  if (avail < sizeof(header)) {
+    return -1;
+  }
+
+  memcpy(&header, message, sizeof(header));
+
+  if (header.length < sizeof(header) || header.length > avail ||
+      (uint32_t)header.type > 0xff) {
+    return -1;
+  }
+
+  const uint8_t* p = message + sizeof(header);
+  uint32_t left = header.length - sizeof(header);
+
+  // the body is written behind room for the longest length, and moved
+  // against the actual length at the end.
+  uint8_t* body = out + 1 + V2_LENGTH_BYTES;
+  uint8_t* w = body;
+
+  switch (header.type) {
+    case MSG_NONE: {
+      break;
+    }
+    case MSG_CONNECT:
+    case MSG_DISCONNECT: {
+      if (left < 4) {
+        return -1;
+      }
+      w += put_varint(w, get_u32(p));
+      break;
+    }
+    case MSG_VERSION: {
+      if (left < 8) {
+        return -1;
+      }
+      w += put_varint(w, get_u32(p));
+      w += put_varint(w, get_u32(p + 4));
+      break;
+    }
+    case MSG_HISTORY: {
+      if (left < 12) {
+        return -1;
+      }
+      w += put_varint(w, get_u32(p));
+      w += put_varint(w, get_u32(p + 4));
+      w += put_varint(w, get_u32(p + 8));
+      break;
+    }
+    case MSG_SEND: {
+      if (left < 12) {
+        return -1;
+      }
+      if (direction == PROTOCOL_TO_CLIENT) {
+        w += put_varint(w, get_u32(p));
+      }
+      w += put_varint(w, get_u32(p + 4));
+      w += put_varint(w, get_u32(p + 8));
+      memcpy(w, p + 12, left - 12);
+      w += left - 12;
+      break;
+    }
+    case MSG_JOIN:
+    case MSG_LEAVE: {
+      if (left < 8) {
+        return -1;
+      }
+      if (direction == PROTOCOL_TO_CLIENT) {
+        w += put_varint(w, get_u32(p));
+      }
+      w += put_varint(w, get_u32(p + 4));
+      break;
+    }
+    case MSG_REPLY: {
+      if (left < 4) {
+        return -1;
+      }
+      *w++ = (uint8_t)get_u32(p);
+      break;
+    }
+    case MSG_REQUEST: {
+      if (left < 4) {
+        return -1;
+      }
+      w += put_varint(w, get_u32(p));
+
+      length_t inner = encode_frame(p + 4, left - 4, direction, w);
+      if (inner < 0) {
+        return -1;
+      }
+      w += inner;
+      break;
+    }
+    case MSG_REPLY_ID: {
+      if (left < 8) {
+        return -1;
+      }
+      w += put_varint(w, get_u32(p));
+      *w++ = (uint8_t)get_u32(p + 4);
+      break;
+    }
+    case MSG_BUNDLE: {
+      if (left < 8) {
+        return -1;
+      }
+      uint32_t count = get_u32(p + 4);
+      w += put_varint(w, get_u32(p));
+      w += put_varint(w, count);
+
+      const uint8_t* q = p + 8;
+      uint32_t rest = left - 8;
+
+      for (uint32_t i = 0; i < count; i++) {
+        length_t inner = encode_frame(q, rest, direction, w);
+        if (inner < 0) {
+          return -1;
+        }
+        w += inner;
+
+        // validated by the encoding of the inner message
+        uint32_t inner_len = get_u32(q + 4);
+        q += inner_len;
+        rest -= inner_len;
+      }
+      break;
+    }
+    case MSG_REPLY_BUNDLE: {
+      if (left < 8 || get_u32(p + 4) > left - 8) {
+        return -1;
+      }
+      uint32_t count = get_u32(p + 4);
+      w += put_varint(w, get_u32(p));
+      w += put_varint(w, count);
+      memcpy(w, p + 8, count);
+      w += count;
+      break;
+    }
+    default: {
+      memcpy(w, p, left);
+      w += left;
+      break;
+    }
+  }
+
+  uint32_t body_len = (uint32_t)(w - body);
+  if (body_len > PROTOCOL_BUFFER_SIZE) {
+    return -1;
+  }
+
+  out[0] = (uint8_t)header.type;
+  uint32_t n = put_varint(out + 1, body_len);
+  memmove(out + 1 + n, body, body_len);
+
+  return 1 + n + body_len;
+}
+
+length_t protocol_v2_encode(
+  const uint8_t message[],
+  protocol_direction_t direction,
+  uint8_t out[]
+) {
+  message_header_t header;
+  memcpy(&header, message, sizeof(header));
+
+  return encode_frame(message, header.length, direction, out);
+}
+
+/// Write the type and the length of a body of `body_len` bytes, followed by
+/// the first `len` bytes of it. Returns the length written.
+static length_t put_header(
+  message_type_t type,
+  uint32_t body_len,
+  const uint8_t* fields,
+  uint32_t len,
+  uint8_t* out
+) {
+  if (body_len > PROTOCOL_BUFFER_SIZE) {
+    return -1;
+  }
+
+  out[0] = (uint8_t)type;
+  uint32_t n = put_varint(out + 1, body_len);
+  memcpy(out + 1 + n, fields, len);
+
+  return 1 + n + len;
+}
+
+length_t protocol_v2_encode_send_header(
+  ident_t src,
+  ident_t dst,
+  format_t format,
+  uint32_t data_len,
+  protocol_direction_t direction,
+  uint8_t out[]
+) {
+  uint8_t fields[15];
+  uint32_t len = 0;
+
+  if (direction == PROTOCOL_TO_CLIENT) {
+    len += put_varint(fields + len, src);
+  }
+  len += put_varint(fields + len, dst);
+  len += put_varint(fields + len, format);
+
+  return put_header(MSG_SEND, len + data_len, fields, len, out);
+}
+
+length_t protocol_v2_encode_request_header(
+  request_id_t id,
+  uint32_t frame_len,
+  uint8_t out[]
+) {
+  uint8_t fields[5];
+  uint32_t len = put_varint(fields, id);
+
+  return put_header(MSG_REQUEST, len + frame_len, fields, len, out);
+}
+
+length_t protocol_v2_encode_header(
+  message_type_t type,
+  uint32_t body_len,
+  uint8_t out[]
+) {
+  if (body_len > PROTOCOL_BUFFER_SIZE) {
+    return -1;
+  }
+
+  out[0] = (uint8_t)type;
+
+  return 1 + put_varint(out + 1, body_len);
+}
+
+/// Append the 32 bits field to the message being decoded, if it fits.
+#define PUT_U32(value)                                \
+  do {                                                \
+    uint32_t v = (value);                             \
+    if ((uint32_t)(w - out) + 4 > capacity) {         \
+      return -1;                                      \
+    }                                                 \
+    memcpy(w, &v, 4);                                 \
+    w += 4;                                           \
+  } while (0)
+
+/// Read a varint of the body into `var`, failing on a truncated one.
+#define GET_VARINT(var)                               \
+  do {                                                \
+    int n = get_varint(p, end, &(var));               \
+    if (n <= 0) {                                     \
+      return -1;                                      \
+    }                                                 \
+    p += n;                                           \
+  } while (0)
+
+length_t protocol_v2_decode(
+  const uint8_t frame[],
+  uint32_t len,
+  protocol_direction_t direction,
+  ident_t src,
+  uint8_t out[],
+  uint32_t capacity
+) {
+  uint32_t frame_len;
+  if (protocol_v2_frame_length(frame, len, &frame_len) != 1 ||
+      frame_len != len || capacity < sizeof(message_header_t)) {
+    return -1;
+  }
+
+  uint8_t type = frame[0];
+  const uint8_t* end = frame + len;
+  const uint8_t* p = frame + 1;
+
+  // skip the length, already checked against `len`
+  while (*p & 0x80) {
+    p++;
+  }
+  p++;
+
+  uint8_t* w = out + sizeof(message_header_t);
+  uint32_t a, b, c;
+
+  switch (type) {
+    case MSG_NONE: {
+      break;
+    }
+    case MSG_CONNECT:
+    case MSG_DISCONNECT: {
+      GET_VARINT(a);
+      PUT_U32(a);
+      break;
+    }
+    case MSG_VERSION: {
+      GET_VARINT(a);
+      GET_VARINT(b);
+      PUT_U32(a);
+      PUT_U32(b);
+      break;
+    }
+    case MSG_HISTORY: {
+      GET_VARINT(a);
+      GET_VARINT(b);
+      GET_VARINT(c);
+      PUT_U32(a);
+      PUT_U32(b);
+      PUT_U32(c);
+      break;
+    }
+    case MSG_SEND: {
+      a = src;
+      if (direction == PROTOCOL_TO_CLIENT) {
+        GET_VARINT(a);
+      }
+      GET_VARINT(b);
+      GET_VARINT(c);
+      PUT_U32(a);
+      PUT_U32(b);
+      PUT_U32(c);
+
+      uint32_t data_len = (uint32_t)(end - p);
+      if ((uint32_t)(w - out) + data_len > capacity) {
+        return -1;
+      }
+      memcpy(w, p, data_len);
+      w += data_len;
+      p = end;
+      break;
+    }
+    case MSG_JOIN:
+    case MSG_LEAVE: {
+      a = src;
+      if (direction == PROTOCOL_TO_CLIENT) {
+        GET_VARINT(a);
+      }
+      GET_VARINT(b);
+      PUT_U32(a);
+      PUT_U32(b);
+      break;
+    }
+    case MSG_REPLY: {
+      if (p >= end) {
+        return -1;
+      }
+      PUT_U32(*p++);
+      break;
+    }
+    case MSG_REQUEST: {
+      GET_VARINT(a);
+      PUT_U32(a);
+
+      length_t inner = protocol_v2_decode(
+        p, (uint32_t)(end - p), direction, src, w,
+        capacity - (uint32_t)(w - out)
+      );
+      if (inner < 0) {
+        return -1;
+      }
+      w += inner;
+      p = end;
+      break;
+    }
+    case MSG_REPLY_ID: {
+      GET_VARINT(a);
+      if (p >= end) {
+        return -1;
+      }
+      PUT_U32(a);
+      PUT_U32(*p++);
+      break;
+    }
+    case MSG_BUNDLE: {
+      GET_VARINT(a);
+      GET_VARINT(b);
+
+      // every frame takes at least two bytes
+      if (b > (uint32_t)(end - p) / 2) {
+        return -1;
+      }
+
+      PUT_U32(a);
+      PUT_U32(b);
+
+      for (uint32_t i = 0; i < b; i++) {
+        uint32_t inner_len;
+        if (protocol_v2_frame_length(p, (uint32_t)(end - p), &inner_len) != 1 ||
+            inner_len > (uint32_t)(end - p)) {
+          return -1;
+        }
+
+        length_t inner = protocol_v2_decode(
+          p, inner_len, direction, src, w, capacity - (uint32_t)(w - out)
+        );
+        if (inner < 0) {
+          return -1;
+        }
+        w += inner;
+        p += inner_len;
+      }
+      break;
+    }
+    case MSG_REPLY_BUNDLE: {
+      GET_VARINT(a);
+      GET_VARINT(b);
+
+      if (b != (uint32_t)(end - p) ||
+          (uint32_t)(w - out) + 8 + b > capacity) {
+        return -1;
+      }
+
+      PUT_U32(a);
+      PUT_U32(b);
+      memcpy(w, p, b);
+      w += b;
+      p = end;
+      break;
+    }
+    default: {
+      uint32_t body_len = (uint32_t)(end - p);
+      if ((uint32_t)(w - out) + body_len > capacity) {
+        return -1;
+      }
+      memcpy(w, p, body_len);
+      w += body_len;
+      p = end;
+      break;
+    }
+  }
+
+  // the fields must fill the body exactly
+  if (p != end) {
+    return -1;
+  }
+
+  message_header_t header;
+  header.type = (message_type_t)type;
+  header.length = (uint32_t)(w - out);
+  memcpy(out, &header, sizeof(header));
+
+  return (length_t)header.length;
+}
@@ -0,0 +1,134 @@
+#ifndef PROTOCOL_PROTOCOL_V2_H_
+#define PROTOCOL_PROTOCOL_V2_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+#include "protocol/protocol.h"
+
+/// The compact wire format, version 2.
+///
+/// Every frame is a one byte type, the varint length of the body and the
+/// body. Varints are little-endian base 128, seven bits per byte with the
+/// high bit set on all bytes but the last. The messages are the same as in
+/// version 1, only encoded differently:
+///
+/// +------+-----+------------------------------------------+
+/// | TYPE | LEN | BODY                                     |
+/// +------+-----+------------------------------------------+
+///
+/// - `NONE`: empty.
+/// - `CONNECT`, `DISCONNECT`: the ident.
+/// - `SEND`: the destination, the format and the data. The source is implied
+///   by the connection towards the server and precedes the destination
+///   towards the client.
+/// - `JOIN`, `LEAVE`: the room, the source is implied like for `SEND`.
+/// - `REPLY`: the code in one byte.
+/// - `REQUEST`: the id and the wrapped frame.
+/// - `REPLY_ID`: the id and the code in one byte.
+/// - `BUNDLE`: the id, the count and the frames.
+/// - `REPLY_BUNDLE`: the id, the count and a byte of code per message.
+/// - `VERSION`: the version and the features.
+/// - `STATS`: the text, as is.
+/// - `HISTORY`: the room, the first sequence and the count. The messages
+///   replayed follow as frames of their own.
+/// - `STREAM_START`, `STREAM_CHUNK`, `STREAM_END`, `STREAM_ACK`: the fields
+///   of version 1 as is, the source included. The body of a chunk is its
+///   data behind a fixed header, as it is read from a file.
+/// - `PING`, `PONG`: empty.
+///
+/// Numbers are varints unless told otherwise. Version 2 is negotiated with
+/// `MSG_CONNECT` and the connection stays at version 1 until then.
+
+/// The direction of a frame, which decides whether the source is implied.
+typedef enum {
+  /// From the client to the server, the source is the client
+  PROTOCOL_TO_SERVER = 0,
+  /// From the server to the client, the source is on the wire
+  PROTOCOL_TO_CLIENT = 1,
+} protocol_direction_t;
+
+/// Upper bound of the length of the version 1 message decoded from a version
+/// 2 frame of `len` bytes.
+#define PROTOCOL_V2_DECODED_MAX(len) ((len) * 6 + 64)
+
+/// Get the length of the version 2 frame at the start of `avail` bytes.
+///
+/// Returns 1 and sets `length` to the length of the whole frame, 0 if more
+/// bytes are needed to tell, or -1 if the frame is invalid.
+int protocol_v2_frame_length(
+  const uint8_t* data,
+  uint32_t avail,
+  uint32_t* length
+);
+
+/// Encode the version 1 message into a version 2 frame.
+///
+/// The frame is never longer than the message. Returns the length of the
+/// frame, or -1 if the message is malformed.
+length_t protocol_v2_encode(
+  const uint8_t message[],
+  protocol_direction_t direction,
+  uint8_t out[]
+);
+
+/// Upper bound of the length of the headers written by
+/// `protocol_v2_encode_send_header` and `protocol_v2_encode_request_header`.
+#define PROTOCOL_V2_HEADER_MAX 20
+
+/// Encode the header of a `SEND` frame of `data_len` bytes of data, without
+/// the data.
+///
+/// The data follows the header on the wire, from where the caller keeps it.
+/// Returns the length of the header, or -1 if the frame would be too long.
+length_t protocol_v2_encode_send_header(
+  ident_t src,
+  ident_t dst,
+  format_t format,
+  uint32_t data_len,
+  protocol_direction_t direction,
+  uint8_t out[]
+);
+
+/// Encode the header of a `REQUEST` frame wrapping a frame of `frame_len`
+/// bytes, which follows it on the wire.
+///
+/// Returns the length of the header, or -1 if the frame would be too long.
+length_t protocol_v2_encode_request_header(
+  request_id_t id,
+  uint32_t frame_len,
+  uint8_t out[]
+);
+
+/// Encode the type and the length of a frame whose body of `body_len` bytes
+/// is the fields of version 1 as is, like the streams, without the body.
+///
+/// Returns the length of the header, or -1 if the frame would be too long.
+length_t protocol_v2_encode_header(
+  message_type_t type,
+  uint32_t body_len,
+  uint8_t out[]
+);
+
+/// Decode the version 2 frame of `len` bytes into a version 1 message.
+///
+/// `src` is the implied source of the frames towards the server. Returns the
+/// length of the message, or -1 if the frame is malformed or the message
+/// does not fit in `capacity` bytes.
+length_t protocol_v2_decode(
+  const uint8_t frame[],
+  uint32_t len,
+  protocol_direction_t direction,
+  ident_t src,
+  uint8_t out[],
+  uint32_t capacity
+);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // PROTOCOL_PROTOCOL_V2_H_
@@ -0,0 +1,361 @@
+#include "server/history.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <filesystem>
+#include <format>
+#include <map>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+MappedFile::~MappedFile() {
+  this->close();
+}
+
+int MappedFile::open(const std::string& path, size_t size) {
+#ifdef _WIN32
+  HANDLE file = CreateFileA(
+    path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL,
+    OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL
+  );
+  if (file == INVALID_HANDLE_VALUE) {
+    return 1;
+  }
+
+  // the mapping grows the file to its size
+  HANDLE mapping = CreateFileMappingA(
+    file, NULL, PAGE_READWRITE, (DWORD)((uint64_t)size >> 32),
+    (DWORD)(size & 0xffffffff), NULL
+  );
+  CloseHandle(file);
+  if (mapping == NULL) {
+    return 1;
+  }
+
+  void* data = MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, size);
+  if (data == NULL) {
+    CloseHandle(mapping);
+    return 1;
+  }
+
+  this->mapping = mapping;
+#else
+  int fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+  if (fd < 0) {
+    return 1;
+  }
+
+  // a hole, the pages are only allocated once written
+  struct stat st;
+  if (fstat(fd, &st) != 0 ||
+      ((size_t)st.st_size < size && ftruncate(fd, (off_t)size) != 0)) {
+    ::close(fd);
+    return 1;
+  }
+
+  void* data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if (data == MAP_FAILED) {
+    return 1;
+  }
+#endif
+
+  this->data = (uint8_t*)data;
+  this->size = size;
+
+  return 0;
+}
+
+void MappedFile::close() {
+  if (this->data == nullptr) {
+    return;
+  }
+
+#ifdef _WIN32
+  UnmapViewOfFile(this->data);
+  CloseHandle(this->mapping);
+  this->mapping = nullptr;
+#else
+  munmap(this->data, this->size);
+#endif
+
+  this->data = nullptr;
+  this->size = 0;
+}
+
+/// The path of a file of the segment, without the extension.
+static std::string history_segment_path(
+  const std::string& dir,
+  ident_t room,
+  uint32_t first
+) {
+  // padded so the segments of a room list in order
+  return std::format("{}/room-{}-{:010}", dir, room, first);
+}
+
+int History::open(const std::string& path) {
+  std::error_code error;
+  std::filesystem::create_directories(path, error);
+  if (error) {
+    return 1;
+  }
+
+  this->path = path;
+
+  // the segments left by the earlier runs, in order for every room
+  std::map<ident_t, std::vector<uint32_t>> found;
+
+  for (const auto& entry : std::filesystem::directory_iterator(path, error)) {
+    std::string name = entry.path().filename().string();
+    unsigned room;
+    unsigned first;
+    char ext[4] = {};
+
+    if (sscanf(name.c_str(), "room-%u-%u.%3s", &room, &first, ext) == 3 &&
+        strcmp(ext, "log") == 0 && first > 0) {
+      found[(ident_t)room].push_back((uint32_t)first);
+    }
+  }
+
+  if (error) {
+    return 1;
+  }
+
+  for (auto& [room, firsts] : found) {
+    std::sort(firsts.begin(), firsts.end());
+
+    RoomLog* log = this->log(room, true);
+
+    for (uint32_t first : firsts) {
+      // a segment not following the one before cannot be read in sequence,
+      // and would be in the way of the next one written
+      if (!log->segments.empty()) {
+        const HistorySegment& last = *log->segments.back();
+        if (first != last.first + last.count.load()) {
+          std::string stale = history_segment_path(path, room, first);
+          std::filesystem::remove(stale + ".log", error);
+          std::filesystem::remove(stale + ".idx", error);
+          continue;
+        }
+      }
+
+      std::shared_ptr<HistorySegment> segment =
+        this->open_segment(room, first);
+      if (segment == nullptr) {
+        return 1;
+      }
+
+      log->segments.push_back(std::move(segment));
+    }
+  }
+
+  return 0;
+}
+
+size_t History::room_count() {
+  std::shared_lock<std::shared_mutex> lock(this->mutex);
+  return this->rooms.size();
+}
+
+RoomLog* History::log(ident_t room, bool create) {
+  {
+    std::shared_lock<std::shared_mutex> lock(this->mutex);
+    auto it = this->rooms.find(room);
+    if (it != this->rooms.end()) {
+      return it->second.get();
+    }
+  }
+
+  if (!create) {
+    return nullptr;
+  }
+
+  std::unique_lock<std::shared_mutex> lock(this->mutex);
+  std::unique_ptr<RoomLog>& log = this->rooms[room];
+  if (log == nullptr) {
+    log = std::make_unique<RoomLog>();
+  }
+
+  return log.get();
+}
+
+std::shared_ptr<HistorySegment> History::open_segment(
+  ident_t room,
+  uint32_t first
+) {
+  auto segment = std::make_shared<HistorySegment>();
+  segment->first = first;
+
+  std::string path = history_segment_path(this->path, room, first);
+
+  if (segment->log.open(path + ".log", HISTORY_SEGMENT_SIZE) != 0 ||
+      segment->index.open(
+        path + ".idx", HISTORY_SEGMENT_MESSAGES * sizeof(uint32_t)
+      ) != 0) {
+    return nullptr;
+  }
+
+  // the offsets grow from the first message on, the rest of the index is
+  // zero. a message is only counted if its offset follows the one before
+  // and its header matches it.
+  const uint32_t* ends = segment->ends();
+  uint32_t count = 0;
+  uint32_t size = 0;
+
+  while (count < HISTORY_SEGMENT_MESSAGES) {
+    uint32_t end = ends[count];
+    if (end < size + sizeof(msg_send_t) || end > HISTORY_SEGMENT_SIZE) {
+      break;
+    }
+
+    message_header_t header;
+    memcpy(&header, segment->log.data + size, sizeof(header));
+    if (header.type != MSG_SEND || header.length != end - size) {
+      break;
+    }
+
+    size = end;
+    count++;
+  }
+
+  segment->size = size;
+  segment->count.store(count, std::memory_order_relaxed);
+
+  return segment;
+}
+
+uint32_t History::append(
+  ident_t room,
+  ident_t src,
+  format_t format,
+  const uint8_t* data,
+  uint32_t len
+) {
+  if (!this->enabled()) {
+    return 0;
+  }
+
+  RoomLog* log = this->log(room, true);
+
+  // only the owner of the room changes its segments, it reads them without
+  // the lock.
+  HistorySegment* segment =
+    log->segments.empty() ? nullptr : log->segments.back().get();
+  uint32_t length = (uint32_t)sizeof(msg_send_t) + len;
+  uint32_t count =
+    segment != nullptr ? segment->count.load(std::memory_order_relaxed) : 0;
+
+  if (segment == nullptr || segment->size + length > HISTORY_SEGMENT_SIZE ||
+      count == HISTORY_SEGMENT_MESSAGES) {
+    uint32_t first = segment != nullptr ? segment->first + count : 1;
+
+    // the sequences are 32 bits, a room stops being logged past them
+    if (first == 0) {
+      return 0;
+    }
+
+    std::shared_ptr<HistorySegment> next = this->open_segment(room, first);
+    if (next == nullptr) {
+      return 0;
+    }
+
+    segment = next.get();
+    count = segment->count.load(std::memory_order_relaxed);
+
+    std::lock_guard<std::mutex> lock(log->mutex);
+    log->segments.push_back(std::move(next));
+  }
+
+  uint8_t* at = segment->log.data + segment->size;
+  at += protocol_wrap_msg_send_header(src, room, format, (length_t)len, at);
+  memcpy(at, data, len);
+
+  // published once the bytes and the offset are written
+  segment->size += length;
+  segment->ends()[count] = segment->size;
+  segment->count.store(count + 1, std::memory_order_release);
+
+  return segment->first + count;
+}
+
+int History::read(
+  ident_t room,
+  uint32_t from,
+  uint32_t count,
+  HistoryRange* range
+) {
+  RoomLog* log = this->enabled() ? this->log(room, false) : nullptr;
+  if (log == nullptr) {
+    return 1;
+  }
+
+  range->runs.clear();
+  range->segments.clear();
+  range->count = 0;
+
+  std::vector<std::shared_ptr<HistorySegment>> segments;
+  {
+    std::lock_guard<std::mutex> lock(log->mutex);
+    segments = log->segments;
+  }
+
+  if (segments.empty()) {
+    range->first = 1;
+    return 0;
+  }
+
+  // the messages counted now, the ones appended meanwhile are left out
+  const HistorySegment& last = *segments.back();
+  uint32_t oldest = segments.front()->first;
+  uint32_t next = last.first + last.count.load(std::memory_order_acquire);
+
+  if (from == 0) {
+    from = next - std::min(count, next - oldest);
+  }
+  from = std::clamp(from, oldest, next);
+  count = std::min(count, next - from);
+
+  range->first = from;
+
+  // the first segment holding `from`, the last one starting at or before it
+  auto it = std::upper_bound(
+    segments.begin(), segments.end(), from,
+    [](uint32_t sequence, const std::shared_ptr<HistorySegment>& segment) {
+      return sequence < segment->first;
+    }
+  );
+  if (it != segments.begin()) {
+    --it;
+  }
+
+  for (; it != segments.end() && range->count < count; ++it) {
+    HistorySegment* segment = it->get();
+    uint32_t available = segment->count.load(std::memory_order_acquire);
+    uint32_t position = from + range->count - segment->first;
+
+    if (position >= available) {
+      continue;
+    }
+
+    uint32_t taken = std::min(available - position, count - range->count);
+    uint32_t start = segment->start(position);
+    uint32_t end = segment->ends()[position + taken - 1];
+
+    range->runs.push_back(
+      HistoryRun{segment->log.data + start, end - start, taken}
+    );
+    range->segments.push_back(*it);
+    range->count += taken;
+  }
+
+  return 0;
+}
@@ -0,0 +1,170 @@
+#ifndef SERVER_HISTORY_H_
+#define SERVER_HISTORY_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "protocol/protocol.h"
+
+/// Bytes of the messages a segment of a room log holds at most.
+#define HISTORY_SEGMENT_SIZE (8 << 20)
+/// Messages a segment holds at most, each taking at least a header.
+#define HISTORY_SEGMENT_MESSAGES (HISTORY_SEGMENT_SIZE / sizeof(msg_send_t))
+/// Most messages replayed by a single `MSG_HISTORY`.
+#define HISTORY_REPLAY_MAX 100000
+
+/// A file mapped in memory, read and written in place.
+struct MappedFile {
+  /// The bytes of the file, null while not mapped
+  uint8_t* data = nullptr;
+  /// Length of the mapping
+  size_t size = 0;
+#ifdef _WIN32
+  /// The handle of the mapping, the file itself is closed once mapped
+  void* mapping = nullptr;
+#endif
+
+  MappedFile() = default;
+  ~MappedFile();
+
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  /// Open the file, creating it if need be, grow it to `size` bytes and map
+  /// it.
+  ///
+  /// The bytes grown are zero, and take no room on the disk until written
+  /// where the file system supports it. Returns 1 on failure.
+  int open(const std::string& path, size_t size);
+  /// Unmap the file, the bytes written are left to the system to write
+  /// back.
+  void close();
+};
+
+/// A segment of a room log, the messages of a range of sequences.
+///
+/// The messages are written back to back in the log file, and the offset
+/// past every message in the index file. The bytes of a message are written
+/// before its offset, and the count is raised last, so a message counted is
+/// complete in both files.
+struct HistorySegment {
+  /// The sequence of the first message
+  uint32_t first = 0;
+  /// The messages, as forwarded
+  MappedFile log;
+  /// The offset past every message in the log
+  MappedFile index;
+  /// Number of the messages written, read by any thread
+  std::atomic<uint32_t> count = 0;
+  /// Bytes of the log written, by the writer only
+  uint32_t size = 0;
+
+  /// The offsets past the messages.
+  uint32_t* ends() const { return (uint32_t*)this->index.data; }
+  /// The offset of the message at the position in the segment.
+  uint32_t start(uint32_t position) const {
+    return position == 0 ? 0 : this->ends()[position - 1];
+  }
+};
+
+/// The log of a room.
+///
+/// Only the reactor owning the room appends to it, in the order the
+/// messages are fanned out. The messages written are never changed, so any
+/// thread reads them in place, without a lock.
+struct RoomLog {
+  /// Guards the list of the segments, not their content
+  std::mutex mutex;
+  /// The segments, in the order of their sequences
+  std::vector<std::shared_ptr<HistorySegment>> segments;
+};
+
+/// A run of messages written back to back, read in place.
+struct HistoryRun {
+  const uint8_t* data;
+  /// Length of the run
+  size_t len;
+  /// Number of the messages
+  uint32_t count;
+};
+
+/// Messages of a room log read in place, a run per segment.
+struct HistoryRange {
+  /// The sequence of the first message, or of the next one written when
+  /// there is none
+  uint32_t first = 0;
+  /// Number of the messages
+  uint32_t count = 0;
+  /// The messages
+  std::vector<HistoryRun> runs;
+  /// Keep the runs mapped as long as the range
+  std::vector<std::shared_ptr<HistorySegment>> segments;
+};
+
+/// The history of the rooms, a segmented log per room in a directory.
+///
+/// The segments of a room are the files `room-<ROOM>-<FIRST>.log` and
+/// `room-<ROOM>-<FIRST>.idx`, `FIRST` being the sequence of the first
+/// message, counted from 1 for every room. The files are mapped once opened:
+/// appending is a copy into the mapping and reading hands out the bytes of
+/// the mapping, never a system call. The system writes the bytes back to the
+/// disk on its own schedule, the messages survive the server but not the
+/// system crashing.
+///
+/// A segment is full at `HISTORY_SEGMENT_SIZE` bytes, the next message opens
+/// a new one. The logs are kept from one run of the server to the next.
+struct History {
+  /// The directory of the logs, none if empty and the history is off
+  std::string path;
+  /// Guards the map of the logs, not the logs
+  std::shared_mutex mutex;
+  /// The logs, never removed
+  std::unordered_map<ident_t, std::unique_ptr<RoomLog>> rooms;
+
+  History() = default;
+
+  History(const History&) = delete;
+  History& operator=(const History&) = delete;
+
+  /// Keep the history in the directory, creating it if need be, and open
+  /// the logs left in it.
+  ///
+  /// Returns 1 if the directory or a segment cannot be opened.
+  int open(const std::string& path);
+  /// Whether the history is kept.
+  bool enabled() const { return !this->path.empty(); }
+  /// Number of the rooms with a log.
+  size_t room_count();
+
+  /// Append a message forwarded to the room, from the owner of the room.
+  ///
+  /// Returns the sequence of the message, or 0 if it could not be written.
+  uint32_t append(
+    ident_t room,
+    ident_t src,
+    format_t format,
+    const uint8_t* data,
+    uint32_t len
+  );
+  /// Read up to `count` messages of the room from the sequence `from`, the
+  /// last ones if `from` is 0.
+  ///
+  /// Returns 1 if the room has no log.
+  int read(ident_t room, uint32_t from, uint32_t count, HistoryRange* range);
+
+  /// The log of the room, created if asked to, null otherwise.
+  RoomLog* log(ident_t room, bool create);
+  /// Open the segment of the room from the sequence `first`, recovering the
+  /// messages it holds. Returns null on failure.
+  std::shared_ptr<HistorySegment> open_segment(ident_t room, uint32_t first);
+};
+
+#endif  // SERVER_HISTORY_H_
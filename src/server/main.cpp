@@ -1,45 +1,151 @@
-#include "WS2tcpip.h"
-#include "WinSock2.h"
 #include "stdio.h"
+#include "string.h"
 #include "time.h"
 
+#include "net/socket.h"
 #include "protocol/protocol.h"
 #include "server/server.h"
 
 #include <iostream>
 #include <string>
 #include <format>
+#include <thread>
 
-#pragma comment(lib, "ws2_32.lib")
+#ifndef _WIN32
+#include <signal.h>
+#include <sys/resource.h>
+#endif
+
+/// Print how the server is run.
+static void print_usage(const char* name) {
+  printf(
+    "Usage: %s [max clients] [port] [epoll|uring] [options]\n"
+    "  --flush-delay-us <us>     latency budget of small writes\n"
+    "  --log-level <level>       lowest level logged, info\n"
+    "  --log-file <path>         binary log file instead of stdout\n"
+    "  --metrics <path>          Unix socket the metrics are dumped on\n"
+    "  --reactors <n>            reactors, each on its own thread\n"
+    "  --cpus <list>             CPUs the reactors are pinned to\n"
+    "  --workers <n|auto>        threads handling the messages\n"
+    "  --history <dir>           directory of the history of the rooms\n"
+    "  --offline <dir>           directory of the offline queues\n"
+    "  --overflow <policy>       block, drop-oldest, drop-newest, disconnect\n"
+    "  --outbound-limit <bytes>  bytes queued to a client, 0 for no limit\n"
+    "  --heartbeat-ms <ms>       silence before a ping, 0 for never\n"
+    "  --idle-timeout-ms <ms>    silence before a disconnect, 0 for never\n",
+    name
+  );
+}
+
+/// Apply the option of the command line to the server.
+///
+/// Returns 1 if the option is unknown or its value cannot be used.
+static int parse_option(ServerState* state, const char* name, char* value) {
+  if (strcmp(name, "--flush-delay-us") == 0) {
+    state->flush_delay_us = atoi(value);
+  } else if (strcmp(name, "--log-level") == 0) {
+    // `debug` logs every message
+    state->logger.level = log_level_parse(value);
+  } else if (strcmp(name, "--log-file") == 0) {
+    // the records go to the file in the binary format instead of stdout
+    if (state->logger.open_binary(value) != 0) {
+      printf("cannot open the log file %s\n", value);
+      return 1;
+    }
+  } else if (strcmp(name, "--metrics") == 0) {
+    state->metrics_path = value;
+  } else if (strcmp(name, "--reactors") == 0) {
+    state->reactor_count = atoi(value);
+  } else if (strcmp(name, "--cpus") == 0) {
+    for (char* cpu = strtok(value, ","); cpu != NULL;
+         cpu = strtok(NULL, ",")) {
+      state->cpus.push_back(atoi(cpu));
+    }
+  } else if (strcmp(name, "--workers") == 0) {
+    // `auto` for one per CPU, without workers the reactors handle the
+    // messages of their connections
+    state->worker_count = strcmp(value, "auto") == 0
+                            ? std::thread::hardware_concurrency()
+                            : atoi(value);
+  } else if (strcmp(name, "--history") == 0) {
+    // replayed with `MSG_HISTORY`
+    state->history_path = value;
+  } else if (strcmp(name, "--offline") == 0) {
+    // the messages to the clients not connected, delivered once they connect
+    state->offline_path = value;
+  } else if (strcmp(name, "--overflow") == 0) {
+    // what is done with the messages to a client not reading fast enough
+    state->overflow = overflow_policy_parse(value);
+  } else if (strcmp(name, "--outbound-limit") == 0) {
+    state->outbound_limit = strtoull(value, NULL, 10);
+  } else if (strcmp(name, "--heartbeat-ms") == 0) {
+    state->heartbeat_ms = strtoull(value, NULL, 10);
+  } else if (strcmp(name, "--idle-timeout-ms") == 0) {
+    state->idle_timeout_ms = strtoull(value, NULL, 10);
+  } else {
+    return 1;
+  }
+
+  return 0;
+}
 
 int main(int argc, char* argv[]) {
   size_t max_clients = 10;
   size_t port = 8888;
 
+  ServerState state;
+
   std::locale::global(std::locale("zh_CN.UTF-8"));
   std::wcin.imbue(std::locale());
   std::wcout.imbue(std::locale());
 
-  if (argc > 1) {
-    max_clients = atoi(argv[1]);
+  // the maximum number of clients, the port and the I/O backend, `epoll` by
+  // default or `uring`, come first, each optional, and the options after
+  // them
+  int arg = 1;
+
+  if (arg < argc && strncmp(argv[arg], "--", 2) != 0) {
+    max_clients = atoi(argv[arg++]);
   }
 
-  if (argc > 2) {
-    port = atoi(argv[2]);
+  if (arg < argc && strncmp(argv[arg], "--", 2) != 0) {
+    port = atoi(argv[arg++]);
   }
 
-  WSADATA wsa;
+  if (arg < argc && strncmp(argv[arg], "--", 2) != 0) {
+    state.backend = argv[arg++];
+  }
 
-  ServerState state;
+  for (; arg < argc; arg += 2) {
+    if (arg + 1 >= argc ||
+        parse_option(&state, argv[arg], argv[arg + 1]) != 0) {
+      print_usage(argv[0]);
+      return 1;
+    }
+  }
+
+  WSADATA wsa;
 
   state.log(L"initializing winsock...");
   if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0) {
-    state.log(std::format(L"failed. error code: {}", WSAGetLastError()));
+    state.log(L"failed. error code: {}", WSAGetLastError());
     return 1;
   }
 
   state.log(L"initialized.");
 
+#ifndef _WIN32
+  // a closed peer must fail the `send` instead of killing the process
+  signal(SIGPIPE, SIG_IGN);
+
+  // every connection holds a descriptor, lift the soft limit to the hard one
+  struct rlimit limit;
+  if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+  }
+#endif
+
   if (state.init(port, max_clients) != 0) {
     state.log(L"failed to initialize server.");
     state.cleanup();
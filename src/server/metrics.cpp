@@ -0,0 +1,363 @@
+#include "server/metrics.h"
+
+#include <bit>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <format>
+
+#ifdef __linux__
+#include <unistd.h>
+#endif
+
+/// Exponents of the nanoseconds bounding the buckets exported, from about a
+/// microsecond to 17 seconds.
+#define METRICS_EXPORT_MIN_SHIFT 10
+#define METRICS_EXPORT_MAX_SHIFT 34
+
+/// Names of the message types, in the labels.
+static const char* message_names[METRICS_MESSAGE_TYPES] = {
+  "none",    "connect",  "disconnect", "send",         nullptr,
+  "join",    "leave",    "reply",      "request",      "reply_id",
+  "bundle",  "reply_bundle", "version", "stats",       "history",
+  "stream_start", "stream_chunk", "stream_end", "stream_ack", "ping",
+  "pong",    "unknown",
+};
+
+/// Names of the reply codes, in the labels.
+static const char* reply_names[METRICS_REPLY_CODES] = {
+  "none",          "ok",             "send_failed", "duplicated_id",
+  "dst_not_found", "room_not_found", "not_in_room", "room_conflict",
+  "rejected",      "bad_request",    "queued",      "queue_full",
+  "dropped",
+};
+
+/// The shard of the current thread, and the metrics it belongs to.
+struct LocalShard {
+  Metrics* owner = nullptr;
+  MetricsShard* shard = nullptr;
+};
+
+static thread_local LocalShard local_shard;
+
+uint64_t metrics_now() {
+  return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+           std::chrono::steady_clock::now().time_since_epoch()
+  )
+    .count();
+}
+
+size_t Histogram::index(uint64_t value) {
+  if (value < (1 << HISTOGRAM_SUB_BITS)) {
+    return (size_t)value;
+  }
+
+  // the highest bit and the bits below it, the highest bit counts 16
+  // buckets per shift.
+  int shift = std::bit_width(value) - 1 - HISTOGRAM_SUB_BITS;
+  return ((size_t)shift << HISTOGRAM_SUB_BITS) + (size_t)(value >> shift);
+}
+
+uint64_t Histogram::lower(size_t index) {
+  if (index < (2 << HISTOGRAM_SUB_BITS)) {
+    return index;
+  }
+
+  int shift = (int)(index >> HISTOGRAM_SUB_BITS) - 1;
+  return (uint64_t)(index - ((size_t)shift << HISTOGRAM_SUB_BITS)) << shift;
+}
+
+void Histogram::record(uint64_t value) {
+  metric_add(this->buckets[Histogram::index(value)], 1);
+  metric_add(this->count, 1);
+  metric_add(this->sum, value);
+}
+
+void Histogram::merge(const Histogram& other) {
+  for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+    metric_add(this->buckets[i], other.buckets[i].load());
+  }
+  metric_add(this->count, other.count.load());
+  metric_add(this->sum, other.sum.load());
+}
+
+uint64_t Histogram::quantile(double q) const {
+  uint64_t count = 0;
+  for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+    count += this->buckets[i].load(std::memory_order_relaxed);
+  }
+
+  if (count == 0) {
+    return 0;
+  }
+
+  uint64_t rank = (uint64_t)std::ceil(q * count);
+  if (rank < 1) {
+    rank = 1;
+  }
+
+  // the highest value of the bucket holding the rank
+  uint64_t seen = 0;
+  for (size_t i = 0; i < HISTOGRAM_BUCKETS - 1; i++) {
+    seen += this->buckets[i].load(std::memory_order_relaxed);
+    if (seen >= rank) {
+      return Histogram::lower(i + 1) - 1;
+    }
+  }
+
+  return UINT64_MAX;
+}
+
+void MetricsShard::message(uint32_t type) {
+  if (type >= METRICS_MESSAGE_TYPES - 1 || message_names[type] == nullptr) {
+    type = METRICS_MESSAGE_TYPES - 1;
+  }
+
+  metric_add(this->messages[type], 1);
+}
+
+void MetricsShard::reply(reply_code_t code) {
+  if ((uint32_t)code < METRICS_REPLY_CODES) {
+    metric_add(this->replies[code], 1);
+  }
+}
+
+void MetricsShard::merge(const MetricsShard& other) {
+  metric_add(this->accepted, other.accepted.load());
+  metric_add(this->closed, other.closed.load());
+  metric_add(this->bytes_in, other.bytes_in.load());
+  metric_add(this->bytes_out, other.bytes_out.load());
+  metric_add(this->forwarded, other.forwarded.load());
+  metric_add(this->relayed, other.relayed.load());
+  metric_add(this->rejected, other.rejected.load());
+  metric_add(this->invalid, other.invalid.load());
+  metric_add(this->archived, other.archived.load());
+  metric_add(this->replayed, other.replayed.load());
+  metric_add(this->queued, other.queued.load());
+  metric_add(this->flushed, other.flushed.load());
+  metric_add(this->streamed, other.streamed.load());
+  metric_add(this->dropped, other.dropped.load());
+  metric_add(this->blocked, other.blocked.load());
+  metric_add(this->evicted, other.evicted.load());
+  metric_add(this->pings, other.pings.load());
+  metric_add(this->timed_out, other.timed_out.load());
+
+  for (size_t i = 0; i < METRICS_MESSAGE_TYPES; i++) {
+    metric_add(this->messages[i], other.messages[i].load());
+  }
+  for (size_t i = 0; i < METRICS_REPLY_CODES; i++) {
+    metric_add(this->replies[i], other.replies[i].load());
+  }
+
+  this->forward_latency.merge(other.forward_latency);
+  this->fanout.merge(other.fanout);
+}
+
+MetricsShard* Metrics::local() {
+  if (local_shard.owner == this) {
+    return local_shard.shard;
+  }
+
+  std::lock_guard<std::mutex> lock(this->mutex);
+  this->shards.push_back(std::make_unique<MetricsShard>());
+
+  local_shard.owner = this;
+  local_shard.shard = this->shards.back().get();
+
+  return local_shard.shard;
+}
+
+void Metrics::collect(MetricsShard* total) {
+  std::lock_guard<std::mutex> lock(this->mutex);
+
+  for (auto& shard : this->shards) {
+    total->merge(*shard);
+  }
+}
+
+/// Bytes of memory resident of the process, 0 where unknown.
+static uint64_t resident_bytes() {
+  uint64_t bytes = 0;
+
+#ifdef __linux__
+  FILE* statm = fopen("/proc/self/statm", "r");
+  if (statm == nullptr) {
+    return 0;
+  }
+
+  unsigned long long size, resident;
+  if (fscanf(statm, "%llu %llu", &size, &resident) == 2) {
+    bytes = resident * (uint64_t)sysconf(_SC_PAGESIZE);
+  }
+  fclose(statm);
+#endif
+
+  return bytes;
+}
+
+/// Append a counter or gauge without labels.
+static void render_value(
+  std::string& out,
+  const char* name,
+  const char* type,
+  const char* help,
+  uint64_t value
+) {
+  out += std::format(
+    "# HELP {} {}\n# TYPE {} {}\n{} {}\n", name, help, name, type, name, value
+  );
+}
+
+/// Append a histogram of nanoseconds, in seconds.
+static void render_histogram(
+  std::string& out,
+  const char* name,
+  const char* help,
+  const Histogram& histogram
+) {
+  out += std::format("# HELP {} {}\n# TYPE {} histogram\n", name, help, name);
+
+  // a power of two is the lowest value of a bucket, the buckets below it
+  // hold the values under the bound.
+  uint64_t cumulative = 0;
+  size_t i = 0;
+
+  for (int shift = METRICS_EXPORT_MIN_SHIFT; shift <= METRICS_EXPORT_MAX_SHIFT;
+       shift++) {
+    size_t end = Histogram::index((uint64_t)1 << shift);
+    for (; i < end; i++) {
+      cumulative += histogram.buckets[i].load(std::memory_order_relaxed);
+    }
+
+    double bound = (double)((uint64_t)1 << shift) / 1e9;
+    out += std::format("{}_bucket{{le=\"{}\"}} {}\n", name, bound, cumulative);
+  }
+
+  out += std::format(
+    "{}_bucket{{le=\"+Inf\"}} {}\n{}_sum {}\n{}_count {}\n", name,
+    histogram.count.load(), name, (double)histogram.sum.load() / 1e9, name,
+    histogram.count.load()
+  );
+}
+
+std::string Metrics::render() {
+  MetricsShard total;
+  this->collect(&total);
+
+  std::string out;
+
+  render_value(
+    out, "chat_connections_accepted_total", "counter", "Connections accepted.",
+    total.accepted
+  );
+  render_value(
+    out, "chat_connections_open", "gauge", "Connections open.",
+    total.accepted - total.closed
+  );
+  render_value(
+    out, "chat_received_bytes_total", "counter",
+    "Bytes read from the clients.", total.bytes_in
+  );
+  render_value(
+    out, "chat_sent_bytes_total", "counter", "Bytes queued to the clients.",
+    total.bytes_out
+  );
+  render_value(
+    out, "chat_forwarded_messages_total", "counter",
+    "Copies of messages queued to their destinations.", total.forwarded
+  );
+  render_value(
+    out, "chat_relayed_messages_total", "counter",
+    "Messages posted to another reactor for its clients.", total.relayed
+  );
+  render_value(
+    out, "chat_archived_messages_total", "counter",
+    "Messages written to the history of their room.", total.archived
+  );
+  render_value(
+    out, "chat_replayed_messages_total", "counter",
+    "Messages replayed from the history of their room.", total.replayed
+  );
+  render_value(
+    out, "chat_queued_messages_total", "counter",
+    "Messages queued for their recipients not connected.", total.queued
+  );
+  render_value(
+    out, "chat_flushed_messages_total", "counter",
+    "Queued messages delivered once their recipients connected.",
+    total.flushed
+  );
+  render_value(
+    out, "chat_streamed_bytes_total", "counter",
+    "Bytes of data forwarded by the streams.", total.streamed
+  );
+  render_value(
+    out, "chat_dropped_messages_total", "counter",
+    "Messages to the clients not reading fast enough dropped.", total.dropped
+  );
+  render_value(
+    out, "chat_blocked_senders_total", "counter",
+    "Senders held back by the clients not reading fast enough.",
+    total.blocked
+  );
+  render_value(
+    out, "chat_evicted_clients_total", "counter",
+    "Clients disconnected for not reading fast enough.", total.evicted
+  );
+  render_value(
+    out, "chat_pings_total", "counter",
+    "Pings sent to the clients silent for a while.", total.pings
+  );
+  render_value(
+    out, "chat_timed_out_clients_total", "counter",
+    "Clients disconnected for being silent too long.", total.timed_out
+  );
+
+  out +=
+    "# HELP chat_messages_total Messages handled by type.\n"
+    "# TYPE chat_messages_total counter\n";
+  for (size_t i = 0; i < METRICS_MESSAGE_TYPES; i++) {
+    if (message_names[i] != nullptr) {
+      out += std::format(
+        "chat_messages_total{{type=\"{}\"}} {}\n", message_names[i],
+        total.messages[i].load()
+      );
+    }
+  }
+
+  out +=
+    "# HELP chat_replies_total Replies by code.\n"
+    "# TYPE chat_replies_total counter\n";
+  for (size_t i = 0; i < METRICS_REPLY_CODES; i++) {
+    out += std::format(
+      "chat_replies_total{{code=\"{}\"}} {}\n", reply_names[i],
+      total.replies[i].load()
+    );
+  }
+
+  out += std::format(
+    "# HELP chat_rejects_total Clients rejected and connections closed for "
+    "malformed frames.\n"
+    "# TYPE chat_rejects_total counter\n"
+    "chat_rejects_total{{reason=\"full\"}} {}\n"
+    "chat_rejects_total{{reason=\"invalid\"}} {}\n",
+    total.rejected.load(), total.invalid.load()
+  );
+
+  render_value(
+    out, "chat_resident_bytes", "gauge", "Memory resident of the server.",
+    resident_bytes()
+  );
+
+  render_histogram(
+    out, "chat_forward_latency_seconds",
+    "Time from reading a message to queueing its last copy.",
+    total.forward_latency
+  );
+  render_histogram(
+    out, "chat_room_fanout_seconds",
+    "Time to queue a message to every member of a room.", total.fanout
+  );
+
+  return out;
+}
@@ -0,0 +1,141 @@
+#ifndef SERVER_METRICS_H_
+#define SERVER_METRICS_H_
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "protocol/protocol.h"
+
+/// Message types counted, the last slot counts the unknown ones.
+#define METRICS_MESSAGE_TYPES (MSG_PONG + 2)
+/// Reply codes counted.
+#define METRICS_REPLY_CODES (RPL_DROPPED + 1)
+
+/// Bits of the value kept below the highest bit set, 16 buckets per power
+/// of two. A value is off by at most 1/16 of itself.
+#define HISTOGRAM_SUB_BITS 4
+/// Buckets of a histogram, enough for any 64 bits value.
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS)
+
+/// Add to a counter written by the current thread only.
+///
+/// A load and a store instead of a read-modify-write, nothing else writes
+/// the counter. Readers on other threads see a value a little behind.
+inline void metric_add(std::atomic<uint64_t>& counter, uint64_t value) {
+  counter.store(
+    counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed
+  );
+}
+
+/// Nanoseconds of the steady clock, for the latencies.
+uint64_t metrics_now();
+
+/// Histogram of the values with a bounded relative error, like HDR
+/// histograms.
+///
+/// The values below 16 have a bucket each, the larger ones are bucketed by
+/// their highest bit set and the 4 bits below it. Recording is a few
+/// instructions and never allocates.
+struct Histogram {
+  std::atomic<uint64_t> buckets[HISTOGRAM_BUCKETS] = {};
+  /// Number of the values recorded
+  std::atomic<uint64_t> count = 0;
+  /// Sum of the values recorded
+  std::atomic<uint64_t> sum = 0;
+
+  /// Record the value, from the thread owning the histogram.
+  void record(uint64_t value);
+  /// Add the buckets of the other histogram to this one.
+  void merge(const Histogram& other);
+  /// The value below which the quantile `q` of the values are, within the
+  /// error of the buckets. Returns 0 if empty.
+  uint64_t quantile(double q) const;
+
+  /// The bucket of the value.
+  static size_t index(uint64_t value);
+  /// The lowest value of the bucket.
+  static uint64_t lower(size_t index);
+};
+
+/// The counters and histograms of a thread.
+///
+/// Only the owning thread writes them, with `metric_add`, so counting never
+/// contends. Aligned to keep the shards of two threads off the same line.
+struct alignas(64) MetricsShard {
+  /// Connections accepted
+  std::atomic<uint64_t> accepted = 0;
+  /// Connections closed
+  std::atomic<uint64_t> closed = 0;
+  /// Bytes read from the sockets
+  std::atomic<uint64_t> bytes_in = 0;
+  /// Bytes queued to the sockets
+  std::atomic<uint64_t> bytes_out = 0;
+  /// Copies of messages queued to their destinations
+  std::atomic<uint64_t> forwarded = 0;
+  /// Messages posted to another reactor for its clients
+  std::atomic<uint64_t> relayed = 0;
+  /// Clients rejected at `MSG_CONNECT`, the server being full
+  std::atomic<uint64_t> rejected = 0;
+  /// Connections closed for sending malformed frames
+  std::atomic<uint64_t> invalid = 0;
+  /// Messages written to the history of their room
+  std::atomic<uint64_t> archived = 0;
+  /// Messages replayed from the history of their room
+  std::atomic<uint64_t> replayed = 0;
+  /// Messages queued for their recipients not connected
+  std::atomic<uint64_t> queued = 0;
+  /// Queued messages delivered once their recipients connected
+  std::atomic<uint64_t> flushed = 0;
+  /// Bytes of data forwarded by the streams
+  std::atomic<uint64_t> streamed = 0;
+  /// Messages to the clients not reading fast enough dropped
+  std::atomic<uint64_t> dropped = 0;
+  /// Senders held back by the clients not reading fast enough
+  std::atomic<uint64_t> blocked = 0;
+  /// Clients disconnected for not reading fast enough
+  std::atomic<uint64_t> evicted = 0;
+  /// Pings sent to the clients silent for a while
+  std::atomic<uint64_t> pings = 0;
+  /// Clients disconnected for being silent too long
+  std::atomic<uint64_t> timed_out = 0;
+  /// Messages handled, by type
+  std::atomic<uint64_t> messages[METRICS_MESSAGE_TYPES] = {};
+  /// Replies, by code
+  std::atomic<uint64_t> replies[METRICS_REPLY_CODES] = {};
+
+  /// Nanoseconds from reading a `MSG_SEND` to queueing its last copy
+  Histogram forward_latency;
+  /// Nanoseconds to queue a message to every member of a room
+  Histogram fanout;
+
+  /// Count a message of the type.
+  void message(uint32_t type);
+  /// Count a reply of the code.
+  void reply(reply_code_t code);
+  /// Add the counters and histograms of the other shard to this one.
+  void merge(const MetricsShard& other);
+};
+
+/// The metrics of the server, a shard per thread.
+///
+/// A thread gets its shard on first use and keeps it, the shards live as
+/// long as the metrics so their counts survive the threads. Reading sums
+/// the shards, while they are written.
+struct Metrics {
+  /// Mutex of the list of the shards
+  std::mutex mutex;
+  std::vector<std::unique_ptr<MetricsShard>> shards;
+
+  /// The shard of the current thread, created on first use.
+  MetricsShard* local();
+  /// Sum the shards into `total`, a shard not written by any thread.
+  void collect(MetricsShard* total);
+  /// The metrics in the text format of Prometheus.
+  std::string render();
+};
+
+#endif  // SERVER_METRICS_H_
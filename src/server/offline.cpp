@@ -0,0 +1,459 @@
+#include "server/offline.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include <chrono>
+#include <filesystem>
+#include <format>
+
+#include "server/metrics.h"
+#include "server/registry.h"
+
+OfflineStore::~OfflineStore() {
+  this->stop();
+}
+
+int OfflineStore::open(const std::string& path) {
+  std::error_code error;
+  std::filesystem::create_directories(path, error);
+  if (error) {
+    return 1;
+  }
+
+  // the queues are not kept from one run of the server to the next
+  std::vector<std::filesystem::path> stale;
+
+  for (const auto& entry : std::filesystem::directory_iterator(path, error)) {
+    std::string name = entry.path().filename().string();
+    if (name.starts_with("offline-") && name.ends_with(".spill")) {
+      stale.push_back(entry.path());
+    }
+  }
+
+  if (error) {
+    return 1;
+  }
+
+  for (const auto& file : stale) {
+    std::filesystem::remove(file, error);
+  }
+
+  this->path = path;
+
+  this->running = true;
+  this->thread = std::thread(&OfflineStore::run, this);
+
+  return 0;
+}
+
+void OfflineStore::stop() {
+  if (!this->thread.joinable()) {
+    return;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(this->jobs_mutex);
+    this->running = false;
+  }
+  this->wake.notify_one();
+  this->thread.join();
+
+  // the queues are lost with the server anyway
+  this->jobs.clear();
+}
+
+OfflineStore::Shard& OfflineStore::shard(ident_t ident) {
+  return this->shards[(ident_hash(ident) >> 16) & (OFFLINE_SHARDS - 1)];
+}
+
+std::string OfflineStore::spill_path(ident_t ident) {
+  return std::format("{}/offline-{}.spill", this->path, ident);
+}
+
+void OfflineStore::expire(ident_t ident, OfflineQueue* queue, uint64_t now) {
+  // the messages spilled are older than those in memory, all of them have
+  // expired once the last one has
+  if (queue->spilled > 0 && queue->spilled_expiry <= now) {
+    OfflineJob job;
+    job.kind = OFFLINE_REMOVE;
+    job.ident = ident;
+    this->queue_job(std::move(job));
+
+    queue->count -= queue->spilled;
+    queue->bytes -= queue->spilled_bytes;
+    this->bytes.fetch_sub(queue->spilled_bytes, std::memory_order_relaxed);
+
+    queue->spilled = 0;
+    queue->spilled_bytes = 0;
+  }
+
+  size_t expired = 0;
+  size_t size = 0;
+
+  while (expired < queue->expiries.size() && queue->expiries[expired] <= now) {
+    message_header_t header;
+    memcpy(&header, queue->frames.data() + size, sizeof(header));
+
+    size += header.length;
+    expired++;
+  }
+
+  if (expired == 0) {
+    return;
+  }
+
+  queue->frames.erase(queue->frames.begin(), queue->frames.begin() + size);
+  queue->expiries.erase(
+    queue->expiries.begin(), queue->expiries.begin() + expired
+  );
+
+  queue->count -= (uint32_t)expired;
+  queue->bytes -= size;
+  this->bytes.fetch_sub(size, std::memory_order_relaxed);
+  this->memory.fetch_sub(size, std::memory_order_relaxed);
+}
+
+void OfflineStore::spill(ident_t ident, OfflineQueue* queue) {
+  // every message after its expiry, written at once
+  OfflineJob job;
+  job.kind = OFFLINE_APPEND;
+  job.ident = ident;
+  job.records.resize(
+    queue->frames.size() + queue->expiries.size() * sizeof(uint64_t)
+  );
+  uint8_t* at = job.records.data();
+  size_t offset = 0;
+
+  for (uint64_t expiry : queue->expiries) {
+    message_header_t header;
+    memcpy(&header, queue->frames.data() + offset, sizeof(header));
+
+    memcpy(at, &expiry, sizeof(expiry));
+    memcpy(at + sizeof(expiry), queue->frames.data() + offset, header.length);
+
+    at += sizeof(expiry) + header.length;
+    offset += header.length;
+  }
+
+  this->queue_job(std::move(job));
+
+  queue->spilled += (uint32_t)queue->expiries.size();
+  queue->spilled_bytes += queue->frames.size();
+  queue->spilled_expiry = queue->expiries.back();
+  this->memory.fetch_sub(queue->frames.size(), std::memory_order_relaxed);
+
+  // the memory is handed back, not only emptied
+  std::vector<uint8_t>().swap(queue->frames);
+  std::vector<uint64_t>().swap(queue->expiries);
+}
+
+reply_code_t OfflineStore::push(
+  ident_t dst,
+  ident_t src,
+  format_t format,
+  const uint8_t* data,
+  uint32_t len,
+  uint64_t now,
+  const std::function<bool()>& online
+) {
+  Shard& shard = this->shard(dst);
+  std::lock_guard<std::mutex> lock(shard.mutex);
+
+  // a client connecting takes its queue after registering, so it either
+  // shows up here or takes the message. While its messages spilled are
+  // read, the message is queued behind them.
+  auto it = shard.queues.find(dst);
+  bool taking = it != shard.queues.end() && it->second.taking;
+
+  if (!taking && online()) {
+    return RPL_NONE;
+  }
+
+  OfflineQueue& queue = shard.queues[dst];
+  this->expire(dst, &queue, now);
+
+  uint32_t length = (uint32_t)sizeof(msg_send_t) + len;
+
+  if (queue.count >= OFFLINE_QUEUE_MESSAGES ||
+      queue.bytes + length > OFFLINE_QUEUE_BYTES ||
+      this->bytes.load(std::memory_order_relaxed) + length >
+        OFFLINE_TOTAL_BYTES) {
+    if (queue.count == 0 && !queue.taking) {
+      shard.queues.erase(dst);
+    }
+    return RPL_QUEUE_FULL;
+  }
+
+  size_t size = queue.frames.size();
+  queue.frames.resize(size + length);
+
+  uint8_t* at = queue.frames.data() + size;
+  at += protocol_wrap_msg_send_header(src, dst, format, (length_t)len, at);
+  memcpy(at, data, len);
+
+  queue.expiries.push_back(now + this->ttl);
+  queue.count++;
+  queue.bytes += length;
+  this->bytes.fetch_add(length, std::memory_order_relaxed);
+  size_t memory =
+    this->memory.fetch_add(length, std::memory_order_relaxed) + length;
+
+  // the file being read is not appended to, the queue is within its quota
+  if (!queue.taking && (queue.frames.size() > OFFLINE_MEMORY_BYTES ||
+                        memory > OFFLINE_MEMORY_TOTAL)) {
+    this->spill(dst, &queue);
+  }
+
+  return RPL_QUEUED;
+}
+
+int OfflineStore::take(
+  ident_t ident,
+  uint64_t now,
+  std::vector<uint8_t>* frames
+) {
+  Shard& shard = this->shard(ident);
+  std::lock_guard<std::mutex> lock(shard.mutex);
+
+  auto it = shard.queues.find(ident);
+  if (it == shard.queues.end() || it->second.taking) {
+    return 0;
+  }
+
+  OfflineQueue& queue = it->second;
+  this->expire(ident, &queue, now);
+
+  if (queue.spilled > 0) {
+    queue.taking = true;
+    return -1;
+  }
+
+  // the messages in memory are the only ones, and none has expired
+  frames->insert(frames->end(), queue.frames.begin(), queue.frames.end());
+  uint32_t taken = (uint32_t)queue.expiries.size();
+
+  this->bytes.fetch_sub(queue.bytes, std::memory_order_relaxed);
+  this->memory.fetch_sub(queue.frames.size(), std::memory_order_relaxed);
+  shard.queues.erase(it);
+
+  return (int)taken;
+}
+
+void OfflineStore::read(ident_t ident, uint64_t now, OfflineReady ready) {
+  Shard& shard = this->shard(ident);
+  std::lock_guard<std::mutex> lock(shard.mutex);
+
+  OfflineJob job;
+  job.kind = OFFLINE_READ;
+  job.ident = ident;
+  job.now = now;
+  job.ready = std::move(ready);
+  this->queue_job(std::move(job));
+}
+
+uint32_t OfflineStore::finish(
+  ident_t ident,
+  uint64_t now,
+  std::vector<uint8_t>* frames,
+  bool gone
+) {
+  Shard& shard = this->shard(ident);
+  std::lock_guard<std::mutex> lock(shard.mutex);
+
+  auto it = shard.queues.find(ident);
+  if (it == shard.queues.end() || !it->second.taking) {
+    return 0;
+  }
+
+  // nothing has been spilled since the file was read
+  OfflineQueue& queue = it->second;
+  this->expire(ident, &queue, now);
+
+  if (gone) {
+    queue.taking = false;
+    if (queue.count == 0) {
+      shard.queues.erase(it);
+    }
+    return 0;
+  }
+
+  frames->insert(frames->end(), queue.frames.begin(), queue.frames.end());
+  uint32_t taken = (uint32_t)queue.expiries.size();
+
+  this->bytes.fetch_sub(queue.bytes, std::memory_order_relaxed);
+  this->memory.fetch_sub(queue.frames.size(), std::memory_order_relaxed);
+  shard.queues.erase(it);
+
+  return taken;
+}
+
+void OfflineStore::queue_job(OfflineJob job) {
+  {
+    std::lock_guard<std::mutex> lock(this->jobs_mutex);
+    this->jobs.push_back(std::move(job));
+  }
+  this->wake.notify_one();
+}
+
+void OfflineStore::run() {
+  uint64_t sweep = (uint64_t)OFFLINE_SWEEP_MS * 1000000;
+  uint64_t next_sweep = metrics_now() + sweep;
+
+  std::unique_lock<std::mutex> lock(this->jobs_mutex);
+
+  while (this->running) {
+    // swept even while the operations keep coming
+    uint64_t now = metrics_now();
+    if (now >= next_sweep) {
+      lock.unlock();
+      this->sweep(now);
+      lock.lock();
+      next_sweep = now + sweep;
+      continue;
+    }
+
+    if (this->jobs.empty()) {
+      this->wake.wait_for(
+        lock, std::chrono::nanoseconds(next_sweep - now),
+        [this]() { return !this->running || !this->jobs.empty(); }
+      );
+      continue;
+    }
+
+    OfflineJob job = std::move(this->jobs.front());
+    this->jobs.pop_front();
+
+    lock.unlock();
+    this->run_job(job);
+    lock.lock();
+  }
+}
+
+void OfflineStore::run_job(OfflineJob& job) {
+  std::string path = this->spill_path(job.ident);
+  std::error_code error;
+
+  switch (job.kind) {
+    case OFFLINE_APPEND: {
+      uintmax_t size = std::filesystem::file_size(path, error);
+      if (error) {
+        size = 0;
+      }
+
+      // the messages of a file which cannot be written are lost, they are
+      // counted until they expire or are taken
+      FILE* file = fopen(path.c_str(), "ab");
+      if (file == NULL) {
+        break;
+      }
+
+      bool written =
+        fwrite(job.records.data(), job.records.size(), 1, file) == 1;
+      if (fclose(file) != 0 || !written) {
+        // a partial record would be read as the start of the next one
+        std::filesystem::resize_file(path, size, error);
+      }
+      break;
+    }
+    case OFFLINE_REMOVE: {
+      std::filesystem::remove(path, error);
+      break;
+    }
+    case OFFLINE_READ: {
+      this->read_spilled(job);
+      break;
+    }
+  }
+}
+
+void OfflineStore::read_spilled(OfflineJob& job) {
+  std::string path = this->spill_path(job.ident);
+  std::error_code error;
+
+  std::vector<uint8_t> records;
+  size_t read = 0;
+
+  // the messages of a file which cannot be read are lost
+  FILE* file = fopen(path.c_str(), "rb");
+  if (file != NULL) {
+    uintmax_t size = std::filesystem::file_size(path, error);
+    if (!error) {
+      records.resize((size_t)size);
+      read = fread(records.data(), 1, records.size(), file);
+    }
+    fclose(file);
+  }
+
+  std::filesystem::remove(path, error);
+
+  std::vector<uint8_t> frames;
+  uint32_t taken = 0;
+  size_t offset = 0;
+
+  while (offset + sizeof(uint64_t) + sizeof(msg_send_t) <= read) {
+    uint64_t expiry;
+    message_header_t header;
+    memcpy(&expiry, records.data() + offset, sizeof(expiry));
+    memcpy(&header, records.data() + offset + sizeof(expiry), sizeof(header));
+
+    if (header.length < sizeof(msg_send_t) ||
+        offset + sizeof(expiry) + header.length > read) {
+      break;
+    }
+
+    const uint8_t* frame = records.data() + offset + sizeof(expiry);
+    if (expiry > job.now) {
+      frames.insert(frames.end(), frame, frame + header.length);
+      taken++;
+    }
+
+    offset += sizeof(expiry) + header.length;
+  }
+
+  {
+    Shard& shard = this->shard(job.ident);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+
+    auto it = shard.queues.find(job.ident);
+    if (it != shard.queues.end() && it->second.taking) {
+      OfflineQueue& queue = it->second;
+      this->expire(job.ident, &queue, job.now);
+
+      // the messages in memory are newer than those of the file
+      frames.insert(frames.end(), queue.frames.begin(), queue.frames.end());
+      taken += (uint32_t)queue.expiries.size();
+
+      this->bytes.fetch_sub(queue.bytes, std::memory_order_relaxed);
+      this->memory.fetch_sub(queue.frames.size(), std::memory_order_relaxed);
+
+      // kept empty for the messages sent until `finish`
+      queue = OfflineQueue{};
+      queue.taking = true;
+    }
+  }
+
+  job.ready(std::move(frames), taken);
+}
+
+void OfflineStore::sweep(uint64_t now) {
+  for (Shard& shard : this->shards) {
+    std::lock_guard<std::mutex> lock(shard.mutex);
+
+    for (auto it = shard.queues.begin(); it != shard.queues.end();) {
+      // the queue being taken is left to the recipient
+      if (it->second.taking) {
+        ++it;
+        continue;
+      }
+
+      this->expire(it->first, &it->second, now);
+
+      if (it->second.count == 0) {
+        it = shard.queues.erase(it);
+      } else {
+        ++it;
+      }
+    }
+  }
+}
@@ -0,0 +1,212 @@
+#ifndef SERVER_OFFLINE_H_
+#define SERVER_OFFLINE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "protocol/protocol.h"
+
+/// Number of shards of the queues, a power of two.
+#define OFFLINE_SHARDS 64
+/// Messages queued for a recipient at most.
+#define OFFLINE_QUEUE_MESSAGES 1000
+/// Bytes queued for a recipient at most, in memory and on the disk.
+#define OFFLINE_QUEUE_BYTES (4 << 20)
+/// Bytes of a recipient kept in memory before they are spilled to the disk.
+#define OFFLINE_MEMORY_BYTES (64 << 10)
+/// Bytes kept in memory over every recipient before spilling.
+#define OFFLINE_MEMORY_TOTAL (64 << 20)
+/// Bytes queued over every recipient at most.
+#define OFFLINE_TOTAL_BYTES (1 << 30)
+/// Seconds a message is kept for its recipient.
+#define OFFLINE_TTL_SECONDS (24 * 60 * 60)
+/// Milliseconds between two sweeps of the expired messages of every queue.
+#define OFFLINE_SWEEP_MS 60000
+
+/// The messages waiting for a recipient to connect, oldest first.
+///
+/// The oldest ones may have been spilled to the segment file of the
+/// recipient, the newer ones are in memory.
+struct OfflineQueue {
+  /// The messages in memory, as version 1 `MSG_SEND` frames back to back
+  std::vector<uint8_t> frames;
+  /// When every message in memory expires
+  std::vector<uint64_t> expiries;
+  /// Number of the messages spilled
+  uint32_t spilled = 0;
+  /// Bytes of the messages spilled, without their expiries
+  size_t spilled_bytes = 0;
+  /// When the last message spilled expires
+  uint64_t spilled_expiry = 0;
+  /// Number of the messages queued, in memory and spilled
+  uint32_t count = 0;
+  /// Bytes of the messages queued, in memory and spilled
+  size_t bytes = 0;
+  /// Whether the recipient has connected and its messages spilled are being
+  /// read, the messages sent to it meanwhile are queued behind them
+  bool taking = false;
+};
+
+/// What the thread of the store does with the segment file of a recipient.
+enum OfflineJobKind {
+  /// Append the records to the file
+  OFFLINE_APPEND = 0,
+  /// Remove the file, all its messages have expired
+  OFFLINE_REMOVE,
+  /// Read and remove the file, for the recipient connected
+  OFFLINE_READ,
+};
+
+/// Handed the messages read for a recipient, as version 1 `MSG_SEND` frames
+/// back to back, and their number.
+using OfflineReady =
+  std::function<void(std::vector<uint8_t> frames, uint32_t count)>;
+
+/// An operation on the segment file of a recipient.
+struct OfflineJob {
+  OfflineJobKind kind = OFFLINE_APPEND;
+  /// The recipient
+  ident_t ident = 0;
+  /// The records to append, each message after the time it expires
+  std::vector<uint8_t> records;
+  /// The messages read expiring by then are dropped
+  uint64_t now = 0;
+  /// Handed the messages read
+  OfflineReady ready;
+};
+
+/// The messages sent to the clients not connected, delivered once they
+/// connect.
+///
+/// A queue keeps up to `OFFLINE_MEMORY_BYTES` in memory, the messages are
+/// then appended in one write to the file `offline-<IDENT>.spill` of the
+/// directory, each after the time it expires. The messages are kept for
+/// `OFFLINE_TTL_SECONDS`, the expired ones are dropped whenever the queue is
+/// touched and by a sweep of every queue each `OFFLINE_SWEEP_MS`. The queues
+/// are lost with the server, the files left are removed on start.
+///
+/// The queues are split into shards by recipient, a queue is only touched
+/// with the mutex of its shard held. The files are only written, read and
+/// removed by the thread of the store, which runs the operations queued in
+/// order and sweeps the queues, so no thread handling the messages waits
+/// for the disk.
+struct OfflineStore {
+  struct alignas(64) Shard {
+    std::mutex mutex;
+    std::unordered_map<ident_t, OfflineQueue> queues;
+  };
+
+  /// The directory of the segment files, none if empty and nothing is
+  /// queued
+  std::string path;
+  Shard shards[OFFLINE_SHARDS];
+  /// How long a message is kept, in nanoseconds
+  uint64_t ttl = (uint64_t)OFFLINE_TTL_SECONDS * 1000000000;
+  /// Bytes of the messages in memory
+  std::atomic<size_t> memory = 0;
+  /// Bytes of the messages queued
+  std::atomic<size_t> bytes = 0;
+
+  /// The operations on the files not run yet, in the order they were queued
+  std::deque<OfflineJob> jobs;
+  /// Mutex of the operations and of the sleep of the thread
+  std::mutex jobs_mutex;
+  /// Wakes the thread up for an operation or to stop
+  std::condition_variable wake;
+  /// Whether the thread runs, changed with `jobs_mutex` held
+  bool running = false;
+  /// Runs the operations on the files and sweeps the queues
+  std::thread thread;
+
+  OfflineStore() = default;
+  ~OfflineStore();
+
+  OfflineStore(const OfflineStore&) = delete;
+  OfflineStore& operator=(const OfflineStore&) = delete;
+
+  /// Spill the queues to the directory, creating it if need be, remove the
+  /// files left in it and start the thread of the store.
+  ///
+  /// Returns 1 if the directory cannot be opened.
+  int open(const std::string& path);
+  /// Stop the thread of the store, the operations not run yet are dropped.
+  void stop();
+  /// Whether the messages to the clients not connected are queued.
+  bool enabled() const { return !this->path.empty(); }
+
+  /// Queue the message for `dst`, at the time `now` of `metrics_now`.
+  ///
+  /// `online` is asked with the mutex of the queue held whether `dst` has
+  /// connected meanwhile, since the queue is taken once connected.
+  ///
+  /// Returns `RPL_NONE` if `dst` is online and nothing is queued,
+  /// `RPL_QUEUE_FULL` if a quota is reached, or `RPL_QUEUED`.
+  reply_code_t push(
+    ident_t dst,
+    ident_t src,
+    format_t format,
+    const uint8_t* data,
+    uint32_t len,
+    uint64_t now,
+    const std::function<bool()>& online
+  );
+  /// Take the messages queued for the recipient not expired at `now`,
+  /// appended to `frames` oldest first as version 1 `MSG_SEND` frames.
+  ///
+  /// Returns the number of the messages taken, or -1 if some have been
+  /// spilled: none is taken then, the queue is kept for `read` and the
+  /// messages sent to the recipient are queued until `finish`.
+  int take(ident_t ident, uint64_t now, std::vector<uint8_t>* frames);
+  /// Read the messages of the queue kept by `take` on the thread of the
+  /// store, and hand them to `ready` on that thread, the messages in memory
+  /// along with them.
+  void read(ident_t ident, uint64_t now, OfflineReady ready);
+  /// Take the messages queued for the recipient since `read` handed the
+  /// others, appended to `frames`, and drop its queue. If the recipient is
+  /// `gone` before they are written, they stay queued instead.
+  ///
+  /// Returns the number of the messages taken.
+  uint32_t finish(
+    ident_t ident,
+    uint64_t now,
+    std::vector<uint8_t>* frames,
+    bool gone
+  );
+
+  /// The shard holding the queue of the ident.
+  Shard& shard(ident_t ident);
+  /// The segment file of the recipient.
+  std::string spill_path(ident_t ident);
+  /// Hand the messages of the queue in memory to the thread of the store,
+  /// to be appended to its segment file.
+  void spill(ident_t ident, OfflineQueue* queue);
+  /// Drop the messages of the queue expired at `now`.
+  void expire(ident_t ident, OfflineQueue* queue, uint64_t now);
+  /// Queue the operation for the thread of the store, with the mutex of the
+  /// shard of its recipient held so that the operations on a file run in
+  /// the order its queue asks for them.
+  void queue_job(OfflineJob job);
+  /// Body of the thread of the store, runs the operations queued and sweeps
+  /// the queues until stopped.
+  void run();
+  /// Run the operation on the segment file, on the thread of the store.
+  void run_job(OfflineJob& job);
+  /// Read and remove the segment file of the queue kept by `take`, and hand
+  /// its messages and those in memory to the job.
+  void read_spilled(OfflineJob& job);
+  /// Drop the messages of every queue expired at `now`, and the queues left
+  /// empty.
+  void sweep(uint64_t now);
+};
+
+#endif  // SERVER_OFFLINE_H_
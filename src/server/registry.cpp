@@ -0,0 +1,472 @@
+#include "server/registry.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+
+/// Mutex of the thread indices
+static std::mutex thread_mutex;
+/// Indices released by the exited threads
+static std::vector<size_t> free_threads;
+/// Number of indices ever handed out, the slots to scan
+static std::atomic<size_t> thread_count = 0;
+
+/// Index of the current thread into the slots of every epoch domain, given
+/// back when the thread exits.
+struct ThreadIndex {
+  size_t index;
+
+  ThreadIndex() {
+    std::lock_guard<std::mutex> lock(thread_mutex);
+
+    if (!free_threads.empty()) {
+      this->index = free_threads.back();
+      free_threads.pop_back();
+      return;
+    }
+
+    this->index = thread_count.load();
+    if (this->index >= EPOCH_MAX_THREADS) {
+      fprintf(stderr, "more than %d threads reading\n", EPOCH_MAX_THREADS);
+      abort();
+    }
+
+    thread_count.store(this->index + 1);
+  }
+
+  ~ThreadIndex() {
+    std::lock_guard<std::mutex> lock(thread_mutex);
+    free_threads.push_back(this->index);
+  }
+};
+
+static thread_local ThreadIndex thread_index;
+
+EpochDomain::~EpochDomain() {
+  for (auto& retired : this->retired) {
+    retired.drop(retired.ptr);
+  }
+}
+
+void EpochDomain::enter() {
+  Slot& slot = this->slots[thread_index.index];
+
+  if (slot.depth++ == 0) {
+    // the announcement must be visible before the shared pointers are read,
+    // or a writer could miss it and free what is about to be read.
+    slot.epoch.store(this->epoch.load(), std::memory_order_seq_cst);
+  }
+}
+
+void EpochDomain::leave() {
+  Slot& slot = this->slots[thread_index.index];
+
+  if (--slot.depth == 0) {
+    slot.epoch.store(0, std::memory_order_release);
+  }
+}
+
+void EpochDomain::retire(void* ptr, void (*drop)(void*)) {
+  // readers announcing this epoch or an earlier one may still hold `ptr`,
+  // the later ones can only see what replaced it.
+  uint64_t epoch = this->epoch.fetch_add(1, std::memory_order_seq_cst);
+
+  std::lock_guard<std::mutex> lock(this->mutex);
+  this->retired.push_back(Retired{epoch, ptr, drop});
+  this->reclaim();
+}
+
+void EpochDomain::reclaim() {
+  uint64_t oldest = UINT64_MAX;
+
+  size_t threads = thread_count.load();
+  for (size_t i = 0; i < threads; i++) {
+    uint64_t epoch = this->slots[i].epoch.load(std::memory_order_seq_cst);
+    if (epoch != 0 && epoch < oldest) {
+      oldest = epoch;
+    }
+  }
+
+  auto end = std::partition(
+    this->retired.begin(), this->retired.end(),
+    [oldest](const Retired& retired) { return retired.epoch >= oldest; }
+  );
+
+  for (auto it = end; it != this->retired.end(); it++) {
+    it->drop(it->ptr);
+  }
+
+  this->retired.erase(end, this->retired.end());
+}
+
+/// Number of the buckets of a shard to start with, a power of two.
+#define REGISTRY_BUCKETS 16
+
+/// Free an entry retired to the epoch domain.
+static void drop_entry(void* ptr) {
+  delete (Registry::Entry*)ptr;
+}
+
+/// Free buckets retired to the epoch domain, with the entries linked in them.
+static void drop_buckets(void* ptr) {
+  Registry::Buckets* buckets = (Registry::Buckets*)ptr;
+
+  for (size_t i = 0; i <= buckets->mask; i++) {
+    Registry::Entry* entry = buckets->heads[i].load(std::memory_order_relaxed);
+    while (entry != nullptr) {
+      Registry::Entry* next = entry->next.load(std::memory_order_relaxed);
+      delete entry;
+      entry = next;
+    }
+  }
+
+  delete buckets;
+}
+
+/// Allocate `count` empty buckets.
+static Registry::Buckets* make_buckets(size_t count) {
+  Registry::Buckets* buckets = new Registry::Buckets();
+  buckets->mask = count - 1;
+  buckets->heads = std::make_unique<std::atomic<Registry::Entry*>[]>(count);
+
+  for (size_t i = 0; i < count; i++) {
+    buckets->heads[i].store(nullptr, std::memory_order_relaxed);
+  }
+
+  return buckets;
+}
+
+/// A copy of the entry to modify, or a new entry of the ident if none.
+static Registry::Entry* copy_entry(const Registry::Entry* old, ident_t ident) {
+  Registry::Entry* entry = new Registry::Entry();
+  entry->ident = ident;
+
+  if (old != nullptr) {
+    entry->client = old->client;
+    entry->endpoint = old->endpoint;
+    entry->room = old->room;
+    entry->members = old->members;
+    entry->joined = old->joined;
+  }
+
+  return entry;
+}
+
+/// Whether the entry refers to nothing any more.
+static bool entry_empty(const Registry::Entry* entry) {
+  return !entry->client && !entry->room && entry->joined.empty();
+}
+
+/// The bucket of the ident.
+static size_t bucket_of(ident_t ident, size_t mask) {
+  return ident_hash(ident) & mask;
+}
+
+Registry::Registry() {
+  for (auto& shard : this->shards) {
+    shard.buckets.store(make_buckets(REGISTRY_BUCKETS));
+  }
+}
+
+Registry::~Registry() {
+  for (auto& shard : this->shards) {
+    drop_buckets(shard.buckets.load());
+  }
+}
+
+Registry::Shard& Registry::shard(ident_t ident) {
+  return this->shards[(ident_hash(ident) >> 16) & (REGISTRY_SHARDS - 1)];
+}
+
+const Registry::Entry* Registry::find(Shard& shard, ident_t ident) {
+  const Buckets* buckets = shard.buckets.load(std::memory_order_seq_cst);
+
+  size_t bucket = bucket_of(ident, buckets->mask);
+
+  const Entry* entry = buckets->heads[bucket].load(std::memory_order_seq_cst);
+  while (entry != nullptr && entry->ident != ident) {
+    entry = entry->next.load(std::memory_order_seq_cst);
+  }
+
+  return entry;
+}
+
+void Registry::replace(Shard& shard, const Entry* old, Entry* entry) {
+  Buckets* buckets = shard.buckets.load(std::memory_order_relaxed);
+  ident_t ident = old != nullptr ? old->ident : entry->ident;
+
+  // the link to the old entry, or the head of the bucket for a new one
+  std::atomic<Entry*>* link = &buckets->heads[bucket_of(ident, buckets->mask)];
+  if (old != nullptr) {
+    while (link->load(std::memory_order_relaxed) != old) {
+      link = &link->load(std::memory_order_relaxed)->next;
+    }
+  }
+
+  Entry* next = old != nullptr ? old->next.load(std::memory_order_relaxed)
+                               : link->load(std::memory_order_relaxed);
+
+  // readers on the old entry still find the rest of the bucket through it
+  if (entry != nullptr) {
+    entry->next.store(next, std::memory_order_relaxed);
+    link->store(entry, std::memory_order_seq_cst);
+  } else {
+    link->store(next, std::memory_order_seq_cst);
+  }
+
+  if (old != nullptr) {
+    this->epoch.retire((void*)old, drop_entry);
+  } else {
+    shard.count++;
+  }
+  if (entry == nullptr) {
+    shard.count--;
+  }
+
+  if (shard.count > buckets->mask + 1) {
+    this->grow(shard);
+  }
+}
+
+void Registry::grow(Shard& shard) {
+  Buckets* old = shard.buckets.load(std::memory_order_relaxed);
+  Buckets* buckets = make_buckets((old->mask + 1) * 2);
+
+  // the entries are copied rather than moved, the readers of the old buckets
+  // walk their links
+  for (size_t i = 0; i <= old->mask; i++) {
+    const Entry* entry = old->heads[i].load(std::memory_order_relaxed);
+    while (entry != nullptr) {
+      Entry* copy = copy_entry(entry, entry->ident);
+      auto& head = buckets->heads[bucket_of(entry->ident, buckets->mask)];
+      copy->next.store(head.load(std::memory_order_relaxed));
+      head.store(copy, std::memory_order_relaxed);
+
+      entry = entry->next.load(std::memory_order_relaxed);
+    }
+  }
+
+  shard.buckets.store(buckets, std::memory_order_seq_cst);
+  this->epoch.retire((void*)old, drop_buckets);
+}
+
+reply_code_t Registry::add_client(
+  ident_t ident,
+  SOCKET socket,
+  size_t max_clients,
+  uint32_t reactor,
+  uint64_t serial
+) {
+  // take the place first, so concurrent connects cannot exceed the maximum
+  if (this->client_count.fetch_add(1) >= max_clients) {
+    this->client_count.fetch_sub(1);
+    return RPL_REJECTED;
+  }
+
+  Shard& shard = this->shard(ident);
+  std::lock_guard<std::mutex> lock(shard.mutex);
+
+  const Entry* old = this->find(shard, ident);
+  if (old != nullptr && old->client) {
+    this->client_count.fetch_sub(1);
+    return RPL_DUPLICATED_ID;
+  }
+
+  Entry* entry = copy_entry(old, ident);
+  entry->client = true;
+  entry->endpoint = Endpoint{socket, reactor, serial};
+  this->replace(shard, old, entry);
+
+  return RPL_OK;
+}
+
+int Registry::remove_client(ident_t ident, SOCKET socket) {
+  Shard& shard = this->shard(ident);
+  std::lock_guard<std::mutex> lock(shard.mutex);
+
+  const Entry* old = this->find(shard, ident);
+  if (old == nullptr || !old->client || old->endpoint.socket != socket) {
+    return 0;
+  }
+
+  Entry* entry = copy_entry(old, ident);
+  entry->client = false;
+  entry->endpoint = Endpoint{};
+
+  if (entry_empty(entry)) {
+    delete entry;
+    entry = nullptr;
+  }
+
+  this->replace(shard, old, entry);
+
+  this->client_count.fetch_sub(1);
+
+  return 1;
+}
+
+SOCKET Registry::find_client(ident_t ident) {
+  EpochGuard guard(&this->epoch);
+
+  const Entry* entry = this->find(this->shard(ident), ident);
+
+  return entry != nullptr && entry->client ? entry->endpoint.socket
+                                           : INVALID_SOCKET;
+}
+
+size_t Registry::clients() {
+  return this->client_count.load(std::memory_order_relaxed);
+}
+
+reply_code_t Registry::join(
+  ident_t room,
+  ident_t member,
+  const std::function<void()>& post
+) {
+  {
+    Shard& shard = this->shard(room);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+
+    const Entry* old = this->find(shard, room);
+    if (old != nullptr && old->client) {
+      return RPL_ROOM_CONFLICT;
+    }
+
+    // the member is counted in first, so the last member leaving meanwhile
+    // cannot drop the room under the join
+    Entry* entry = copy_entry(old, room);
+    entry->room = true;
+    entry->members++;
+    this->replace(shard, old, entry);
+  }
+
+  {
+    Shard& shard = this->shard(member);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+
+    const Entry* old = this->find(shard, member);
+    if (old == nullptr ||
+        std::find(old->joined.begin(), old->joined.end(), room) ==
+          old->joined.end()) {
+      Entry* entry = copy_entry(old, member);
+      entry->joined.push_back(room);
+      this->replace(shard, old, entry);
+
+      post();
+
+      return RPL_OK;
+    }
+  }
+
+  // in the room already, counted twice
+  this->release(room);
+
+  return RPL_OK;
+}
+
+reply_code_t Registry::leave(
+  ident_t room,
+  ident_t member,
+  const std::function<void()>& post
+) {
+  {
+    // a room is only dropped once the member is out of it, the check holds
+    // for a member of the room
+    EpochGuard guard(&this->epoch);
+
+    const Entry* entry = this->find(this->shard(room), room);
+    if (entry == nullptr || !entry->room) {
+      return RPL_ROOM_NOT_FOUND;
+    }
+  }
+
+  {
+    Shard& shard = this->shard(member);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+
+    const Entry* old = this->find(shard, member);
+    if (old == nullptr) {
+      return RPL_NOT_IN_ROOM;
+    }
+
+    auto pos = std::find(old->joined.begin(), old->joined.end(), room);
+    if (pos == old->joined.end()) {
+      return RPL_NOT_IN_ROOM;
+    }
+
+    Entry* entry = copy_entry(old, member);
+    entry->joined.erase(entry->joined.begin() + (pos - old->joined.begin()));
+
+    if (entry_empty(entry)) {
+      delete entry;
+      entry = nullptr;
+    }
+
+    this->replace(shard, old, entry);
+
+    post();
+  }
+
+  this->release(room);
+
+  return RPL_OK;
+}
+
+void Registry::release(ident_t room) {
+  Shard& shard = this->shard(room);
+  std::lock_guard<std::mutex> lock(shard.mutex);
+
+  const Entry* old = this->find(shard, room);
+  Entry* entry = copy_entry(old, room);
+
+  if (--entry->members == 0) {
+    entry->room = false;
+  }
+
+  if (entry_empty(entry)) {
+    delete entry;
+    entry = nullptr;
+  }
+
+  this->replace(shard, old, entry);
+}
+
+bool Registry::joined(ident_t room, ident_t member) {
+  EpochGuard guard(&this->epoch);
+
+  const Entry* entry = this->find(this->shard(member), member);
+
+  return entry != nullptr &&
+         std::find(entry->joined.begin(), entry->joined.end(), room) !=
+           entry->joined.end();
+}
+
+RouteKind Registry::route(ident_t dst, std::vector<Endpoint>* endpoints) {
+  EpochGuard guard(&this->epoch);
+
+  const Entry* entry = this->find(this->shard(dst), dst);
+  if (entry == nullptr) {
+    return ROUTE_NONE;
+  }
+
+  if (entry->client) {
+    endpoints->push_back(entry->endpoint);
+    return ROUTE_CLIENT;
+  }
+
+  return entry->room ? ROUTE_ROOM : ROUTE_NONE;
+}
+
+void Registry::resolve(
+  const std::vector<ident_t>& members,
+  std::vector<Endpoint>* endpoints
+) {
+  EpochGuard guard(&this->epoch);
+
+  for (auto member : members) {
+    const Entry* entry = this->find(this->shard(member), member);
+    if (entry != nullptr && entry->client) {
+      endpoints->push_back(entry->endpoint);
+    }
+  }
+}
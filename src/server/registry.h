@@ -0,0 +1,243 @@
+#ifndef SERVER_REGISTRY_H_
+#define SERVER_REGISTRY_H_
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "net/socket.h"
+#include "protocol/protocol.h"
+
+/// Number of shards of the registry, a power of two.
+#define REGISTRY_SHARDS 64
+/// Maximum number of threads reading an epoch domain at the same time.
+#define EPOCH_MAX_THREADS 256
+
+/// Epoch based reclamation of memory read without locks.
+///
+/// A reader announces the epoch it started in for as long as it holds
+/// pointers to shared memory. A writer replacing such memory retires the old
+/// copy with the current epoch, and it is freed once every reader announces a
+/// later epoch or none. Reading costs a store to a cache line owned by the
+/// reading thread and never waits for writers.
+struct EpochDomain {
+  /// The announcement of a thread.
+  struct alignas(64) Slot {
+    /// The epoch the thread started reading in, 0 while not reading
+    std::atomic<uint64_t> epoch = 0;
+    /// Depth of the nested guards of the thread
+    uint32_t depth = 0;
+  };
+
+  /// Memory waiting for the readers to move on.
+  struct Retired {
+    /// The epoch it has been retired in
+    uint64_t epoch;
+    void* ptr;
+    void (*drop)(void*);
+  };
+
+  /// The current epoch
+  std::atomic<uint64_t> epoch = 1;
+  /// The announcements, indexed by thread
+  Slot slots[EPOCH_MAX_THREADS];
+  /// Mutex of the retired memory
+  std::mutex mutex;
+  /// The retired memory
+  std::vector<Retired> retired;
+
+  ~EpochDomain();
+
+  /// Start reading on the current thread.
+  void enter();
+  /// Stop reading on the current thread.
+  void leave();
+  /// Free `ptr` with `drop` once no reader can hold it.
+  void retire(void* ptr, void (*drop)(void*));
+  /// Free the retired memory no reader can hold, with the mutex held.
+  void reclaim();
+};
+
+/// Keeps the memory read by the current thread alive in its scope.
+struct EpochGuard {
+  EpochDomain* domain;
+
+  explicit EpochGuard(EpochDomain* domain) : domain(domain) { domain->enter(); }
+  ~EpochGuard() { domain->leave(); }
+
+  EpochGuard(const EpochGuard&) = delete;
+  EpochGuard& operator=(const EpochGuard&) = delete;
+};
+
+/// Hash of the ident for spreading idents over shards, reactors or buckets.
+///
+/// Consecutive idents, which clients tend to pick, land far apart in the
+/// bits from the 16th up, which are taken for the shards.
+inline uint32_t ident_hash(ident_t ident) {
+  return ident * 0x9E3779B1u;
+}
+
+/// What a destination ident refers to.
+enum RouteKind {
+  ROUTE_NONE = 0,
+  ROUTE_CLIENT,
+  ROUTE_ROOM,
+};
+
+/// Where a registered client is connected.
+struct Endpoint {
+  /// The socket of the client
+  SOCKET socket = INVALID_SOCKET;
+  /// The reactor of the server owning the socket
+  uint32_t reactor = 0;
+  /// The serial of the connection, to tell it from a later connection on
+  /// the socket
+  uint64_t serial = 0;
+};
+
+/// Concurrent registry of the clients and rooms.
+///
+/// Idents are split into shards, each a hash table of immutable entries, one
+/// per ident. Lookups walk the buckets without any lock, under an epoch
+/// guard. Writers are serialized per shard: they copy the entry of the
+/// ident, modify the copy and link it in place of the old one, which is
+/// retired to the epoch domain. Connecting, joining and leaving thus cost the
+/// same however many clients the shard holds. A shard growing past a load of
+/// one entry per bucket is copied into twice the buckets, which spreads to a
+/// constant per entry.
+///
+/// A client and a room with the same ident share the entry, so the conflict
+/// checks between them are atomic.
+///
+/// The members of a room are not kept here but by the reactor owning the
+/// room, the registry only records the rooms each member has joined, to
+/// answer joins and leaves at once and order the changes posted to the
+/// owner, and counts the members of each room. A room is created by its
+/// first join and dropped once its last member leaves.
+struct Registry {
+  /// Rooms joined by a member.
+  using Rooms = std::vector<ident_t>;
+
+  /// What an ident refers to.
+  struct Entry {
+    ident_t ident = 0;
+    /// Whether a client is registered with the ident
+    bool client = false;
+    /// Where the client is connected
+    Endpoint endpoint;
+    /// Whether a room has the ident
+    bool room = false;
+    /// Number of the members of the room
+    uint32_t members = 0;
+    /// The rooms joined by the client with the ident
+    Rooms joined;
+    /// The next entry of the bucket
+    std::atomic<Entry*> next = nullptr;
+  };
+
+  /// The buckets of a shard, replaced as a whole when the shard grows.
+  struct Buckets {
+    /// Number of the buckets minus one, a power of two minus one
+    size_t mask = 0;
+    /// The first entry of every bucket
+    std::unique_ptr<std::atomic<Entry*>[]> heads;
+  };
+
+  struct alignas(64) Shard {
+    /// Serializes the writers of the shard
+    std::mutex mutex;
+    /// The published buckets
+    std::atomic<Buckets*> buckets;
+    /// Number of the entries, with the mutex held
+    size_t count = 0;
+  };
+
+  EpochDomain epoch;
+  Shard shards[REGISTRY_SHARDS];
+  /// Number of the registered clients
+  std::atomic<size_t> client_count = 0;
+
+  Registry();
+  ~Registry();
+
+  Registry(const Registry&) = delete;
+  Registry& operator=(const Registry&) = delete;
+
+  /// Register the client on the connection of the socket and serial, of the
+  /// reactor.
+  ///
+  /// Returns `RPL_REJECTED` if `max_clients` are registered already,
+  /// `RPL_DUPLICATED_ID` if the ident is taken or `RPL_OK`.
+  reply_code_t add_client(
+    ident_t ident,
+    SOCKET socket,
+    size_t max_clients,
+    uint32_t reactor = 0,
+    uint64_t serial = 0
+  );
+  /// Unregister the client if it is still bound to the socket.
+  ///
+  /// Returns 1 if the client has been removed.
+  int remove_client(ident_t ident, SOCKET socket);
+  /// Get the socket of the client, `INVALID_SOCKET` if not registered.
+  SOCKET find_client(ident_t ident);
+  /// Number of the registered clients.
+  size_t clients();
+
+  /// Add the member to the room, creating the room if needed.
+  ///
+  /// If the member was not in the room yet, `post` is called to pass the
+  /// change on to the owner of the room, with the mutex of the member held
+  /// so the changes of a membership reach the owner in the order they are
+  /// decided.
+  ///
+  /// Returns `RPL_ROOM_CONFLICT` if a client has the ident of the room, or
+  /// `RPL_OK`.
+  reply_code_t join(
+    ident_t room,
+    ident_t member,
+    const std::function<void()>& post
+  );
+  /// Remove the member from the room, calling `post` like `join` does, and
+  /// drop the room once it has no member left.
+  ///
+  /// Returns `RPL_ROOM_NOT_FOUND`, `RPL_NOT_IN_ROOM` or `RPL_OK`.
+  reply_code_t leave(
+    ident_t room,
+    ident_t member,
+    const std::function<void()>& post
+  );
+
+  /// Whether the member has joined the room.
+  bool joined(ident_t room, ident_t member);
+
+  /// Resolve the destination.
+  ///
+  /// The endpoint of a client is appended to `endpoints`, the members of a
+  /// room are resolved by its owner with `resolve`.
+  RouteKind route(ident_t dst, std::vector<Endpoint>* endpoints);
+  /// Append the endpoints of the registered clients among the members to
+  /// `endpoints`.
+  void resolve(
+    const std::vector<ident_t>& members,
+    std::vector<Endpoint>* endpoints
+  );
+
+  /// The shard holding the ident.
+  Shard& shard(ident_t ident);
+  /// The entry of the ident in the shard, `nullptr` if none, under an epoch
+  /// guard or with the mutex of the shard held.
+  const Entry* find(Shard& shard, ident_t ident);
+  /// Link `entry` in place of `old`, either `nullptr` to add or remove the
+  /// entry of the ident, with the mutex of the shard held.
+  void replace(Shard& shard, const Entry* old, Entry* entry);
+  /// Copy the entries into twice the buckets, with the mutex of the shard
+  /// held.
+  void grow(Shard& shard);
+  /// Count a member out of the room, dropping the room if it was the last.
+  void release(ident_t room);
+};
+
+#endif  // SERVER_REGISTRY_H_
@@ -1,95 +1,438 @@
 
 #include "stdio.h"
+#include "string.h"
 #include "time.h"
 
-#include "WS2tcpip.h"
-#include "process.h"
-
+#include "net/socket.h"
+#include "protocol/compress.h"
 #include "protocol/protocol.h"
+#include "protocol/protocol_v2.h"
 #include "server/server.h"
 
+#include <algorithm>
 #include <chrono>
+#include <format>
 #include <iostream>
+#include <thread>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+/// How long a connection to the metrics socket may take to send a request.
+#define METRICS_REQUEST_WAIT_US 100000
+
+OverflowPolicy overflow_policy_parse(const std::string& name) {
+  if (name == "drop-oldest") {
+    return OVERFLOW_DROP_OLDEST;
+  } else if (name == "drop-newest") {
+    return OVERFLOW_DROP_NEWEST;
+  } else if (name == "disconnect") {
+    return OVERFLOW_DISCONNECT;
+  }
 
-#pragma comment(lib, "ws2_32.lib")
-
-void ServerState::log(const std::wstring& msg) {
-  auto const time =
-    std::chrono::current_zone()->to_local(std::chrono::system_clock::now());
+  return OVERFLOW_BLOCK;
+}
 
-  // grey for time and default for msg
-  std::wcout << std::format(L"\033[90m[ {} SERVER ]\033[0m {}", time, msg)
-             << std::endl;
+/// Pin the calling thread to the CPU.
+///
+/// Returns 1 if the platform cannot or the CPU does not exist.
+static int server_pin_thread(int cpu) {
+#if defined(__linux__)
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0 ? 0
+                                                                         : 1;
+#elif defined(_WIN32)
+  DWORD_PTR mask = (DWORD_PTR)1 << cpu;
+  return SetThreadAffinityMask(GetCurrentThread(), mask) != 0 ? 0 : 1;
+#else
+  return 1;
+#endif
 }
 
 int ServerState::init(size_t port, size_t max_clients) {
   this->port = port;
   this->max_clients = max_clients;
 
-  this->master = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-  if (this->master == INVALID_SOCKET) {
-    this->log(std::format(L"could not create socket: {}", WSAGetLastError()));
-    return 1;
-  }
-
-  this->log(L"master socket created.");
-
   this->server.sin_family = AF_INET;
   this->server.sin_addr.s_addr = INADDR_ANY;
   this->server.sin_port = htons((u_short)port);
 
-  if (bind(this->master, (struct sockaddr*)&this->server, sizeof(this->server)) == SOCKET_ERROR) {
-    this->log(std::format(L"bind failed with error code: {}", WSAGetLastError())
+#ifndef SO_REUSEPORT
+  // a single socket can listen on the port
+  if (this->reactor_count > 1) {
+    this->log<LOG_WARN>(
+      L"SO_REUSEPORT is not supported, running a single reactor."
     );
-    return 1;
+    this->reactor_count = 1;
+  }
+#endif
+
+  this->reactor_count = std::max(this->reactor_count, (size_t)1);
+
+  // every reactor and worker reads the registry, which serves a bounded
+  // number of threads. a worker is kept if any was asked for.
+  size_t max_threads = EPOCH_MAX_THREADS - SERVER_OTHER_THREADS;
+  if (this->reactor_count + this->worker_count > max_threads) {
+    this->log<LOG_ERROR>(
+      L"{} reactors and {} workers are more than the {} threads supported.",
+      this->reactor_count, this->worker_count, max_threads
+    );
+
+    this->reactor_count = std::min(
+      this->reactor_count, max_threads - (this->worker_count > 0 ? 1 : 0)
+    );
+    this->worker_count =
+      std::min(this->worker_count, max_threads - this->reactor_count);
+
+    this->log<LOG_ERROR>(
+      L"running {} reactors and {} workers.", this->reactor_count,
+      this->worker_count
+    );
+  }
+
+  for (size_t i = 0; i < this->reactor_count; i++) {
+    auto reactor = std::make_unique<ServerReactor>(this, (uint32_t)i);
+
+    if (reactor->listen_on(&this->server) != 0) {
+      return 1;
+    }
+
+    this->reactors.push_back(std::move(reactor));
   }
 
   this->log(L"bind done.");
 
+  if (!this->history_path.empty()) {
+    std::wstring path(this->history_path.begin(), this->history_path.end());
+
+    if (this->history.open(this->history_path) != 0) {
+      this->log<LOG_WARN>(L"could not open the history in {}", path);
+      return 1;
+    }
+
+    this->log(
+      L"keeping the history of the rooms in {}, {} rooms so far.", path,
+      this->history.room_count()
+    );
+  }
+
+  if (!this->offline_path.empty()) {
+    std::wstring path(this->offline_path.begin(), this->offline_path.end());
+
+    if (this->offline.open(this->offline_path) != 0) {
+      this->log<LOG_WARN>(L"could not open the offline queues in {}", path);
+      return 1;
+    }
+
+    this->log(L"queueing the messages to the offline clients in {}.", path);
+  }
+
   this->show_info();
 
   return 0;
 }
 
+uint32_t ServerState::room_owner(ident_t room) {
+  return (ident_hash(room) >> 16) % (uint32_t)this->reactors.size();
+}
+
 void ServerState::loop() {
-  listen(this->master, SOMAXCONN);
+  this->log(
+    L"listening on port {} with {} reactors...", this->port,
+    this->reactors.size()
+  );
+
+  if (this->worker_count > 0) {
+    this->log(L"handling the messages on {} workers.", this->worker_count);
+    this->pool = std::make_unique<WorkPool>();
+    this->pool->start(this->worker_count);
+  }
+
+  std::latch ready((ptrdiff_t)this->reactors.size());
+  std::latch stopped((ptrdiff_t)this->reactors.size());
+  std::vector<std::thread> threads;
+
+  for (size_t i = 0; i < this->reactors.size(); i++) {
+    threads.emplace_back([this, i, &ready, &stopped]() {
+      if (!this->cpus.empty()) {
+        int cpu = this->cpus[i % this->cpus.size()];
 
-  this->log(std::format(L"listening on port {}...", this->port));
+        if (server_pin_thread(cpu) != 0) {
+          this->log<LOG_WARN>(L"could not pin reactor {} to cpu {}.", i, cpu);
+        }
+      }
 
-  SOCKET client_socket;
-  struct sockaddr_in client_addr;
+      this->reactors[i]->run(&ready, &stopped);
+    });
+  }
 
-  int addrlen = sizeof(struct sockaddr_in);
+  ready.wait();
 
-  // tracking the threads of recv handler
-  std::vector<std::thread> threads;
+  // a reactor failing to start stops them all
+  std::thread quit_handler;
+  std::thread metrics_handler;
 
-  std::thread quit_handler(server_quit_handler, this);
+  if (this->running) {
+    // ready before the quit handler may wake it up
+    if (!this->metrics_path.empty() && this->metrics_reactor.init() != 0) {
+      this->log<LOG_WARN>(L"could not wait for the metrics socket.");
+      this->metrics_path.clear();
+    }
 
-  while ((client_socket =
-            accept(this->master, (struct sockaddr*)&client_addr, &addrlen)) !=
-         INVALID_SOCKET) {
-    // modify the clients
-    this->mutex.lock();
-    this->log(L"connection accepted.");
-    // unlock the mutex
-    this->mutex.unlock();
+    quit_handler = std::thread(server_quit_handler, this);
 
-    // create a thread to handle the client and track it
-    threads.emplace_back(server_recv_handler, this, client_socket);
+    if (!this->metrics_path.empty()) {
+      metrics_handler = std::thread(server_metrics_handler, this);
+    }
   }
 
   for (auto& thread : threads) {
     thread.join();
   }
 
-  quit_handler.join();
+  if (quit_handler.joinable()) {
+    quit_handler.join();
+  }
+
+  if (metrics_handler.joinable()) {
+    metrics_handler.join();
+    this->metrics_reactor.cleanup();
+  }
+
+  // the tasks left, like unregistering the clients closed last, may still
+  // post to the reactors
+  if (this->pool != nullptr) {
+    this->pool->stop();
+  }
+
+  // the messages read for the clients are posted to the reactors as well
+  this->offline.stop();
+
+  // released once nothing can wake the reactors up any more
+  for (auto& reactor : this->reactors) {
+    if (reactor->io != nullptr) {
+      reactor->io->cleanup();
+    }
+  }
+
+  MetricsShard total;
+  this->metrics.collect(&total);
+
+  uint64_t syscalls = 0;
+  uint64_t flushes = 0;
+  uint64_t flushed_bytes = 0;
+
+  for (auto& reactor : this->reactors) {
+    if (reactor->io != nullptr) {
+      syscalls += reactor->io->syscalls;
+      flushes += reactor->io->flushes;
+      flushed_bytes += reactor->io->flushed_bytes;
+    }
+  }
+
+  this->log(
+    L"{} system calls for {} forwarded messages.", syscalls,
+    total.forwarded.load()
+  );
+  this->log(
+    L"{} flushes, {} bytes per flush.", flushes,
+    flushes > 0 ? flushed_bytes / flushes : 0
+  );
+
+  Histogram& latency = total.forward_latency;
+  this->log(
+    L"forward latency p50 {} us, p99 {} us, p99.9 {} us.",
+    latency.quantile(0.5) / 1000, latency.quantile(0.99) / 1000,
+    latency.quantile(0.999) / 1000
+  );
+
+  this->cleanup();
+}
+
+int ServerReactor::listen_on(const struct sockaddr_in* address) {
+  this->master = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+  if (this->master == INVALID_SOCKET) {
+    this->log<LOG_WARN>(L"could not create socket: {}", WSAGetLastError());
+    return 1;
+  }
+
+  this->log<LOG_DEBUG>(L"master socket {} created.", this->index);
+
+#ifdef SO_REUSEPORT
+  // every reactor listens on the port, the kernel spreads the connections
+  int reuse = 1;
+  if (setsockopt(
+        this->master, SOL_SOCKET, SO_REUSEPORT, (char*)&reuse, sizeof(reuse)
+      ) == SOCKET_ERROR) {
+    this->log<LOG_WARN>(
+      L"SO_REUSEPORT failed with error code: {}", WSAGetLastError()
+    );
+    return 1;
+  }
+#endif
+
+  if (bind(this->master, (struct sockaddr*)address, sizeof(*address)) ==
+      SOCKET_ERROR) {
+    this->log<LOG_WARN>(L"bind failed with error code: {}", WSAGetLastError());
+    return 1;
+  }
+
+  if (listen(this->master, SOMAXCONN) == SOCKET_ERROR) {
+    this->log<LOG_WARN>(
+      L"listen failed with error code: {}", WSAGetLastError()
+    );
+    return 1;
+  }
+
+  return 0;
+}
+
+void ServerReactor::run(std::latch* ready, std::latch* stopped) {
+  // the messages of the connections of the reactor are all handled here
+  this->stats = this->server->metrics.local();
+
+  this->io = io_backend_create(this->server->backend);
+
+  if (this->io == nullptr || this->io->init(this->master, this) != 0) {
+    const std::string& backend = this->server->backend;
+    std::wstring name(backend.begin(), backend.end());
+    this->log<LOG_WARN>(
+      L"failed to initialize the {} backend, falling back to epoll.", name
+    );
+
+    if (this->io != nullptr) {
+      this->io->cleanup();
+    }
+
+    this->io = io_backend_create("epoll");
+
+    if (this->io->init(this->master, this) != 0) {
+      this->log<LOG_WARN>(
+        L"failed to initialize the epoll backend: {}", WSAGetLastError()
+      );
+      this->io = nullptr;
+      this->server->running = false;
+      ready->count_down();
+      stopped->count_down();
+      return;
+    }
+  }
+
+  this->io->flush_delay_us = this->server->flush_delay_us;
+
+  if (this->index == 0) {
+    std::string name = this->io->name();
+    this->log(L"using the {} backend.", std::wstring(name.begin(), name.end()));
+  }
+
+  this->timers.init(metrics_now(), (uint64_t)TIMER_TICK_MS * 1000000);
+
+  // nothing is posted to a reactor before its backend can be woken up
+  ready->arrive_and_wait();
+
+  // idle connections cost nothing here, the thread only wakes up when a
+  // socket is ready, a message is posted, the quit handler wakes it up or a
+  // tick of the timers has heartbeats to run.
+  while (this->server->running) {
+    if (this->io->poll(this->timers.timeout_ms(metrics_now())) < 0) {
+      this->log<LOG_WARN>(
+        L"backend poll failed with error code: {}", WSAGetLastError()
+      );
+      break;
+    }
+
+    server_drain_mailbox(this);
+
+    this->timers.advance(metrics_now(), [this](uint64_t socket) {
+      server_heartbeat(this, (SOCKET)socket);
+    });
+  }
+
+  // the others may still post and wake this reactor up until they stop
+  stopped->arrive_and_wait();
+
+  std::vector<SOCKET> sockets;
+  for (auto& [socket, conn] : this->connections) {
+    sockets.push_back(socket);
+  }
+  for (auto socket : sockets) {
+    server_close(this, socket);
+  }
+}
+
+void ServerReactor::on_accept(SOCKET socket) {
+  int nodelay = 1;
+  setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, (char*)&nodelay, sizeof(nodelay));
+
+  auto [it, inserted] = this->connections.emplace(socket, Connection());
+  Connection& connection = it->second;
+  connection.socket = socket;
+  framer_init(&connection.framer);
+  connection.framer.allocator = &this->pool.allocator;
+  connection.serial = ++this->server->serials;
+
+  connection.session = std::make_shared<Session>();
+  connection.session->socket = socket;
+  connection.session->serial = connection.serial;
+  connection.session->reactor = this->index;
+
+  if (this->server->pool != nullptr) {
+    connection.session->strand =
+      std::make_unique<Strand>(this->server->pool.get());
+  }
+
+  connection.active = metrics_now();
+  server_schedule_heartbeat(this, &connection, connection.active);
+
+  metric_add(this->stats->accepted, 1);
+
+  this->log(L"connection accepted.");
+}
+
+void ServerReactor::on_accept_failed(int error) {
+  this->log<LOG_ERROR>(L"accept failed with error code: {}", error);
+}
+
+void ServerReactor::on_recv(SOCKET socket, uint8_t* data, size_t len) {
+  server_recv_handler(this, socket, data, (int)len);
+}
+
+void ServerReactor::on_closed(SOCKET socket) {
+  this->log(L"socket disconnected.");
+  server_close(this, socket);
+}
+
+void ServerReactor::on_drained(SOCKET socket) {
+  auto it = this->connections.find(socket);
+  if (it == this->connections.end()) {
+    return;
+  }
+
+  Connection& connection = it->second;
+  server_release(this, &connection);
+
+  // the client learns about the messages it missed once it has caught up
+  if (connection.dropped > 0) {
+    this->log<LOG_DEBUG>(
+      L"{} messages dropped to a slow client.", connection.dropped
+    );
+    connection.dropped = 0;
+
+    uint8_t reply[sizeof(msg_reply_t)];
+    length_t len = protocol_wrap_msg_reply(RPL_DROPPED, reply);
+    this->stats->reply(RPL_DROPPED);
+    server_send(this, socket, reply, len);
+  }
 }
 
 void ServerState::show_info() {
   char hostname[256];
   gethostname(hostname, 256);
-  struct addrinfo hints = {0};
+  struct addrinfo hints = {};
   struct addrinfo* addrs;
 
   hints.ai_family = AF_INET;
@@ -112,330 +455,1952 @@ void ServerState::show_info() {
   // this->log(std::format(L"server max clients: {}", this->max_clients));
 
   // green for ip, port and max clients value and default for promt text
-  this->log(std::format(
+  this->log(
     L"server ip & port:   \033[92m{}:{}\033[0m", ip_wstr,
     ntohs(this->server.sin_port)
-  ));
-  this->log(
-    std::format(L"server max clients: \033[92m{}\033[0m", this->max_clients)
   );
+  this->log(L"server max clients: \033[92m{}\033[0m", this->max_clients);
 }
 
 void ServerState::cleanup() {
   this->log(L"cleaning up...");
-  closesocket(this->master);
+  for (auto& reactor : this->reactors) {
+    if (reactor->master != INVALID_SOCKET) {
+      closesocket(reactor->master);
+      reactor->master = INVALID_SOCKET;
+    }
+  }
   WSACleanup();
   this->log(L"cleaned up.");
 }
 
-void server_recv_handler(ServerState* state, SOCKET socket) {
-  uint8_t buffer[PROTOCOL_BUFFER_SIZE] = {0};
-  uint8_t reply_buffer[PROTOCOL_BUFFER_SIZE] = {0};
+void server_recv_handler(
+  ServerReactor* reactor,
+  SOCKET socket,
+  uint8_t* buffer,
+  int recv_size
+) {
+  reactor->log<LOG_DEBUG>(L"received {} bytes.", recv_size);
 
-  state->mutex.lock();
-  state->socket_mutexes.emplace((size_t)socket, std::make_shared<std::mutex>());
-  state->mutex.unlock();
+  // the latency of the messages completed by these bytes starts here
+  reactor->recv_time = metrics_now();
+  metric_add(reactor->stats->bytes_in, recv_size);
+
+  auto it = reactor->connections.find(socket);
+  if (it == reactor->connections.end()) {
+    return;
+  }
 
-  // set timeout
-  struct timeval timeout;
-  timeout.tv_sec = 1;
-  timeout.tv_usec = 0;
+  Connection* connection = &it->second;
+  connection->active = reactor->recv_time;
 
-  if (setsockopt(socket, SOL_SOCKET, SO_RCVTIMEO, (char*)&timeout, sizeof(timeout)) < 0) {
-    state->log(
-      std::format(L"setsockopt failed with error code: {}", WSAGetLastError())
-    );
+  if (connection->holding) {
+    connection->held.insert(connection->held.end(), buffer, buffer + recv_size);
     return;
   }
 
-  while (true) {
-    if (!state->running) {
+  framer_feed(&connection->framer, buffer, recv_size);
+  server_frame(reactor, connection);
+}
+
+/// Whether the version 1 message may change the version of the frames after
+/// it, by being or wrapping a `MSG_CONNECT`.
+static bool server_may_upgrade(const uint8_t* frame) {
+  message_type_t type = ((const message_header_t*)frame)->type;
+  return type == MSG_CONNECT || type == MSG_REQUEST || type == MSG_BUNDLE;
+}
+
+void server_frame(ServerReactor* reactor, Connection* connection) {
+  SOCKET socket = connection->socket;
+  bool pooled = reactor->server->pool != nullptr;
+
+  Dispatch* dispatch = &reactor->dispatch;
+  dispatch->session = connection->session.get();
+  dispatch->stats = reactor->stats;
+  dispatch->recv_time = reactor->recv_time;
+
+  // the frames of a task, each after its length
+  std::vector<uint8_t> batch;
+  uint32_t version = connection->framer.version;
+  bool hold = false;
+
+  uint8_t* frame;
+  uint32_t len;
+  int res;
+
+  while ((res = framer_next(&connection->framer, &frame, &len)) > 0) {
+    if (!pooled) {
+      res = server_dispatch_frame(dispatch, frame, len, version);
+
+      // the connection and its framer are gone if it has been closed
+      if (res > 0) {
+        return;
+      }
+      if (res < 0) {
+        break;
+      }
+
+      // raised by the reply to `MSG_CONNECT`
+      version = connection->framer.version;
+      continue;
+    }
+
+    size_t offset = batch.size();
+    batch.resize(offset + sizeof(uint32_t) + len);
+    memcpy(batch.data() + offset, &len, sizeof(uint32_t));
+    memcpy(batch.data() + offset + sizeof(uint32_t), frame, len);
+
+    // the frames after it may be in the version agreed on, they are framed
+    // once the reply is written.
+    if (version < PROTOCOL_VERSION && server_may_upgrade(frame)) {
+      hold = true;
+      connection->holding = true;
+      connection->held.assign(
+        connection->framer.input,
+        connection->framer.input + connection->framer.input_len
+      );
+      framer_feed(&connection->framer, NULL, 0);
       break;
     }
+  }
+
+  if (!batch.empty()) {
+    std::shared_ptr<Session> session = connection->session;
+    ServerState* server = reactor->server;
+    uint64_t recv_time = reactor->recv_time;
+
+    session->strand->post(
+      [server, session, batch = std::move(batch), version, recv_time, hold]() {
+        server_dispatch_batch(
+          server, session.get(), batch, version, recv_time, hold
+        );
+      }
+    );
+  }
+
+  if (res < 0) {
+    reactor->log<LOG_WARN>(L"invalid message.");
+    metric_add(reactor->stats->invalid, 1);
+    server_close(reactor, socket);
+  }
+}
+
+int server_dispatch_frame(
+  Dispatch* dispatch,
+  uint8_t* frame,
+  uint32_t len,
+  uint32_t version
+) {
+  message_header_t* header = (message_header_t*)frame;
+
+  // version 2 frames are handled as the messages they encode, with the
+  // source implied by the connection.
+  if (version == 2) {
+    dispatch->decoded.resize(PROTOCOL_V2_DECODED_MAX(len));
+
+    length_t decoded_len = protocol_v2_decode(
+      frame, len, PROTOCOL_TO_SERVER, dispatch->session->ident,
+      dispatch->decoded.data(), (uint32_t)dispatch->decoded.size()
+    );
+
+    if (decoded_len < 0) {
+      return -1;
+    }
+
+    header = (message_header_t*)dispatch->decoded.data();
+  }
 
-    int recv_size = recv(socket, (char*)buffer, PROTOCOL_BUFFER_SIZE, 0);
+  return server_handle_message(dispatch, header);
+}
 
-    if (recv_size == 0) {
-      state->mutex.lock();
-      state->log(L"socket disconnected.");
-      state->socket_mutexes.erase(socket);
-      state->mutex.unlock();
+void server_dispatch_batch(
+  ServerState* server,
+  Session* session,
+  const std::vector<uint8_t>& batch,
+  uint32_t version,
+  uint64_t recv_time,
+  bool resume
+) {
+  ServerReactor* reactor = server->reactors[session->reactor].get();
+
+  Dispatch dispatch;
+  dispatch.server = server;
+  dispatch.reactor = reactor;
+  dispatch.pooled = true;
+  dispatch.session = session;
+  dispatch.stats = server->metrics.local();
+  dispatch.recv_time = recv_time;
+
+  size_t offset = 0;
+  while (offset < batch.size()) {
+    uint32_t len;
+    memcpy(&len, batch.data() + offset, sizeof(uint32_t));
+    uint8_t* frame = (uint8_t*)batch.data() + offset + sizeof(uint32_t);
+    offset += sizeof(uint32_t) + len;
+
+    int res = server_dispatch_frame(&dispatch, frame, len, version);
+
+    if (res < 0) {
+      dispatch.log<LOG_WARN>(L"invalid message.");
+      metric_add(dispatch.stats->invalid, 1);
+      dispatch.close = true;
+    }
+    if (res != 0) {
       break;
     }
+  }
 
-    if (recv_size < 0) {
-      if (WSAGetLastError() == WSAETIMEDOUT) {
-        continue;
-      }
+  if (!dispatch.output.empty() || dispatch.close || resume) {
+    server_post_output(&dispatch, resume);
+  }
+}
+
+void server_post_output(Dispatch* dispatch, bool resume) {
+  Session* session = dispatch->session;
+
+  Delivery delivery;
+  delivery.kind = DELIVERY_OUTPUT;
+  delivery.payload =
+    std::make_shared<std::vector<uint8_t>>(std::move(dispatch->output));
+  delivery.targets.push_back(
+    Endpoint{session->socket, session->reactor, session->serial}
+  );
+  delivery.resume = resume;
+  delivery.close = dispatch->close;
+
+  dispatch->output = std::vector<uint8_t>();
 
-      if (!state->running) {
+  server_post(nullptr, dispatch->reactor, std::move(delivery));
+}
+
+/// Length of the fields read in place from a message of the type, checked
+/// before handling it. The messages of a variable length check their own.
+static size_t server_fixed_length(message_type_t type) {
+  switch (type) {
+    case MSG_CONNECT:
+    case MSG_DISCONNECT:
+      return sizeof(msg_conn_t);
+    case MSG_JOIN:
+    case MSG_LEAVE:
+      return sizeof(msg_room_t);
+    default:
+      return sizeof(message_header_t);
+  }
+}
+
+int server_handle_message(Dispatch* dispatch, message_header_t* header) {
+  uint8_t* iter = (uint8_t*)header;
+  ServerState* server = dispatch->server;
+  Session* session = dispatch->session;
+  // the reactor running the handling, if any
+  ServerReactor* reactor = dispatch->pooled ? nullptr : dispatch->reactor;
+
+  dispatch->stats->message(header->type);
+
+  // the framer only guarantees a header, and on the pool the frame is
+  // copied to a buffer of its exact length. the messages wrapped by
+  // requests and bundles come through here as well.
+  if (header->length < server_fixed_length(header->type)) {
+    dispatch->log<LOG_WARN>(L"invalid message length.");
+    server_reply(dispatch, RPL_BAD_REQUEST);
+    return server_dispatch_closed(dispatch);
+  }
+
+  switch (header->type) {
+    case MSG_NONE: {
+      dispatch->log<LOG_DEBUG>(L"received MSG_NONE.");
+      break;
+    }
+    case MSG_CONNECT: {
+      msg_conn_t* conn = (msg_conn_t*)iter;
+      dispatch->log(L"received MSG_CONNECT from: {}", conn->ident);
+
+      // a connection holds a single ident, the one unregistered when it
+      // closes
+      if (session->registered) {
+        dispatch->log<LOG_WARN>(
+          L"client already connected as: {}", session->ident
+        );
+
+        // reply client already exists
+        server_reply(dispatch, RPL_DUPLICATED_ID);
         break;
       }
 
-      state->mutex.lock();
-      state->log(
-        std::format(L"recv failed with error code: {}", WSAGetLastError())
+      reply_code_t code = server->registry.add_client(
+        conn->ident, session->socket, server->max_clients, session->reactor,
+        session->serial
       );
-      state->socket_mutexes.erase(socket);
-      state->mutex.unlock();
-      break;
-    }
 
-    state->log(std::format(L"received {} bytes.", recv_size));
+      if (code == RPL_REJECTED) {
+        dispatch->log<LOG_WARN>(L"client rejected.");
+        metric_add(dispatch->stats->rejected, 1);
 
-    // parse the message
-    uint8_t* iter = buffer;
-    while (iter < buffer + recv_size) {
-      message_header_t* header = (message_header_t*)iter;
-      switch (header->type) {
-        case MSG_NONE: {
-          state->log(L"received MSG_NONE.");
-          break;
-        }
-        case MSG_CONNECT: {
-          msg_conn_t* conn = (msg_conn_t*)iter;
-          state->log(std::format(L"received MSG_CONNECT from: {}", conn->ident)
-          );
+        // reply rejected
+        server_reply(dispatch, RPL_REJECTED);
 
-          if (state->clients.size() >= state->max_clients) {
-            state->log(L"client rejected.");
-
-            // reply rejected
-            state->socket_mutexes[socket]->lock();
-            protocol_wrap_msg_reply(RPL_REJECTED, reply_buffer);
-            send(socket, (char*)reply_buffer, sizeof(msg_reply_t), 0);
-            state->socket_mutexes[socket]->unlock();
-            
-            // close
-            closesocket(socket);
-            return;
-          }
+        // close
+        server_disconnect(dispatch);
+        return 1;
+      }
 
-          if (state->clients.contains(conn->ident)) {
-            state->log(std::format(L"client already exists: {}", conn->ident));
-
-            // reply client already exists
-            state->socket_mutexes[socket]->lock();
-            protocol_wrap_msg_reply(RPL_DUPLICATED_ID, reply_buffer);
-            send(socket, (char*)reply_buffer, sizeof(msg_reply_t), 0);
-            state->socket_mutexes[socket]->unlock();
-
-          } else {
-            state->mutex.lock();
-            state->clients.emplace(conn->ident, socket);
-            state->mutex.unlock();
-
-            // reply ok
-            state->socket_mutexes[socket]->lock();
-            protocol_wrap_msg_reply(RPL_OK, reply_buffer);
-            send(socket, (char*)reply_buffer, sizeof(msg_reply_t), 0);
-            state->socket_mutexes[socket]->unlock();
-          }
+      if (code == RPL_DUPLICATED_ID) {
+        dispatch->log(L"client already exists: {}", conn->ident);
 
-          break;
-        }
-        case MSG_DISCONNECT: {
-          msg_conn_t* disconn = (msg_conn_t*)iter;
-          state->log(
-            std::format(L"received MSG_DISCONNECT from: {}", disconn->ident)
+        // reply client already exists
+        server_reply(dispatch, RPL_DUPLICATED_ID);
+      } else {
+        session->registered = true;
+        session->ident = conn->ident;
+
+        // the version and features offered by the client, if any, are
+        // agreed on before the reply, which is the first message in the new
+        // format. a connection never goes back to an older version.
+        if (header->length >= sizeof(msg_conn_version_t)) {
+          msg_conn_version_t* offer = (msg_conn_version_t*)iter;
+
+          uint32_t version = std::clamp(
+            offer->version, session->version, (uint32_t)PROTOCOL_VERSION
           );
+          uint32_t features = offer->features & PROTOCOL_FEATURES;
 
-          state->mutex.lock();
-          state->clients.erase(disconn->ident);
-          state->mutex.unlock();
+          // the connection switches once the message is written
+          uint8_t version_buffer[sizeof(msg_version_t)];
+          length_t len =
+            protocol_wrap_msg_version(version, features, version_buffer);
+          server_output(dispatch, version_buffer, len);
 
-          // reply ok
-          state->socket_mutexes[socket]->lock();
-          protocol_wrap_msg_reply(RPL_OK, reply_buffer);
-          send(socket, (char*)reply_buffer, sizeof(msg_reply_t), 0);
-          state->socket_mutexes[socket]->unlock();
+          session->version = version;
 
-          break;
-        }
-        case MSG_SEND: {
-          msg_send_t* msg = (msg_send_t*)iter;
-
-          int content_len = msg->header.length - sizeof(msg_send_t);
-          wchar_t* content = (wchar_t*)(iter + sizeof(msg_send_t));
-
-          std::wstring wstr(content, content + content_len / sizeof(wchar_t));
-
-          state->log(std::format(
-            L"received MSG_SEND from {} to {} with `{}`", msg->src, msg->dst,
-            wstr
-          ));
-
-          if (state->clients.contains(msg->dst)) {
-            state->log(std::format(L"sending message to {}", msg->dst));
-
-            state->socket_mutexes[state->clients[msg->dst]]->lock();
-            int res =
-              send(state->clients[msg->dst], (char*)iter, header->length, 0);
-            state->socket_mutexes[state->clients[msg->dst]]->unlock();
-
-            if (res < 0) {
-              // reply send failed
-              state->socket_mutexes[socket]->lock();
-              protocol_wrap_msg_reply(RPL_SEND_FAILED, reply_buffer);
-              send(socket, (char*)reply_buffer, sizeof(msg_reply_t), 0);
-              state->socket_mutexes[socket]->unlock();
-            } else {
-              // reply ok
-              state->socket_mutexes[socket]->lock();
-              protocol_wrap_msg_reply(RPL_OK, reply_buffer);
-              send(socket, (char*)reply_buffer, sizeof(msg_reply_t), 0);
-              state->socket_mutexes[socket]->unlock();
-            }
-          } else if (state->rooms.contains(msg->dst)) {
-            state->log(std::format(L"sending message to room {}", msg->dst));
-
-            int all_res = 0;
-
-            for (auto& client : state->rooms[msg->dst]) {
-              if (state->clients.contains(client)) {
-                state->socket_mutexes[state->clients[client]]->lock();
-                int res =
-                  send(state->clients[client], (char*)iter, header->length, 0);
-                state->socket_mutexes[state->clients[client]]->unlock();
-
-                if (res < 0) {
-                  all_res = -1;
-                  break;
-                } else {
-                  all_res += res;
-                }
-              }
-            }
-
-            if (all_res < 0) {
-              // reply send failed
-              state->socket_mutexes[socket]->lock();
-              protocol_wrap_msg_reply(RPL_SEND_FAILED, reply_buffer);
-              send(socket, (char*)reply_buffer, sizeof(msg_reply_t), 0);
-              state->socket_mutexes[socket]->unlock();
-            } else {
-              // reply ok
-              state->socket_mutexes[socket]->lock();
-              protocol_wrap_msg_reply(RPL_OK, reply_buffer);
-              send(socket, (char*)reply_buffer, sizeof(msg_reply_t), 0);
-              state->socket_mutexes[socket]->unlock();
-            }
-
-          } else {
-            state->log(std::format(L"unable to find dst: {}", msg->dst));
-
-            // reply dst not found
-            state->socket_mutexes[socket]->lock();
-            protocol_wrap_msg_reply(RPL_DST_NOT_FOUND, reply_buffer);
-            send(socket, (char*)reply_buffer, sizeof(msg_reply_t), 0);
-            state->socket_mutexes[socket]->unlock();
+          // version 2 comes with the pings
+          if (version >= 2) {
+            session->answers_pings.store(true, std::memory_order_relaxed);
           }
-          break;
+
+          dispatch->log<LOG_DEBUG>(
+            L"speaking version {} with features {}.", version, features
+          );
         }
-        case MSG_JOIN: {
-          msg_room_t* join = (msg_room_t*)iter;
-          state->log(std::format(
-            L"received MSG_JOIN from {} to {}", join->src, join->dst
-          ));
-
-          if (state->clients.contains(join->dst)) {
-            state->log(std::format(L"conflict of room and client id: {}", join->dst));
-
-            // reply client already exists
-            state->socket_mutexes[socket]->lock();
-            protocol_wrap_msg_reply(RPL_ROOM_CONFLICT, reply_buffer);
-            send(socket, (char*)reply_buffer, sizeof(msg_reply_t), 0);
-            state->socket_mutexes[socket]->unlock();
-            break;
-          }
 
-          if (state->rooms.contains(join->dst)) {
-            state->log(std::format(L"joining room {}", join->dst));
-            state->mutex.lock();
-            state->rooms[join->dst].insert(join->src);
-            state->mutex.unlock();
-          } else {
-            state->log(std::format(L"creating room {}", join->dst));
-            state->mutex.lock();
-            state->rooms.emplace(
-              join->dst, std::unordered_set<ident_t>{join->src}
+        // reply ok
+        server_reply(dispatch, RPL_OK);
+
+        // the messages queued while the client was away follow the reply,
+        // in a single frame
+        if (server->offline.enabled()) {
+          std::vector<uint8_t> queued;
+          int count =
+            server->offline.take(conn->ident, dispatch->recv_time, &queued);
+
+          if (count > 0) {
+            dispatch->log<LOG_DEBUG>(
+              L"delivering {} queued messages to {}", count, conn->ident
             );
-            state->mutex.unlock();
+            server_output_run(dispatch, queued.data(), queued.size());
+            metric_add(dispatch->stats->flushed, count);
           }
 
-          // reply ok
-          state->socket_mutexes[socket]->lock();
-          protocol_wrap_msg_reply(RPL_OK, reply_buffer);
-          send(socket, (char*)reply_buffer, sizeof(msg_reply_t), 0);
-          state->socket_mutexes[socket]->unlock();
-
-          break;
+          // some have been spilled, they are read off this thread
+          if (count < 0) {
+            server_read_offline(dispatch, conn->ident);
+          }
         }
-        case MSG_LEAVE: {
-          msg_room_t* leave = (msg_room_t*)iter;
-          state->log(std::format(
-            L"received MSG_LEAVE from {} to {}", leave->src, leave->dst
-          ));
-
-          if (state->rooms.contains(leave->dst)) {
-            if (state->rooms[leave->dst].contains(leave->src)) {
-              state->log(std::format(L"leaving room {}", leave->dst));
-              state->mutex.lock();
-              state->rooms[leave->dst].erase(leave->src);
-              state->mutex.unlock();
-
-              // reply ok
-              state->socket_mutexes[socket]->lock();
-              protocol_wrap_msg_reply(RPL_OK, reply_buffer);
-              send(socket, (char*)reply_buffer, sizeof(msg_reply_t), 0);
-              state->socket_mutexes[socket]->unlock();
-            } else {
-              state->log(std::format(
-                L"unable to find src: {} in room {}", leave->src, leave->dst
-              ));
-
-              // reply not in room
-              state->socket_mutexes[socket]->lock();
-              protocol_wrap_msg_reply(RPL_NOT_IN_ROOM, reply_buffer);
-              send(socket, (char*)reply_buffer, sizeof(msg_reply_t), 0);
-              state->socket_mutexes[socket]->unlock();
-            }
-          } else {
-            state->log(std::format(L"unable to find room: {}", leave->dst));
-
-            // reply room not found
-            state->socket_mutexes[socket]->lock();
-            protocol_wrap_msg_reply(RPL_ROOM_NOT_FOUND, reply_buffer);
-            send(socket, (char*)reply_buffer, sizeof(msg_reply_t), 0);
-            state->socket_mutexes[socket]->unlock();
+      }
+
+      break;
+    }
+    case MSG_DISCONNECT: {
+      msg_conn_t* disconn = (msg_conn_t*)iter;
+      dispatch->log<LOG_DEBUG>(
+        L"received MSG_DISCONNECT from: {}", disconn->ident
+      );
+
+      if (server->registry.remove_client(disconn->ident, session->socket)) {
+        session->registered = false;
+        server_drop_streams(
+          server, dispatch->pooled ? nullptr : reactor, disconn->ident
+        );
+      }
+
+      // reply ok
+      server_reply(dispatch, RPL_OK);
+
+      break;
+    }
+    case MSG_SEND: {
+      msg_send_t* msg = (msg_send_t*)iter;
+
+      // a version 2 frame may decode to more than a version 1 frame holds
+      if (header->length < sizeof(msg_send_t) ||
+          header->length > PROTOCOL_BUFFER_SIZE) {
+        dispatch->log<LOG_WARN>(L"invalid message length.");
+        server_reply(dispatch, RPL_SEND_FAILED);
+        break;
+      }
+
+      // the data is forwarded as is, only the clients read it
+      dispatch->log<LOG_DEBUG>(
+        L"received MSG_SEND from {} to {} with {} bytes of format {}", msg->src,
+        msg->dst, msg->header.length - sizeof(msg_send_t), msg->format
+      );
+
+      std::vector<Endpoint> targets;
+      RouteKind route = server->registry.route(msg->dst, &targets);
+
+      if (route == ROUTE_NONE && server->offline.enabled()) {
+        reply_code_t code = server->offline.push(
+          msg->dst, msg->src, msg->format, iter + sizeof(msg_send_t),
+          header->length - sizeof(msg_send_t), dispatch->recv_time,
+          [&]() {
+            return server->registry.find_client(msg->dst) != INVALID_SOCKET;
           }
+        );
 
-          break;
+        if (code == RPL_QUEUED) {
+          dispatch->log<LOG_DEBUG>(L"queued message to {}", msg->dst);
+          metric_add(dispatch->stats->queued, 1);
         }
-        default: {
-          state->log(std::format(
-            L"received unknown message type: {}", (uint32_t)header->type
-          ));
+
+        if (code != RPL_NONE) {
+          server_reply(dispatch, code);
           break;
         }
+
+        // connected meanwhile
+        route = server->registry.route(msg->dst, &targets);
       }
-      iter += header->length;
-    }
-  }
 
-  closesocket(socket);
-}
+      if (route == ROUTE_NONE) {
+        dispatch->log<LOG_DEBUG>(L"unable to find dst: {}", msg->dst);
 
-void server_quit_handler(ServerState* state) {
-  // wait and read `q` from screen
-  char c;
-  while ((c = getchar()) != 'q') {
-    continue;
-  }
+        // reply dst not found
+        server_reply(dispatch, RPL_DST_NOT_FOUND);
+        break;
+      }
 
-  state->log(L"quitting server...");
-  state->mutex.lock();
+      if (route == ROUTE_CLIENT) {
+        dispatch->log<LOG_DEBUG>(L"sending message to {}", msg->dst);
+      } else {
+        dispatch->log<LOG_DEBUG>(L"sending message to room {}", msg->dst);
+      }
+
+      // queueing cannot block or fail for the sender, a member whose socket
+      // fails is closed on its own. the sender is answered before the
+      // fan-out, whatever the size of the room.
+      server_reply(dispatch, RPL_OK);
+
+      // on the pool the reply is posted first, the sender may be among the
+      // clients the message is posted to
+      if (dispatch->pooled && !dispatch->output.empty()) {
+        server_post_output(dispatch, false);
+      }
+
+      // the data is copied once out of the read buffer and shared by every
+      // reactor delivering it
+      Delivery delivery;
+      delivery.src = msg->src;
+      delivery.sender =
+        Endpoint{session->socket, session->reactor, session->serial};
+      delivery.dst = msg->dst;
+      delivery.format = msg->format;
+      delivery.payload = payload_create(
+        iter + sizeof(msg_send_t), header->length - sizeof(msg_send_t)
+      );
+      delivery.recv_time = dispatch->recv_time;
+
+      if (route == ROUTE_ROOM) {
+        // the owner of the room knows its members
+        delivery.kind = DELIVERY_ROOM;
+        server_post_room(server, reactor, std::move(delivery));
+      } else {
+        server_fan_out(server, reactor, delivery, targets);
+      }
+
+      break;
+    }
+    case MSG_JOIN: {
+      msg_room_t* join = (msg_room_t*)iter;
+      dispatch->log<LOG_DEBUG>(
+        L"received MSG_JOIN from {} to {}", join->src, join->dst
+      );
+
+      reply_code_t code =
+        server->registry.join(join->dst, join->src, [&]() {
+          Delivery change;
+          change.kind = DELIVERY_JOIN;
+          change.src = join->src;
+          change.dst = join->dst;
+          server_post_room(server, reactor, std::move(change));
+        });
+
+      if (code == RPL_ROOM_CONFLICT) {
+        dispatch->log<LOG_DEBUG>(
+          L"conflict of room and client id: {}", join->dst
+        );
+
+        // reply client already exists
+        server_reply(dispatch, RPL_ROOM_CONFLICT);
+        break;
+      }
+
+      dispatch->log<LOG_DEBUG>(L"joining room {}", join->dst);
+
+      // reply ok
+      server_reply(dispatch, RPL_OK);
+
+      break;
+    }
+    case MSG_LEAVE: {
+      msg_room_t* leave = (msg_room_t*)iter;
+      dispatch->log<LOG_DEBUG>(
+        L"received MSG_LEAVE from {} to {}", leave->src, leave->dst
+      );
+
+      reply_code_t code =
+        server->registry.leave(leave->dst, leave->src, [&]() {
+          Delivery change;
+          change.kind = DELIVERY_LEAVE;
+          change.src = leave->src;
+          change.dst = leave->dst;
+          server_post_room(server, reactor, std::move(change));
+        });
+
+      if (code == RPL_OK) {
+        dispatch->log<LOG_DEBUG>(L"leaving room {}", leave->dst);
+      } else if (code == RPL_NOT_IN_ROOM) {
+        dispatch->log<LOG_DEBUG>(
+          L"unable to find src: {} in room {}", leave->src, leave->dst
+        );
+      } else {
+        dispatch->log<LOG_DEBUG>(L"unable to find room: {}", leave->dst);
+      }
+
+      server_reply(dispatch, code);
+
+      break;
+    }
+    case MSG_REQUEST: {
+      msg_request_t* request = (msg_request_t*)iter;
+
+      return server_handle_request(dispatch, request);
+    }
+    case MSG_BUNDLE: {
+      msg_bundle_t* bundle = (msg_bundle_t*)iter;
+
+      return server_handle_bundle(dispatch, bundle);
+    }
+    case MSG_HISTORY: {
+      msg_history_t* request = (msg_history_t*)iter;
+
+      return server_handle_history(dispatch, request);
+    }
+    case MSG_STREAM_START:
+    case MSG_STREAM_CHUNK:
+    case MSG_STREAM_END:
+    case MSG_STREAM_ACK: {
+      return server_handle_stream(dispatch, header);
+    }
+    case MSG_PING: {
+      dispatch->log<LOG_DEBUG>(L"received MSG_PING");
+      session->answers_pings.store(true, std::memory_order_relaxed);
+
+      uint8_t pong[sizeof(message_header_t)];
+      length_t len = protocol_wrap_msg_ping(1, pong);
+      server_output(dispatch, pong, len);
+      break;
+    }
+    case MSG_PONG: {
+      // the client is alive, as told by any bytes read from it
+      dispatch->log<LOG_DEBUG>(L"received MSG_PONG");
+      session->answers_pings.store(true, std::memory_order_relaxed);
+      break;
+    }
+    case MSG_STATS: {
+      dispatch->log<LOG_DEBUG>(L"received MSG_STATS");
+
+      std::string text = server->metrics.render();
+
+      if (text.size() > PROTOCOL_BUFFER_SIZE - sizeof(message_header_t)) {
+        dispatch->log<LOG_WARN>(L"metrics too long for a message.");
+        server_reply(dispatch, RPL_SEND_FAILED);
+        break;
+      }
+
+      std::vector<uint8_t> stats(sizeof(message_header_t) + text.size());
+      length_t len = protocol_wrap_msg_stats(
+        (length_t)text.size(), (uint8_t*)text.data(), stats.data()
+      );
+      server_output(dispatch, stats.data(), len);
+
+      break;
+    }
+    default: {
+      dispatch->log<LOG_WARN>(
+        L"received unknown message type: {}", (uint32_t)header->type
+      );
+
+      if (dispatch->in_request) {
+        server_reply(dispatch, RPL_BAD_REQUEST);
+      }
+      break;
+    }
+  }
+
+  return server_dispatch_closed(dispatch);
+}
+
+int server_decompress_send(
+  const std::vector<uint8_t>& compressed,
+  format_t* format,
+  std::vector<uint8_t>* data
+) {
+  data->resize(PROTOCOL_BUFFER_SIZE - sizeof(msg_send_t));
+
+  length_t len = decompress_data(
+    compressed.data(), (uint32_t)compressed.size(), format, data->data(),
+    (uint32_t)data->size()
+  );
+  if (len < 0) {
+    return 1;
+  }
+
+  data->resize(len);
+
+  return 0;
+}
+
+void server_deliver(
+  ServerReactor* reactor,
+  const Delivery& delivery,
+  const Endpoint* targets,
+  size_t count
+) {
+  // wrap the message once per version, and once more decompressed for the
+  // clients not reading compressed data. a frame per version adds its
+  // header to the shared data, every client queues the same frame.
+  FrameRef frames[PROTOCOL_VERSION][2];
+  Payload payloads[2] = {delivery.payload, nullptr};
+  format_t formats[2] = {delivery.format, delivery.format};
+  bool plain_invalid = false;
+
+  for (size_t i = 0; i < count; i++) {
+    auto it = reactor->connections.find(targets[i].socket);
+
+    // the client may have left, and its socket been reused, since the
+    // message has been routed
+    if (it == reactor->connections.end() ||
+        it->second.serial != targets[i].serial) {
+      continue;
+    }
+
+    bool decompress =
+      delivery.format == FMT_LZ && !(it->second.features & FEATURE_LZ);
+    FrameRef& frame = frames[it->second.version - 1][decompress];
+
+    if (frame == nullptr) {
+      Payload& payload = payloads[decompress];
+
+      if (payload == nullptr && !plain_invalid) {
+        auto plain = std::make_shared<std::vector<uint8_t>>();
+        if (server_decompress_send(
+              *delivery.payload, &formats[1], plain.get()
+            ) != 0) {
+          reactor->log<LOG_WARN>(L"invalid compressed data.");
+          plain_invalid = true;
+        } else {
+          payload = std::move(plain);
+        }
+      }
+
+      if (payload == nullptr) {
+        continue;
+      }
+
+      uint8_t prefix[PROTOCOL_V2_HEADER_MAX];
+      length_t len;
+
+      if (it->second.version == 2) {
+        len = protocol_v2_encode_send_header(
+          delivery.src, delivery.dst, formats[decompress],
+          (uint32_t)payload->size(), PROTOCOL_TO_CLIENT, prefix
+        );
+      } else {
+        len = protocol_wrap_msg_send_header(
+          delivery.src, delivery.dst, formats[decompress],
+          (length_t)payload->size(), prefix
+        );
+      }
+
+      frame = frame_create(prefix, len, payload, true);
+    }
+
+    if (server_overflow(reactor, &it->second, delivery, frame->size()) != 0) {
+      continue;
+    }
+
+    server_send_frame(reactor, targets[i].socket, frame);
+    metric_add(reactor->stats->forwarded, 1);
+  }
+
+  reactor->stats->forward_latency.record(metrics_now() - delivery.recv_time);
+}
+
+void server_fan_out(
+  ServerState* server,
+  ServerReactor* reactor,
+  const Delivery& delivery,
+  std::vector<Endpoint>& targets
+) {
+  // the clients of this reactor are queued to at once, the others are
+  // posted in a batch to the mailbox of their reactor
+  std::stable_sort(
+    targets.begin(), targets.end(),
+    [](const Endpoint& a, const Endpoint& b) { return a.reactor < b.reactor; }
+  );
+
+  size_t first = 0;
+  while (first < targets.size()) {
+    uint32_t owner = targets[first].reactor;
+    size_t last = first;
+    while (last < targets.size() && targets[last].reactor == owner) {
+      last++;
+    }
+
+    if (reactor != nullptr && owner == reactor->index) {
+      server_deliver(reactor, delivery, &targets[first], last - first);
+    } else {
+      Delivery posted = delivery;
+      posted.kind = DELIVERY_CLIENTS;
+      posted.targets.assign(targets.begin() + first, targets.begin() + last);
+      server_post(reactor, server->reactors[owner].get(), posted);
+    }
+
+    first = last;
+  }
+}
+
+void server_post(
+  ServerReactor* reactor,
+  ServerReactor* owner,
+  Delivery delivery
+) {
+  owner->mailbox.push(std::move(delivery));
+
+  if (owner == reactor) {
+    // the reactor drains its mailbox before polling again
+    owner->mail_pending.store(true);
+    return;
+  }
+
+  MetricsShard* stats =
+    reactor != nullptr ? reactor->stats : owner->server->metrics.local();
+  metric_add(stats->relayed, 1);
+
+  // a reactor draining its mailbox clears the flag first, so either it
+  // sees the delivery or the flag is down and it is woken up again
+  if (!owner->mail_pending.exchange(true)) {
+    owner->io->wake();
+  }
+}
+
+void server_post_room(
+  ServerState* server,
+  ServerReactor* reactor,
+  Delivery delivery
+) {
+  ServerReactor* owner =
+    server->reactors[server->room_owner(delivery.dst)].get();
+
+  server_post(reactor, owner, std::move(delivery));
+}
+
+void server_forward_stream(
+  ServerState* server,
+  ServerReactor* reactor,
+  const Endpoint& target,
+  message_type_t type,
+  Payload body
+) {
+  if (reactor != nullptr && target.reactor == reactor->index) {
+    server_send_stream(reactor, target, type, body);
+    return;
+  }
+
+  Delivery delivery;
+  delivery.kind = DELIVERY_STREAM;
+  delivery.type = type;
+  delivery.payload = std::move(body);
+  delivery.targets.push_back(target);
+
+  server_post(reactor, server->reactors[target.reactor].get(), delivery);
+}
+
+/// Tell the target that the stream has ended with the code.
+static void server_end_stream(
+  ServerState* server,
+  ServerReactor* reactor,
+  const Stream& stream,
+  const Endpoint& target,
+  reply_code_t code
+) {
+  uint8_t end[sizeof(msg_stream_end_t)];
+  protocol_wrap_msg_stream_end(stream.src, stream.id, code, end);
+
+  server_forward_stream(
+    server, reactor, target, MSG_STREAM_END,
+    payload_create(
+      end + sizeof(message_header_t), sizeof(end) - sizeof(message_header_t)
+    )
+  );
+}
+
+void server_drop_streams(
+  ServerState* server,
+  ServerReactor* reactor,
+  ident_t ident
+) {
+  std::vector<Stream> closed;
+  server->streams.drop(ident, &closed);
+
+  // the end still there learns why, a client streaming to itself is gone
+  // at both ends
+  for (const Stream& stream : closed) {
+    if (stream.src == ident && stream.dst != ident) {
+      server_end_stream(
+        server, reactor, stream, stream.receiver, RPL_SEND_FAILED
+      );
+    } else if (stream.src != ident) {
+      server_end_stream(
+        server, reactor, stream, stream.sender, RPL_DST_NOT_FOUND
+      );
+    }
+  }
+}
+
+/// Stop or resume reading from the sender on its reactor, see
+/// `server_block`.
+static void server_post_block(
+  ServerReactor* reactor,
+  const Endpoint& sender,
+  bool block
+) {
+  if (sender.reactor == reactor->index) {
+    server_block(reactor, sender, block);
+    return;
+  }
+
+  Delivery delivery;
+  delivery.kind = block ? DELIVERY_BLOCK : DELIVERY_UNBLOCK;
+  delivery.targets.push_back(sender);
+
+  server_post(
+    reactor, reactor->server->reactors[sender.reactor].get(), delivery
+  );
+}
+
+int server_overflow(
+  ServerReactor* reactor,
+  Connection* connection,
+  const Delivery& delivery,
+  size_t len
+) {
+  ServerState* server = reactor->server;
+  size_t limit = server->outbound_limit;
+  size_t queued = reactor->io->queued(connection->socket);
+
+  if (limit == 0 || queued + len <= limit) {
+    return 0;
+  }
+
+  int skip = 0;
+
+  switch (server->overflow) {
+    case OVERFLOW_BLOCK: {
+      // the connection the message came from is held back, not the client
+      // it claims to be from. without one the queue would grow for good.
+      const Endpoint& sender = delivery.sender;
+
+      if (sender.socket == INVALID_SOCKET) {
+        connection->dropped++;
+        metric_add(reactor->stats->dropped, 1);
+        skip = 1;
+        break;
+      }
+
+      // held back once, until the queue drains
+      if (connection->blocked.contains(sender.serial)) {
+        break;
+      }
+
+      connection->blocked.emplace(sender.serial, sender);
+      server_post_block(reactor, sender, true);
+      metric_add(reactor->stats->blocked, 1);
+      break;
+    }
+    case OVERFLOW_DROP_OLDEST: {
+      size_t dropped =
+        reactor->io->drop(connection->socket, queued + len - limit);
+      connection->dropped += (uint32_t)dropped;
+      metric_add(reactor->stats->dropped, dropped);
+
+      // the replies are never dropped, the message goes if they fill the
+      // queue
+      if (reactor->io->queued(connection->socket) + len <= limit) {
+        break;
+      }
+
+      connection->dropped++;
+      metric_add(reactor->stats->dropped, 1);
+      skip = 1;
+      break;
+    }
+    case OVERFLOW_DROP_NEWEST: {
+      connection->dropped++;
+      metric_add(reactor->stats->dropped, 1);
+      skip = 1;
+      break;
+    }
+    case OVERFLOW_DISCONNECT: {
+      reactor->log<LOG_WARN>(L"disconnecting a slow client.");
+      metric_add(reactor->stats->evicted, 1);
+      server_close(reactor, connection->socket);
+      return 1;
+    }
+  }
+
+  reactor->io->watch(connection->socket, limit / 2);
+
+  return skip;
+}
+
+void server_block(ServerReactor* reactor, const Endpoint& sender, bool block) {
+  auto it = reactor->connections.find(sender.socket);
+  if (it == reactor->connections.end() ||
+      it->second.serial != sender.serial) {
+    return;
+  }
+
+  Connection& connection = it->second;
+
+  if (block) {
+    if (connection.blockers++ == 0) {
+      reactor->io->pause(sender.socket, true);
+    }
+  } else if (connection.blockers > 0 && --connection.blockers == 0) {
+    reactor->io->pause(sender.socket, false);
+  }
+}
+
+void server_release(ServerReactor* reactor, Connection* connection) {
+  for (const auto& [serial, sender] : connection->blocked) {
+    server_post_block(reactor, sender, false);
+  }
+
+  connection->blocked.clear();
+}
+
+void server_schedule_heartbeat(
+  ServerReactor* reactor,
+  Connection* connection,
+  uint64_t now
+) {
+  uint64_t heartbeat = reactor->server->heartbeat_ms * 1000000;
+  uint64_t timeout = reactor->server->idle_timeout_ms * 1000000;
+  uint64_t idle = now > connection->active ? now - connection->active : 0;
+  uint64_t delay = UINT64_MAX;
+
+  // a client which may not know the pings is never timed out
+  if (!connection->session->answers_pings.load(std::memory_order_relaxed)) {
+    timeout = 0;
+  }
+
+  // pinged again every heartbeat while silent
+  if (heartbeat > 0) {
+    delay = idle < heartbeat ? heartbeat - idle : heartbeat;
+  }
+  if (timeout > 0) {
+    delay = std::min(delay, idle < timeout ? timeout - idle : 0);
+  }
+
+  if (delay != UINT64_MAX) {
+    connection->timer =
+      reactor->timers.schedule(now, delay, (uint64_t)connection->socket);
+  }
+}
+
+void server_heartbeat(ServerReactor* reactor, SOCKET socket) {
+  // the timer of a connection is cancelled when it is closed
+  auto it = reactor->connections.find(socket);
+  if (it == reactor->connections.end()) {
+    return;
+  }
+
+  Connection& connection = it->second;
+  connection.timer = 0;
+
+  uint64_t now = metrics_now();
+
+  // not read from while held back, the silence is the server's
+  if (connection.blockers > 0) {
+    connection.active = now;
+  }
+
+  uint64_t idle = now - connection.active;
+  uint64_t timeout = reactor->server->idle_timeout_ms * 1000000;
+  bool answers_pings =
+    connection.session->answers_pings.load(std::memory_order_relaxed);
+
+  if (timeout > 0 && idle >= timeout && answers_pings) {
+    reactor->log(L"closing a connection silent for {} ms.", idle / 1000000);
+    metric_add(reactor->stats->timed_out, 1);
+    server_close(reactor, socket);
+    return;
+  }
+
+  uint64_t heartbeat = reactor->server->heartbeat_ms * 1000000;
+
+  if (heartbeat > 0 && idle >= heartbeat) {
+    reactor->log<LOG_DEBUG>(L"pinging a connection silent for a while.");
+
+    uint8_t ping[sizeof(message_header_t)];
+    length_t len = protocol_wrap_msg_ping(0, ping);
+    metric_add(reactor->stats->pings, 1);
+
+    // closed if it cannot be written
+    if (server_send(reactor, socket, ping, len) < 0) {
+      return;
+    }
+  }
+
+  server_schedule_heartbeat(reactor, &connection, now);
+}
+
+void server_handle_room(ServerReactor* reactor, const Delivery& delivery) {
+  switch (delivery.kind) {
+    case DELIVERY_JOIN: {
+      reactor->rooms[delivery.dst].push_back(delivery.src);
+      break;
+    }
+    case DELIVERY_LEAVE: {
+      auto room = reactor->rooms.find(delivery.dst);
+      if (room == reactor->rooms.end()) {
+        break;
+      }
+
+      std::vector<ident_t>& members = room->second;
+      auto it = std::find(members.begin(), members.end(), delivery.src);
+      if (it != members.end()) {
+        members.erase(it);
+      }
+
+      // dropped once empty, the next join creates it again
+      if (members.empty()) {
+        reactor->rooms.erase(room);
+      }
+      break;
+    }
+    case DELIVERY_ROOM: {
+      uint64_t fanout_start = metrics_now();
+
+      // logged in the order the owner fans the messages out
+      History& history = reactor->server->history;
+      if (history.enabled()) {
+        if (history.append(
+              delivery.dst, delivery.src, delivery.format,
+              delivery.payload->data(), (uint32_t)delivery.payload->size()
+            ) == 0) {
+          reactor->log<LOG_WARN>(
+            L"could not write to the history of room {}", delivery.dst
+          );
+        } else {
+          metric_add(reactor->stats->archived, 1);
+        }
+      }
+
+      std::vector<Endpoint> targets;
+      auto room = reactor->rooms.find(delivery.dst);
+      if (room != reactor->rooms.end()) {
+        reactor->server->registry.resolve(room->second, &targets);
+      }
+
+      server_fan_out(reactor->server, reactor, delivery, targets);
+
+      reactor->stats->fanout.record(metrics_now() - fanout_start);
+      break;
+    }
+    default: {
+      break;
+    }
+  }
+}
+
+void server_write_output(ServerReactor* reactor, const Delivery& delivery) {
+  SOCKET socket = delivery.targets[0].socket;
+
+  auto it = reactor->connections.find(socket);
+  if (it == reactor->connections.end() ||
+      it->second.serial != delivery.targets[0].serial) {
+    return;
+  }
+
+  const std::vector<uint8_t>& output = *delivery.payload;
+  size_t offset = 0;
+  // the start of the messages not written yet, sent in a single frame up to
+  // a change of version
+  size_t run = 0;
+
+  while (offset < output.size()) {
+    message_header_t* header = (message_header_t*)(output.data() + offset);
+    uint32_t len = header->length;
+
+    if (header->type == MSG_VERSION) {
+      if (offset > run && server_send_run(
+                            reactor, socket, output.data() + run, offset - run
+                          ) < 0) {
+        return;
+      }
+
+      if (server_write(reactor, socket, (uint8_t*)header, (int)len) < 0) {
+        return;
+      }
+
+      run = offset + len;
+    }
+
+    offset += len;
+  }
+
+  if (offset > run && server_send_run(
+                        reactor, socket, output.data() + run, offset - run
+                      ) < 0) {
+    return;
+  }
+
+  if (delivery.close) {
+    server_close(reactor, socket);
+    return;
+  }
+
+  if (delivery.resume) {
+    Connection& connection = it->second;
+    connection.holding = false;
+
+    // the held bytes are framed in the version the output has agreed on,
+    // and count from now
+    std::vector<uint8_t> held = std::move(connection.held);
+    connection.held = std::vector<uint8_t>();
+    reactor->recv_time = metrics_now();
+
+    framer_feed(&connection.framer, held.data(), (uint32_t)held.size());
+    server_frame(reactor, &connection);
+  }
+}
+
+void server_read_offline(Dispatch* dispatch, ident_t ident) {
+  ServerState* server = dispatch->server;
+  Session* session = dispatch->session;
+  Endpoint target{session->socket, session->reactor, session->serial};
+
+  // the reply collected on the pool is posted first, the messages follow it
+  if (dispatch->pooled) {
+    server_post_output(dispatch, false);
+  }
+
+  dispatch->log<LOG_DEBUG>(L"reading the messages queued to {}", ident);
+
+  server->offline.read(
+    ident, dispatch->recv_time,
+    [server, target, ident](std::vector<uint8_t> frames, uint32_t count) {
+      metric_add(server->metrics.local()->flushed, count);
+
+      Delivery delivery;
+      delivery.kind = DELIVERY_QUEUED;
+      delivery.dst = ident;
+      delivery.payload =
+        std::make_shared<std::vector<uint8_t>>(std::move(frames));
+      delivery.targets.push_back(target);
+
+      server_post(
+        nullptr, server->reactors[target.reactor].get(), std::move(delivery)
+      );
+    }
+  );
+}
+
+void server_write_queued(ServerReactor* reactor, const Delivery& delivery) {
+  OfflineStore& offline = reactor->server->offline;
+  const Endpoint& target = delivery.targets[0];
+  uint64_t now = metrics_now();
+
+  auto it = reactor->connections.find(target.socket);
+  if (it == reactor->connections.end() ||
+      it->second.serial != target.serial) {
+    offline.finish(delivery.dst, now, nullptr, true);
+    return;
+  }
+
+  const std::vector<uint8_t>& queued = *delivery.payload;
+  if (!queued.empty() && server_send_run(
+                           reactor, target.socket, queued.data(), queued.size()
+                         ) < 0) {
+    offline.finish(delivery.dst, now, nullptr, true);
+    return;
+  }
+
+  // the messages sent to the client from now on are forwarded to it
+  std::vector<uint8_t> more;
+  uint32_t count = offline.finish(delivery.dst, now, &more, false);
+
+  if (count > 0) {
+    metric_add(reactor->stats->flushed, count);
+    server_send_run(reactor, target.socket, more.data(), more.size());
+  }
+}
+
+void server_drain_mailbox(ServerReactor* reactor) {
+  // a room fanning out to the clients of the reactor posts nothing back,
+  // but the flag raised again while draining is not left up
+  while (reactor->mail_pending.exchange(false)) {
+    Delivery delivery;
+    while (reactor->mailbox.pop(&delivery)) {
+      if (delivery.kind == DELIVERY_CLIENTS) {
+        server_deliver(
+          reactor, delivery, delivery.targets.data(), delivery.targets.size()
+        );
+      } else if (delivery.kind == DELIVERY_OUTPUT) {
+        server_write_output(reactor, delivery);
+      } else if (delivery.kind == DELIVERY_QUEUED) {
+        server_write_queued(reactor, delivery);
+      } else if (delivery.kind == DELIVERY_STREAM) {
+        server_send_stream(
+          reactor, delivery.targets[0], delivery.type, delivery.payload
+        );
+      } else if (delivery.kind == DELIVERY_BLOCK ||
+                 delivery.kind == DELIVERY_UNBLOCK) {
+        server_block(
+          reactor, delivery.targets[0], delivery.kind == DELIVERY_BLOCK
+        );
+      } else {
+        server_handle_room(reactor, delivery);
+      }
+    }
+  }
+}
+
+int server_handle_bundle(Dispatch* dispatch, msg_bundle_t* bundle) {
+  // too short to carry an id to reply to
+  if (bundle->header.length < sizeof(msg_bundle_t)) {
+    dispatch->log<LOG_WARN>(L"invalid bundle.");
+    server_reply(dispatch, RPL_BAD_REQUEST);
+    return server_dispatch_closed(dispatch);
+  }
+
+  dispatch->log<LOG_DEBUG>(
+    L"received MSG_BUNDLE {} with {} messages", bundle->id, bundle->count
+  );
+
+  uint8_t* iter = (uint8_t*)bundle + sizeof(msg_bundle_t);
+  uint32_t left = bundle->header.length - sizeof(msg_bundle_t);
+
+  std::vector<uint8_t> codes;
+
+  // every message takes at least a header, a larger count cannot be honest
+  if (bundle->count > left / sizeof(message_header_t)) {
+    dispatch->log<LOG_WARN>(L"invalid bundle.");
+  } else {
+    codes.reserve(bundle->count);
+
+    dispatch->in_request = true;
+    dispatch->request_id = bundle->id;
+    dispatch->bundle_codes = &codes;
+
+    for (uint32_t i = 0; i < bundle->count; i++) {
+      message_header_t* header = (message_header_t*)iter;
+
+      // the rest of the bundle cannot be delimited past a malformed message.
+      // a message too short for its fields is delimited, and answered by
+      // `server_handle_message`.
+      if (left < sizeof(message_header_t) ||
+          header->length < sizeof(message_header_t) || header->length > left ||
+          header->type == MSG_REQUEST || header->type == MSG_BUNDLE) {
+        dispatch->log<LOG_WARN>(L"invalid message in bundle.");
+        codes.resize(bundle->count, RPL_BAD_REQUEST);
+        break;
+      }
+
+      dispatch->request_replied = false;
+
+      if (server_handle_message(dispatch, header) != 0) {
+        dispatch->in_request = false;
+        dispatch->bundle_codes = nullptr;
+        return 1;
+      }
+
+      if (!dispatch->request_replied) {
+        codes.push_back(RPL_OK);
+      }
+
+      iter += header->length;
+      left -= header->length;
+    }
+
+    dispatch->in_request = false;
+    dispatch->bundle_codes = nullptr;
+  }
+
+  std::vector<uint8_t> reply(sizeof(msg_reply_bundle_t) + codes.size());
+  length_t len = protocol_wrap_msg_reply_bundle(
+    bundle->id, (uint32_t)codes.size(), codes.data(), reply.data()
+  );
+  server_output(dispatch, reply.data(), len);
+
+  return server_dispatch_closed(dispatch);
+}
+
+int server_handle_request(Dispatch* dispatch, msg_request_t* request) {
+  // too short to carry an id to reply to
+  if (request->header.length < sizeof(msg_request_t)) {
+    dispatch->log<LOG_WARN>(L"invalid request.");
+    server_reply(dispatch, RPL_BAD_REQUEST);
+    return server_dispatch_closed(dispatch);
+  }
+
+  dispatch->log<LOG_DEBUG>(L"received MSG_REQUEST {}", request->id);
+
+  dispatch->in_request = true;
+  dispatch->request_id = request->id;
+  dispatch->request_replied = false;
+
+  message_header_t* inner =
+    (message_header_t*)((uint8_t*)request + sizeof(msg_request_t));
+  uint32_t inner_len = request->header.length - sizeof(msg_request_t);
+
+  int res = 0;
+
+  // the wrapped message must fill the request exactly, and requests and
+  // bundles do not nest.
+  if (inner_len < sizeof(message_header_t) || inner->length != inner_len ||
+      inner->type == MSG_REQUEST || inner->type == MSG_BUNDLE) {
+    dispatch->log<LOG_WARN>(L"invalid request.");
+    server_reply(dispatch, RPL_BAD_REQUEST);
+  } else {
+    res = server_handle_message(dispatch, inner);
+
+    // messages without a reply of their own, like `MSG_NONE`, are
+    // acknowledged so the client can retire the request.
+    if (res == 0 && !dispatch->request_replied) {
+      server_reply(dispatch, RPL_OK);
+    }
+  }
+
+  dispatch->in_request = false;
+
+  return res;
+}
+
+int server_handle_history(Dispatch* dispatch, msg_history_t* request) {
+  if (request->header.length < sizeof(msg_history_t)) {
+    dispatch->log<LOG_WARN>(L"invalid history request.");
+    server_reply(dispatch, RPL_BAD_REQUEST);
+    return server_dispatch_closed(dispatch);
+  }
+
+  dispatch->log<LOG_DEBUG>(
+    L"received MSG_HISTORY of room {} from {} for {} messages", request->room,
+    request->from, request->count
+  );
+
+  // the history of a room is read by its members only, like its messages
+  Session* session = dispatch->session;
+  if (!session->registered ||
+      !dispatch->server->registry.joined(request->room, session->ident)) {
+    dispatch->log<LOG_DEBUG>(L"not in room {}", request->room);
+    server_reply(dispatch, RPL_NOT_IN_ROOM);
+    return server_dispatch_closed(dispatch);
+  }
+
+  HistoryRange range;
+  uint32_t count = std::min(request->count, (uint32_t)HISTORY_REPLAY_MAX);
+
+  if (dispatch->server->history.read(
+        request->room, request->from, count, &range
+      ) != 0) {
+    dispatch->log<LOG_DEBUG>(L"no history of room {}", request->room);
+    server_reply(dispatch, RPL_ROOM_NOT_FOUND);
+    return server_dispatch_closed(dispatch);
+  }
+
+  uint8_t header[sizeof(msg_history_t)];
+  length_t len =
+    protocol_wrap_msg_history(request->room, range.first, range.count, header);
+  server_output(dispatch, header, len);
+
+  // the messages go out from the mapped segments as they were forwarded,
+  // in a frame per segment
+  for (const HistoryRun& run : range.runs) {
+    server_output_run(dispatch, run.data, run.len);
+  }
+
+  metric_add(dispatch->stats->replayed, range.count);
+
+  server_reply(dispatch, RPL_OK);
+
+  return server_dispatch_closed(dispatch);
+}
+
+int server_handle_stream(Dispatch* dispatch, message_header_t* header) {
+  ServerState* server = dispatch->server;
+  Session* session = dispatch->session;
+  // the messages are queued at once to the clients of the reactor, posted
+  // to the others
+  ServerReactor* reactor = dispatch->pooled ? nullptr : dispatch->reactor;
+  uint8_t* iter = (uint8_t*)header;
+
+  size_t fixed = header->type == MSG_STREAM_START   ? sizeof(msg_stream_start_t)
+                 : header->type == MSG_STREAM_CHUNK ? sizeof(msg_stream_chunk_t)
+                                                    : sizeof(msg_stream_end_t);
+  bool replied =
+    header->type == MSG_STREAM_START || header->type == MSG_STREAM_END;
+
+  // the source is the sender of the stream, only the sender opens, feeds
+  // and ends it. the fields are only read once known to be there.
+  msg_stream_chunk_t* fields = (msg_stream_chunk_t*)iter;
+  bool valid = header->length >= fixed;
+
+  if (valid && header->type != MSG_STREAM_ACK) {
+    valid = session->registered && fields->src == session->ident;
+  }
+
+  if (!valid) {
+    dispatch->log<LOG_WARN>(L"invalid stream message.");
+    if (replied) {
+      server_reply(dispatch, RPL_BAD_REQUEST);
+    }
+    return server_dispatch_closed(dispatch);
+  }
+
+  // the body goes out as is, shared by the frames of both versions
+  auto body = [&]() {
+    return payload_create(
+      iter + sizeof(message_header_t),
+      header->length - sizeof(message_header_t)
+    );
+  };
+
+  switch (header->type) {
+    case MSG_STREAM_START: {
+      msg_stream_start_t* start = (msg_stream_start_t*)iter;
+      dispatch->log<LOG_DEBUG>(
+        L"received MSG_STREAM_START {} from {} to {} of {} bytes", start->id,
+        start->src, start->dst, start->size
+      );
+
+      if (header->length - sizeof(msg_stream_start_t) > STREAM_NAME_MAX) {
+        server_reply(dispatch, RPL_BAD_REQUEST);
+        break;
+      }
+
+      std::vector<Endpoint> targets;
+      if (server->registry.route(start->dst, &targets) != ROUTE_CLIENT) {
+        server_reply(dispatch, RPL_DST_NOT_FOUND);
+        break;
+      }
+
+      Stream stream;
+      stream.src = start->src;
+      stream.id = start->id;
+      stream.dst = start->dst;
+      stream.sender =
+        Endpoint{session->socket, session->reactor, session->serial};
+      stream.receiver = targets[0];
+      stream.size = start->size;
+
+      reply_code_t code = server->streams.open(stream);
+      if (code != RPL_OK) {
+        server_reply(dispatch, code);
+        break;
+      }
+
+      // a receiver leaving meanwhile either drops the stream once
+      // unregistered, or is found gone here
+      targets.clear();
+      if (server->registry.route(start->dst, &targets) != ROUTE_CLIENT ||
+          targets[0].serial != stream.receiver.serial) {
+        server->streams.close(stream.src, stream.id, &stream);
+        server_reply(dispatch, RPL_DST_NOT_FOUND);
+        break;
+      }
+
+      server_forward_stream(
+        server, reactor, stream.receiver, MSG_STREAM_START, body()
+      );
+      server_reply(dispatch, RPL_OK);
+      break;
+    }
+    case MSG_STREAM_CHUNK: {
+      msg_stream_chunk_t* chunk = (msg_stream_chunk_t*)iter;
+      uint32_t len = header->length - sizeof(msg_stream_chunk_t);
+
+      Stream stream;
+      int res = server->streams.send(chunk->src, chunk->id, len, &stream);
+
+      // the chunks sent before the stream was cut off are dropped
+      if (res > 0) {
+        dispatch->log<LOG_DEBUG>(
+          L"chunk of stream {} of {} not open", chunk->id, chunk->src
+        );
+        break;
+      }
+
+      // a chunk too large for a version 1 frame ends the stream as well
+      if (res < 0 || len > STREAM_CHUNK_SIZE) {
+        dispatch->log<LOG_WARN>(
+          L"stream {} of {} went over its window.", chunk->id, chunk->src
+        );
+
+        if (res == 0) {
+          server->streams.close(chunk->src, chunk->id, &stream);
+        }
+        server_end_stream(
+          server, reactor, stream, stream.receiver, RPL_SEND_FAILED
+        );
+        server_end_stream(
+          server, reactor, stream, stream.sender, RPL_SEND_FAILED
+        );
+        break;
+      }
+
+      server_forward_stream(
+        server, reactor, stream.receiver, MSG_STREAM_CHUNK, body()
+      );
+      metric_add(dispatch->stats->streamed, len);
+      break;
+    }
+    case MSG_STREAM_END: {
+      msg_stream_end_t* end = (msg_stream_end_t*)iter;
+      dispatch->log<LOG_DEBUG>(
+        L"received MSG_STREAM_END {} from {} with code {}", end->id, end->src,
+        (int)end->code
+      );
+
+      Stream stream;
+      if (server->streams.close(end->src, end->id, &stream) != 0) {
+        server_reply(dispatch, RPL_BAD_REQUEST);
+        break;
+      }
+
+      server_forward_stream(
+        server, reactor, stream.receiver, MSG_STREAM_END, body()
+      );
+      server_reply(dispatch, RPL_OK);
+      break;
+    }
+    case MSG_STREAM_ACK: {
+      msg_stream_ack_t* ack = (msg_stream_ack_t*)iter;
+
+      // only the receiver of the stream opens the window of the sender
+      Stream stream;
+      if (!session->registered ||
+          server->streams.ack(
+            ack->src, ack->id, session->ident, ack->bytes, &stream
+          ) != 0) {
+        break;
+      }
+
+      server_forward_stream(
+        server, reactor, stream.sender, MSG_STREAM_ACK, body()
+      );
+      break;
+    }
+    default: {
+      break;
+    }
+  }
+
+  return server_dispatch_closed(dispatch);
+}
+
+int server_send(ServerReactor* reactor, SOCKET socket, uint8_t* data, int len) {
+  auto it = reactor->connections.find(socket);
+  if (it == reactor->connections.end()) {
+    return -1;
+  }
+
+  if (it->second.version == 2) {
+    // never longer than the message
+    std::vector<uint8_t> encoded(len);
+    len = protocol_v2_encode(data, PROTOCOL_TO_CLIENT, encoded.data());
+    return server_send_frame(
+      reactor, socket, frame_create(encoded.data(), len)
+    );
+  }
+
+  return server_send_frame(reactor, socket, frame_create(data, len));
+}
+
+int server_send_run(
+  ServerReactor* reactor,
+  SOCKET socket,
+  const uint8_t* data,
+  size_t len
+) {
+  auto it = reactor->connections.find(socket);
+  if (it == reactor->connections.end()) {
+    return -1;
+  }
+
+  Connection& connection = it->second;
+  auto frame = std::make_shared<Frame>();
+  std::vector<uint8_t>& bytes = frame->bytes;
+
+  if (connection.version == 1 && (connection.features & FEATURE_LZ)) {
+    bytes.assign(data, data + len);
+    return server_send_frame(reactor, socket, frame);
+  }
+
+  // the messages are encoded one by one into the frame, which only grows
+  // past the run for the data decompressed
+  bytes.reserve(len);
+  std::vector<uint8_t> plain;
+  size_t offset = 0;
+
+  while (offset < len) {
+    const uint8_t* message = data + offset;
+    const msg_send_t* send = (const msg_send_t*)message;
+    uint32_t message_len = send->header.length;
+    offset += message_len;
+
+    // invalid compressed data is sent as is, like the client sent it
+    if (send->header.type == MSG_SEND && send->format == FMT_LZ &&
+        !(connection.features & FEATURE_LZ)) {
+      plain.resize(PROTOCOL_BUFFER_SIZE);
+
+      format_t format;
+      length_t plain_len = decompress_data(
+        message + sizeof(msg_send_t), message_len - sizeof(msg_send_t),
+        &format, plain.data() + sizeof(msg_send_t),
+        (uint32_t)(plain.size() - sizeof(msg_send_t))
+      );
+
+      if (plain_len >= 0) {
+        protocol_wrap_msg_send_header(
+          send->src, send->dst, format, plain_len, plain.data()
+        );
+        message = plain.data();
+        message_len = sizeof(msg_send_t) + plain_len;
+      }
+    }
+
+    size_t at = bytes.size();
+    bytes.resize(at + message_len);
+
+    if (connection.version == 2) {
+      length_t encoded =
+        protocol_v2_encode(message, PROTOCOL_TO_CLIENT, bytes.data() + at);
+      bytes.resize(at + std::max(encoded, 0));
+    } else {
+      memcpy(bytes.data() + at, message, message_len);
+    }
+  }
+
+  return server_send_frame(reactor, socket, frame);
+}
+
+int server_send_stream(
+  ServerReactor* reactor,
+  const Endpoint& target,
+  message_type_t type,
+  const Payload& body
+) {
+  auto it = reactor->connections.find(target.socket);
+  if (it == reactor->connections.end() ||
+      it->second.serial != target.serial) {
+    return -1;
+  }
+
+  uint8_t prefix[PROTOCOL_V2_HEADER_MAX];
+  length_t len;
+
+  if (it->second.version == 2) {
+    len = protocol_v2_encode_header(type, (uint32_t)body->size(), prefix);
+  } else {
+    message_header_t header = {
+      type, (uint32_t)(sizeof(message_header_t) + body->size())
+    };
+    memcpy(prefix, &header, sizeof(header));
+    len = sizeof(header);
+  }
+
+  if (len < 0) {
+    return -1;
+  }
+
+  return server_send_frame(
+    reactor, target.socket, frame_create(prefix, len, body)
+  );
+}
+
+int server_send_frame(
+  ServerReactor* reactor,
+  SOCKET socket,
+  const FrameRef& frame
+) {
+  if (!reactor->connections.contains(socket)) {
+    return -1;
+  }
+
+  if (reactor->io->send_frame(socket, frame) < 0) {
+    reactor->log<LOG_WARN>(
+      L"send failed with error code: {}", WSAGetLastError()
+    );
+    server_close(reactor, socket);
+    return -1;
+  }
+
+  metric_add(reactor->stats->bytes_out, frame->size());
+
+  return (int)frame->size();
+}
+
+int server_write(
+  ServerReactor* reactor,
+  SOCKET socket,
+  uint8_t* data,
+  int len
+) {
+  int res = server_send(reactor, socket, data, len);
+
+  message_header_t* header = (message_header_t*)data;
+  if (res < 0 || header->type != MSG_VERSION) {
+    return res;
+  }
+
+  // the messages after it, both ways, are in the version agreed on
+  msg_version_t* version = (msg_version_t*)data;
+  Connection& connection = reactor->connections[socket];
+  connection.version = version->version;
+  connection.framer.version = version->version;
+  connection.features = version->features;
+
+  return res;
+}
+
+void server_output(Dispatch* dispatch, uint8_t* data, int len) {
+  if (!dispatch->pooled) {
+    server_write(dispatch->reactor, dispatch->session->socket, data, len);
+    return;
+  }
+
+  if (!dispatch->close) {
+    dispatch->output.insert(dispatch->output.end(), data, data + len);
+  }
+}
+
+void server_output_run(Dispatch* dispatch, const uint8_t* data, size_t len) {
+  if (!dispatch->pooled) {
+    server_send_run(dispatch->reactor, dispatch->session->socket, data, len);
+    return;
+  }
+
+  if (!dispatch->close) {
+    dispatch->output.insert(dispatch->output.end(), data, data + len);
+  }
+}
+
+void server_disconnect(Dispatch* dispatch) {
+  if (!dispatch->pooled) {
+    server_close(dispatch->reactor, dispatch->session->socket);
+    return;
+  }
+
+  dispatch->close = true;
+}
+
+int server_dispatch_closed(Dispatch* dispatch) {
+  if (dispatch->pooled) {
+    return dispatch->close ? 1 : 0;
+  }
+
+  SOCKET socket = dispatch->session->socket;
+  return dispatch->reactor->connections.contains(socket) ? 0 : 1;
+}
+
+void server_reply(Dispatch* dispatch, reply_code_t code) {
+  uint8_t reply_buffer[sizeof(msg_reply_id_t)];
+  length_t len;
+
+  dispatch->stats->reply(code);
+
+  if (dispatch->in_request && dispatch->bundle_codes != nullptr) {
+    dispatch->bundle_codes->push_back((uint8_t)code);
+    dispatch->request_replied = true;
+    return;
+  } else if (dispatch->in_request) {
+    len = protocol_wrap_msg_reply_id(dispatch->request_id, code, reply_buffer);
+    dispatch->request_replied = true;
+  } else {
+    len = protocol_wrap_msg_reply(code, reply_buffer);
+  }
+
+  server_output(dispatch, reply_buffer, len);
+}
+
+void server_close(ServerReactor* reactor, SOCKET socket) {
+  auto it = reactor->connections.find(socket);
+  if (it == reactor->connections.end()) {
+    return;
+  }
+
+  // the socket number may be reused by the next accepted connection, so the
+  // ident must not keep pointing at it.
+  std::shared_ptr<Session> session = it->second.session;
+  ServerState* server = reactor->server;
+
+  if (session->strand != nullptr) {
+    session->strand->post([server, session]() {
+      server_unregister(server, session.get());
+    });
+  } else {
+    server_unregister(server, session.get());
+  }
+
+  // the senders held back by the client are not any more
+  server_release(reactor, &it->second);
+  reactor->timers.cancel(it->second.timer);
+
+  framer_free(&it->second.framer);
+  reactor->connections.erase(it);
+  reactor->io->close(socket);
+
+  metric_add(reactor->stats->closed, 1);
+}
+
+void server_unregister(ServerState* server, Session* session) {
+  if (session->registered) {
+    server->registry.remove_client(session->ident, session->socket);
+    session->registered = false;
+    server_drop_streams(server, nullptr, session->ident);
+  }
+}
+
+void server_quit_handler(ServerState* state) {
+  // wait and read `q` from screen
+  int c;
+  while ((c = getchar()) != 'q') {
+    // stdin is closed, e.g. running in background, keep serving
+    if (c == EOF) {
+      return;
+    }
+  }
+
+  state->log(L"quitting server...");
   state->running = false;
-  state->cleanup();
-  state->mutex.unlock();
-}
\ No newline at end of file
+
+  for (auto& reactor : state->reactors) {
+    reactor->io->wake();
+  }
+
+  if (!state->metrics_path.empty()) {
+    state->metrics_reactor.wake();
+  }
+}
+
+/// Answer a connection to the metrics socket and close it.
+static void server_metrics_reply(ServerState* state, SOCKET peer) {
+  // a scraper sends its request first, a plain reader like `nc -U` sends
+  // nothing and gets the text alone.
+  fd_set readable;
+  FD_ZERO(&readable);
+  FD_SET(peer, &readable);
+  struct timeval timeout = {0, METRICS_REQUEST_WAIT_US};
+
+  char request[1024];
+  int request_len = 0;
+  if (select((int)peer + 1, &readable, NULL, NULL, &timeout) > 0) {
+    request_len = recv(peer, request, sizeof(request), 0);
+  }
+
+  std::string text = state->metrics.render();
+
+  if (request_len >= 4 && memcmp(request, "GET ", 4) == 0) {
+    text = std::format(
+      "HTTP/1.0 200 OK\r\n"
+      "Content-Type: text/plain; version=0.0.4\r\n"
+      "Content-Length: {}\r\n\r\n{}",
+      text.size(), text
+    );
+  }
+
+  size_t sent = 0;
+  while (sent < text.size()) {
+    int res = send(peer, text.data() + sent, (int)(text.size() - sent), 0);
+    if (res <= 0) {
+      break;
+    }
+    sent += res;
+  }
+
+  closesocket(peer);
+}
+
+void server_metrics_handler(ServerState* state) {
+  const std::string& path = state->metrics_path;
+  std::wstring wpath(path.begin(), path.end());
+
+  struct sockaddr_un addr = {};
+  addr.sun_family = AF_UNIX;
+
+  if (path.size() >= sizeof(addr.sun_path)) {
+    state->log<LOG_WARN>(L"metrics socket path too long: {}", wpath);
+    return;
+  }
+  memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+
+  SOCKET listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listener == INVALID_SOCKET) {
+    state->log<LOG_WARN>(
+      L"could not create metrics socket: {}", WSAGetLastError()
+    );
+    return;
+  }
+
+  // the socket file of an earlier run would fail the bind
+  remove(path.c_str());
+
+  if (bind(listener, (struct sockaddr*)&addr, sizeof(addr)) == SOCKET_ERROR ||
+      listen(listener, SOMAXCONN) == SOCKET_ERROR) {
+    state->log<LOG_WARN>(
+      L"metrics socket bind failed with error code: {}", WSAGetLastError()
+    );
+    closesocket(listener);
+    return;
+  }
+
+  state->log(L"serving metrics on {}", wpath);
+
+  // a connection at a time, the listener stays ready until all are taken
+  Reactor& reactor = state->metrics_reactor;
+  reactor.add(
+    listener, EV_READ | EV_LEVEL,
+    [state, listener](SOCKET, uint32_t) {
+      SOCKET peer = accept(listener, NULL, NULL);
+      if (peer != INVALID_SOCKET) {
+        server_metrics_reply(state, peer);
+      }
+    }
+  );
+
+  // the quit handler wakes the reactor up
+  while (state->running) {
+    if (reactor.poll(-1) < 0) {
+      state->log<LOG_WARN>(
+        L"metrics poll failed with error code: {}", WSAGetLastError()
+      );
+      break;
+    }
+  }
+
+  reactor.remove(listener);
+  closesocket(listener);
+  remove(path.c_str());
+}
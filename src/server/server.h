@@ -1,16 +1,219 @@
 #ifndef SERVER_SERVER_H_
 #define SERVER_SERVER_H_
 
-#include "WinSock2.h"
-
-#include <mutex>
+#include <atomic>
+#include <latch>
+#include <memory>
 #include <queue>
 #include <string>
 #include <unordered_map>
-#include <unordered_set>
 #include <vector>
 
+#include "log/logger.h"
+#include "net/buffer_pool.h"
+#include "net/io.h"
+#include "net/mailbox.h"
+#include "net/reactor.h"
+#include "net/socket.h"
+#include "net/timer_wheel.h"
+#include "net/work_pool.h"
+#include "protocol/framer.h"
 #include "protocol/protocol.h"
+#include "server/history.h"
+#include "server/metrics.h"
+#include "server/offline.h"
+#include "server/registry.h"
+#include "server/stream.h"
+
+/// Bytes queued to a client from which the messages forwarded to it
+/// overflow, by default.
+#define SERVER_OUTBOUND_LIMIT (4 << 20)
+/// Milliseconds a client may stay silent before it is pinged, by default.
+#define SERVER_HEARTBEAT_MS 30000
+/// Milliseconds a client answering pings may stay silent before it is
+/// disconnected, by default.
+#define SERVER_IDLE_TIMEOUT_MS 90000
+/// Number of the threads reading the registry other than the reactors and
+/// the workers, kept out of the `EPOCH_MAX_THREADS` they share.
+#define SERVER_OTHER_THREADS 8
+
+/// What is done with a message forwarded to a client whose queue is over
+/// the limit, as the client does not read fast enough.
+enum OverflowPolicy {
+  /// Queue the message and stop reading from its sender until the queue is
+  /// down to half the limit, drop it if it has no sender to stop
+  OVERFLOW_BLOCK = 0,
+  /// Drop the oldest messages forwarded and not written yet to make room
+  OVERFLOW_DROP_OLDEST,
+  /// Drop the message
+  OVERFLOW_DROP_NEWEST,
+  /// Close the connection of the client
+  OVERFLOW_DISCONNECT,
+};
+
+/// Parse a policy name, `block`, `drop-oldest`, `drop-newest` or
+/// `disconnect`.
+///
+/// Returns `OVERFLOW_BLOCK` for anything else.
+OverflowPolicy overflow_policy_parse(const std::string& name);
+
+/// The state of a connection read and changed by the handling of its
+/// messages.
+///
+/// Touched by the reactor of the connection only, or with a dispatch pool by
+/// the tasks of the strand of the connection only.
+struct Session {
+  /// The socket of the connection
+  SOCKET socket;
+  /// The serial of the connection, see `Endpoint`
+  uint64_t serial = 0;
+  /// The reactor of the connection
+  uint32_t reactor = 0;
+  /// Whether a client has been registered with `MSG_CONNECT` on this
+  /// connection.
+  bool registered = false;
+  /// The ident registered by the client
+  ident_t ident = 0;
+  /// The version of the wire format agreed on at `MSG_CONNECT`
+  uint32_t version = 1;
+  /// Whether the client is known to answer `MSG_PING`, having agreed on
+  /// version 2 or sent a `MSG_PING` or `MSG_PONG`. Read by the reactor for
+  /// the idle timeout, a version 1 client may never answer.
+  std::atomic<bool> answers_pings = false;
+  /// Runs the messages of the connection in order on the dispatch pool,
+  /// null without one
+  std::unique_ptr<Strand> strand;
+};
+
+/// A connection accepted by the server.
+struct Connection {
+  /// The socket of the connection
+  SOCKET socket;
+  /// Tells the connection from the earlier ones on the same socket number
+  uint64_t serial = 0;
+  /// Reassembles the messages split across reads
+  framer_t framer = {};
+  /// The version of the wire format written, raised by `MSG_VERSION`
+  uint32_t version = 1;
+  /// The features agreed on at `MSG_CONNECT`
+  uint32_t features = 0;
+  /// The state of the handling of the messages
+  std::shared_ptr<Session> session;
+  /// Whether framing waits for the dispatch pool to handle a message that
+  /// may change the version of the frames after it
+  bool holding = false;
+  /// The bytes received while holding
+  std::vector<uint8_t> held;
+  /// Number of the clients whose queue holds the reading of the connection
+  /// back, read again once none
+  uint32_t blockers = 0;
+  /// The senders held back by the queue of the connection, by serial, until
+  /// it drains
+  std::unordered_map<uint64_t, Endpoint> blocked;
+  /// Number of the messages dropped since the client was last told
+  uint32_t dropped = 0;
+  /// When the last bytes were read from the connection, see `metrics_now`
+  uint64_t active = 0;
+  /// The timer of the next heartbeat of the connection, 0 if none
+  timer_id_t timer = 0;
+};
+
+struct ServerState;
+struct ServerReactor;
+
+/// The handling of the messages of a connection, on the reactor of the
+/// connection or on a thread of the dispatch pool.
+///
+/// On the reactor the replies are written at once. On the pool they are
+/// collected and posted to the reactor, which writes them in order.
+struct Dispatch {
+  ServerState* server = nullptr;
+  /// The reactor of the connection
+  ServerReactor* reactor = nullptr;
+  /// Whether running on the dispatch pool
+  bool pooled = false;
+  /// The connection whose messages are handled
+  Session* session = nullptr;
+  /// The shard of the metrics of the thread
+  MetricsShard* stats = nullptr;
+  /// When the bytes being handled were read, see `metrics_now`
+  uint64_t recv_time = 0;
+  /// The message decoded from the version 2 frame being handled
+  std::vector<uint8_t> decoded;
+
+  /// Whether a request is being handled, whose reply carries its id
+  bool in_request = false;
+  /// The id of the request being handled
+  request_id_t request_id = 0;
+  /// Whether the request being handled has been replied to
+  bool request_replied = false;
+  /// The reply codes collected for the bundle being handled, null outside of
+  /// a bundle
+  std::vector<uint8_t>* bundle_codes = nullptr;
+
+  /// The messages to write to the connection, on the pool
+  std::vector<uint8_t> output;
+  /// Whether the connection is to be closed after the output, on the pool
+  bool close = false;
+
+  /// Log a message of the level, formatted only if the level is enabled.
+  template <LogLevel Level = LOG_INFO, typename... Args>
+  void log(std::wformat_string<Args...> fmt, Args&&... args);
+};
+
+/// What a delivery asks of the reactor it is posted to.
+enum DeliveryKind {
+  /// Queue the message to the targets, clients of the reactor
+  DELIVERY_CLIENTS = 0,
+  /// Fan the message out to the members of the room `dst`, owned by the
+  /// reactor
+  DELIVERY_ROOM,
+  /// Add `src` to the members of the room `dst`, owned by the reactor
+  DELIVERY_JOIN,
+  /// Remove `src` from the members of the room `dst`, owned by the reactor
+  DELIVERY_LEAVE,
+  /// Write the messages of the payload, built on the dispatch pool, to the
+  /// connection of the target
+  DELIVERY_OUTPUT,
+  /// Write the stream message of the type, whose body is the payload, to
+  /// the connection of the target
+  DELIVERY_STREAM,
+  /// Write the messages queued for the target `dst` while it was not
+  /// connected, the payload, then those sent to it since they were read
+  DELIVERY_QUEUED,
+  /// Stop reading from the target, held back by a client of another
+  /// reactor
+  DELIVERY_BLOCK,
+  /// Read from the target again
+  DELIVERY_UNBLOCK,
+};
+
+/// A message to deliver to the clients of a reactor, or a change to a room
+/// it owns.
+struct Delivery {
+  DeliveryKind kind = DELIVERY_CLIENTS;
+  /// The sender, or the member joining or leaving
+  ident_t src = 0;
+  /// The connection the message was read from, held back by the targets
+  /// it overflows. None for the messages not read from a client.
+  Endpoint sender;
+  /// The client or room the message is sent to, or the room joined or left
+  ident_t dst = 0;
+  /// The format of the data
+  format_t format = 0;
+  /// The type of a stream message
+  message_type_t type = MSG_NONE;
+  /// The data, shared by every reactor delivering the message
+  Payload payload;
+  /// When the message was read, see `metrics_now`
+  uint64_t recv_time = 0;
+  /// The clients of the reactor to deliver to
+  std::vector<Endpoint> targets;
+  /// Whether the connection frames the bytes held after the output
+  bool resume = false;
+  /// Whether the connection is closed after the output
+  bool close = false;
+};
 
 /// State of the server
 struct ServerState {
@@ -18,28 +221,74 @@ struct ServerState {
   size_t port;
   /// The maximum number of clients
   size_t max_clients;
-  /// The master socket
-  SOCKET master;
   /// The server address
   struct sockaddr_in server;
 
-  bool running = true;
+  std::atomic<bool> running = true;
+
+  /// The logger, off the threads handling the messages
+  Logger logger{L"SERVER"};
+
+  /// The name of the I/O backend, `epoll` or `uring`
+  std::string backend = "epoll";
+  /// How long small writes may be held to be coalesced, in microseconds
+  int flush_delay_us = 0;
+  /// Bytes queued to a client from which the messages forwarded to it
+  /// overflow, 0 for no limit
+  size_t outbound_limit = SERVER_OUTBOUND_LIMIT;
+  /// What is done with the messages overflowing
+  OverflowPolicy overflow = OVERFLOW_BLOCK;
+  /// Milliseconds a client may stay silent before it is pinged, 0 for never
+  uint64_t heartbeat_ms = SERVER_HEARTBEAT_MS;
+  /// Milliseconds a client answering pings may stay silent before it is
+  /// disconnected, 0 for never
+  uint64_t idle_timeout_ms = SERVER_IDLE_TIMEOUT_MS;
+  /// Number of the reactors, each on its own thread
+  size_t reactor_count = 1;
+  /// The CPUs the reactors are pinned to in turn, none if empty
+  std::vector<int> cpus;
+  /// The reactors serving the connections
+  std::vector<std::unique_ptr<ServerReactor>> reactors;
+  /// Number of the threads handling the messages, none to handle them on
+  /// the reactors
+  size_t worker_count = 0;
+  /// The threads handling the messages, null without workers
+  std::unique_ptr<WorkPool> pool;
+  /// The serial of the last connection accepted
+  std::atomic<uint64_t> serials = 0;
+  /// The clients and rooms, shared by the reactors
+  Registry registry;
 
-  /// The clients
-  std::unordered_map<ident_t, SOCKET> clients;
-  /// Mutex for sockets
-  std::unordered_map<SOCKET, std::shared_ptr<std::mutex>> socket_mutexes;
-  /// The rooms
-  std::unordered_map<ident_t, std::unordered_set<ident_t>> rooms;
+  /// The counters and histograms of the server
+  Metrics metrics;
+  /// The path of the Unix socket the metrics are dumped on, none if empty
+  std::string metrics_path;
+  /// Waits for the connections to the metrics socket, woken up to quit
+  Reactor metrics_reactor;
 
-  /// Mutex
-  std::mutex mutex;
+  /// The directory the history of the rooms is kept in, none if empty
+  std::string history_path;
+  /// The messages forwarded to the rooms, appended by their owners
+  History history;
+  /// The streams open between the clients
+  StreamTable streams;
 
-  /// Print a message to stdout with a prefix
-  void log(const std::wstring& msg);
-  /// Initialize the server
+  /// The directory the messages to the clients not connected are spilled
+  /// to, none if empty and they are not queued
+  std::string offline_path;
+  /// The messages to the clients not connected, until they connect
+  OfflineStore offline;
+
+  /// Log a message of the level, formatted only if the level is enabled.
+  template <LogLevel Level = LOG_INFO, typename... Args>
+  void log(std::wformat_string<Args...> fmt, Args&&... args) {
+    this->logger.log<Level>(fmt, std::forward<Args>(args)...);
+  }
+  /// Initialize the server and the listening sockets of its reactors
   int init(size_t port, size_t max_clients);
-  /// Main loop of the server
+  /// The index of the reactor owning the room
+  uint32_t room_owner(ident_t room);
+  /// Main loop of the server, running the reactors until quitting
   void loop();
   /// Show information about the server
   void show_info();
@@ -47,10 +296,384 @@ struct ServerState {
   void cleanup();
 };
 
+/// A reactor of the server, serving its share of the connections on its own
+/// thread.
+///
+/// Every reactor listens on the port with its own socket, the kernel
+/// spreading the incoming connections between them with `SO_REUSEPORT`, and
+/// drives its sockets with its own I/O backend. A connection is handled by
+/// the reactor which accepted it until closed. The messages to the clients
+/// of another reactor are posted to its mailbox, so no connection state is
+/// ever shared between the threads.
+///
+/// Every room is owned by a single reactor, which alone changes its members
+/// and fans its messages out. Joining, leaving and sending to a room are
+/// posted to the mailbox of the owner, even by the owner itself, so they are
+/// applied in the order they are posted without any lock.
+struct ServerReactor : IoHandler {
+  /// The server
+  ServerState* server;
+  /// The index of the reactor in the server
+  uint32_t index;
+  /// The listening socket of the reactor
+  SOCKET master = INVALID_SOCKET;
+  /// The I/O backend driving the sockets of the reactor
+  std::unique_ptr<IoBackend> io;
+  /// The buffers of the messages split across reads, held by the
+  /// connections only until the messages are handled
+  BufferPool pool;
+  /// The accepted connections
+  std::unordered_map<SOCKET, Connection> connections;
+  /// The shard of the metrics of the thread of the reactor
+  MetricsShard* stats = nullptr;
+  /// When the bytes being framed were read, see `metrics_now`
+  uint64_t recv_time = 0;
+  /// The handling of the messages on the reactor, without a dispatch pool
+  Dispatch dispatch;
+  /// The heartbeats of the connections, by socket
+  TimerWheel timers;
+
+  /// The members of the rooms owned by the reactor, in the order they
+  /// joined
+  std::unordered_map<ident_t, std::vector<ident_t>> rooms;
+
+  /// The messages and room changes posted to the reactor
+  Mailbox<Delivery> mailbox;
+  /// Whether the reactor has been woken up for its mailbox and not drained
+  /// it yet
+  std::atomic<bool> mail_pending = false;
+
+  ServerReactor(ServerState* server, uint32_t index)
+      : server(server), index(index) {
+    this->dispatch.server = server;
+    this->dispatch.reactor = this;
+  }
+
+  /// Log a message of the level, formatted only if the level is enabled.
+  template <LogLevel Level = LOG_INFO, typename... Args>
+  void log(std::wformat_string<Args...> fmt, Args&&... args) {
+    this->server->logger.log<Level>(fmt, std::forward<Args>(args)...);
+  }
+  /// Create the listening socket of the reactor bound to the port
+  int listen_on(const struct sockaddr_in* address);
+  /// Serve the connections until the server quits, on the calling thread.
+  ///
+  /// Every reactor arrives at `ready` with its backend initialized, before
+  /// anything can be posted to it, and at `stopped` before closing its
+  /// connections, once nothing can be posted to it any more. The backend is
+  /// released by the server.
+  void run(std::latch* ready, std::latch* stopped);
+
+  void on_accept(SOCKET socket) override;
+  void on_accept_failed(int error) override;
+  void on_recv(SOCKET socket, uint8_t* data, size_t len) override;
+  void on_closed(SOCKET socket) override;
+  void on_drained(SOCKET socket) override;
+};
+
+template <LogLevel Level, typename... Args>
+void Dispatch::log(std::wformat_string<Args...> fmt, Args&&... args) {
+  this->server->logger.log<Level>(fmt, std::forward<Args>(args)...);
+}
+
 /// The handler for receiving messages from the client.
-void server_recv_handler(ServerState* state, SOCKET socket);
+///
+/// Called by the I/O backend with the bytes received on the socket, which may
+/// carry any number of messages and parts of messages. Dispatches every
+/// complete message, the incomplete one is kept by the framer of the
+/// connection.
+void server_recv_handler(
+  ServerReactor* reactor,
+  SOCKET socket,
+  uint8_t* buffer,
+  int recv_size
+);
+
+/// Hand the complete frames fed to the framer of the connection to their
+/// handling.
+///
+/// Without a dispatch pool the frames are handled at once. With one they are
+/// copied and posted in a single task to the strand of the connection, and
+/// framing stops after a frame which may change the version of the next
+/// ones, until the task is done.
+void server_frame(ServerReactor* reactor, Connection* connection);
+
+/// Handle the frame of the version, decoding it first if need be.
+///
+/// Returns 1 if the connection has been closed while handling the message,
+/// or -1 if the frame is malformed.
+int server_dispatch_frame(
+  Dispatch* dispatch,
+  uint8_t* frame,
+  uint32_t len,
+  uint32_t version
+);
+
+/// Handle the frames of a task of the strand of the connection, on the
+/// dispatch pool, and post the replies to its reactor.
+///
+/// The frames are packed in `batch`, each after its length. If `resume`, the
+/// reactor resumes framing once the replies are written.
+void server_dispatch_batch(
+  ServerState* server,
+  Session* session,
+  const std::vector<uint8_t>& batch,
+  uint32_t version,
+  uint64_t recv_time,
+  bool resume
+);
+
+/// Post the output collected on the dispatch pool to the reactor of the
+/// connection, see `server_write_output`.
+void server_post_output(Dispatch* dispatch, bool resume);
+
+/// Handle a single message received on the connection.
+///
+/// Returns 1 if the connection has been closed while handling the message.
+int server_handle_message(Dispatch* dispatch, message_header_t* header);
+
+/// Write the message built by the handling to its connection.
+///
+/// On the reactor the message is sent at once, on the pool it is added to
+/// the output.
+void server_output(Dispatch* dispatch, uint8_t* data, int len);
+
+/// Write the run of messages built by the handling, back to back, to its
+/// connection.
+///
+/// On the reactor the run is sent at once, on the pool it is added to the
+/// output.
+void server_output_run(Dispatch* dispatch, const uint8_t* data, size_t len);
+
+/// Close the connection handled once its output is written.
+void server_disconnect(Dispatch* dispatch);
+
+/// Whether the connection handled has been closed, or is to be once its
+/// output is written.
+int server_dispatch_closed(Dispatch* dispatch);
+
+/// Write a message of the handling to the socket, see `server_send`.
+///
+/// The version and the features of the connection change once it has
+/// written `MSG_VERSION`.
+int server_write(ServerReactor* reactor, SOCKET socket, uint8_t* data, int len);
+
+/// Send a message to the socket without blocking.
+///
+/// The message is encoded in the version of the connection and queued by the
+/// I/O backend, the connection is closed if the socket has failed. Returns -1
+/// on failure.
+int server_send(
+  ServerReactor* reactor,
+  SOCKET socket,
+  uint8_t* data,
+  int len
+);
+
+/// Send the run of messages, back to back, to the socket in a single frame,
+/// see `server_send`.
+///
+/// None of the messages may be `MSG_VERSION`. The compressed data of a
+/// `MSG_SEND` is decompressed for a connection without `FEATURE_LZ`.
+int server_send_run(
+  ServerReactor* reactor,
+  SOCKET socket,
+  const uint8_t* data,
+  size_t len
+);
+
+/// Queue the stream message of the type, its body shared by the payload, to
+/// the connection of the target in its version.
+///
+/// The body is the fields of version 1, read in version 2 as is, so the
+/// chunks of data go out without being copied. Returns -1 if the target is
+/// gone.
+int server_send_stream(
+  ServerReactor* reactor,
+  const Endpoint& target,
+  message_type_t type,
+  const Payload& body
+);
+
+/// Queue the frame, already encoded in the version of the connection, to the
+/// socket without copying it, see `server_send`.
+int server_send_frame(
+  ServerReactor* reactor,
+  SOCKET socket,
+  const FrameRef& frame
+);
+
+/// Reply to the connection with the code.
+///
+/// Inside a request, the reply carries the id of the request. Inside a
+/// bundle, the code is collected into the reply to the bundle.
+void server_reply(Dispatch* dispatch, reply_code_t code);
+
+/// Decompress the `FMT_LZ` data of a message into the data of the original
+/// format, for the clients without `FEATURE_LZ`.
+///
+/// Returns 1 if the data is malformed.
+int server_decompress_send(
+  const std::vector<uint8_t>& compressed,
+  format_t* format,
+  std::vector<uint8_t>* data
+);
+
+/// Queue the message to the clients of the delivery owned by the reactor.
+///
+/// The message is wrapped once per version and format wanted by the
+/// clients, every client queues the same frame. A client gone since the
+/// message has been routed is skipped.
+void server_deliver(
+  ServerReactor* reactor,
+  const Delivery& delivery,
+  const Endpoint* targets,
+  size_t count
+);
+
+/// Queue the message to the targets, those of other reactors being posted
+/// to them in a batch per reactor.
+///
+/// `reactor` is the reactor running the caller, null on the dispatch pool
+/// where every target is posted to.
+void server_fan_out(
+  ServerState* server,
+  ServerReactor* reactor,
+  const Delivery& delivery,
+  std::vector<Endpoint>& targets
+);
+
+/// Post the delivery to the mailbox of `owner`, waking it up unless it is
+/// already.
+///
+/// `reactor` is the reactor posting, null on the dispatch pool. A reactor
+/// posting to itself drains its mailbox once done with the ready sockets.
+void server_post(
+  ServerReactor* reactor,
+  ServerReactor* owner,
+  Delivery delivery
+);
+
+/// Post the change or the message to the owner of the room `delivery.dst`,
+/// see `server_post`.
+void server_post_room(
+  ServerState* server,
+  ServerReactor* reactor,
+  Delivery delivery
+);
+
+/// Queue the stream message to the target at once if it is a client of
+/// `reactor`, or post it to the reactor of the target.
+///
+/// `reactor` is the reactor running the caller, null elsewhere.
+void server_forward_stream(
+  ServerState* server,
+  ServerReactor* reactor,
+  const Endpoint& target,
+  message_type_t type,
+  Payload body
+);
+
+/// Close the streams sent or received by the client, telling the other end
+/// with a `MSG_STREAM_END`, see `server_forward_stream`.
+void server_drop_streams(
+  ServerState* server,
+  ServerReactor* reactor,
+  ident_t ident
+);
+
+/// Apply the overflow policy to the message of the delivery to the client,
+/// of `len` bytes, before it is queued.
+///
+/// Returns 1 if the message is not to be queued, dropped or the client
+/// disconnected.
+int server_overflow(
+  ServerReactor* reactor,
+  Connection* connection,
+  const Delivery& delivery,
+  size_t len
+);
+
+/// Stop reading from the sender, or read from it again once no client holds
+/// it back, if it is a client of the reactor.
+void server_block(ServerReactor* reactor, const Endpoint& sender, bool block);
+
+/// Read again from the senders held back by the connection, once its queue
+/// has drained or it is closed.
+void server_release(ServerReactor* reactor, Connection* connection);
+
+/// Schedule the next heartbeat of the connection, after `heartbeat_ms` or,
+/// if it answers pings, `idle_timeout_ms` of silence from `now`.
+void server_schedule_heartbeat(
+  ServerReactor* reactor,
+  Connection* connection,
+  uint64_t now
+);
+
+/// The heartbeat of the connection: disconnect it if silent for
+/// `idle_timeout_ms` while it answers pings, else ping it if silent for
+/// `heartbeat_ms`, and schedule the next one.
+void server_heartbeat(ServerReactor* reactor, SOCKET socket);
+
+/// Apply the change or fan the message out to the room owned by the reactor.
+void server_handle_room(ServerReactor* reactor, const Delivery& delivery);
+
+/// Write the output of a dispatch task to its connection, then close the
+/// connection or resume its framing as the task asks.
+void server_write_output(ServerReactor* reactor, const Delivery& delivery);
+
+/// Have the messages spilled for the client connected read off the thread
+/// handling its messages, and posted to its reactor after the output so
+/// far, see `server_write_queued`.
+void server_read_offline(Dispatch* dispatch, ident_t ident);
+
+/// Write the messages queued for the client while it was not connected,
+/// then those sent to it while they were read. They stay queued if the
+/// client is gone.
+void server_write_queued(ServerReactor* reactor, const Delivery& delivery);
+
+/// Handle the deliveries posted to the reactor, on its thread.
+void server_drain_mailbox(ServerReactor* reactor);
+
+/// Handle the messages of a bundle in order and reply to them all at once.
+///
+/// Returns 1 if the connection has been closed while handling the messages.
+int server_handle_bundle(Dispatch* dispatch, msg_bundle_t* bundle);
+
+/// Handle the message wrapped by a request and reply to it exactly once.
+///
+/// Returns 1 if the connection has been closed while handling the message.
+int server_handle_request(Dispatch* dispatch, msg_request_t* request);
+
+/// Replay the messages of a room from its history, followed by the reply.
+///
+/// Returns 1 if the connection has been closed while handling the message.
+int server_handle_history(Dispatch* dispatch, msg_history_t* request);
+
+/// Open, forward or close a stream, or acknowledge its data.
+///
+/// Only the start and the end of a stream are replied to.
+///
+/// Returns 1 if the connection has been closed while handling the message.
+int server_handle_stream(Dispatch* dispatch, message_header_t* header);
+
+/// Close the connection and unregister the client bound to it.
+///
+/// With a dispatch pool, the client is unregistered by the strand of the
+/// connection once done with the messages before.
+void server_close(ServerReactor* reactor, SOCKET socket);
+
+/// Unregister the client of the session, if any.
+void server_unregister(ServerState* server, Session* session);
 
 /// The handler for quitting the server.
 void server_quit_handler(ServerState* state);
 
-#endif
\ No newline at end of file
+/// The handler dumping the metrics on the Unix socket at `metrics_path`.
+///
+/// Every connection to the socket is answered with the metrics in the text
+/// format of Prometheus and closed, with the headers of an HTTP response if
+/// it starts with a `GET` request, so Prometheus can scrape it directly.
+void server_metrics_handler(ServerState* state);
+
+#endif
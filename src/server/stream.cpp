@@ -0,0 +1,100 @@
+#include "server/stream.h"
+
+#include <algorithm>
+
+uint64_t StreamTable::key(ident_t src, uint32_t id) {
+  return ((uint64_t)src << 32) | id;
+}
+
+reply_code_t StreamTable::open(const Stream& stream) {
+  std::lock_guard<std::mutex> lock(this->mutex);
+
+  if (this->streams.contains(StreamTable::key(stream.src, stream.id))) {
+    return RPL_BAD_REQUEST;
+  }
+
+  size_t open = 0;
+  for (const auto& [key, other] : this->streams) {
+    if (other.src == stream.src) {
+      open++;
+    }
+  }
+
+  if (open >= STREAM_MAX_OPEN) {
+    return RPL_BAD_REQUEST;
+  }
+
+  this->streams.emplace(StreamTable::key(stream.src, stream.id), stream);
+
+  return RPL_OK;
+}
+
+int StreamTable::send(ident_t src, uint32_t id, uint32_t len, Stream* stream) {
+  std::lock_guard<std::mutex> lock(this->mutex);
+
+  auto it = this->streams.find(StreamTable::key(src, id));
+  if (it == this->streams.end()) {
+    return 1;
+  }
+
+  Stream& open = it->second;
+  open.sent += len;
+  *stream = open;
+
+  if (open.sent - open.acked > STREAM_WINDOW ||
+      (open.size != 0 && open.sent > open.size)) {
+    this->streams.erase(it);
+    return -1;
+  }
+
+  return 0;
+}
+
+int StreamTable::ack(
+  ident_t src,
+  uint32_t id,
+  ident_t dst,
+  uint32_t bytes,
+  Stream* stream
+) {
+  std::lock_guard<std::mutex> lock(this->mutex);
+
+  auto it = this->streams.find(StreamTable::key(src, id));
+  if (it == this->streams.end() || it->second.dst != dst) {
+    return 1;
+  }
+
+  // never more than what has been sent
+  Stream& open = it->second;
+  open.acked = std::min(open.acked + bytes, open.sent);
+  *stream = open;
+
+  return 0;
+}
+
+int StreamTable::close(ident_t src, uint32_t id, Stream* stream) {
+  std::lock_guard<std::mutex> lock(this->mutex);
+
+  auto it = this->streams.find(StreamTable::key(src, id));
+  if (it == this->streams.end()) {
+    return 1;
+  }
+
+  *stream = it->second;
+  this->streams.erase(it);
+
+  return 0;
+}
+
+void StreamTable::drop(ident_t ident, std::vector<Stream>* closed) {
+  std::lock_guard<std::mutex> lock(this->mutex);
+
+  for (auto it = this->streams.begin(); it != this->streams.end();) {
+    if (it->second.src == ident || it->second.dst == ident) {
+      closed->push_back(it->second);
+      it = this->streams.erase(it);
+    } else {
+      ++it;
+    }
+  }
+}
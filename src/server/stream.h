@@ -0,0 +1,81 @@
+#ifndef SERVER_STREAM_H_
+#define SERVER_STREAM_H_
+
+#include <stdint.h>
+
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include "protocol/protocol.h"
+#include "server/registry.h"
+
+/// Number of the streams a client sends at once at most.
+#define STREAM_MAX_OPEN 16
+
+/// A stream of data from a client to another, forwarded chunk by chunk.
+struct Stream {
+  /// The sender
+  ident_t src = 0;
+  /// The id of the stream, chosen by the sender
+  uint32_t id = 0;
+  /// The receiver
+  ident_t dst = 0;
+  /// Where the sender is connected
+  Endpoint sender;
+  /// Where the receiver is connected
+  Endpoint receiver;
+  /// Number of bytes of the data announced, 0 if not known
+  uint32_t size = 0;
+  /// Bytes of the data forwarded
+  uint64_t sent = 0;
+  /// Bytes of the data acknowledged by the receiver
+  uint64_t acked = 0;
+};
+
+/// The streams open between the clients.
+///
+/// The server holds no data of a stream, only what it takes to bound it:
+/// the chunks go out to the receiver as soon as they are read, and a sender
+/// going over `STREAM_WINDOW` bytes not acknowledged is cut off, so a stream
+/// never queues more than that to its receiver. Streams are few and long
+/// lived next to the chunks they carry, a single mutex guards them.
+struct StreamTable {
+  std::mutex mutex;
+  /// The streams, by sender and id
+  std::unordered_map<uint64_t, Stream> streams;
+
+  /// The key of the stream of the sender.
+  static uint64_t key(ident_t src, uint32_t id);
+
+  /// Open the stream.
+  ///
+  /// Returns `RPL_BAD_REQUEST` if the sender has a stream of the id or
+  /// `STREAM_MAX_OPEN` streams already, or `RPL_OK`.
+  reply_code_t open(const Stream& stream);
+  /// Count a chunk of `len` bytes of the stream, copied to `stream`.
+  ///
+  /// Returns 1 if the stream is not open, -1 if the chunk goes over the
+  /// window or the size and the stream is closed, or 0.
+  int send(ident_t src, uint32_t id, uint32_t len, Stream* stream);
+  /// Count `bytes` acknowledged by the receiver `dst`, the stream copied to
+  /// `stream`.
+  ///
+  /// Returns 1 if the stream is not open or not received by `dst`.
+  int ack(
+    ident_t src,
+    uint32_t id,
+    ident_t dst,
+    uint32_t bytes,
+    Stream* stream
+  );
+  /// Close the stream, copied to `stream`.
+  ///
+  /// Returns 1 if the stream is not open.
+  int close(ident_t src, uint32_t id, Stream* stream);
+  /// Close the streams sent or received by the client, appended to
+  /// `closed`.
+  void drop(ident_t ident, std::vector<Stream>* closed);
+};
+
+#endif  // SERVER_STREAM_H_